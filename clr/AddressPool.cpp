@@ -0,0 +1,226 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "stdafx.h"
+#include "AddressPool.h"
+#include "DirectoryLock.h"
+
+#include <intrin.h>
+#include <msclr/lock.h>
+
+AddressPool::AddressPool(String^ path, UInt32 network, int prefixLength)
+{
+	this->path = path;
+	this->mask = prefixLength == 0 ? 0 : 0xFFFFFFFFu << (32 - prefixLength);
+	this->network = network & this->mask;
+	this->size = ~this->mask + 1;
+	this->words = gcnew array<UInt64>((int)((this->size + 63) / 64));
+	this->hint = 0;
+	this->lock = gcnew Object();
+	reserveFixed();
+}
+
+bool AddressPool::Load()
+{
+	if (!File::Exists(this->path))
+		return true;
+	try {
+		array<Byte>^ data = File::ReadAllBytes(this->path);
+		// A bitmap for a different sized subnet can't be trusted
+		if (data->Length != this->words->Length * 8) {
+			Console::WriteLine("ERROR: Address pool {0} does not match the server subnet.", this->path);
+			return false;
+		}
+		Buffer::BlockCopy(data, 0, this->words, 0, data->Length);
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to read address pool. {0}", e->Message);
+		return false;
+	}
+	reserveFixed();
+	this->hint = 0;
+	return true;
+}
+
+bool AddressPool::Save()
+{
+	msclr::lock l(this->lock);
+	return write();
+}
+
+bool AddressPool::write()
+{
+	try {
+		array<Byte>^ data = gcnew array<Byte>(this->words->Length * 8);
+		Buffer::BlockCopy(this->words, 0, data, 0, data->Length);
+		Directory::CreateDirectory(Path::GetDirectoryName(this->path));
+		DirectoryLock::WriteFile(this->path, data);
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to write address pool. {0}", e->Message);
+		return false;
+	}
+	return true;
+}
+
+UInt32 AddressPool::Allocate()
+{
+	msclr::lock l(this->lock);
+	for (int i = this->hint; i < this->words->Length; i++) {
+		if (this->words[i] == 0xFFFFFFFFFFFFFFFFull)
+			continue;
+		// Another process may have taken addresses since Load, the file has the last word on each
+		readWord(i);
+		UInt64 word = this->words[i];
+		if (word == 0xFFFFFFFFFFFFFFFFull)
+			continue;
+		unsigned long bit;
+		_BitScanForward64(&bit, ~word);
+		this->words[i] = word | (1ull << bit);
+		this->hint = i;
+		if (!writeWord(i))
+			throw gcnew Exception("Failed to save address pool");
+		return this->network + (UInt32)i * 64 + bit;
+	}
+	throw gcnew Exception("No free addresses left in the server subnet");
+}
+
+bool AddressPool::Reserve(UInt32 address)
+{
+	msclr::lock l(this->lock);
+	UInt32 offset = address - this->network;
+	if ((address & this->mask) != this->network || isFixed(offset))
+		return false;
+	try {
+		readWord(offset / 64);
+	}
+	catch (Exception^) {
+		return false;
+	}
+	UInt64 bit = 1ull << (offset % 64);
+	if ((this->words[offset / 64] & bit) != 0)
+		return false;
+	this->words[offset / 64] |= bit;
+	return writeWord(offset / 64);
+}
+
+bool AddressPool::Free(UInt32 address)
+{
+	msclr::lock l(this->lock);
+	UInt32 offset = address - this->network;
+	if ((address & this->mask) != this->network || isFixed(offset))
+		return true;
+	try {
+		readWord(offset / 64);
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to read address pool. {0}", e->Message);
+		return false;
+	}
+	this->words[offset / 64] &= ~(1ull << (offset % 64));
+	if ((int)(offset / 64) < this->hint)
+		this->hint = offset / 64;
+	return writeWord(offset / 64);
+}
+
+void AddressPool::readWord(int i)
+{
+	if (!File::Exists(this->path))
+		return;
+	FileStream^ stream = gcnew FileStream(this->path, FileMode::Open, FileAccess::Read, FileShare::ReadWrite);
+	try {
+		array<Byte>^ data = gcnew array<Byte>(8);
+		stream->Seek((Int64)i * 8, SeekOrigin::Begin);
+		if (stream->Read(data, 0, 8) != 8)
+			throw gcnew IOException("Address pool is truncated");
+		this->words[i] = BitConverter::ToUInt64(data, 0);
+	}
+	finally {
+		delete stream;
+	}
+	if (i == 0 || i == this->words->Length - 1)
+		reserveFixed();
+}
+
+bool AddressPool::writeWord(int i)
+{
+	// Nothing saved yet, the first write is the whole bitmap
+	if (!File::Exists(this->path))
+		return write();
+	try {
+		FileStream^ stream = gcnew FileStream(this->path, FileMode::Open, FileAccess::Write, FileShare::ReadWrite);
+		try {
+			stream->Seek((Int64)i * 8, SeekOrigin::Begin);
+			stream->Write(BitConverter::GetBytes(this->words[i]), 0, 8);
+		}
+		finally {
+			delete stream;
+		}
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to write address pool. {0}", e->Message);
+		return false;
+	}
+	return true;
+}
+
+bool AddressPool::Contains(UInt32 address)
+{
+	return (address & this->mask) == this->network;
+}
+
+String^ AddressPool::ToString(UInt32 address)
+{
+	return String::Format("{0}.{1}.{2}.{3}", address >> 24, (address >> 16) & 0xFF, (address >> 8) & 0xFF, address & 0xFF);
+}
+
+bool AddressPool::TryParse(String^ address, UInt32% result)
+{
+	IPAddress^ ip;
+	if (address == nullptr || !IPAddress::TryParse(address, ip) || ip->AddressFamily != Sockets::AddressFamily::InterNetwork)
+		return false;
+	array<Byte>^ bytes = ip->GetAddressBytes();
+	result = ((UInt32)bytes[0] << 24) | ((UInt32)bytes[1] << 16) | ((UInt32)bytes[2] << 8) | bytes[3];
+	return true;
+}
+
+bool AddressPool::TryParseSubnet(String^ cidr, UInt32% network, int% prefixLength)
+{
+	if (cidr == nullptr)
+		return false;
+	array<String^>^ parts = cidr->Split('/');
+	UInt32 address;
+	int length;
+	if (parts->Length != 2 || !TryParse(parts[0], address) || !int::TryParse(parts[1], length) || length < 8 || length > 29)
+		return false;
+	UInt32 mask = 0xFFFFFFFFu << (32 - length);
+	if ((address & ~mask) != 0)
+		return false;
+	network = address;
+	prefixLength = length;
+	return true;
+}
+
+int AddressPool::PrefixForClients(int clients)
+{
+	// Network, server and broadcast addresses come out of every subnet
+	int length = 29;
+	while (length > 8 && ((1LL << (32 - length)) - 3) < clients)
+		length--;
+	return length;
+}
+
+void AddressPool::reserveFixed()
+{
+	// Network address, the server's own address and broadcast are never handed out,
+	// nor is the padding past the end of the subnet in the last word
+	this->words[0] |= 3;
+	UInt32 last = this->size - 1;
+	this->words[last / 64] |= 1ull << (last % 64);
+	for (UInt32 offset = this->size; offset < (UInt32)this->words->Length * 64; offset++)
+		this->words[offset / 64] |= 1ull << (offset % 64);
+}
+
+bool AddressPool::isFixed(UInt32 offset)
+{
+	return offset <= 1 || offset >= this->size - 1;
+}
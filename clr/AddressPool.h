@@ -0,0 +1,73 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+using namespace System;
+using namespace System::IO;
+using namespace System::Net;
+
+// Persistent allocator for static client addresses in the server subnet. One bit per address,
+// saved as a raw bitmap. Allocation resumes from the lowest word that may have a free bit, so
+// handing out an address doesn't rescan the addresses already taken.
+//
+// The bitmap is read once per run. Allocate, Reserve and Free then write just the word they change
+// back to the file, re-reading it first so addresses other processes took since are seen. Call
+// them with the directory lock held.
+ref class AddressPool
+{
+public:
+	AddressPool(String^ path, UInt32 network, int prefixLength);
+
+	bool Load();
+	// Writes the whole bitmap
+	bool Save();
+	// Next free address. Throws once the subnet is exhausted or the file can't be updated.
+	UInt32 Allocate();
+	// Marks an address taken, false if it already was, is outside the pool or can't be saved
+	bool Reserve(UInt32 address);
+	// False if the file couldn't be updated
+	bool Free(UInt32 address);
+	bool Contains(UInt32 address);
+
+	property String^ Network {
+		String^ get() { return ToString(this->network); }
+	}
+	property String^ Netmask {
+		String^ get() { return ToString(this->mask); }
+	}
+	property String^ Gateway {
+		String^ get() { return ToString(this->network + 1); }
+	}
+	// Addresses in the subnet, including the reserved ones
+	property UInt32 Span {
+		UInt32 get() { return this->size; }
+	}
+	// Addresses available to clients
+	property int Capacity {
+		int get() { return (int)(this->size - 3); }
+	}
+
+	static String^ ToString(UInt32 address);
+	static bool TryParse(String^ address, UInt32% result);
+	// a.b.c.d/nn with no host bits set, between /8 and /29
+	static bool TryParseSubnet(String^ cidr, UInt32% network, int% prefixLength);
+	// Smallest prefix length with room for the given number of clients
+	static int PrefixForClients(int clients);
+
+private:
+	String^ path;
+	UInt32 network;
+	UInt32 mask;
+	UInt32 size;
+	array<UInt64>^ words;
+	int hint;
+	Object^ lock;
+
+	void reserveFixed();
+	bool isFixed(UInt32 offset);
+	// Takes word i from the file into words, when there is a file. Throws.
+	void readWord(int i);
+	// Writes word i through to the file, the whole bitmap if there is no file yet
+	bool writeWord(int i);
+	bool write();
+};
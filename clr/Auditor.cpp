@@ -0,0 +1,273 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "stdafx.h"
+#include "Auditor.h"
+
+#include <openssl/bn.h>
+#include <openssl/pem.h>
+#include <msclr/marshal.h>
+
+using namespace msclr::interop;
+using namespace System::Threading::Tasks;
+using namespace Newtonsoft::Json;
+
+Auditor::Auditor(String^ path)
+{
+	this->path = path;
+	this->pkiPath = Path::Combine(path, "pki");
+	this->clientsPath = Path::Combine(path, "clients");
+	this->now = DateTimeOffset::UtcNow.ToUnixTimeSeconds();
+	this->revoked = gcnew HashSet<String^>();
+	this->crlValid = true;
+	this->RequireBundles = true;
+	this->ca = NULL;
+	this->store = NULL;
+	this->intermediates = NULL;
+	this->intermediateCRLs = gcnew List<String^>();
+}
+
+Auditor::~Auditor()
+{
+	this->!Auditor();
+}
+
+Auditor::!Auditor()
+{
+	if (this->store != NULL)
+		X509_STORE_free(this->store);
+	if (this->intermediates != NULL)
+		sk_X509_pop_free(this->intermediates, X509_free);
+	if (this->ca != NULL)
+		X509_free(this->ca);
+	this->store = NULL;
+	this->intermediates = NULL;
+	this->ca = NULL;
+}
+
+bool Auditor::Load()
+{
+	String^ caPath = Path::Combine(this->pkiPath, "ca.crt");
+	try {
+		BIO* bio = readFile(caPath);
+		this->ca = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+		BIO_free(bio);
+	}
+	catch (Exception^) {}
+	if (this->ca == NULL) {
+		Console::WriteLine("ERROR: Failed to load CA from {0}.", caPath);
+		return false;
+	}
+
+	// Expiry is reported separately, so the store only judges the signatures
+	this->store = X509_STORE_new();
+	if (this->store == NULL || !X509_STORE_add_cert(this->store, this->ca)) {
+		Console::WriteLine("ERROR: Failed to build trust store.");
+		return false;
+	}
+	X509_STORE_set_flags(this->store, X509_V_FLAG_NO_CHECK_TIME);
+
+	this->intermediates = sk_X509_new_null();
+	String^ issuersPath = Path::Combine(this->pkiPath, "issuers");
+	if (Directory::Exists(issuersPath)) {
+		for each (String^ entry in Directory::GetFiles(issuersPath, "*.crt")) {
+			X509* intermediate = NULL;
+			try {
+				BIO* bio = readFile(entry);
+				intermediate = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+				BIO_free(bio);
+			}
+			catch (Exception^) {}
+			if (intermediate == NULL) {
+				Console::WriteLine("ERROR: Failed to load intermediate from {0}.", entry);
+				return false;
+			}
+			sk_X509_push(this->intermediates, intermediate);
+			this->intermediateCRLs->Add(Path::ChangeExtension(entry, ".crl"));
+		}
+	}
+
+	loadRevoked();
+	return true;
+}
+
+void Auditor::loadRevoked()
+{
+	loadCRL(Path::Combine(this->pkiPath, "crl.crt"), this->ca);
+	for (int i = 0; i < sk_X509_num(this->intermediates); i++)
+		loadCRL(this->intermediateCRLs[i], sk_X509_value(this->intermediates, i));
+
+	// crl-verify dir entries are named after the decimal serial
+	String^ crlDirPath = Path::Combine(this->pkiPath, "crl");
+	if (Directory::Exists(crlDirPath)) {
+		marshal_context ctx;
+		for each (String^ entry in Directory::GetFiles(crlDirPath)) {
+			BIGNUM* bn = NULL;
+			if (!BN_dec2bn(&bn, ctx.marshal_as<const char*>(Path::GetFileName(entry))))
+				continue;
+			char* hex = BN_bn2hex(bn);
+			this->revoked->Add(gcnew String(hex));
+			OPENSSL_free(hex);
+			BN_free(bn);
+		}
+	}
+}
+
+void Auditor::loadCRL(String^ crlPath, X509* issuer)
+{
+	if (!File::Exists(crlPath))
+		return;
+	BIO* bio = readFile(crlPath);
+	X509_CRL* crl = PEM_read_bio_X509_CRL(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	// A CRL the CA didn't sign would be rejected by OpenVPN, the revocations in it don't count
+	if (crl == NULL || X509_CRL_verify(crl, X509_get0_pubkey(issuer)) != 1)
+		this->crlValid = false;
+	if (crl != NULL) {
+		STACK_OF(X509_REVOKED)* entries = X509_CRL_get_REVOKED(crl);
+		for (int i = 0; i < sk_X509_REVOKED_num(entries); i++)
+			this->revoked->Add(serialToHex(X509_REVOKED_get0_serialNumber(sk_X509_REVOKED_value(entries, i))));
+		X509_CRL_free(crl);
+	}
+}
+
+List<String^>^ Auditor::identities()
+{
+	// Anything with a cert or a key, so a key left without its cert shows up too
+	SortedSet<String^>^ names = gcnew SortedSet<String^>(StringComparer::Ordinal);
+	for each (String^ file in Directory::GetFiles(this->pkiPath)) {
+		String^ extension = Path::GetExtension(file);
+		if (extension != ".crt" && extension != ".key")
+			continue;
+		String^ name = Path::GetFileNameWithoutExtension(file);
+		if (name == "ca" || name == "crl" || name->StartsWith("tls-crypt") || name == "ta")
+			continue;
+		names->Add(name);
+	}
+	return gcnew List<String^>(names);
+}
+
+bool Auditor::Run(TextWriter^ report)
+{
+	try {
+		List<String^>^ names = identities();
+		this->results = gcnew array<Result^>(names->Count);
+		for (int i = 0; i < names->Count; i++) {
+			this->results[i] = gcnew Result();
+			this->results[i]->name = names[i];
+		}
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to list identities. {0}", e->Message);
+		return false;
+	}
+
+	// The store is only read while checking, so identities are spread over every core
+	Parallel::For(0, this->results->Length, gcnew Action<int>(this, &Auditor::check));
+
+	int failed = 0;
+	for each (Result^ result in this->results) {
+		Dictionary<String^, Object^>^ line = gcnew Dictionary<String^, Object^>();
+		line->Add("name", result->name);
+		line->Add("serial", result->serial);
+		line->Add("notAfter", result->notAfter);
+		line->Add("chain", result->chain);
+		line->Add("key", result->key);
+		line->Add("revoked", result->revoked);
+		line->Add("expired", result->expired);
+		line->Add("bundle", result->bundle);
+		line->Add("ok", result->ok());
+		if (result->error != nullptr)
+			line->Add("error", result->error);
+		report->WriteLine(JsonConvert::SerializeObject(line));
+		if (!result->ok())
+			failed++;
+	}
+
+	Int64 caNotAfter = toUnixTime(X509_get0_notAfter(this->ca));
+	Dictionary<String^, Object^>^ summary = gcnew Dictionary<String^, Object^>();
+	summary->Add("identities", this->results->Length);
+	summary->Add("failed", failed);
+	summary->Add("revocations", this->revoked->Count);
+	summary->Add("crlValid", this->crlValid);
+	summary->Add("caNotAfter", caNotAfter);
+	summary->Add("caExpired", caNotAfter < this->now);
+	report->WriteLine(JsonConvert::SerializeObject(summary));
+	report->Flush();
+	return failed == 0 && this->crlValid;
+}
+
+void Auditor::check(int index)
+{
+	Result^ result = this->results[index];
+	String^ certPath = Path::Combine(this->pkiPath, result->name + ".crt");
+	String^ keyPath = Path::Combine(this->pkiPath, result->name + ".key");
+
+	X509* cert = NULL;
+	if (File::Exists(certPath)) {
+		BIO* bio = readFile(certPath);
+		cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+		BIO_free(bio);
+	}
+	if (cert == NULL) {
+		result->error = "certificate missing or unreadable";
+		return;
+	}
+
+	result->serial = serialToHex(X509_get0_serialNumber(cert));
+	result->notAfter = toUnixTime(X509_get0_notAfter(cert));
+	result->expired = result->notAfter < this->now;
+	result->revoked = this->revoked->Contains(result->serial);
+
+	// Each thread verifies with its own context
+	X509_STORE_CTX* ctx = X509_STORE_CTX_new();
+	if (ctx != NULL && X509_STORE_CTX_init(ctx, this->store, cert, this->intermediates)) {
+		result->chain = X509_verify_cert(ctx) == 1;
+		if (!result->chain)
+			result->error = gcnew String(X509_verify_cert_error_string(X509_STORE_CTX_get_error(ctx)));
+	}
+	X509_STORE_CTX_free(ctx);
+
+	if (File::Exists(keyPath)) {
+		BIO* bio = readFile(keyPath);
+		EVP_PKEY* key = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+		BIO_free(bio);
+		if (key != NULL) {
+			result->key = X509_check_private_key(cert, key) == 1;
+			EVP_PKEY_free(key);
+		}
+	}
+	X509_free(cert);
+
+	// The server's files live in server/, everyone else gets a bundle
+	if (result->name != "server" && this->RequireBundles)
+		result->bundle = File::Exists(Path::Combine(this->clientsPath, result->name + ".visz"));
+}
+
+String^ Auditor::serialToHex(const ASN1_INTEGER* serial)
+{
+	BIGNUM* bn = ASN1_INTEGER_to_BN(serial, NULL);
+	char* hex = BN_bn2hex(bn);
+	String^ result = gcnew String(hex);
+	OPENSSL_free(hex);
+	BN_free(bn);
+	return result;
+}
+
+Int64 Auditor::toUnixTime(const ASN1_TIME* time)
+{
+	struct tm tm;
+	if (time == NULL || !ASN1_TIME_to_tm(time, &tm))
+		return 0;
+	return DateTimeOffset(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, TimeSpan::Zero).ToUnixTimeSeconds();
+}
+
+BIO* Auditor::readFile(String^ path)
+{
+	array<Byte>^ data = File::ReadAllBytes(path);
+	BIO* bio = BIO_new(BIO_s_mem());
+	if (data->Length > 0) {
+		pin_ptr<Byte> p = &data[0];
+		BIO_write(bio, p, data->Length);
+	}
+	return bio;
+}
@@ -0,0 +1,69 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include <openssl/x509.h>
+
+using namespace System;
+using namespace System::Collections::Generic;
+using namespace System::IO;
+
+// Checks every identity in pki: chains to the CA, matches its key, isn't revoked or expired and
+// (for clients) has a bundle. The trust store and revocation list are built once up front and
+// shared read-only by the worker threads.
+ref class Auditor
+{
+public:
+	Auditor(String^ path);
+	~Auditor();
+	!Auditor();
+
+	bool Load();
+	// Writes one JSON object per identity followed by a summary, one per line. False if any
+	// identity failed a check.
+	bool Run(TextWriter^ report);
+
+	// Off when bundles are sent to an output sink rather than kept in clients/
+	property bool RequireBundles;
+
+private:
+	ref class Result
+	{
+	public:
+		String^ name;
+		String^ serial = "";
+		String^ error;
+		Int64 notAfter;
+		bool chain;
+		bool key;
+		bool revoked;
+		bool expired;
+		bool bundle = true;
+		bool ok() { return error == nullptr && chain && key && !revoked && !expired && bundle; }
+	};
+
+	String^ path;
+	String^ pkiPath;
+	String^ clientsPath;
+	Int64 now;
+
+	X509* ca;
+	X509_STORE* store;
+	// Intermediates from pki/issuers, offered as untrusted links between a client and the CA
+	STACK_OF(X509)* intermediates;
+	List<String^>^ intermediateCRLs;
+	// Upper case hex serials from crl.crt, the intermediates' CRLs and the crl/ directory. Serials
+	// are unique across intermediates, so one set covers every issuer.
+	HashSet<String^>^ revoked;
+	bool crlValid;
+	array<Result^>^ results;
+
+	List<String^>^ identities();
+	void check(int index);
+	void loadRevoked();
+	void loadCRL(String^ crlPath, X509* issuer);
+
+	static String^ serialToHex(const ASN1_INTEGER* serial);
+	static Int64 toUnixTime(const ASN1_TIME* time);
+	static BIO* readFile(String^ path);
+};
@@ -5,7 +5,7 @@
 
 CLI::CLI()
 {
-	OptionTypeStrings = gcnew List<String^>(7);
+	OptionTypeStrings = gcnew List<String^>(28);
 	OptionTypeStrings->Add("--name");
 	OptionTypeStrings->Add("--path");
 	OptionTypeStrings->Add("--keysize");
@@ -13,19 +13,59 @@ CLI::CLI()
 	OptionTypeStrings->Add("--algorithm");
 	OptionTypeStrings->Add("--curve");
 	OptionTypeStrings->Add("--suffix");
+	OptionTypeStrings->Add("--crl-mode");
+	OptionTypeStrings->Add("--port");
+	OptionTypeStrings->Add("--bind");
+	OptionTypeStrings->Add("--tls-crypt");
+	OptionTypeStrings->Add("--batch");
+	OptionTypeStrings->Add("--routes");
+	OptionTypeStrings->Add("--subnet");
+	OptionTypeStrings->Add("--clients");
+	OptionTypeStrings->Add("--workers");
+	OptionTypeStrings->Add("--profile");
+	OptionTypeStrings->Add("--dco");
+	OptionTypeStrings->Add("--metrics");
+	OptionTypeStrings->Add("--metrics-days");
+	OptionTypeStrings->Add("--jobs");
+	OptionTypeStrings->Add("--operations");
+	OptionTypeStrings->Add("--seconds");
+	OptionTypeStrings->Add("--issuer");
+	OptionTypeStrings->Add("--output");
+	OptionTypeStrings->Add("--roster");
+	OptionTypeStrings->Add("--server-rsa-primes");
+	OptionTypeStrings->Add("--compact-certs");
+	OptionTypeStrings->Add("--force");
 
-	ModeStrings = gcnew List<String^>(7);
+	ModeStrings = gcnew List<String^>(13);
 	ModeStrings->Add("client");
 	ModeStrings->Add("init");
 	ModeStrings->Add("revoke");
 	ModeStrings->Add("--show-curves");
 	ModeStrings->Add("--help");
 	ModeStrings->Add("--about");
+	ModeStrings->Add("ocsp-serve");
+	ModeStrings->Add("regenerate");
+	ModeStrings->Add("verify");
+	ModeStrings->Add("stress");
+	ModeStrings->Add("bench-handshake");
+	ModeStrings->Add("issuer");
+	ModeStrings->Add("reconcile");
 
 	AlgStrings = gcnew List<String^>(3);
 	AlgStrings->Add("rsa");
 	AlgStrings->Add("ecdsa");
 	AlgStrings->Add("eddsa");
+
+	TLSCryptStrings = gcnew List<String^>(3);
+	TLSCryptStrings->Add("none");
+	TLSCryptStrings->Add("v1");
+	TLSCryptStrings->Add("v2");
+
+	ProfileStrings = gcnew List<String^>(4);
+	ProfileStrings->Add("none");
+	ProfileStrings->Add("throughput");
+	ProfileStrings->Add("latency");
+	ProfileStrings->Add("mobile");
 }
 
 CLI::~CLI()
@@ -59,6 +99,24 @@ OpenSSLHelper::Algorithm CLI::getAlgorithm(String^ alg)
 	throw gcnew Exception("Unknown Algorithm: " + alg);
 }
 
+TLSCrypt::Mode CLI::getTLSCryptMode(String^ mode)
+{
+	if (TLSCryptStrings->Contains(mode)) {
+		int raw = TLSCryptStrings->IndexOf(mode);
+		return static_cast<TLSCrypt::Mode>(raw);
+	}
+	throw gcnew Exception("Unknown tls-crypt mode: " + mode);
+}
+
+Tuning::Profile CLI::getTuningProfile(String^ profile)
+{
+	if (ProfileStrings->Contains(profile)) {
+		int raw = ProfileStrings->IndexOf(profile);
+		return static_cast<Tuning::Profile>(raw);
+	}
+	throw gcnew Exception("Unknown profile: " + profile);
+}
+
 void CLI::printUsage()
 {
 	String^ name = System::Reflection::Assembly::GetEntryAssembly()->GetName()->Name;
@@ -73,12 +131,40 @@ void CLI::printUsage()
 	Console::WriteLine("                                ECDSA defaults to secp384r1. EDDSA defaults to ED25519");
 	Console::WriteLine("  --curve curve_name            ECDSA/EDDSA curve to use");
 	Console::WriteLine("  --suffix suffix  Appends suffix to server file names. Simplifies running multiple servers slightly.");
+	Console::WriteLine("  --crl-mode (file|dir)         Revocation list format (file default)");
+	Console::WriteLine("                                dir revokes by creating a file per serial, no CRL signing required");
+	Console::WriteLine("  --tls-crypt (none|v1|v2)      Control channel key (v1 default)");
+	Console::WriteLine("                                v2 issues a unique key per client and requires OpenVPN 2.5+");
+	Console::WriteLine("  --routes FILE   Push routes for the prefixes in FILE, one per line, merged into the fewest CIDR blocks");
+	Console::WriteLine("  --subnet CIDR   Tunnel subnet clients are addressed from (10.8.0.0/24 default)");
+	Console::WriteLine("  --clients count Size the tunnel subnet for this many clients");
+	Console::WriteLine("  --workers count Server processes to run, one per core (1 default)");
+	Console::WriteLine("                                Each listens on the next port with its own tun device and subnet");
+	Console::WriteLine("  --profile (throughput|latency|mobile) Tune ciphers, buffers and MTU (none default)");
+	Console::WriteLine("                                Requires OpenVPN 2.5+");
+	Console::WriteLine("  --dco           Keep the data channel offloaded to the kernel, AEAD ciphers and no compression");
+	Console::WriteLine("                                Requires OpenVPN 2.6+ with the ovpn-dco module");
+	Console::WriteLine("  --server-rsa-primes (2|3|4) Primes in the RSA server key, more make server handshakes faster (2 default)");
+	Console::WriteLine("                                3 needs a key size of 1024+, 4 needs 4096+");
+	Console::WriteLine("  --compact-certs Certificates with only a Common Name and the extensions OpenVPN checks");
+	Console::WriteLine("                                Keeps the handshake small, eddsa is the default algorithm with it");
+	Console::WriteLine("  --output (dir|tar|exec:COMMAND) Where server files go (dir default)");
+	Console::WriteLine("                                tar streams them to stdout, exec runs COMMAND per file with it on stdin");
 	Console::WriteLine("");
 	Console::WriteLine(String::Format("Usage: {0} client", name));
 	Console::WriteLine("Creates client configurations");
 	Console::WriteLine("Optional:");
 	Console::WriteLine("  --path DIR      Directory configurations are stored (Current Directory default)");
 	Console::WriteLine("  --name NAME     Prefill Common Name");
+	Console::WriteLine("  --batch FILE    Create a client for every Common Name in FILE, one per line");
+	Console::WriteLine("  --issuer NAME   Sign with the intermediate NAME instead of the root CA");
+	Console::WriteLine("  --output (dir|tar|exec:COMMAND) Where client bundles go (dir default)");
+	Console::WriteLine("");
+	Console::WriteLine(String::Format("Usage: {0} issuer", name));
+	Console::WriteLine("Create an intermediate CA signed by the root, issuing from its own block of serials");
+	Console::WriteLine("Optional:");
+	Console::WriteLine("  --path DIR      Directory configurations are stored (Current Directory default)");
+	Console::WriteLine("  --name NAME     Name of the intermediate, for example a site or worker");
 	Console::WriteLine("");
 	Console::WriteLine(String::Format("Usage: {0} revoke", name));
 	Console::WriteLine("Revoke a client and create/update the CRL");
@@ -86,6 +172,59 @@ void CLI::printUsage()
 	Console::WriteLine("  --path DIR      Directory configurations are stored (Current Directory default)");
 	Console::WriteLine("  --name NAME     Prefill Common Name");
 	Console::WriteLine("");
+	Console::WriteLine(String::Format("Usage: {0} reconcile", name));
+	Console::WriteLine("Issue every client in a roster that hasn't got a certificate and revoke every client that isn't in it");
+	Console::WriteLine("Revocations share one CRL update and the server configuration is rebuilt once");
+	Console::WriteLine("Required:");
+	Console::WriteLine("  --roster FILE   Common Names that should have access, one per line");
+	Console::WriteLine("Optional:");
+	Console::WriteLine("  --path DIR      Directory configurations are stored (Current Directory default)");
+	Console::WriteLine("  --issuer NAME   Sign new clients with the intermediate NAME instead of the root CA");
+	Console::WriteLine("  --output (dir|tar|exec:COMMAND) Where new client bundles and server files go (dir default)");
+	Console::WriteLine("  --force         Revoke every client or more than a quarter of them without asking");
+	Console::WriteLine("");
+	Console::WriteLine(String::Format("Usage: {0} ocsp-serve", name));
+	Console::WriteLine("Run an OCSP responder answering from precomputed responses");
+	Console::WriteLine("Optional:");
+	Console::WriteLine("  --path DIR      Directory configurations are stored (Current Directory default)");
+	Console::WriteLine("  --port port     Port to listen on (8888 default)");
+	Console::WriteLine("  --bind address  Address to listen on (127.0.0.1 default)");
+	Console::WriteLine("");
+	Console::WriteLine(String::Format("Usage: {0} regenerate", name));
+	Console::WriteLine("Rebuild the server configuration and every client bundle, rewriting only what changed");
+	Console::WriteLine("Optional:");
+	Console::WriteLine("  --path DIR      Directory configurations are stored (Current Directory default)");
+	Console::WriteLine("  --output (dir|tar|exec:COMMAND) Send everything, changed or not, somewhere other than the directory");
+	Console::WriteLine("");
+	Console::WriteLine(String::Format("Usage: {0} verify", name));
+	Console::WriteLine("Check every identity chains to the CA, matches its key, isn't revoked or expired and has a bundle");
+	Console::WriteLine("Writes one JSON object per identity and a summary, one per line");
+	Console::WriteLine("Optional:");
+	Console::WriteLine("  --path DIR      Directory configurations are stored (Current Directory default)");
+	Console::WriteLine("  --output (dir|tar|exec:COMMAND) Where client bundles were sent, only dir expects them in clients/");
+	Console::WriteLine("");
+	Console::WriteLine(String::Format("Usage: {0} stress", name));
+	Console::WriteLine("Run client, revoke and regenerate as concurrent processes, then check the PKI is consistent");
+	Console::WriteLine("Issues and revokes real clients, use a scratch directory made with init");
+	Console::WriteLine("Optional:");
+	Console::WriteLine("  --path DIR      Directory configurations are stored (Current Directory default)");
+	Console::WriteLine("  --jobs count    Processes to run at once (8 default)");
+	Console::WriteLine("  --operations count            Operations to run in total (64 default)");
+	Console::WriteLine("");
+	Console::WriteLine(String::Format("Usage: {0} bench-handshake", name));
+	Console::WriteLine("Time full TLS handshakes between the server and a client identity in memory, per core");
+	Console::WriteLine("Uses the TLS settings of the generated server config");
+	Console::WriteLine("Optional:");
+	Console::WriteLine("  --path DIR      Directory configurations are stored (Current Directory default)");
+	Console::WriteLine("  --name NAME     Client identity to connect with (first client default)");
+	Console::WriteLine("  --seconds count How long to run for (3 default)");
+	Console::WriteLine("  --server-rsa-primes (2|3|4) Run again with a server key of this many primes, signed by the CA, and compare");
+	Console::WriteLine("");
+	Console::WriteLine("Metrics, for init, client, revoke, reconcile, regenerate and ocsp-serve:");
+	Console::WriteLine("  --metrics FILE  Write Prometheus metrics to FILE for the node_exporter textfile collector");
+	Console::WriteLine("                                Counters carry on from the values already in FILE");
+	Console::WriteLine("  --metrics-days days           Window for the certificates expiring gauge (30 default)");
+	Console::WriteLine("");
 	Console::WriteLine(String::Format("Usage: {0} --show-curves", name));
 	Console::WriteLine("Show available ECDSA/EdDSA curves");
 	Console::WriteLine("");
@@ -3,6 +3,8 @@
 #pragma once
 
 #include "OpenSSLHelper.h"
+#include "TLSCrypt.h"
+#include "Tuning.h"
 
 using namespace System;
 using namespace System::Collections::Generic;
@@ -14,15 +16,17 @@ public:
 	~CLI();
 
 	enum class OptionType {
-		CommonName, Path, KeySize, ValidDays, Algorithm, Curve, Suffix, Unknown
+		CommonName, Path, KeySize, ValidDays, Algorithm, Curve, Suffix, CRLMode, Port, Bind, TLSCrypt, Batch, Routes, Subnet, Clients, Workers, Profile, DCO, Metrics, MetricsDays, Jobs, Operations, Seconds, Issuer, Output, Roster, ServerRSAPrimes, CompactCerts, Force, Unknown
 	};
 	enum class Mode {
-		CreateClient, InitSetup, Revoke, ShowCurves, Help, About, Unknown
+		CreateClient, InitSetup, Revoke, ShowCurves, Help, About, OCSPServe, Regenerate, Verify, Stress, BenchHandshake, CreateIssuer, Reconcile, Unknown
 	};
 
 	OptionType getOption(String^ option);
 	Mode getMode(String^ mode);
 	OpenSSLHelper::Algorithm getAlgorithm(String^ alg);
+	TLSCrypt::Mode getTLSCryptMode(String^ mode);
+	Tuning::Profile getTuningProfile(String^ profile);
 	void printUsage();
 	void printAbout();
 	void showCurves();
@@ -31,5 +35,7 @@ private:
 	List<String^>^ OptionTypeStrings;
 	List<String^>^ ModeStrings;
 	List<String^>^ AlgStrings;
+	List<String^>^ TLSCryptStrings;
+	List<String^>^ ProfileStrings;
 };
 
@@ -0,0 +1,475 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "stdafx.h"
+#include "CRLFile.h"
+#include "DirectoryLock.h"
+#include "Signing.h"
+
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <msclr/marshal.h>
+
+#include <string>
+#include <vector>
+
+using namespace msclr::interop;
+using namespace System::IO::MemoryMappedFiles;
+using namespace System::Runtime::InteropServices;
+
+namespace {
+
+// One DER element: where it starts, where its contents start and where it ends
+struct Element
+{
+	unsigned char tag;
+	size_t start;
+	size_t content;
+	size_t end;
+};
+
+bool readElement(const unsigned char* data, size_t end, size_t offset, Element& element)
+{
+	if (offset + 2 > end)
+		return false;
+	element.tag = data[offset];
+	element.start = offset;
+	size_t length = data[offset + 1];
+	offset += 2;
+	if (length & 0x80) {
+		// Long form, nothing in a CRL needs more than four length bytes
+		size_t count = length & 0x7F;
+		if (count == 0 || count > 4 || offset + count > end)
+			return false;
+		length = 0;
+		for (size_t i = 0; i < count; i++)
+			length = (length << 8) | data[offset++];
+	}
+	if (length > end - offset)
+		return false;
+	element.content = offset;
+	element.end = offset + length;
+	return true;
+}
+
+std::string encode(unsigned char tag, const std::string& content)
+{
+	std::string out(1, (char)tag);
+	size_t length = content.size();
+	if (length < 0x80) {
+		out += (char)length;
+	}
+	else {
+		std::string bytes;
+		for (; length > 0; length >>= 8)
+			bytes.insert(bytes.begin(), (char)(length & 0xFF));
+		out += (char)(0x80 | bytes.size());
+		out += bytes;
+	}
+	return out + content;
+}
+
+std::string encodeTime(const ASN1_TIME* time)
+{
+	unsigned char* der = NULL;
+	int length = i2d_ASN1_TIME(time, &der);
+	if (length <= 0)
+		return std::string();
+	std::string out((const char*)der, length);
+	OPENSSL_free(der);
+	return out;
+}
+
+// The parts of a CRL that are carried over or replaced, as offsets into the mapped DER.
+// RFC 5280 section 5.1: CertificateList and TBSCertList.
+struct CRLLayout
+{
+	Element tbs;
+	Element signatureAlgorithm;
+	Element version;
+	Element tbsSignature;
+	Element issuer;
+	Element revoked;
+	Element extensions;
+	bool hasVersion;
+	bool hasRevoked;
+	bool hasExtensions;
+};
+
+bool isTime(const Element& element)
+{
+	return element.tag == V_ASN1_UTCTIME || element.tag == V_ASN1_GENERALIZEDTIME;
+}
+
+bool parseLayout(const unsigned char* data, size_t size, CRLLayout& layout)
+{
+	layout.hasVersion = layout.hasRevoked = layout.hasExtensions = false;
+	Element outer;
+	if (!readElement(data, size, 0, outer) || outer.tag != 0x30 || outer.end != size)
+		return false;
+	if (!readElement(data, outer.end, outer.content, layout.tbs) || layout.tbs.tag != 0x30)
+		return false;
+	if (!readElement(data, outer.end, layout.tbs.end, layout.signatureAlgorithm) || layout.signatureAlgorithm.tag != 0x30)
+		return false;
+
+	size_t end = layout.tbs.end;
+	Element element;
+	if (!readElement(data, end, layout.tbs.content, element))
+		return false;
+	if (element.tag == V_ASN1_INTEGER) {
+		layout.version = element;
+		layout.hasVersion = true;
+		if (!readElement(data, end, element.end, element))
+			return false;
+	}
+	layout.tbsSignature = element;
+	if (layout.tbsSignature.tag != 0x30 || !readElement(data, end, element.end, layout.issuer) || layout.issuer.tag != 0x30)
+		return false;
+	// thisUpdate, then nextUpdate which is optional
+	if (!readElement(data, end, layout.issuer.end, element) || !isTime(element))
+		return false;
+	size_t offset = element.end;
+	if (offset < end && readElement(data, end, offset, element) && isTime(element))
+		offset = element.end;
+	if (offset < end) {
+		if (!readElement(data, end, offset, element))
+			return false;
+		if (element.tag == 0x30) {
+			layout.revoked = element;
+			layout.hasRevoked = true;
+			offset = element.end;
+		}
+	}
+	if (offset < end) {
+		if (!readElement(data, end, offset, element) || element.tag != 0xA0 || element.end != end)
+			return false;
+		layout.extensions = element;
+		layout.hasExtensions = true;
+	}
+	return true;
+}
+
+std::string slice(const unsigned char* data, const Element& element)
+{
+	return std::string((const char*)data + element.start, element.end - element.start);
+}
+
+Int64 countEntries(const unsigned char* data, size_t size)
+{
+	CRLLayout layout;
+	if (!parseLayout(data, size, layout))
+		return -1;
+	Int64 entries = 0;
+	Element element;
+	for (size_t offset = layout.revoked.content; layout.hasRevoked && offset < layout.revoked.end; offset = element.end) {
+		if (!readElement(data, layout.revoked.end, offset, element))
+			return -1;
+		entries++;
+	}
+	return entries;
+}
+
+}
+
+static String^ lastError()
+{
+	char buf[256];
+	unsigned long error = ERR_get_error();
+	ERR_clear_error();
+	if (error == 0)
+		return "Unknown error";
+	ERR_error_string_n(error, buf, sizeof(buf));
+	return gcnew String(buf);
+}
+
+// Only the base64 is decoded, the entries are left alone
+static std::string pemToDER(String^ path)
+{
+	marshal_context ctx;
+	BIO* bio = BIO_new_file(ctx.marshal_as<const char*>(path), "r");
+	unsigned char* der = NULL;
+	long length = 0;
+	bool ok = bio != NULL && PEM_bytes_read_bio(&der, &length, NULL, PEM_STRING_X509_CRL, bio, NULL, NULL) == 1;
+	BIO_free(bio);
+	if (!ok)
+		throw gcnew Exception("Failed to read CRL. " + lastError());
+	std::string data((const char*)der, length);
+	OPENSSL_free(der);
+	return data;
+}
+
+CRLFile::CRLFile(String^ pemPath)
+{
+	this->pemPath = pemPath;
+	this->derPath = Path::ChangeExtension(pemPath, ".der");
+}
+
+bool CRLFile::Exists()
+{
+	return File::Exists(this->pemPath) || File::Exists(this->derPath);
+}
+
+bool CRLFile::derCurrent()
+{
+	// The PEM is always written after the DER, so a PEM that is newer was replaced by something else
+	if (!File::Exists(this->derPath))
+		return false;
+	if (!File::Exists(this->pemPath))
+		return true;
+	return File::GetLastWriteTimeUtc(this->derPath) >= File::GetLastWriteTimeUtc(this->pemPath);
+}
+
+void CRLFile::convertPEM()
+{
+	std::string der = pemToDER(this->pemPath);
+	writeFile(this->derPath, (const unsigned char*)der.data(), der.size());
+}
+
+void CRLFile::Revoke(String^ caPath, String^ keyPath, String^ certData, int validDays)
+{
+	List<String^>^ certs = gcnew List<String^>();
+	certs->Add(certData);
+	Revoke(caPath, keyPath, certs, validDays);
+}
+
+void CRLFile::Revoke(String^ caPath, String^ keyPath, List<String^>^ certData, int validDays)
+{
+	if (certData->Count == 0)
+		return;
+	X509* issuer = NULL;
+	EVP_PKEY* key = NULL;
+	loadIssuer(caPath, keyPath, issuer, key);
+	std::vector<X509*> certs;
+	try {
+		if (issuer == NULL || key == NULL)
+			throw gcnew Exception("Failed to load the CA. " + lastError());
+		for each (String^ data in certData) {
+			marshal_context ctx;
+			const char* certPEM = ctx.marshal_as<const char*>(data);
+			BIO* bio = BIO_new_mem_buf(certPEM, -1);
+			X509* cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+			BIO_free(bio);
+			if (cert == NULL)
+				throw gcnew Exception("Failed to parse certificate. " + lastError());
+			certs.push_back(cert);
+		}
+		size_t first = 0;
+		if (!Exists()) {
+			// Nothing to splice onto, the first CRL is built whole with the first certificate
+			create(certs[0], issuer, key, validDays);
+			if (certs.size() == 1)
+				return;
+			first = 1;
+		}
+		if (!derCurrent())
+			convertPEM();
+
+		// revokedCertificate: serial and revocation date, one per certificate, all signed together
+		ASN1_TIME* now = X509_gmtime_adj(NULL, 0);
+		ASN1_TIME* next = X509_gmtime_adj(NULL, (long)validDays * 24 * 60 * 60);
+		std::string entry;
+		bool encoded = true;
+		for (size_t i = first; i < certs.size() && encoded; i++) {
+			X509_REVOKED* revoked = X509_REVOKED_new();
+			X509_REVOKED_set_serialNumber(revoked, X509_get_serialNumber(certs[i]));
+			X509_REVOKED_set_revocationDate(revoked, now);
+			unsigned char* entryDER = NULL;
+			int entryLength = i2d_X509_REVOKED(revoked, &entryDER);
+			X509_REVOKED_free(revoked);
+			encoded = entryLength > 0;
+			if (encoded)
+				entry.append((const char*)entryDER, entryLength);
+			OPENSSL_free(entryDER);
+		}
+		std::string thisUpdate = encodeTime(now);
+		std::string nextUpdate = encodeTime(next);
+		ASN1_TIME_free(now);
+		ASN1_TIME_free(next);
+		if (!encoded || thisUpdate.empty() || nextUpdate.empty())
+			throw gcnew Exception("Failed to encode revocation. " + lastError());
+
+		unsigned char* nameDER = NULL;
+		int nameLength = i2d_X509_NAME(X509_get_subject_name(issuer), &nameDER);
+		std::string issuerName(nameLength > 0 ? (const char*)nameDER : "", nameLength > 0 ? nameLength : 0);
+		OPENSSL_free(nameDER);
+
+		std::string tbs;
+		std::string signatureAlgorithm;
+		{
+			MemoryMappedFile^ file = MemoryMappedFile::CreateFromFile(this->derPath, FileMode::Open, nullptr, 0, MemoryMappedFileAccess::Read);
+			MemoryMappedViewAccessor^ view = file->CreateViewAccessor(0, 0, MemoryMappedFileAccess::Read);
+			unsigned char* data = NULL;
+			view->SafeMemoryMappedViewHandle->AcquirePointer(data);
+			try {
+				size_t size = (size_t)(gcnew FileInfo(this->derPath))->Length;
+				CRLLayout layout;
+				if (!parseLayout(data, size, layout))
+					throw gcnew Exception("Failed to parse existing CRL " + this->derPath);
+				if (slice(data, layout.issuer) != issuerName)
+					throw gcnew Exception("Existing CRL was not issued by this CA");
+				signatureAlgorithm = slice(data, layout.signatureAlgorithm);
+				if (slice(data, layout.tbsSignature) != signatureAlgorithm)
+					throw gcnew Exception("Existing CRL has mismatched signature algorithms");
+
+				// Everything up to the issuer is kept, the update times are replaced and the new entry goes
+				// after the existing ones. Order doesn't matter, OpenSSL sorts entries when it looks one up.
+				std::string revokedList;
+				if (layout.hasRevoked)
+					revokedList.assign((const char*)data + layout.revoked.content, layout.revoked.end - layout.revoked.content);
+				revokedList += entry;
+				std::string content;
+				content.reserve(layout.tbs.end - layout.tbs.content + entry.size() + 64);
+				if (layout.hasVersion)
+					content += slice(data, layout.version);
+				content += signatureAlgorithm;
+				content += issuerName;
+				content += thisUpdate;
+				content += nextUpdate;
+				content += encode(0x30, revokedList);
+				if (layout.hasExtensions)
+					content += slice(data, layout.extensions);
+				tbs = encode(0x30, content);
+			}
+			finally {
+				view->SafeMemoryMappedViewHandle->ReleasePointer();
+				delete view;
+				delete file;
+			}
+		}
+
+		// Signed the same way X509_CRL_sign would, over the encoded TBSCertList
+		EVP_MD_CTX* mdctx = EVP_MD_CTX_new();
+		size_t signatureLength = 0;
+		std::vector<unsigned char> signature;
+		bool ok = mdctx != NULL
+			&& EVP_DigestSignInit(mdctx, NULL, SigningDigest(key), NULL, key) == 1
+			&& EVP_DigestSign(mdctx, NULL, &signatureLength, (const unsigned char*)tbs.data(), tbs.size()) == 1;
+		if (ok) {
+			signature.resize(signatureLength);
+			ok = EVP_DigestSign(mdctx, signature.data(), &signatureLength, (const unsigned char*)tbs.data(), tbs.size()) == 1;
+		}
+		EVP_MD_CTX_free(mdctx);
+		if (!ok)
+			throw gcnew Exception("Failed to sign CRL. " + lastError());
+
+		std::string bits(1, '\0');
+		bits.append((const char*)signature.data(), signatureLength);
+		tbs += signatureAlgorithm;
+		tbs += encode(V_ASN1_BIT_STRING, bits);
+		std::string der = encode(0x30, tbs);
+		write((const unsigned char*)der.data(), der.size());
+	}
+	finally {
+		for (X509* cert : certs)
+			X509_free(cert);
+		X509_free(issuer);
+		EVP_PKEY_free(key);
+	}
+}
+
+void CRLFile::Create(String^ caPath, String^ keyPath, int validDays)
+{
+	if (Exists())
+		return;
+	X509* issuer = NULL;
+	EVP_PKEY* key = NULL;
+	loadIssuer(caPath, keyPath, issuer, key);
+	try {
+		if (issuer == NULL || key == NULL)
+			throw gcnew Exception("Failed to load the CA. " + lastError());
+		create(NULL, issuer, key, validDays);
+	}
+	finally {
+		X509_free(issuer);
+		EVP_PKEY_free(key);
+	}
+}
+
+void CRLFile::loadIssuer(String^ caPath, String^ keyPath, X509*& issuer, EVP_PKEY*& key)
+{
+	marshal_context ctx;
+	BIO* bio = BIO_new_file(ctx.marshal_as<const char*>(caPath), "r");
+	issuer = bio != NULL ? PEM_read_bio_X509(bio, NULL, NULL, NULL) : NULL;
+	BIO_free(bio);
+	bio = BIO_new_file(ctx.marshal_as<const char*>(keyPath), "r");
+	key = bio != NULL ? PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL) : NULL;
+	BIO_free(bio);
+}
+
+void CRLFile::create(X509* cert, X509* issuer, EVP_PKEY* key, int validDays)
+{
+	X509_CRL* crl = X509_CRL_new();
+	X509_CRL_set_version(crl, 1);
+	X509_CRL_set_issuer_name(crl, X509_get_subject_name(issuer));
+	ASN1_TIME* now = X509_gmtime_adj(NULL, 0);
+	ASN1_TIME* next = X509_gmtime_adj(NULL, (long)validDays * 24 * 60 * 60);
+	if (cert != NULL) {
+		X509_REVOKED* revoked = X509_REVOKED_new();
+		X509_REVOKED_set_serialNumber(revoked, X509_get_serialNumber(cert));
+		X509_REVOKED_set_revocationDate(revoked, now);
+		X509_CRL_add0_revoked(crl, revoked);
+	}
+	X509_CRL_set1_lastUpdate(crl, now);
+	X509_CRL_set1_nextUpdate(crl, next);
+	ASN1_TIME_free(now);
+	ASN1_TIME_free(next);
+	unsigned char* der = NULL;
+	int length = X509_CRL_sign(crl, key, SigningDigest(key)) ? i2d_X509_CRL(crl, &der) : 0;
+	X509_CRL_free(crl);
+	if (length <= 0)
+		throw gcnew Exception("Failed to sign CRL. " + lastError());
+	try {
+		write(der, length);
+	}
+	finally {
+		OPENSSL_free(der);
+	}
+}
+
+Int64 CRLFile::Entries()
+{
+	try {
+		if (!derCurrent()) {
+			// Not converted yet, decoded in memory and left for the next revoke to write out
+			std::string der = pemToDER(this->pemPath);
+			return countEntries((const unsigned char*)der.data(), der.size());
+		}
+		MemoryMappedFile^ file = MemoryMappedFile::CreateFromFile(this->derPath, FileMode::Open, nullptr, 0, MemoryMappedFileAccess::Read);
+		MemoryMappedViewAccessor^ view = file->CreateViewAccessor(0, 0, MemoryMappedFileAccess::Read);
+		unsigned char* data = NULL;
+		view->SafeMemoryMappedViewHandle->AcquirePointer(data);
+		try {
+			return countEntries(data, (size_t)(gcnew FileInfo(this->derPath))->Length);
+		}
+		finally {
+			view->SafeMemoryMappedViewHandle->ReleasePointer();
+			delete view;
+			delete file;
+		}
+	}
+	catch (Exception^) {
+		return -1;
+	}
+}
+
+void CRLFile::write(const unsigned char* der, size_t length)
+{
+	// DER first, so a PEM that is newer than it can only have come from somewhere else
+	BIO* bio = BIO_new(BIO_s_mem());
+	PEM_write_bio(bio, PEM_STRING_X509_CRL, "", der, (long)length);
+	char* pem;
+	long pemLength = BIO_get_mem_data(bio, &pem);
+	try {
+		writeFile(this->derPath, der, length);
+		writeFile(this->pemPath, (const unsigned char*)pem, pemLength);
+	}
+	finally {
+		BIO_free(bio);
+	}
+}
+
+void CRLFile::writeFile(String^ path, const unsigned char* data, size_t length)
+{
+	array<Byte>^ bytes = gcnew array<Byte>((int)length);
+	Marshal::Copy(IntPtr((void*)data), bytes, 0, (int)length);
+	DirectoryLock::WriteFile(path, bytes);
+}
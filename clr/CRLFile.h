@@ -0,0 +1,48 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include <openssl/x509.h>
+
+using namespace System;
+using namespace System::Collections::Generic;
+using namespace System::IO;
+
+// The CRL at pki/crl.crt together with a DER copy beside it in pki/crl.der. Revoking maps the DER
+// and splices the new entry onto the end of the revoked list, then signs the result, so existing
+// entries are never decoded or converted through a managed String. The PEM is written from the
+// same bytes for OpenVPN. A PEM newer than the DER, or one without a DER, is converted once.
+ref class CRLFile
+{
+public:
+	CRLFile(String^ pemPath);
+
+	bool Exists();
+	// Writes a CRL with no entries, signed by the CA in caPath/keyPath, if there isn't one. OpenVPN
+	// checks every certificate in a chain against a CRL from its issuer, so each CA needs one once
+	// any CRL is in use. Throws on failure.
+	void Create(String^ caPath, String^ keyPath, int validDays);
+	// Adds the certificate to the CRL, signed by the CA in caPath/keyPath, creating it if there
+	// isn't one, and writes both copies. Throws on failure. Call with the directory lock held.
+	void Revoke(String^ caPath, String^ keyPath, String^ certData, int validDays);
+	// Adds every certificate with a single signature
+	void Revoke(String^ caPath, String^ keyPath, List<String^>^ certData, int validDays);
+	// Number of revoked entries, counted from the DER framing. -1 if the CRL can't be read.
+	Int64 Entries();
+
+	property String^ DERPath {
+		String^ get() { return derPath; }
+	}
+
+private:
+	String^ pemPath;
+	String^ derPath;
+
+	bool derCurrent();
+	void convertPEM();
+	// Signs a new CRL revoking cert, or with no entries when cert is NULL
+	void create(X509* cert, X509* issuer, EVP_PKEY* key, int validDays);
+	static void loadIssuer(String^ caPath, String^ keyPath, X509*& issuer, EVP_PKEY*& key);
+	void write(const unsigned char* der, size_t length);
+	static void writeFile(String^ path, const unsigned char* data, size_t length);
+};
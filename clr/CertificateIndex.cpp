@@ -0,0 +1,198 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "stdafx.h"
+#include "CertificateIndex.h"
+#include "DirectoryLock.h"
+
+#include <openssl/bn.h>
+#include <openssl/pem.h>
+#include <msclr/lock.h>
+#include <msclr/marshal.h>
+
+using namespace msclr::interop;
+using namespace System::Globalization;
+using namespace System::IO;
+using namespace System::Text;
+
+CertificateIndex::CertificateIndex(String^ path)
+{
+	this->path = path;
+	this->entries = gcnew List<Entry^>();
+	this->lock = gcnew Object();
+}
+
+bool CertificateIndex::Load(String^ pkiPath)
+{
+	msclr::lock l(this->lock);
+	this->entries->Clear();
+
+	if (File::Exists(this->path)) {
+		for each (String^ line in File::ReadAllLines(this->path)) {
+			// status, expiry, revocation date, serial, file name, subject
+			array<String^>^ fields = line->Split('\t');
+			if (fields->Length < 6 || fields[0]->Length != 1)
+				continue;
+			Entry^ entry = gcnew Entry();
+			entry->status = fields[0][0];
+			entry->notAfter = parseTime(fields[1]);
+			entry->revoked = fields[2];
+			entry->serial = fields[3];
+			entry->subject = fields[5];
+			this->entries->Add(entry);
+		}
+		return true;
+	}
+
+	// No index yet, build one from whatever has been issued so far
+	try {
+		if (Directory::Exists(pkiPath)) {
+			for each (String^ file in Directory::GetFiles(pkiPath, "*.crt")) {
+				String^ name = Path::GetFileNameWithoutExtension(file);
+				if (name == "ca" || name == "crl")
+					continue;
+				try {
+					this->entries->Add(parse(File::ReadAllText(file)));
+				}
+				catch (Exception^ e) {
+					Console::WriteLine("WARNING: Skipping {0}. {1}", file, e->Message);
+				}
+			}
+		}
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("WARNING: Failed to build certificate index. {0}", e->Message);
+		return false;
+	}
+	return save();
+}
+
+void CertificateIndex::Add(String^ certData)
+{
+	Entry^ entry;
+	try {
+		entry = parse(certData);
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("WARNING: Failed to index certificate. {0}", e->Message);
+		return;
+	}
+	msclr::lock l(this->lock);
+	this->entries->Add(entry);
+	try {
+		File::AppendAllText(this->path, format(entry));
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("WARNING: Failed to update certificate index {0}. {1}", this->path, e->Message);
+	}
+}
+
+void CertificateIndex::Revoke(String^ certData)
+{
+	Entry^ revoked;
+	try {
+		revoked = parse(certData);
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("WARNING: Failed to index certificate. {0}", e->Message);
+		return;
+	}
+	String^ when = asn1Time(DateTime::UtcNow);
+
+	msclr::lock l(this->lock);
+	bool found = false;
+	for each (Entry^ entry in this->entries) {
+		if (entry->serial == revoked->serial) {
+			entry->status = 'R';
+			entry->revoked = when;
+			found = true;
+		}
+	}
+	if (!found) {
+		revoked->status = 'R';
+		revoked->revoked = when;
+		this->entries->Add(revoked);
+	}
+	save();
+}
+
+int CertificateIndex::CountValid(DateTime now)
+{
+	int count = 0;
+	for each (Entry^ entry in this->entries) {
+		if (entry->status == 'V' && entry->notAfter > now)
+			count++;
+	}
+	return count;
+}
+
+int CertificateIndex::CountExpiring(DateTime now, int days)
+{
+	DateTime horizon = now.AddDays(days);
+	int count = 0;
+	for each (Entry^ entry in this->entries) {
+		if (entry->status == 'V' && entry->notAfter > now && entry->notAfter <= horizon)
+			count++;
+	}
+	return count;
+}
+
+bool CertificateIndex::save()
+{
+	StringBuilder^ data = gcnew StringBuilder();
+	for each (Entry^ entry in this->entries)
+		data->Append(format(entry));
+	try {
+		DirectoryLock::WriteFile(this->path, data->ToString());
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("WARNING: Failed to write certificate index {0}. {1}", this->path, e->Message);
+		return false;
+	}
+	return true;
+}
+
+CertificateIndex::Entry^ CertificateIndex::parse(String^ certData)
+{
+	marshal_context ctx;
+	const char* pem = ctx.marshal_as<const char*>(certData);
+	BIO* bio = BIO_new_mem_buf(pem, -1);
+	X509* cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (cert == NULL)
+		throw gcnew Exception("Failed to parse certificate.");
+
+	Entry^ entry = gcnew Entry();
+	const ASN1_TIME* notAfter = X509_get0_notAfter(cert);
+	entry->notAfter = parseTime(gcnew String((const char*)ASN1_STRING_get0_data(notAfter), 0, ASN1_STRING_length(notAfter)));
+	BIGNUM* bn = ASN1_INTEGER_to_BN(X509_get0_serialNumber(cert), NULL);
+	char* hex = BN_bn2hex(bn);
+	entry->serial = gcnew String(hex);
+	OPENSSL_free(hex);
+	BN_free(bn);
+	char* subject = X509_NAME_oneline(X509_get_subject_name(cert), NULL, 0);
+	entry->subject = gcnew String(subject);
+	OPENSSL_free(subject);
+	X509_free(cert);
+	return entry;
+}
+
+String^ CertificateIndex::format(Entry^ entry)
+{
+	return String::Format("{0}\t{1}\t{2}\t{3}\tunknown\t{4}\n", entry->status, asn1Time(entry->notAfter), entry->revoked, entry->serial, entry->subject);
+}
+
+String^ CertificateIndex::asn1Time(DateTime time)
+{
+	// UTCTime through 2049, GeneralizedTime after, as openssl ca writes them
+	String^ pattern = time.Year >= 1950 && time.Year < 2050 ? "yyMMddHHmmss'Z'" : "yyyyMMddHHmmss'Z'";
+	return time.ToUniversalTime().ToString(pattern, CultureInfo::InvariantCulture);
+}
+
+DateTime CertificateIndex::parseTime(String^ time)
+{
+	DateTime result;
+	array<String^>^ patterns = { "yyMMddHHmmss'Z'", "yyyyMMddHHmmss'Z'" };
+	if (DateTime::TryParseExact(time, patterns, CultureInfo::InvariantCulture, DateTimeStyles::AdjustToUniversal | DateTimeStyles::AssumeUniversal, result))
+		return result;
+	return DateTime::MinValue;
+}
@@ -0,0 +1,44 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+using namespace System;
+using namespace System::Collections::Generic;
+
+// pki/index.txt in the layout of openssl ca, one line per issued certificate with its status,
+// expiry, serial and subject. Answers expiry questions without parsing every certificate and
+// keeps a record of revoked certificates after their files are removed.
+ref class CertificateIndex
+{
+public:
+	CertificateIndex(String^ path);
+
+	// Builds the index from the certificates in pkiPath the first time it's needed
+	bool Load(String^ pkiPath);
+	// Appends one line, safe to call from several writers
+	void Add(String^ certData);
+	void Revoke(String^ certData);
+	int CountValid(DateTime now);
+	int CountExpiring(DateTime now, int days);
+
+private:
+	ref class Entry
+	{
+	public:
+		Char status = 'V';
+		DateTime notAfter;
+		String^ revoked = "";
+		String^ serial;
+		String^ subject;
+	};
+
+	String^ path;
+	List<Entry^>^ entries;
+	Object^ lock;
+
+	bool save();
+	static Entry^ parse(String^ certData);
+	static String^ format(Entry^ entry);
+	static String^ asn1Time(DateTime time);
+	static DateTime parseTime(String^ time);
+};
@@ -0,0 +1,92 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "stdafx.h"
+#include "DirectoryLock.h"
+
+using namespace System::Diagnostics;
+using namespace System::Threading;
+
+DirectoryLock::DirectoryLock(String^ path, Metrics^ metrics)
+{
+	Stopwatch^ watch = Stopwatch::StartNew();
+	Monitor::Enter(processLock);
+	this->held = true;
+	// Sharing violations are the only way another process holding the file shows up, so retry
+	// them with a growing backoff
+	int delay = 1;
+	while (this->stream == nullptr) {
+		try {
+			this->stream = gcnew FileStream(path, FileMode::OpenOrCreate, FileAccess::ReadWrite, FileShare::None);
+		}
+		catch (IOException^ e) {
+			if (File::Exists(path) && (e->HResult & 0xFFFF) == 32) {
+				Thread::Sleep(delay);
+				delay = Math::Min(delay * 2, 50);
+				continue;
+			}
+			Monitor::Exit(processLock);
+			this->held = false;
+			throw gcnew Exception(String::Format("Failed to lock {0}. {1}", path, e->Message));
+		}
+	}
+
+	if (metrics != nullptr)
+		metrics->Observe("openvpn_generate_lock_wait_seconds", watch->Elapsed.TotalSeconds);
+}
+
+DirectoryLock::~DirectoryLock()
+{
+	// Closing the handle lets the next process open it
+	if (this->stream != nullptr)
+		delete this->stream;
+	this->stream = nullptr;
+	if (this->held)
+		Monitor::Exit(processLock);
+	this->held = false;
+}
+
+String^ DirectoryLock::TempPath(String^ path)
+{
+	return String::Format("{0}.{1}.{2}.{3}.tmp", path, Environment::MachineName,
+		Process::GetCurrentProcess()->Id, Interlocked::Increment(counter));
+}
+
+void DirectoryLock::Commit(String^ temp, String^ path)
+{
+	try {
+		if (File::Exists(path))
+			File::Replace(temp, path, nullptr);
+		else
+			File::Move(temp, path);
+	}
+	catch (Exception^) {
+		File::Delete(temp);
+		throw;
+	}
+}
+
+void DirectoryLock::WriteFile(String^ path, String^ data)
+{
+	String^ temp = TempPath(path);
+	try {
+		File::WriteAllText(temp, data);
+	}
+	catch (Exception^) {
+		File::Delete(temp);
+		throw;
+	}
+	Commit(temp, path);
+}
+
+void DirectoryLock::WriteFile(String^ path, array<Byte>^ data)
+{
+	String^ temp = TempPath(path);
+	try {
+		File::WriteAllBytes(temp, data);
+	}
+	catch (Exception^) {
+		File::Delete(temp);
+		throw;
+	}
+	Commit(temp, path);
+}
@@ -0,0 +1,36 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include "Metrics.h"
+
+using namespace System;
+using namespace System::IO;
+
+// Exclusive lock on a file shared by every process working on one config directory, including
+// processes on other hosts when the directory is on a share. Held for one read-modify-write of
+// shared state at a time, never nested. Use with stack semantics.
+ref class DirectoryLock
+{
+public:
+	// Blocks until the lock is held, observing the wait in metrics when given
+	DirectoryLock(String^ path, Metrics^ metrics);
+	~DirectoryLock();
+
+	// A name next to path that no other thread or host will pick, for writing a file in full
+	// before renaming it over path. Readers then see the old file or the new one, never part.
+	static String^ TempPath(String^ path);
+	// Moves a file written to TempPath over path
+	static void Commit(String^ temp, String^ path);
+	// Writes data to a TempPath and commits it over path. Throws, leaving path as it was.
+	static void WriteFile(String^ path, String^ data);
+	static void WriteFile(String^ path, array<Byte>^ data);
+
+private:
+	// Windows locks a file against other handles in this process too, but threads queue here
+	// rather than spinning on the sharing violation
+	static Object^ processLock = gcnew Object();
+	static int counter = 0;
+	FileStream^ stream;
+	bool held;
+};
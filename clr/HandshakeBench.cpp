@@ -0,0 +1,434 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "stdafx.h"
+#include "HandshakeBench.h"
+#include "Signing.h"
+
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <msclr/marshal.h>
+
+using namespace msclr::interop;
+using namespace System::Diagnostics;
+using namespace System::Threading;
+
+HandshakeBench::HandshakeBench(String^ path)
+{
+	this->path = path;
+	this->pkiPath = Path::Combine(path, "pki");
+	this->minVersion = "1.2";
+	this->serverCtx = NULL;
+	this->clientCtx = NULL;
+}
+
+HandshakeBench::~HandshakeBench()
+{
+	this->!HandshakeBench();
+}
+
+HandshakeBench::!HandshakeBench()
+{
+	SSL_CTX_free(this->serverCtx);
+	SSL_CTX_free(this->clientCtx);
+	this->serverCtx = NULL;
+	this->clientCtx = NULL;
+}
+
+bool HandshakeBench::Load(String^ clientName)
+{
+	// Every worker's config has the same TLS settings, the first one will do
+	String^ serverPath = Path::Combine(this->path, "server");
+	array<String^>^ configs = Directory::Exists(serverPath) ? Directory::GetFiles(serverPath, "*.conf") : gcnew array<String^>(0);
+	if (configs->Length == 0) {
+		Console::WriteLine("ERROR: No server configuration in {0}, run init or regenerate first.", serverPath);
+		return false;
+	}
+	Array::Sort(configs, StringComparer::Ordinal);
+	this->serverConfig = configs[0];
+
+	this->clientName = clientName;
+	if (String::IsNullOrEmpty(this->clientName)) {
+		List<String^>^ names = gcnew List<String^>();
+		for each (String^ cert in Directory::GetFiles(this->pkiPath, "*.crt")) {
+			String^ stem = Path::GetFileNameWithoutExtension(cert);
+			if (stem != "ca" && stem != "server" && stem != "crl" && File::Exists(Path::Combine(this->pkiPath, stem + ".key")))
+				names->Add(stem);
+		}
+		if (names->Count == 0) {
+			Console::WriteLine("ERROR: No client identity in {0}, create one with client first.", this->pkiPath);
+			return false;
+		}
+		names->Sort(StringComparer::Ordinal);
+		this->clientName = names[0];
+	}
+	else if (!File::Exists(Path::Combine(this->pkiPath, this->clientName + ".crt"))) {
+		Console::WriteLine("ERROR: Client {0} not found.", this->clientName);
+		return false;
+	}
+
+	this->serverCtx = createContext(true);
+	if (this->serverCtx == NULL)
+		return false;
+	this->clientCtx = createContext(false);
+	return this->clientCtx != NULL;
+}
+
+SSL_CTX* HandshakeBench::createContext(bool server)
+{
+	// The server loads exactly what OpenVPN would from its config, relative to the server directory
+	String^ serverPath = Path::GetDirectoryName(this->serverConfig);
+	String^ ca;
+	String^ cert;
+	String^ key;
+	String^ dh;
+	String^ crl;
+	for each (String^ line in File::ReadAllLines(this->serverConfig)) {
+		array<String^>^ parts = line->Split((array<wchar_t>^)nullptr, StringSplitOptions::RemoveEmptyEntries);
+		if (parts->Length < 2)
+			continue;
+		if (parts[0] == "ca")
+			ca = Path::Combine(serverPath, parts[1]);
+		else if (parts[0] == "cert")
+			cert = Path::Combine(serverPath, parts[1]);
+		else if (parts[0] == "key")
+			key = Path::Combine(serverPath, parts[1]);
+		else if (parts[0] == "dh" && parts[1] != "none")
+			dh = Path::Combine(serverPath, parts[1]);
+		else if (parts[0] == "crl-verify" && (parts->Length < 3 || parts[2] != "dir"))
+			crl = Path::Combine(serverPath, parts[1]);
+		else if (parts[0] == "tls-version-min")
+			this->minVersion = parts[1];
+		else if (parts[0] == "tls-cipher")
+			this->cipher = parts[1];
+		else if (parts[0] == "ecdh-curve")
+			this->curve = parts[1];
+	}
+	if (!server) {
+		cert = Path::Combine(this->pkiPath, this->clientName + ".crt");
+		key = Path::Combine(this->pkiPath, this->clientName + ".key");
+	}
+
+	marshal_context ctx;
+	SSL_CTX* sslCtx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+	bool ok = sslCtx != NULL && cert != nullptr && key != nullptr && ca != nullptr
+		&& SSL_CTX_use_certificate_chain_file(sslCtx, ctx.marshal_as<const char*>(cert)) == 1
+		&& SSL_CTX_use_PrivateKey_file(sslCtx, ctx.marshal_as<const char*>(key), SSL_FILETYPE_PEM) == 1
+		&& SSL_CTX_check_private_key(sslCtx) == 1
+		&& SSL_CTX_load_verify_locations(sslCtx, ctx.marshal_as<const char*>(ca), NULL) == 1;
+	if (!ok) {
+		Console::WriteLine("ERROR: Failed to load the {0} identity. {1}", server ? "server" : "client", lastError());
+		SSL_CTX_free(sslCtx);
+		return NULL;
+	}
+	// Both ends verify each other the way OpenVPN does, and every handshake is a full one
+	SSL_CTX_set_verify(sslCtx, SSL_VERIFY_PEER | (server ? SSL_VERIFY_FAIL_IF_NO_PEER_CERT : 0), NULL);
+	SSL_CTX_set_session_cache_mode(sslCtx, SSL_SESS_CACHE_OFF);
+	SSL_CTX_set_options(sslCtx, SSL_OP_NO_TICKET);
+
+	if (server && dh != nullptr) {
+		BIO* bio = BIO_new_file(ctx.marshal_as<const char*>(dh), "r");
+		EVP_PKEY* params = bio != NULL ? PEM_read_bio_Parameters(bio, NULL) : NULL;
+		BIO_free(bio);
+		DH* paramsDH = params != NULL ? EVP_PKEY_get1_DH(params) : NULL;
+		ok = paramsDH != NULL && SSL_CTX_set_tmp_dh(sslCtx, paramsDH) == 1;
+		DH_free(paramsDH);
+		EVP_PKEY_free(params);
+		if (!ok) {
+			Console::WriteLine("ERROR: Failed to load DH parameters from {0}. {1}", dh, lastError());
+			SSL_CTX_free(sslCtx);
+			return NULL;
+		}
+	}
+	if (server && crl != nullptr && File::Exists(crl)) {
+		// crl-verify checks every client against the CRL, a large one costs on every handshake
+		X509_STORE* store = SSL_CTX_get_cert_store(sslCtx);
+		if (X509_load_crl_file(X509_STORE_add_lookup(store, X509_LOOKUP_file()), ctx.marshal_as<const char*>(crl), X509_FILETYPE_PEM) <= 0) {
+			Console::WriteLine("ERROR: Failed to load CRL from {0}. {1}", crl, lastError());
+			SSL_CTX_free(sslCtx);
+			return NULL;
+		}
+		X509_STORE_set_flags(store, X509_V_FLAG_CRL_CHECK);
+	}
+	if (!configure(sslCtx)) {
+		SSL_CTX_free(sslCtx);
+		return NULL;
+	}
+	return sslCtx;
+}
+
+bool HandshakeBench::configure(SSL_CTX* sslCtx)
+{
+	int version = this->minVersion == "1.3" ? TLS1_3_VERSION : this->minVersion == "1.1" ? TLS1_1_VERSION : TLS1_2_VERSION;
+	if (SSL_CTX_set_min_proto_version(sslCtx, version) != 1) {
+		Console::WriteLine("ERROR: Unsupported tls-version-min {0}.", this->minVersion);
+		return false;
+	}
+	marshal_context ctx;
+	if (this->cipher != nullptr) {
+		// TLS 1.3 suites go through their own list, older ciphers use OpenVPN's IANA style names
+		bool ok = this->cipher->StartsWith("TLS_")
+			? SSL_CTX_set_ciphersuites(sslCtx, ctx.marshal_as<const char*>(this->cipher)) == 1
+			: SSL_CTX_set_cipher_list(sslCtx, ctx.marshal_as<const char*>(cipherName(this->cipher))) == 1;
+		if (!ok) {
+			Console::WriteLine("ERROR: Unsupported tls-cipher {0}. {1}", this->cipher, lastError());
+			return false;
+		}
+	}
+	if (this->curve != nullptr && SSL_CTX_set1_groups_list(sslCtx, ctx.marshal_as<const char*>(this->curve)) != 1) {
+		// Not a key exchange group, OpenVPN falls back to secp384r1 the same way
+		ERR_clear_error();
+		SSL_CTX_set1_groups_list(sslCtx, "secp384r1");
+	}
+	return true;
+}
+
+bool HandshakeBench::Run(int threads, double seconds)
+{
+	threads = Math::Max(1, threads);
+	Console::WriteLine("Server identity: {0}, from {1}", describeKey(), Path::GetFileName(this->serverConfig));
+	Console::WriteLine("Client identity: {0}", this->clientName);
+
+	// One handshake up front catches a config that can't work and shows what was negotiated
+	Tally^ first = gcnew Tally();
+	if (!handshake(first)) {
+		Console::WriteLine("ERROR: Handshake failed. {0}", first->error);
+		return false;
+	}
+	Console::WriteLine("Negotiated: {0}", first->negotiated);
+	// Certificates included, this is what has to cross the link before the client can answer
+	Console::WriteLine("Largest server flight: {0} bytes", first->serverFlight);
+	double serverRate;
+	if (!measure(threads, seconds, serverRate))
+		return false;
+	if (this->ComparePrimes == 0)
+		return true;
+
+	Console::WriteLine();
+	if (!useMultiPrimeKey())
+		return false;
+	Console::WriteLine("Server identity: {0}, generated for comparison", describeKey());
+	double compareRate;
+	if (!measure(threads, seconds, compareRate))
+		return false;
+	Console::WriteLine();
+	Console::WriteLine("Server side with {0} primes: {1:F2}x the handshakes per core", this->ComparePrimes, compareRate / serverRate);
+	return true;
+}
+
+bool HandshakeBench::measure(int threads, double seconds, double% serverRate)
+{
+	Console::WriteLine("Running handshakes for {0:F0}s on {1} threads...", seconds, threads);
+
+	array<Tally^>^ tallies = gcnew array<Tally^>(threads);
+	array<Thread^>^ workers = gcnew array<Thread^>(threads);
+	Stopwatch^ watch = Stopwatch::StartNew();
+	for (int i = 0; i < threads; i++) {
+		tallies[i] = gcnew Tally();
+		tallies[i]->seconds = seconds;
+		workers[i] = gcnew Thread(gcnew ParameterizedThreadStart(this, &HandshakeBench::run));
+		workers[i]->Start(tallies[i]);
+	}
+	for each (Thread^ t in workers)
+		t->Join();
+	double elapsed = watch->Elapsed.TotalSeconds;
+
+	Tally^ total = gcnew Tally();
+	for each (Tally^ tally in tallies) {
+		total->handshakes += tally->handshakes;
+		total->serverSeconds += tally->serverSeconds;
+		total->clientSeconds += tally->clientSeconds;
+		if (tally->error != nullptr)
+			total->error = tally->error;
+	}
+	if (total->error != nullptr) {
+		Console::WriteLine("ERROR: Handshake failed. {0}", total->error);
+		return false;
+	}
+	if (total->handshakes == 0) {
+		Console::WriteLine("ERROR: No handshakes completed.");
+		return false;
+	}
+
+	Console::WriteLine();
+	Console::WriteLine("{0} handshakes in {1:F1}s.", total->handshakes, elapsed);
+	Console::WriteLine("  Both ends:   {0:F1} handshakes/s, {1:F1} per core", total->handshakes / elapsed, total->handshakes / elapsed / threads);
+	// Each thread plays both ends, the time in the server's half is what a server core would spend
+	Console::WriteLine("  Server side: {0:F1} handshakes/s per core, {1:F2}ms each", total->handshakes / total->serverSeconds,
+		total->serverSeconds * 1000 / total->handshakes);
+	Console::WriteLine("  Client side: {0:F2}ms each", total->clientSeconds * 1000 / total->handshakes);
+	serverRate = total->handshakes / total->serverSeconds;
+	return true;
+}
+
+bool HandshakeBench::useMultiPrimeKey()
+{
+	X509* current = SSL_CTX_get0_certificate(this->serverCtx);
+	if (EVP_PKEY_base_id(X509_get0_pubkey(current)) != EVP_PKEY_RSA) {
+		Console::WriteLine("ERROR: Comparing primes needs an RSA server key.");
+		return false;
+	}
+	int keySize = EVP_PKEY_bits(X509_get0_pubkey(current));
+	// The same limits OpenSSL applies, each prime has to stay large enough to be safe
+	int maxPrimes = keySize < 1024 ? 2 : keySize < 4096 ? 3 : keySize < 8192 ? 4 : 5;
+	if (this->ComparePrimes > maxPrimes) {
+		Console::WriteLine("ERROR: A {0} bit key is too small for {1} primes.", keySize, this->ComparePrimes);
+		return false;
+	}
+	String^ caKey = Path::Combine(this->pkiPath, "ca.key");
+	if (!File::Exists(caKey)) {
+		Console::WriteLine("ERROR: Comparing primes needs the CA key to sign the test key, {0} not found.", caKey);
+		return false;
+	}
+
+	// Nothing is written, the key and a copy of the server cert re-signed for it only live in the
+	// server context
+	marshal_context ctx;
+	BIO* bio = BIO_new_file(ctx.marshal_as<const char*>(caKey), "r");
+	EVP_PKEY* signer = bio != NULL ? PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL) : NULL;
+	BIO_free(bio);
+	EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+	EVP_PKEY* key = NULL;
+	bool ok = signer != NULL && pctx != NULL && EVP_PKEY_keygen_init(pctx) > 0
+		&& EVP_PKEY_CTX_set_rsa_keygen_bits(pctx, keySize) > 0
+		&& EVP_PKEY_CTX_set_rsa_keygen_primes(pctx, this->ComparePrimes) > 0
+		&& EVP_PKEY_keygen(pctx, &key) > 0;
+	EVP_PKEY_CTX_free(pctx);
+	X509* cert = X509_dup(current);
+	if (ok) {
+		ok = cert != NULL && RekeyCertificate(cert, key) && X509_sign(cert, signer, SigningDigest(signer)) > 0
+			&& SSL_CTX_use_certificate(this->serverCtx, cert) == 1
+			&& SSL_CTX_use_PrivateKey(this->serverCtx, key) == 1
+			&& SSL_CTX_check_private_key(this->serverCtx) == 1;
+	}
+	if (!ok)
+		Console::WriteLine("ERROR: Failed to create a {0} prime server key. {1}", this->ComparePrimes, lastError());
+	X509_free(cert);
+	EVP_PKEY_free(key);
+	EVP_PKEY_free(signer);
+	return ok;
+}
+
+void HandshakeBench::run(Object^ state)
+{
+	Tally^ tally = (Tally^)state;
+	Stopwatch^ watch = Stopwatch::StartNew();
+	while (watch->Elapsed.TotalSeconds < tally->seconds) {
+		if (!handshake(tally))
+			return;
+	}
+}
+
+bool HandshakeBench::handshake(Tally^ tally)
+{
+	SSL* server = SSL_new(this->serverCtx);
+	SSL* client = SSL_new(this->clientCtx);
+	BIO* serverBio = NULL;
+	BIO* clientBio = NULL;
+	if (server == NULL || client == NULL || BIO_new_bio_pair(&serverBio, 0, &clientBio, 0) != 1) {
+		tally->error = lastError();
+		SSL_free(server);
+		SSL_free(client);
+		return false;
+	}
+	SSL_set_bio(server, serverBio, serverBio);
+	SSL_set_bio(client, clientBio, clientBio);
+	SSL_set_accept_state(server);
+	SSL_set_connect_state(client);
+
+	// Each side runs until it needs the other's next flight, both finish within a few rounds
+	bool serverDone = false, clientDone = false, ok = true;
+	for (int round = 0; round < 16 && ok && !(serverDone && clientDone); round++) {
+		for (int side = 0; side < 2 && ok; side++) {
+			bool isServer = side == 1;
+			SSL* ssl = isServer ? server : client;
+			if (isServer ? serverDone : clientDone)
+				continue;
+			Int64 start = Stopwatch::GetTimestamp();
+			int result = SSL_do_handshake(ssl);
+			double spent = (double)(Stopwatch::GetTimestamp() - start) / Stopwatch::Frequency;
+			if (isServer)
+				tally->serverSeconds += spent;
+			else
+				tally->clientSeconds += spent;
+			if (isServer && tally->handshakes == 0)
+				tally->serverFlight = Math::Max(tally->serverFlight, (int)BIO_ctrl_pending(clientBio));
+			if (result == 1) {
+				if (isServer)
+					serverDone = true;
+				else
+					clientDone = true;
+				continue;
+			}
+			int error = SSL_get_error(ssl, result);
+			if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+				tally->error = (isServer ? "Server: " : "Client: ") + lastError();
+				ok = false;
+			}
+		}
+	}
+	if (ok && !(serverDone && clientDone)) {
+		tally->error = "Handshake did not complete";
+		ok = false;
+	}
+	if (ok) {
+		if (tally->handshakes == 0)
+			tally->negotiated = gcnew String(SSL_get_version(client)) + ", " + gcnew String(SSL_get_cipher_name(client));
+		tally->handshakes++;
+	}
+	SSL_free(server);
+	SSL_free(client);
+	return ok;
+}
+
+String^ HandshakeBench::describeKey()
+{
+	EVP_PKEY* key = X509_get0_pubkey(SSL_CTX_get0_certificate(this->serverCtx));
+	switch (EVP_PKEY_base_id(key)) {
+	case EVP_PKEY_RSA: {
+		String^ description = String::Format("RSA {0}", EVP_PKEY_bits(key));
+		int primes = RSA_get_multi_prime_extra_count(EVP_PKEY_get0_RSA(SSL_CTX_get0_privatekey(this->serverCtx))) + 2;
+		if (primes > 2)
+			description += String::Format(", {0} primes", primes);
+		return description;
+	}
+	case EVP_PKEY_EC:
+		return "ECDSA " + gcnew String(OBJ_nid2sn(EC_GROUP_get_curve_name(EC_KEY_get0_group(EVP_PKEY_get0_EC_KEY(key)))));
+	case EVP_PKEY_ED25519:
+		return "Ed25519";
+	case EVP_PKEY_ED448:
+		return "Ed448";
+	default:
+		return gcnew String(OBJ_nid2sn(EVP_PKEY_base_id(key)));
+	}
+}
+
+String^ HandshakeBench::cipherName(String^ ianaName)
+{
+	// OpenVPN accepts names like TLS-ECDHE-ECDSA-WITH-AES-256-GCM-SHA384 and translates them to
+	// OpenSSL's, this covers the ones written by this generator. Anything else is passed through.
+	Dictionary<String^, String^>^ names = gcnew Dictionary<String^, String^>();
+	names["TLS-ECDHE-ECDSA-WITH-AES-256-GCM-SHA384"] = "ECDHE-ECDSA-AES256-GCM-SHA384";
+	names["TLS-ECDHE-ECDSA-WITH-AES-128-GCM-SHA256"] = "ECDHE-ECDSA-AES128-GCM-SHA256";
+	names["TLS-ECDHE-ECDSA-WITH-CHACHA20-POLY1305-SHA256"] = "ECDHE-ECDSA-CHACHA20-POLY1305";
+	names["TLS-ECDHE-RSA-WITH-AES-256-GCM-SHA384"] = "ECDHE-RSA-AES256-GCM-SHA384";
+	names["TLS-DHE-RSA-WITH-AES-256-GCM-SHA384"] = "DHE-RSA-AES256-GCM-SHA384";
+	array<String^>^ parts = ianaName->Split(':');
+	for (int i = 0; i < parts->Length; i++) {
+		String^ name;
+		if (names->TryGetValue(parts[i], name))
+			parts[i] = name;
+	}
+	return String::Join(":", parts);
+}
+
+String^ HandshakeBench::lastError()
+{
+	char buf[256];
+	unsigned long error = ERR_get_error();
+	ERR_clear_error();
+	if (error == 0)
+		return "Unknown error";
+	ERR_error_string_n(error, buf, sizeof(buf));
+	return gcnew String(buf);
+}
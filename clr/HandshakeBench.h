@@ -0,0 +1,63 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include <openssl/ssl.h>
+
+using namespace System;
+using namespace System::Collections::Generic;
+using namespace System::IO;
+
+// Runs full TLS handshakes between the server identity and a client identity entirely in memory,
+// over a BIO pair, with the TLS settings from the generated server config. Measures how many
+// handshakes a core can complete, no network or OpenVPN needed.
+ref class HandshakeBench
+{
+public:
+	HandshakeBench(String^ path);
+	~HandshakeBench();
+	!HandshakeBench();
+
+	// Reads the server config and both identities. The client is the first one in pki unless named.
+	bool Load(String^ clientName);
+	bool Run(int threads, double seconds);
+
+	// When set, Run goes again with an RSA server key of this many primes and the same modulus size,
+	// generated in memory and signed by the CA, and compares the server side
+	property int ComparePrimes;
+
+private:
+	ref class Tally
+	{
+	public:
+		Int64 handshakes;
+		double serverSeconds;
+		double clientSeconds;
+		// Most bytes the server sent in one round of the first handshake
+		int serverFlight;
+		double seconds;
+		String^ negotiated;
+		String^ error;
+	};
+
+	String^ path;
+	String^ pkiPath;
+	String^ serverConfig;
+	String^ clientName;
+	SSL_CTX* serverCtx;
+	SSL_CTX* clientCtx;
+	String^ minVersion;
+	String^ cipher;
+	String^ curve;
+
+	SSL_CTX* createContext(bool server);
+	bool configure(SSL_CTX* ctx);
+	bool measure(int threads, double seconds, double% serverRate);
+	bool useMultiPrimeKey();
+	void run(Object^ state);
+	bool handshake(Tally^ tally);
+	String^ describeKey();
+
+	static String^ cipherName(String^ ianaName);
+	static String^ lastError();
+};
@@ -2,6 +2,16 @@
 
 #include "stdafx.h"
 #include "Interactive.h"
+#include "CRLFile.h"
+#include "Signing.h"
+
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/x509v3.h>
+#include <msclr/lock.h>
+#include <msclr/marshal.h>
+
+using namespace msclr::interop;
 
 Interactive::Interactive(String ^ path, OpenSSLHelper::Algorithm algorithm, int keySize, String^ ecCurve, int validDays, String^ suffix)
 {
@@ -13,13 +23,29 @@ Interactive::Interactive(String ^ path, OpenSSLHelper::Algorithm algorithm, int
 	this->suffix = suffix;
 	if (suffix == nullptr)
 		this->suffix = "";
+	this->Subnet = defaultSubnet;
+	this->Workers = 1;
+	this->TuningProfile = Tuning::Profile::None;
+	this->DCO = false;
+	this->ServerRSAPrimes = 2;
+	this->CompactCerts = false;
+	this->MetricsExpiryDays = 30;
 	//Init other paths
 	this->configPath = Path::Combine(path, "config.conf");
 	this->pkiPath = Path::Combine(path, "pki");
 	this->caPath = Path::Combine(this->pkiPath, "ca.crt");
 	this->keyPath = Path::Combine(this->pkiPath, "ca.key");
 	this->crlPath = Path::Combine(this->pkiPath, "crl.crt");
+	this->crlDirPath = Path::Combine(this->pkiPath, "crl");
+	this->tlsCryptPath = Path::Combine(this->pkiPath, "ta.key");
+	this->tlsCryptV2Path = Path::Combine(this->pkiPath, "tls-crypt-v2-server.key");
 	this->clientsPath = Path::Combine(path, "clients");
+	this->ccdPath = Path::Combine(path, "ccd");
+	this->addressPoolPath = Path::Combine(this->pkiPath, "addresses.bin");
+	this->lockPath = Path::Combine(path, "config.lock");
+	this->cache = gcnew RegenerationCache(path, Path::Combine(this->pkiPath, "cache.json"));
+	this->index = gcnew CertificateIndex(Path::Combine(this->pkiPath, "index.txt"));
+	this->metrics = gcnew Metrics();
 }
 
 bool Interactive::LoadConfig()
@@ -66,6 +92,8 @@ bool Interactive::LoadConfig()
 	}
 	if (dict->TryGetValue("serial", val)) {
 		this->_serial = Convert::ToInt32(val);
+		// Nothing reserved yet, the first serial issued reserves a block
+		this->serialLimit = this->_serial;
 	}
 	else {
 		Console::WriteLine("ERROR: Failed to load serial from config");
@@ -98,6 +126,59 @@ bool Interactive::LoadConfig()
 	else
 		this->suffix = "";
 
+	if (dict->TryGetValue("crlmode", val))
+		this->UseCRLDir = ((String^)val == "dir");
+	else
+		this->UseCRLDir = false;
+
+	// Configs from before tls-crypt support keep working without it
+	if (dict->TryGetValue("tlscrypt", val))
+		this->TLSCryptMode = static_cast<TLSCrypt::Mode>(Convert::ToInt32(val));
+	else
+		this->TLSCryptMode = TLSCrypt::Mode::None;
+
+	// Configs from before the subnet was configurable are all 10.8.0.0/24
+	if (dict->TryGetValue("subnet", val))
+		this->Subnet = (String^)val;
+	else
+		this->Subnet = defaultSubnet;
+
+	if (dict->TryGetValue("workers", val))
+		this->Workers = Convert::ToInt32(val);
+	else
+		this->Workers = 1;
+
+	if (dict->TryGetValue("profile", val))
+		this->TuningProfile = static_cast<Tuning::Profile>(Convert::ToInt32(val));
+	else
+		this->TuningProfile = Tuning::Profile::None;
+
+	if (dict->TryGetValue("dco", val))
+		this->DCO = Convert::ToBoolean(val);
+	else
+		this->DCO = false;
+
+	if (dict->TryGetValue("serverrsaprimes", val))
+		this->ServerRSAPrimes = Convert::ToInt32(val);
+	else
+		this->ServerRSAPrimes = 2;
+
+	if (dict->TryGetValue("compactcerts", val))
+		this->CompactCerts = Convert::ToBoolean(val);
+	else
+		this->CompactCerts = false;
+
+	if (dict->TryGetValue("aesni", val))
+		this->aesni = Convert::ToBoolean(val);
+	else
+		this->aesni = false;
+
+	this->Routes = gcnew List<String^>();
+	if (dict->TryGetValue("routes", val)) {
+		for each (Object^ route in (System::Collections::IEnumerable^)val)
+			this->Routes->Add(route->ToString());
+	}
+
 	//Load in CA
 	String^ certData;
 	try {
@@ -109,6 +190,13 @@ bool Interactive::LoadConfig()
 		Console::WriteLine("ERROR: Failed to read cert off disk. " + e->Message);
 		return false;
 	}
+	// Once intermediates issue the clients the root key can be kept offline, the root
+	// certificate is all that's needed to bundle the chain
+	this->rootOffline = !File::Exists(this->keyPath) && dict->ContainsKey("issuers");
+	if (this->rootOffline) {
+		this->Issuer = nullptr;
+		return loadAddressPool();
+	}
 	String^ keyData;
 	try {
 		StreamReader^ sr = gcnew StreamReader(this->keyPath);
@@ -132,21 +220,38 @@ bool Interactive::LoadConfig()
 		return false;
 	}
 
-	return true;
+	return loadAddressPool();
 }
 
 bool Interactive::SaveConfig()
 {
-	this->config["serial"] = this->_serial;
+	msclr::auto_handle<DirectoryLock> lock(lockDirectory());
+	if (lock.get() == nullptr)
+		return false;
+	// Another process may have reserved serials past ours since we loaded, never go backwards.
+	// The address pool is saved as each address is handed out.
+	int serial = this->_serial;
+	try {
+		if (File::Exists(this->configPath)) {
+			Dictionary<String^, Object^>^ disk = JsonConvert::DeserializeObject<Dictionary<String^, Object^>^>(File::ReadAllText(this->configPath));
+			Object^ val;
+			if (disk->TryGetValue("serial", val))
+				serial = Math::Max(serial, Convert::ToInt32(val));
+			// Intermediates are only ever added straight to the file, under the lock
+			if (disk->TryGetValue("issuers", val))
+				this->config["issuers"] = val;
+		}
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("WARNING: Failed to reread config at {0}. {1}", this->configPath, e->Message);
+	}
+	this->config["serial"] = serial;
 	try {
 		//Convert to JSON
 		String^ json = JsonConvert::SerializeObject(this->config);
 
 		//Write to config
-		StreamWriter^ sw = gcnew StreamWriter(this->configPath);
-sw->Write(json);
-sw->Flush();
-sw->Close();
+		DirectoryLock::WriteFile(this->configPath, json);
 	}
 	catch (Exception ^ e) {
 		Console::WriteLine("ERROR: Failed to write config to {0}. {1}", this->configPath, e->Message);
@@ -174,6 +279,93 @@ bool Interactive::CreateNewIssuer()
 	return this->saveIdentity(identity, "ca");
 }
 
+bool Interactive::CreateIssuingCA(String^ name)
+{
+	if (!verifyRequirements() || !requireRootKey())
+		return false;
+	String^ CN = name;
+	if (String::IsNullOrWhiteSpace(CN)) {
+		CN = askQuestion("Intermediate name, for example a site or worker [site1]:", false);
+		if (String::IsNullOrWhiteSpace(CN))
+			CN = "site1";
+	}
+	if (!IssuingCA::ValidName(CN)) {
+		Console::WriteLine("ERROR: Intermediate names can only use letters, digits, '-', '_' and '.'.");
+		return false;
+	}
+	// The subject is the root's with this Common Name, the two have to be told apart
+	if (CN == this->cSubject->CommonName) {
+		Console::WriteLine("ERROR: An intermediate can't have the same name as the root CA.");
+		return false;
+	}
+	// Taken from the root's block before the lock, reserving it takes the lock too
+	int serial;
+	try {
+		serial = this->Serial;
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: {0}", e->Message);
+		return false;
+	}
+
+	IssuingCA^ intermediate;
+	{
+		msclr::auto_handle<DirectoryLock> lock(lockDirectory());
+		if (lock.get() == nullptr)
+			return false;
+		Dictionary<String^, Object^>^ disk;
+		try {
+			disk = JsonConvert::DeserializeObject<Dictionary<String^, Object^>^>(File::ReadAllText(this->configPath));
+		}
+		catch (Exception^ e) {
+			Console::WriteLine("ERROR: Failed to reread config at {0}. {1}", this->configPath, e->Message);
+			return false;
+		}
+		// The root's own serials have to fit below the first intermediate's block
+		Object^ val;
+		if (disk->TryGetValue("serial", val) && Convert::ToInt32(val) >= (1 << IssuingCA::SerialBits) - 1) {
+			Console::WriteLine("ERROR: The root CA has issued too many serials to split them with intermediates.");
+			return false;
+		}
+		Dictionary<String^, int>^ issuers = issuerIndexes(disk);
+		if (issuers->ContainsKey(CN)) {
+			Console::WriteLine("ERROR: Intermediate {0} already exists.", CN);
+			return false;
+		}
+		int index = 1;
+		for each (int existing in issuers->Values)
+			index = Math::Max(index, existing + 1);
+		if (index > IssuingCA::MaxIssuers) {
+			Console::WriteLine("ERROR: No serial blocks left for another intermediate.");
+			return false;
+		}
+
+		intermediate = gcnew IssuingCA(this->pkiPath, CN, index, this->metrics);
+		try {
+			// OpenVPN checks the intermediate against the root's CRL as well as the client against the
+			// intermediate's, so both have to exist before the first client is issued
+			if (!this->UseCRLDir)
+				(gcnew CRLFile(this->crlPath))->Create(this->caPath, this->keyPath, this->validDays);
+			intermediate->Create(this->Issuer, this->keyAlg, this->keySize, this->curveName, this->validDays, serial, this->CompactCerts);
+			issuers[CN] = index;
+			disk["issuers"] = issuers;
+			DirectoryLock::WriteFile(this->configPath, JsonConvert::SerializeObject(disk));
+			this->config["issuers"] = issuers;
+		}
+		catch (Exception^ e) {
+			Console::WriteLine("ERROR: Failed to create intermediate {0}. {1}", CN, e->Message);
+			return false;
+		}
+	}
+
+	Console::WriteLine();
+	Console::WriteLine("Intermediate \"{0}\" created at {1}, issuing serials {2} to {3}.", CN, intermediate->CertPath,
+		intermediate->FirstSerial + 1, intermediate->LastSerial);
+	Console::WriteLine("Use client --issuer {0} to sign clients with it. The root key in {1} is only needed to create", CN, this->keyPath);
+	Console::WriteLine("more intermediates, sign the server or revoke certificates the root issued.");
+	return true;
+}
+
 bool Interactive::CreateDH()
 {
 	Console::WriteLine("Creating DH Params. This will take a while...");
@@ -195,16 +387,56 @@ bool Interactive::CreateDH()
 	return true;
 }
 
+bool Interactive::CreateTLSCryptKey()
+{
+	if (this->TLSCryptMode == TLSCrypt::Mode::None)
+		return true;
+	try {
+		String^ key;
+		String^ keyPath;
+		if (this->TLSCryptMode == TLSCrypt::Mode::V2) {
+			key = TLSCrypt::CreateV2ServerKey();
+			keyPath = this->tlsCryptV2Path;
+		}
+		else {
+			key = TLSCrypt::CreateStaticKey();
+			keyPath = this->tlsCryptPath;
+		}
+
+		StreamWriter^ sw = gcnew StreamWriter(keyPath);
+		sw->Write(key);
+		sw->Flush();
+		sw->Close();
+	}
+	catch (Exception ^ e) {
+		Console::WriteLine("ERROR: Failed to generate tls-crypt key. {0}", e->Message);
+		return false;
+	}
+	return true;
+}
+
 bool Interactive::CreateServerConfig()
 {
 	String^ caName = "ca" + this->suffix + ".crt";
 	String^ crlName = "crl" + this->suffix + ".crt";
+	String^ crlDirName = "crl" + this->suffix;
+	String^ ccdDirName = "ccd" + this->suffix;
 	String^ certName = "server" + this->suffix + ".crt";
 	String^ certpath = Path::Combine(this->pkiPath, "server.crt");
 	String^ keyName = "server" + this->suffix + ".key";
 	String^ keypath = Path::Combine(this->pkiPath, "server.key");
 	String^ dhName = "dh" + this->suffix + ".pem";
 	String^ dhPath = Path::Combine(this->pkiPath, "dh.pem");
+	String^ tlsCryptName;
+	String^ tlsCryptKeyPath;
+	if (this->TLSCryptMode == TLSCrypt::Mode::V2) {
+		tlsCryptName = "tls-crypt-v2-server" + this->suffix + ".key";
+		tlsCryptKeyPath = this->tlsCryptV2Path;
+	}
+	else if (this->TLSCryptMode == TLSCrypt::Mode::V1) {
+		tlsCryptName = "ta" + this->suffix + ".key";
+		tlsCryptKeyPath = this->tlsCryptPath;
+	}
 
 	if (!File::Exists(this->caPath)) {
 		Console::WriteLine("ERROR: Missing CA. Please regenerate config");
@@ -214,6 +446,10 @@ bool Interactive::CreateServerConfig()
 		Console::WriteLine("ERROR: Missing DH. Please regenerate config");
 		return false;
 	}
+	if (tlsCryptKeyPath != nullptr && !File::Exists(tlsCryptKeyPath)) {
+		Console::WriteLine("ERROR: Missing tls-crypt key. Please regenerate config");
+		return false;
+	}
 
 	if (!File::Exists(certpath) || !File::Exists(keypath)) {
 		if (!this->createNewServerIdentity()) {
@@ -221,6 +457,8 @@ bool Interactive::CreateServerConfig()
 			return false;
 		}
 	}
+	if (!this->assignMissingAddresses())
+		return false;
 
 	String^ port;
 	String^ proto;
@@ -247,151 +485,424 @@ bool Interactive::CreateServerConfig()
 		return false;
 	}
 
-	String^ file = "#-- Config Auto Generated by SparkLabs OpenVPN Certificate Generator --#\n";
-	file += "#--                   Config for OpenVPN 2.4 Server                  --#\n\n";
-	file += "proto {0}\n";
-	file += "ifconfig-pool-persist ipp" + this->suffix + ".txt\n";
-	file += "keepalive 10 120\n";
-	file += "user nobody\ngroup nogroup\n";
-	file += "persist-key\npersist-tun\n";
-	file += "status openvpn-status" + this->suffix + ".log\n";
-	file += "verb 3\n";
-	file += "mute 10\n";
-	file += String::Format("ca {0}\ncert {1}\nkey {2}\n", caName, certName, keyName);
-	if (File::Exists(this->crlPath)) {
-		file += "crl-verify " + crlName + "\n";
-	}
-	if (this->keyAlg == OpenSSLHelper::Algorithm::RSA) {
-		file += "dh " + dhName + "\n";
-	}
-	else if (this->keyAlg == OpenSSLHelper::Algorithm::EdDSA) {
-		file += "tls-version-min 1.3\n";
-		file += "dh none\n";
-		file += "# Note this curve probably isn't supported (yet), however OpenVPN will fall back to another (secp384r1)\n";
-		file += "ecdh-curve " + this->curveName + "\n";
-		file += "tls-cipher TLS_AES_256_GCM_SHA384\n";
-	}
-	else { // ecdsa
-		file += "tls-version-min 1.2\n";
-		file += "dh none\n";
-		file += "ecdh-curve " + this->curveName + "\n";
-		file += "tls-cipher TLS-ECDHE-ECDSA-WITH-AES-256-GCM-SHA384\n";
-	}
-	file += "port {1}\n";
-	file += "dev tun0\n";
-	file += "server 10.8.0.0 255.255.255.0\n";
+	// Each worker is a separate OpenVPN process, so the data channel of each gets its own core
+	array<String^>^ files = gcnew array<String^>(this->Workers);
+	for (int worker = 0; worker < this->Workers; worker++) {
+		String^ workerName = workerSuffix(worker);
+		String^ file = "#-- Config Auto Generated by SparkLabs OpenVPN Certificate Generator --#\n";
+		if (this->DCO)
+			file += "#--                   Config for OpenVPN 2.6 Server                  --#\n\n";
+		else
+			file += "#--                   Config for OpenVPN 2.4 Server                  --#\n\n";
+		file += "proto {0}\n";
+		file += "keepalive 10 120\n";
+		file += "user nobody\ngroup nogroup\n";
+		file += "persist-key\npersist-tun\n";
+		file += "status openvpn-status" + this->suffix + workerName + ".log\n";
+		file += "verb 3\n";
+		file += "mute 10\n";
+		file += String::Format("ca {0}\ncert {1}\nkey {2}\n", caName, certName, keyName);
+		if (this->UseCRLDir) {
+			file += "crl-verify " + crlDirName + " dir\n";
+		}
+		else if (File::Exists(this->crlPath)) {
+			file += "crl-verify " + crlName + "\n";
+		}
+		if (this->TLSCryptMode == TLSCrypt::Mode::V2) {
+			file += "tls-crypt-v2 " + tlsCryptName + "\n";
+		}
+		else if (this->TLSCryptMode == TLSCrypt::Mode::V1) {
+			file += "tls-crypt " + tlsCryptName + "\n";
+		}
+		if (this->keyAlg == OpenSSLHelper::Algorithm::RSA) {
+			file += "dh " + dhName + "\n";
+		}
+		else if (this->keyAlg == OpenSSLHelper::Algorithm::EdDSA) {
+			file += "tls-version-min 1.3\n";
+			file += "dh none\n";
+			file += "# Note this curve probably isn't supported (yet), however OpenVPN will fall back to another (secp384r1)\n";
+			file += "ecdh-curve " + this->curveName + "\n";
+			file += "tls-cipher TLS_AES_256_GCM_SHA384\n";
+		}
+		else { // ecdsa
+			file += "tls-version-min 1.2\n";
+			file += "dh none\n";
+			file += "ecdh-curve " + this->curveName + "\n";
+			file += "tls-cipher TLS-ECDHE-ECDSA-WITH-AES-256-GCM-SHA384\n";
+		}
+		file += Tuning::ServerDirectives(this->TuningProfile, this->aesni, this->DCO, proto);
+		file += String::Format("port {0}\n", Int32::Parse(port) + worker);
+		file += String::Format("dev tun{0}\n", worker);
+		file += "topology subnet\n";
+		// Every client has a static address in ccd, so there is no dynamic pool for them to collide with
+		UInt32 network;
+		AddressPool::TryParse(this->addressPool->Network, network);
+		file += "server " + AddressPool::ToString(workerAddress(network, worker)) + " " + this->addressPool->Netmask + " nopool\n";
+		if (this->addressPool->Capacity > defaultMaxClients) {
+			// OpenVPN turns clients away past 1024 unless told otherwise
+			file += String::Format("max-clients {0}\n", this->addressPool->Capacity);
+		}
+		file += "client-config-dir " + ccdDirName + workerName + "\n";
 
-	try {
-		List<String^>^ dns = (List<String^>^)config["dns"];
-		if (dns != nullptr && dns->Count > 0) {
-			for each (String^ var in dns)
+		try {
+			for each (Object^ var in (System::Collections::IEnumerable^)config["dns"])
 			{
-				file += String::Format("push \"dhcp-option DNS {0}\"\n", var);
+				// A local DNS server is reached on this worker's own tunnel address
+				String^ dns = var->ToString();
+				UInt32 dnsAddress;
+				if (AddressPool::TryParse(dns, dnsAddress) && this->addressPool->Contains(dnsAddress))
+					dns = AddressPool::ToString(workerAddress(dnsAddress, worker));
+				file += String::Format("push \"dhcp-option DNS {0}\"\n", dns);
 			}
-		}
-	} catch (Exception^) {}
+		} catch (Exception^) {}
 
-	try {
-		if ((bool)this->config["redirect"]) {
-			file += "push \"redirect-gateway def1\"\n";
-		}
-	} catch (Exception^){}
+		try {
+			if ((bool)this->config["redirect"]) {
+				file += "push \"redirect-gateway def1\"\n";
+			}
+		} catch (Exception^){}
 
-	file += "#Uncomment the below to allow client to client communication\n#client-to-client\n";
-	file += "#Uncomment the below and modify the command to allow access to your internal network\n#push \"route 192.168.0.0 255.255.255.0\"\n";
+		file += "#Uncomment the below to allow client to client communication\n#client-to-client\n";
+		if (this->Routes != nullptr && this->Routes->Count > 0) {
+			try {
+				for each (String^ route in this->Routes) {
+					file += RouteAggregator::PushLine(route) + "\n";
+				}
+			}
+			catch (Exception^ e) {
+				Console::WriteLine("ERROR: Invalid route in config. Please regenerate config. " + e->Message);
+				return false;
+			}
+		}
+		else {
+			file += "#Uncomment the below and modify the command to allow access to your internal network\n#push \"route 192.168.0.0 255.255.255.0\"\n";
+		}
 
-	file = String::Format(file, proto, port);
+		files[worker] = String::Format(file, proto, port);
+	}
 
 	//Make a new directory for the server
 	String^ serverPath = Path::Combine(this->path, "server");
 	try {
-		if (Directory::Exists(serverPath)) {
-			Directory::Delete(serverPath, true);
-		}
-		Directory::CreateDirectory(serverPath);
+		if (this->Output == nullptr)
+			Directory::CreateDirectory(serverPath);
 	}
 	catch (Exception^ e) {
 		Console::WriteLine("ERROR: Failed to make directory for server configuration. {0}", e->Message);
 		return false;
 	}
 
-	//Write config
-	try {
-		StreamWriter^ sw = gcnew StreamWriter(Path::Combine(serverPath, "server" + this->suffix + ".conf"));
-		sw->Write(file);
-		sw->Flush();
-		sw->Close();
-	}
-	catch (Exception^ e) {
-		Console::WriteLine("ERROR: Failed to write server config. {0}", e->Message);
+	// Everything the server directory should hold, relative to it. Files with a source are copied
+	// from pki so they keep its permissions.
+	Dictionary<String^, array<Byte>^>^ outputs = gcnew Dictionary<String^, array<Byte>^>();
+	Dictionary<String^, String^>^ sources = gcnew Dictionary<String^, String^>();
+	HashSet<String^>^ outputDirs = gcnew HashSet<String^>();
+	// Held to the end so the inputs read, the files written and the stale files removed all agree,
+	// a client issued meanwhile by another process would otherwise lose its ccd entry
+	msclr::auto_handle<DirectoryLock> lock(lockDirectory());
+	if (lock.get() == nullptr)
 		return false;
-	}
+	for (int worker = 0; worker < this->Workers; worker++)
+		outputs["server" + this->suffix + workerSuffix(worker) + ".conf"] = Text::Encoding::UTF8->GetBytes(files[worker]);
+
 	//Copy Files
 	try {
-		File::Copy(this->caPath, Path::Combine(serverPath, caName), true);
+		outputs[caName] = File::ReadAllBytes(this->caPath);
+		sources[caName] = this->caPath;
 	}
 	catch (Exception^ e) {
 		Console::WriteLine("ERROR: Failed to copy CA. {0}", e->Message);
 		return false;
 	}
 	try {
-		File::Copy(certpath, Path::Combine(serverPath, certName), true);
+		outputs[certName] = File::ReadAllBytes(certpath);
+		sources[certName] = certpath;
 	}
 	catch (Exception^ e) {
 		Console::WriteLine("ERROR: Failed to copy Cert. {0}", e->Message);
 		return false;
 	}
 	try {
-		if (this->keyAlg == OpenSSLHelper::Algorithm::RSA)
-			File::Copy(dhPath, Path::Combine(serverPath, dhName), true);
+		if (this->keyAlg == OpenSSLHelper::Algorithm::RSA) {
+			outputs[dhName] = File::ReadAllBytes(dhPath);
+			sources[dhName] = dhPath;
+		}
 	}
 	catch (Exception^ e) {
 		Console::WriteLine("ERROR: Failed to copy DH. {0}", e->Message);
 		return false;
 	}
 	try {
-		File::Copy(keypath, Path::Combine(serverPath, keyName), true);
+		outputs[keyName] = File::ReadAllBytes(keypath);
+		sources[keyName] = keypath;
 	}
 	catch (Exception^ e) {
 		Console::WriteLine("ERROR: Failed to copy Key. {0}", e->Message);
 		return false;
 	}
 	try {
-		if (File::Exists(this->crlPath)) {
-			File::Copy(this->crlPath, Path::Combine(serverPath, crlName), true);
+		if (tlsCryptKeyPath != nullptr) {
+			outputs[tlsCryptName] = File::ReadAllBytes(tlsCryptKeyPath);
+			sources[tlsCryptName] = tlsCryptKeyPath;
+		}
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to copy tls-crypt key. {0}", e->Message);
+		return false;
+	}
+	try {
+		if (this->UseCRLDir) {
+			// OpenVPN requires the directory to exist even if nothing has been revoked yet
+			outputDirs->Add(crlDirName);
+			if (Directory::Exists(this->crlDirPath)) {
+				for each (String^ entry in Directory::GetFiles(this->crlDirPath)) {
+					String^ name = crlDirName + "/" + Path::GetFileName(entry);
+					outputs[name] = File::ReadAllBytes(entry);
+					sources[name] = entry;
+				}
+			}
+		}
+		else if (File::Exists(this->crlPath)) {
+			// Written from the concatenation, not copied
+			if (this->config->ContainsKey("issuers")) {
+				outputs[crlName] = serverCRL();
+			}
+			else {
+				outputs[crlName] = File::ReadAllBytes(this->crlPath);
+				sources[crlName] = this->crlPath;
+			}
 		}
 	}
 	catch (Exception^ e) {
 		Console::WriteLine("ERROR: Failed to copy CRL. {0}", e->Message);
 		return false;
 	}
+	try {
+		for (int worker = 0; worker < this->Workers; worker++) {
+			String^ serverCcdDir = ccdDirName + workerSuffix(worker);
+			outputDirs->Add(serverCcdDir);
+			if (!Directory::Exists(this->ccdPath))
+				continue;
+			for each (String^ entry in Directory::GetFiles(this->ccdPath)) {
+				UInt32 address;
+				if (readAssignment(entry, address))
+					outputs[serverCcdDir + "/" + Path::GetFileName(entry)] = Text::Encoding::UTF8->GetBytes(ccdEntry(address, worker));
+			}
+		}
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to copy client config dir. {0}", e->Message);
+		return false;
+	}
+
+	if (this->Output != nullptr) {
+		// Everything is handed on each time, there's no directory to compare against or clean up
+		try {
+			for each (KeyValuePair<String^, array<Byte>^> output in outputs)
+				this->Output->Write("server/" + output.Key, output.Value, output.Key->EndsWith(".key") ? 0600 : 0644);
+		}
+		catch (Exception^ e) {
+			Console::WriteLine("ERROR: Failed to write server configuration. {0}", e->Message);
+			return false;
+		}
+		Console::WriteLine("Successfully sent {0} server files to {1}.", outputs->Count, this->Output->Describe());
+		return true;
+	}
+
+	// Only files whose content changed since the last run are written
+	this->cache->Load();
+	array<Byte>^ version = Text::Encoding::UTF8->GetBytes(TemplateVersion.ToString());
+	int written = 0;
+	try {
+		for each (String^ dir in outputDirs)
+			Directory::CreateDirectory(Path::Combine(serverPath, dir));
+		for each (KeyValuePair<String^, array<Byte>^> output in outputs) {
+			String^ artifact = "server/" + output.Key;
+			String^ key = RegenerationCache::Key(version, output.Value);
+			if (this->cache->Fresh(artifact, key))
+				continue;
+			String^ target = Path::Combine(serverPath, output.Key);
+			String^ source;
+			if (sources->TryGetValue(output.Key, source)) {
+				String^ temp = DirectoryLock::TempPath(target);
+				File::Copy(source, temp, true);
+				DirectoryLock::Commit(temp, target);
+			}
+			else {
+				DirectoryLock::WriteFile(target, output.Value);
+			}
+			this->cache->Record(artifact, key);
+			written++;
+		}
+
+		// Anything else is left from an earlier run, like an old worker's config or a revoked client's ccd entry
+		for each (String^ dir in Directory::GetDirectories(serverPath)) {
+			if (!outputDirs->Contains(Path::GetFileName(dir)))
+				Directory::Delete(dir, true);
+		}
+		for each (String^ file in Directory::GetFiles(serverPath, "*", SearchOption::AllDirectories)) {
+			String^ name = file->Substring(serverPath->Length + 1)->Replace(Path::DirectorySeparatorChar, '/');
+			if (!outputs->ContainsKey(name)) {
+				File::Delete(file);
+				this->cache->Forget("server/" + name);
+			}
+		}
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to write server configuration. {0}", e->Message);
+		this->cache->Save();
+		return false;
+	}
+	this->cache->Save();
 	Console::WriteLine("Successfully generated server configuration at {0}.", serverPath);
+	Console::WriteLine("{0} of {1} server files changed.", written, outputs->Count);
 	return true;
 }
 
 bool Interactive::CreateNewClientConfig(String ^ name)
 {
-	if (cSubject == nullptr) {
-		Console::WriteLine("ERROR: No subject available.");
+	if (!prepareClients() || (this->issuingCA == nullptr && !requireRootKey()) || !openJournal())
+		return false;
+
+	String^ CN;
+	if (!String::IsNullOrWhiteSpace(name)) {
+		CN = name;
+	}
+	else {
+		String^ input = askQuestion("Common Name. This should be unique, for example a username [client1]:", false);
+		if (String::IsNullOrWhiteSpace(input)) {
+			CN = "client1";
+		}
+		else {
+			CN = input;
+		}
+	}
+	if (!isValidClientName(CN)) {
+		Console::WriteLine("ERROR: \"{0}\" can't be a client.", CN);
+		delete this->journal;
+		this->journal = nullptr;
+		return false;
+	}
+
+	this->keyArena = gcnew KeyArena(1, KeySlotSize);
+	this->clientChainBytes = 0;
+	try {
+		ClientBundle^ bundle = issueClient(CN);
+		if (bundle == nullptr)
+			return false;
+		if (!encodeClient(bundle))
+			return false;
+		bool written = writeClient(bundle);
+		bool ok = flushClients() && written;
+		if (ok)
+			reportChain("Client", this->clientChainBytes);
+		return ok;
+	}
+	finally {
+		delete this->keyArena;
+		this->keyArena = nullptr;
+		delete this->journal;
+		this->journal = nullptr;
+		saveCache();
+	}
+}
+
+bool Interactive::CreateNewClientConfigs(IEnumerable<String^>^ names)
+{
+	if (!prepareClients() || (this->issuingCA == nullptr && !requireRootKey()) || !openJournal())
 		return false;
+
+	// Keygen/signing is CPU bound and gets a worker per core, encoding is cheap and writing/gzip
+	// is mostly waiting on disk. Bounded queues between stages keep a fast stage from running ahead,
+	// and names are read a window at a time, so memory use doesn't grow with the number of clients.
+	int issueWorkers = Environment::ProcessorCount;
+	int encodeWorkers = Math::Max(1, Environment::ProcessorCount / 4);
+	int writeWorkers = 2;
+	this->pendingClients = gcnew BlockingCollection<String^>(BatchWindow);
+	this->issuedClients = gcnew BlockingCollection<ClientBundle^>(issueWorkers * 4);
+	this->encodedClients = gcnew BlockingCollection<ClientBundle^>(writeWorkers * 4);
+	this->failedClients = 0;
+	this->clientChainBytes = 0;
+	this->serialBlock = BatchWindow;
+	// Private keys only exist between encoding and writing, so that is all the arena has to cover
+	this->keyArena = gcnew KeyArena(encodeWorkers + writeWorkers * 5, KeySlotSize);
+
+	Console::WriteLine("Creating clients...");
+	Stopwatch^ timer = Stopwatch::StartNew();
+	array<Task^>^ issuers = gcnew array<Task^>(issueWorkers);
+	for (int i = 0; i < issueWorkers; i++)
+		issuers[i] = Task::Factory->StartNew(gcnew Action(this, &Interactive::issueWorker), TaskCreationOptions::LongRunning);
+	array<Task^>^ encoders = gcnew array<Task^>(encodeWorkers);
+	for (int i = 0; i < encodeWorkers; i++)
+		encoders[i] = Task::Factory->StartNew(gcnew Action(this, &Interactive::encodeWorker), TaskCreationOptions::LongRunning);
+	array<Task^>^ writers = gcnew array<Task^>(writeWorkers);
+	for (int i = 0; i < writeWorkers; i++)
+		writers[i] = Task::Factory->StartNew(gcnew Action(this, &Interactive::writeWorker), TaskCreationOptions::LongRunning);
+
+	// A repeated name would be issued twice, the second key overwriting the first and leaving its
+	// certificate valid with nothing to revoke it by, so names are remembered for the whole run.
+	// They are small next to the keys and bundles the windows bound.
+	int total = 0;
+	HashSet<String^>^ seen = gcnew HashSet<String^>();
+	try {
+		for each (String^ line in names) {
+			String^ name = line->Trim();
+			if (name == String::Empty || name->StartsWith("#"))
+				continue;
+			if (!seen->Add(name))
+				continue;
+			total++;
+			if (!isValidClientName(name)) {
+				Console::WriteLine("ERROR: \"{0}\" can't be a client.", name);
+				Interlocked::Increment(this->failedClients);
+				continue;
+			}
+			this->pendingClients->Add(name);
+		}
 	}
+	finally {
+		// Drain each stage in order, closing the next stage's input once its producers are done
+		this->pendingClients->CompleteAdding();
+		Task::WaitAll(issuers);
+		this->issuedClients->CompleteAdding();
+		Task::WaitAll(encoders);
+		this->encodedClients->CompleteAdding();
+		Task::WaitAll(writers);
+		flushClients();
+		timer->Stop();
+		delete this->keyArena;
+		this->keyArena = nullptr;
+		delete this->journal;
+		this->journal = nullptr;
+		releaseSerials();
+		saveCache();
+	}
+
+	int created = total - this->failedClients;
+	Console::WriteLine("Created {0} of {1} clients in {2:F1}s.", created, total, timer->Elapsed.TotalSeconds);
+	if (created > 0)
+		reportChain(created > 1 ? "Largest client" : "Client", this->clientChainBytes);
+	return this->failedClients == 0;
+}
+
+bool Interactive::prepareClients()
+{
+	if (String::IsNullOrEmpty(this->IssuerName) ? !verifyRequirements() : !loadIssuingCA())
+		return false;
 	if (!File::Exists(this->caPath)) {
 		Console::WriteLine("ERROR: Missing CA. Please regenerate config.");
 		return false;
 	}
 
-	String^ address;
-	String^ port;
-	String^ proto;
 	try {
-		address = (String^)this->config["server"];
-		port = (String^)this->config["port"];
-		proto = (String^)this->config["proto"];
+		this->clientAddress = (String^)this->config["server"];
+		this->clientPort = (String^)this->config["port"];
+		String^ proto = (String^)this->config["proto"];
 		if (proto == "tcp") {
-			proto = "tcp-client";
+			this->clientProto = "tcp-client";
 		}
 		else {
-			proto = "udp";
+			this->clientProto = "udp";
 		}
 	}
 	catch (Exception^ e) {
@@ -401,7 +912,7 @@ bool Interactive::CreateNewClientConfig(String ^ name)
 
 	//Try and make dir for all clients if not exists
 	try {
-		if (!Directory::Exists(this->clientsPath)) {
+		if (this->Output == nullptr && !Directory::Exists(this->clientsPath)) {
 			Directory::CreateDirectory(this->clientsPath);
 		}
 	}
@@ -410,250 +921,1113 @@ bool Interactive::CreateNewClientConfig(String ^ name)
 		return false;
 	}
 
-	String^ CN;
-	if (!String::IsNullOrWhiteSpace(name)) {
-		CN = name;
+	this->cache->Load();
+	{
+		// Building a missing index writes it
+		msclr::auto_handle<DirectoryLock> lock(lockDirectory());
+		if (lock.get() == nullptr)
+			return false;
+		this->index->Load(this->pkiPath);
 	}
-	else {
-		String^ input = askQuestion("Common Name. This should be unique, for example a username [client1]:", false);
-		if (String::IsNullOrWhiteSpace(input)) {
-			CN = "client1";
+	// Everything shared by every bundle is read once up front
+	try {
+		this->caData = File::ReadAllBytes(this->caPath);
+		this->tlsCryptData = nullptr;
+		this->tlsCryptV2ServerKey = nullptr;
+		if (this->TLSCryptMode == TLSCrypt::Mode::V2) {
+			this->tlsCryptV2ServerKey = File::ReadAllText(this->tlsCryptV2Path);
+		}
+		else if (this->TLSCryptMode == TLSCrypt::Mode::V1) {
+			this->tlsCryptData = File::ReadAllBytes(this->tlsCryptPath);
+		}
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to read shared client files. {0}", e->Message);
+		return false;
+	}
+	return true;
+}
+
+Interactive::ClientBundle^ Interactive::issueClient(String^ CN)
+{
+	// A copy, so concurrent issuers don't share the CommonName
+	CertificateSubject^ subject = subjectFor(CN);
+
+	ClientBundle^ bundle = gcnew ClientBundle();
+	bundle->CN = CN;
+	try {
+		Metrics::Timer timer(this->metrics, "openvpn_generate_issue_duration_seconds");
+		Identity^ issuer = this->issuingCA != nullptr ? this->issuingCA->Issuer : this->Issuer;
+		int serial = this->issuingCA != nullptr ? this->issuingCA->Serial(this->serialBlock) : this->Serial;
+		bundle->identity = OpenSSLHelper::CreateCertKeyBundle(subject, issuer, this->keyAlg, this->keySize, this->curveName, this->validDays, serial, false);
+		if (this->CompactCerts)
+			compactCert(bundle->identity, issuer);
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to create client identity for {0}. {1}", CN, e->Message);
+		return nullptr;
+	}
+	this->metrics->Add("openvpn_generate_certificates_issued_total", "algorithm=\"" + algorithmLabel() + "\"");
+	return bundle;
+}
+
+bool Interactive::encodeClient(ClientBundle^ bundle)
+{
+	bundle->cert = OpenSSLHelper::CertAsPEM(bundle->identity->cert);
+	if (bundle->cert == nullptr) {
+		Console::WriteLine("ERROR: Failed to create certificate for {0}", bundle->CN);
+		return false;
+	}
+	int chainBytes = derSize(bundle->identity->cert);
+	// The intermediate follows the client's own certificate, so OpenVPN sends the chain and the
+	// server only has to trust the root
+	if (this->issuingCA != nullptr) {
+		bundle->cert += this->issuingCA->CertPEM;
+		chainBytes += derSize(this->issuingCA->Issuer->cert);
+	}
+	int largest = this->clientChainBytes;
+	while (chainBytes > largest) {
+		int seen = Interlocked::CompareExchange(this->clientChainBytes, chainBytes, largest);
+		if (seen == largest)
+			break;
+		largest = seen;
+	}
+	// The key goes straight from OpenSSL into locked memory, never through a managed String
+	bundle->key = this->keyArena->Acquire();
+	if (!bundle->key->LoadPEM(bundle->identity->key)) {
+		Console::WriteLine("ERROR: Failed to create key for {0}", bundle->CN);
+		this->keyArena->Release(bundle->key);
+		bundle->key = nullptr;
+		return false;
+	}
+	bundle->identity = nullptr;
+
+	try {
+		if (this->TLSCryptMode == TLSCrypt::Mode::V2) {
+			// Each client gets its own key wrapped with the server key, nothing to keep in pki
+			bundle->tlsCrypt = Text::Encoding::ASCII->GetBytes(TLSCrypt::CreateV2ClientKey(this->tlsCryptV2ServerKey));
 		}
 		else {
-			CN = input;
+			bundle->tlsCrypt = this->tlsCryptData;
 		}
 	}
-	String^ clientPath = Path::Combine(this->path, CN);
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to create tls-crypt key for {0}. {1}", bundle->CN, e->Message);
+		this->keyArena->Release(bundle->key);
+		bundle->key = nullptr;
+		return false;
+	}
+
+	bundle->config = renderClientConfig(bundle->CN);
+	return true;
+}
+
+bool Interactive::writeClient(ClientBundle^ bundle)
+{
+	// Take an address first, a client that can't get one shouldn't be issued at all
+	if (!assignAddress(bundle->CN)) {
+		this->keyArena->Release(bundle->key);
+		bundle->key = nullptr;
+		return false;
+	}
+	StagedClient^ staged = gcnew StagedClient();
+	staged->entry = gcnew IssuanceJournal::Entry();
+	staged->entry->name = bundle->CN;
+	try {
+		// Written beside their targets, nothing is in place until the client's group is committed
+		Directory::CreateDirectory(this->pkiPath);
+		DirectoryLock::WriteFile(IssuanceJournal::Stage(staged->entry, Path::Combine(this->pkiPath, bundle->CN + ".crt")), bundle->cert);
+		if (!bundle->key->WriteTo(IssuanceJournal::Stage(staged->entry, Path::Combine(this->pkiPath, bundle->CN + ".key"))))
+			throw gcnew IOException("Failed to write key to disk");
+		if (this->Output != nullptr) {
+			MemoryStream^ visz = gcnew MemoryStream();
+			writeVisz(visz, bundle);
+			staged->visz = visz->ToArray();
+		}
+		else {
+			writeVisz(IssuanceJournal::Stage(staged->entry, Path::Combine(this->clientsPath, String::Format("{0}.visz", bundle->CN))), bundle);
+		}
+		staged->cert = bundle->cert;
+		staged->cacheKey = clientCacheKey(bundle->config, bundle->cert);
+		this->journal->Record(staged->entry);
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to write client {0}. {1}", bundle->CN, e->Message);
+		for each (KeyValuePair<String^, String^> file in staged->entry->files)
+			File::Delete(file.Key);
+		releaseAddress(bundle->CN);
+		return false;
+	}
+	finally {
+		this->keyArena->Release(bundle->key);
+		bundle->key = nullptr;
+	}
+
+	List<StagedClient^>^ group = nullptr;
+	{
+		msclr::lock l(this->stagedLock);
+		this->stagedClients->Add(staged);
+		if (this->stagedClients->Count >= CommitGroup) {
+			group = this->stagedClients;
+			this->stagedClients = gcnew List<StagedClient^>();
+		}
+	}
+	// A group that fails is counted in failedClients, this client was written
+	if (group != nullptr)
+		commitClients(group);
+	return true;
+}
+
+bool Interactive::commitClients(List<StagedClient^>^ group)
+{
+	if (group->Count == 0)
+		return true;
+	List<IssuanceJournal::Entry^>^ entries = gcnew List<IssuanceJournal::Entry^>();
+	for each (StagedClient^ staged in group)
+		entries->Add(staged->entry);
+	try {
+		this->journal->Commit(entries);
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to commit {0} clients. {1}", group->Count, e->Message);
+		for each (StagedClient^ staged in group)
+			releaseAddress(staged->entry->name);
+		Interlocked::Add(this->failedClients, group->Count);
+		return false;
+	}
+	// Issued now whatever happens to the bundle, a bundle the sink refuses can be sent again by
+	// regenerate
+	bool ok = true;
+	for each (StagedClient^ staged in group) {
+		if (this->Output == nullptr) {
+			this->cache->Record("clients/" + staged->entry->name + ".visz", staged->cacheKey);
+			continue;
+		}
+		try {
+			this->Output->Write("clients/" + staged->entry->name + ".visz", staged->visz, 0600);
+		}
+		catch (Exception^ e) {
+			Console::WriteLine("ERROR: Failed to write client {0}. {1}", staged->entry->name, e->Message);
+			Interlocked::Increment(this->failedClients);
+			ok = false;
+		}
+	}
+	msclr::auto_handle<DirectoryLock> lock(lockDirectory());
+	if (lock.get() == nullptr)
+		return false;
+	for each (StagedClient^ staged in group)
+		this->index->Add(staged->cert);
+	return ok;
+}
+
+bool Interactive::flushClients()
+{
+	List<StagedClient^>^ group;
+	{
+		msclr::lock l(this->stagedLock);
+		group = this->stagedClients;
+		this->stagedClients = gcnew List<StagedClient^>();
+	}
+	return commitClients(group);
+}
+
+bool Interactive::openJournal()
+{
+	if (this->journal != nullptr)
+		return true;
+	// Recovered and opened under the lock, so no other process takes this journal for a crashed one
+	// before it is open
+	List<String^>^ undone;
+	{
+		msclr::auto_handle<DirectoryLock> lock(lockDirectory());
+		if (lock.get() == nullptr)
+			return false;
+		try {
+			String^ directory = Path::Combine(this->pkiPath, "journal");
+			undone = IssuanceJournal::Recover(directory, gcnew array<String^>{ this->pkiPath, this->clientsPath });
+			this->journal = gcnew IssuanceJournal(directory);
+		}
+		catch (Exception^ e) {
+			Console::WriteLine("ERROR: Failed to open the issuance journal. {0}", e->Message);
+			return false;
+		}
+	}
+	// Clients a crashed process never committed give their addresses back
+	for each (String^ CN in undone) {
+		if (!File::Exists(Path::Combine(this->pkiPath, CN + ".crt")) && this->addressPool != nullptr)
+			releaseAddress(CN);
+	}
+	return true;
+}
+
+String^ Interactive::renderClientConfig(String^ CN)
+{
+	String^ file = "#-- Config Auto Generated By SparkLabs OpenVPN Certificate Generator--#\n\n";
+	file += "#viscosity name {0}@{1}\n";
+	if (this->Workers > 1) {
+		// One remote per worker process, picked at random so clients spread across them
+		for (int worker = 0; worker < this->Workers; worker++) {
+			file += String::Format("remote {{1}} {0} {{3}}\n", Int32::Parse(this->clientPort) + worker);
+		}
+		file += "remote-random\n";
+	}
+	else {
+		file += "remote {1} {2} {3}\n";
+	}
+	file += "dev tun\ntls-client\n";
+	//Certs
+	file += "ca ca.crt\n";
+	file += "cert {0}.crt\n";
+	file += "key {0}.key\n";
+	file += "persist-tun\npersist-key\nnobind\npull\n";
+	if (this->TLSCryptMode == TLSCrypt::Mode::V2) {
+		file += "tls-crypt-v2 tls-crypt-v2.key\n";
+	}
+	else if (this->TLSCryptMode == TLSCrypt::Mode::V1) {
+		file += "tls-crypt ta.key\n";
+	}
+	if (this->keyAlg == OpenSSLHelper::Algorithm::EdDSA) {
+		file += "tls-version-min 1.3\n";
+	}
+	else if (this->keyAlg == OpenSSLHelper::Algorithm::ECDSA) {		
+		file += "tls-version-min 1.2\n";
+		file += "tls-cipher TLS-ECDHE-ECDSA-WITH-AES-256-GCM-SHA384\n";
+	}
+	file += Tuning::ClientDirectives(this->TuningProfile, this->aesni, this->DCO);
+
+	return String::Format(file, CN, this->clientAddress, this->clientPort, this->clientProto);
+}
+
+void Interactive::issueWorker()
+{
+	for each (String^ CN in this->pendingClients->GetConsumingEnumerable()) {
+		ClientBundle^ bundle = issueClient(CN);
+		if (bundle == nullptr) {
+			Interlocked::Increment(this->failedClients);
+			continue;
+		}
+		this->issuedClients->Add(bundle);
+	}
+}
+
+void Interactive::encodeWorker()
+{
+	for each (ClientBundle^ bundle in this->issuedClients->GetConsumingEnumerable()) {
+		if (!encodeClient(bundle)) {
+			Interlocked::Increment(this->failedClients);
+			continue;
+		}
+		this->encodedClients->Add(bundle);
+	}
+}
+
+void Interactive::writeWorker()
+{
+	for each (ClientBundle^ bundle in this->encodedClients->GetConsumingEnumerable()) {
+		if (!writeClient(bundle)) {
+			Interlocked::Increment(this->failedClients);
+		}
+	}
+}
+
+String ^ Interactive::askQuestion(String ^ question, bool allowedBlank, bool hasDefault)
+{
+	while (true) {
+		Console::Write(question + " ");
+		String^ input = Console::ReadLine();
+		if (String::IsNullOrWhiteSpace(input) && !hasDefault) {
+			Console::WriteLine("This field cannot be left blank.");
+			continue;
+		}
+		if (input == "." && !allowedBlank) {
+			Console::WriteLine("This field cannot be left blank.");
+			continue;
+		}
+		return input;
+	}
+}
+String ^ Interactive::askQuestion(String ^ question, bool allowedBlank) {
+	return askQuestion(question, allowedBlank, true);
+}
+
+bool Interactive::saveIdentity(Identity^ identity, String^ name)
+{
+	String^ cert = OpenSSLHelper::CertAsPEM(identity->cert);
+	if (cert == nullptr) {
+		Console::WriteLine("ERROR: Failed to create certificate");
+		return false;
+	}
+	String^ key = OpenSSLHelper::KeyAsPEM(identity->key);
+	if (key == nullptr) {
+		Console::WriteLine("ERROR: Failed to create key");
+		return false;
+	}
+	return writeIdentity(name, cert, key);
+}
+
+bool Interactive::writeIdentity(String^ name, String^ cert, String^ key)
+{
+	//Create PKI dir
+	try {
+		if (!Directory::Exists(this->pkiPath))
+			Directory::CreateDirectory(this->pkiPath);
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to create PKI dir. {0}", e->Message);
+	}
+
+	String^ certpath = Path::Combine(this->pkiPath, name + ".crt");
+	String^ keypath = Path::Combine(this->pkiPath, name + ".key");
+
+	// Committed through the journal like clients, so the certificate and key land together
+	bool opened = this->journal == nullptr;
+	if (!openJournal())
+		return false;
+	IssuanceJournal::Entry^ entry = gcnew IssuanceJournal::Entry();
+	entry->name = name;
+	bool ok = true;
+	try {
+		DirectoryLock::WriteFile(IssuanceJournal::Stage(entry, certpath), cert);
+		DirectoryLock::WriteFile(IssuanceJournal::Stage(entry, keypath), key);
+		this->journal->Record(entry);
+		List<IssuanceJournal::Entry^>^ group = gcnew List<IssuanceJournal::Entry^>();
+		group->Add(entry);
+		this->journal->Commit(group);
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to write {0} certificate and key to disk. {1}", name, e->Message);
+		for each (KeyValuePair<String^, String^> file in entry->files)
+			File::Delete(file.Key);
+		ok = false;
+	}
+	if (opened) {
+		delete this->journal;
+		this->journal = nullptr;
+	}
+	return ok;
+}
+
+bool Interactive::createNewServerIdentity()
+{
+	if (!verifyRequirements() || !requireRootKey())
+		return false;
+	CertificateSubject^ subject = subjectFor("server");
+	Identity^ identity;
+	try {
+		Metrics::Timer timer(this->metrics, "openvpn_generate_issue_duration_seconds");
+		identity = OpenSSLHelper::CreateCertKeyBundle(subject, this->Issuer, this->keyAlg, this->keySize, this->curveName, this->validDays, this->Serial, true);
+		if (this->CompactCerts)
+			compactCert(identity, this->Issuer);
+		if (this->keyAlg == OpenSSLHelper::Algorithm::RSA && this->ServerRSAPrimes > 2)
+			useMultiPrimeKey(identity);
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("Failed to create server identity. {0}", e->Message);
+		return false;
+	}
+	this->metrics->Add("openvpn_generate_certificates_issued_total", "algorithm=\"" + algorithmLabel() + "\"");
+	// Opening the journal takes the lock, so it's opened first
+	if (!openJournal())
+		return false;
+	msclr::auto_handle<DirectoryLock> lock(lockDirectory());
+	if (lock.get() == nullptr)
+		return false;
+	// Load before saving, a missing index is built from the certificates already in pki
+	this->index->Load(this->pkiPath);
+	bool saved = saveIdentity(identity, "server");
+	delete this->journal;
+	this->journal = nullptr;
+	if (!saved)
+		return false;
+	this->index->Add(OpenSSLHelper::CertAsPEM(identity->cert));
+	reportChain("Server", derSize(identity->cert));
+	return true;
+}
+
+void Interactive::useMultiPrimeKey(Identity^ identity)
+{
+	// OpenSSLHelper only generates two prime keys, so the bundle is given a new key of the same
+	// size and its certificate is signed again for it
+	EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+	EVP_PKEY* key = NULL;
+	bool ok = pctx != NULL && EVP_PKEY_keygen_init(pctx) > 0
+		&& EVP_PKEY_CTX_set_rsa_keygen_bits(pctx, this->keySize) > 0
+		&& EVP_PKEY_CTX_set_rsa_keygen_primes(pctx, this->ServerRSAPrimes) > 0
+		&& EVP_PKEY_keygen(pctx, &key) > 0;
+	EVP_PKEY_CTX_free(pctx);
+	if (ok) {
+		ok = RekeyCertificate(identity->cert, key) && X509_sign(identity->cert, this->Issuer->key, SigningDigest(this->Issuer->key)) > 0;
+	}
+	if (!ok) {
+		EVP_PKEY_free(key);
+		throw gcnew Exception(String::Format("Failed to generate a {0} prime RSA key.", this->ServerRSAPrimes));
+	}
+	EVP_PKEY_free(identity->key);
+	identity->key = key;
+}
+
+void Interactive::compactCert(Identity^ identity, Identity^ issuer)
+{
+	// OpenSSLHelper always adds these, so they are taken out and the certificate is signed again.
+	// Not being a CA is the default, and the key identifiers and Netscape type are for older or
+	// stricter clients than OpenVPN, which only checks the key usages.
+	const int removed[] = { NID_basic_constraints, NID_subject_key_identifier, NID_authority_key_identifier, NID_netscape_cert_type };
+	for (int nid : removed) {
+		int index;
+		while ((index = X509_get_ext_by_NID(identity->cert, nid, -1)) >= 0)
+			X509_EXTENSION_free(X509_delete_ext(identity->cert, index));
+	}
+	if (!X509_sign(identity->cert, issuer->key, SigningDigest(issuer->key)))
+		throw gcnew Exception("Failed to sign compact certificate.");
+}
+
+CertificateSubject^ Interactive::subjectFor(String^ CN)
+{
+	if (this->CompactCerts)
+		return gcnew CertificateSubject(CN);
+	CertificateSubject^ subject = CertificateSubject::fromDict(this->cSubject->toDict());
+	subject->CommonName = CN;
+	return subject;
+}
+
+void Interactive::reportChain(String^ who, int bytes)
+{
+	// The chain shares its flight with the rest of the handshake, past a packet it is fragmented
+	// and a lost fragment holds up the whole flight
+	int packets = (bytes + ControlPacketSize - 1) / ControlPacketSize;
+	if (packets <= 1)
+		Console::WriteLine("{0} certificate chain: {1} bytes, fits in one {2} byte control packet.", who, bytes, ControlPacketSize);
+	else
+		Console::WriteLine("{0} certificate chain: {1} bytes, spans {2} control packets of {3} bytes.", who, bytes, packets, ControlPacketSize);
+}
+
+int Interactive::derSize(X509* cert)
+{
+	return Math::Max(0, i2d_X509(cert, NULL));
+}
+
+String^ Interactive::clientCacheKey(String^ config, String^ cert)
+{
+	// The key isn't part of it, a new key always comes with a new cert. A v2 client's tls-crypt
+	// key is random, so the server key it's wrapped with stands in for it.
+	array<Byte>^ tlsCrypt = gcnew array<Byte>(0);
+	if (this->TLSCryptMode == TLSCrypt::Mode::V2)
+		tlsCrypt = Text::Encoding::ASCII->GetBytes(this->tlsCryptV2ServerKey);
+	else if (this->tlsCryptData != nullptr)
+		tlsCrypt = this->tlsCryptData;
+	return RegenerationCache::Key(Text::Encoding::UTF8->GetBytes(TemplateVersion.ToString()), Text::Encoding::UTF8->GetBytes(config),
+		this->caData, Text::Encoding::ASCII->GetBytes(cert), tlsCrypt);
+}
+
+bool Interactive::Regenerate()
+{
+	if (!CreateServerConfig())
+		return false;
+	if (!prepareClients())
+		return false;
+
+	// Every client with a cert and key still in pki, revoking removes them
+	List<String^>^ names = gcnew List<String^>();
+	try {
+		for each (String^ cert in Directory::GetFiles(this->pkiPath, "*.crt")) {
+			String^ CN = Path::GetFileNameWithoutExtension(cert);
+			if (Array::IndexOf(protectedCNs, CN) >= 0)
+				continue;
+			if (File::Exists(Path::Combine(this->pkiPath, CN + ".key")))
+				names->Add(CN);
+		}
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to list clients. {0}", e->Message);
+		return false;
+	}
+	names->Sort(StringComparer::Ordinal);
+
+	this->keyArena = gcnew KeyArena(1, KeySlotSize);
+	int rebuilt = 0;
+	int failed = 0;
+	try {
+		for each (String^ CN in names) {
+			ClientBundle^ bundle = gcnew ClientBundle();
+			bundle->CN = CN;
+			String^ visz = Path::Combine(this->clientsPath, String::Format("{0}.visz", CN));
+			try {
+				// A client revoked by another process since the listing is skipped, not brought back
+				msclr::auto_handle<DirectoryLock> lock(lockDirectory());
+				if (lock.get() == nullptr)
+					throw gcnew IOException("Failed to lock the config directory");
+				if (!File::Exists(Path::Combine(this->pkiPath, CN + ".crt")))
+					continue;
+				bundle->cert = File::ReadAllText(Path::Combine(this->pkiPath, CN + ".crt"));
+				bundle->config = renderClientConfig(CN);
+				String^ key = clientCacheKey(bundle->config, bundle->cert);
+				if (this->Output == nullptr && this->cache->Fresh("clients/" + CN + ".visz", key))
+					continue;
+
+				bundle->key = this->keyArena->Acquire();
+				if (!bundle->key->ReadFrom(Path::Combine(this->pkiPath, CN + ".key")))
+					throw gcnew IOException("Failed to read key");
+				if (this->TLSCryptMode == TLSCrypt::Mode::V2)
+					bundle->tlsCrypt = Text::Encoding::ASCII->GetBytes(TLSCrypt::CreateV2ClientKey(this->tlsCryptV2ServerKey));
+				else
+					bundle->tlsCrypt = this->tlsCryptData;
+				if (this->Output != nullptr) {
+					MemoryStream^ bundleData = gcnew MemoryStream();
+					writeVisz(bundleData, bundle);
+					this->Output->Write("clients/" + CN + ".visz", bundleData->ToArray(), 0600);
+				}
+				else {
+					writeVisz(visz, bundle);
+					this->cache->Record("clients/" + CN + ".visz", key);
+				}
+				rebuilt++;
+			}
+			catch (Exception^ e) {
+				Console::WriteLine("ERROR: Failed to regenerate client {0}. {1}", CN, e->Message);
+				failed++;
+			}
+			finally {
+				if (bundle->key != nullptr)
+					this->keyArena->Release(bundle->key);
+			}
+		}
+	}
+	finally {
+		delete this->keyArena;
+		this->keyArena = nullptr;
+		saveCache();
+	}
+
+	Console::WriteLine("{0} of {1} client bundles changed.", rebuilt, names->Count);
+	return failed == 0;
+}
+
+bool Interactive::Reconcile(IEnumerable<String^>^ roster)
+{
+	// Read the way client --batch reads names, duplicates don't matter here
+	SortedSet<String^>^ wanted = gcnew SortedSet<String^>(StringComparer::Ordinal);
+	for each (String^ line in roster) {
+		String^ name = line->Trim();
+		if (name == String::Empty || name->StartsWith("#"))
+			continue;
+		if (!isValidClientName(name)) {
+			Console::WriteLine("ERROR: \"{0}\" can't be a client.", name);
+			return false;
+		}
+		wanted->Add(name);
+	}
+	// Most likely an export or upload that failed, not a decision to revoke everyone
+	if (wanted->Count == 0) {
+		Console::WriteLine("ERROR: The roster has no clients in it.");
+		return false;
+	}
+
+	// Issued clients are the certificates still in pki, revoking removes them
+	SortedSet<String^>^ issued = gcnew SortedSet<String^>(StringComparer::Ordinal);
+	try {
+		if (Directory::Exists(this->pkiPath)) {
+			for each (String^ cert in Directory::GetFiles(this->pkiPath, "*.crt")) {
+				String^ CN = Path::GetFileNameWithoutExtension(cert);
+				if (Array::IndexOf(protectedCNs, CN) < 0)
+					issued->Add(CN);
+			}
+		}
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to list clients. {0}", e->Message);
+		return false;
+	}
+
+	List<String^>^ missing = gcnew List<String^>();
+	List<String^>^ removed = gcnew List<String^>();
+	for each (String^ CN in wanted) {
+		if (!issued->Contains(CN))
+			missing->Add(CN);
+	}
+	for each (String^ CN in issued) {
+		if (!wanted->Contains(CN))
+			removed->Add(CN);
+	}
+	Console::WriteLine("{0} to issue, {1} to revoke, {2} unchanged.", missing->Count, removed->Count, wanted->Count - missing->Count);
+	if (missing->Count == 0 && removed->Count == 0)
+		return true;
+	// A roster missing most of its names looks the same as one revoking them on purpose
+	if (!this->ForceRevoke && removed->Count > 0 && (removed->Count == issued->Count || removed->Count * 100 > issued->Count * RevokeConfirmPercent)) {
+		String^ input = askQuestion(String::Format("Revoke {0} of {1} clients? [y/N]:", removed->Count, issued->Count), false, true);
+		if (!String::Equals(input, "y", StringComparison::OrdinalIgnoreCase)) {
+			Console::WriteLine("Nothing changed. Use --force to revoke them without asking.");
+			return false;
+		}
+	}
+
+	// Revoked first so the addresses they free can go to the new clients
+	if (removed->Count > 0) {
+		if (!revokeClients(removed, gcnew HashSet<String^>()))
+			return false;
+		Console::WriteLine("Revoked {0} clients.", removed->Count);
+	}
+	bool ok = true;
+	if (missing->Count > 0)
+		ok = CreateNewClientConfigs(missing);
+	// Once, after both, so the new CRL and every address change land in one rebuild
+	return CreateServerConfig() && ok;
+}
+
+void Interactive::writeVisz(String^ visz, ClientBundle^ bundle)
+{
+	// Written beside the bundle and renamed over it once complete, the old bundle stays if this fails
+	String^ temp = DirectoryLock::TempPath(visz);
+	bool complete = false;
+	try {
+		writeVisz(File::Create(temp), bundle);
+		complete = true;
+	}
+	finally {
+		if (!complete)
+			File::Delete(temp);
+	}
+	DirectoryLock::Commit(temp, visz);
+}
+
+void Interactive::writeVisz(Stream^ outStream, ClientBundle^ bundle)
+{
+	Metrics::Timer timer(this->metrics, "openvpn_generate_bundle_duration_seconds");
+	// Built straight from memory, one directory deep as Viscosity expects. Closes outStream.
+	TarOutputStream^ tar = gcnew TarOutputStream(gcnew GZipOutputStream(outStream));
+	try {
+		TarEntry^ dir = TarEntry::CreateTarEntry(bundle->CN + "/");
+		dir->TarHeader->TypeFlag = TarHeader::LF_DIR;
+		tar->PutNextEntry(dir);
+		tar->CloseEntry();
+
+		addTarEntry(tar, bundle->CN + "/ca.crt", this->caData);
+		addTarEntry(tar, String::Format("{0}/{0}.crt", bundle->CN), Text::Encoding::ASCII->GetBytes(bundle->cert));
+		// SharpZipLib only takes managed arrays, so the key is copied into a pinned array that is
+		// cleared as soon as it has been written
+		array<Byte>^ key = gcnew array<Byte>(bundle->key->Length);
+		pin_ptr<Byte> pinnedKey = &key[0];
+		bundle->key->CopyTo(pinnedKey);
+		try {
+			addTarEntry(tar, String::Format("{0}/{0}.key", bundle->CN), key);
+		}
+		finally {
+			Array::Clear(key, 0, key->Length);
+		}
+		if (bundle->tlsCrypt != nullptr) {
+			String^ name = this->TLSCryptMode == TLSCrypt::Mode::V2 ? "tls-crypt-v2.key" : "ta.key";
+			addTarEntry(tar, bundle->CN + "/" + name, bundle->tlsCrypt);
+		}
+		addTarEntry(tar, bundle->CN + "/config.conf", Text::Encoding::UTF8->GetBytes(bundle->config));
+	}
+	finally {
+		tar->Close();
+	}
+}
+
+void Interactive::addTarEntry(TarOutputStream^ tar, String^ name, array<Byte>^ data)
+{
+	TarEntry^ entry = TarEntry::CreateTarEntry(name);
+	entry->Size = data->Length;
+	tar->PutNextEntry(entry);
+	tar->Write(data, 0, data->Length);
+	tar->CloseEntry();
+}
+
+bool Interactive::isValidClientName(String^ CN)
+{
+	if (String::IsNullOrEmpty(CN) || CN->StartsWith(".") || Array::IndexOf(protectedCNs, CN) >= 0 || CN->Contains(".."))
+		return false;
+	for each (Char c in CN) {
+		if (c == '/' || c == '\\' || Char::IsControl(c))
+			return false;
+	}
+	return true;
+}
+
+DirectoryLock^ Interactive::lockDirectory()
+{
 	try {
-		if (Directory::Exists(clientPath)) {
-			Directory::Delete(clientPath, true);
-		}
-		Directory::CreateDirectory(clientPath);
+		return gcnew DirectoryLock(this->lockPath, this->metrics);
 	}
 	catch (Exception^ e) {
-		Console::WriteLine("ERROR: Failed to make directory for server configuration. {0}", e->Message);
-		return false;
+		Console::WriteLine("ERROR: {0}", e->Message);
+		return nullptr;
 	}
+}
 
-	if (!createNewClientIdentity(CN))
+bool Interactive::saveCache()
+{
+	msclr::auto_handle<DirectoryLock> lock(lockDirectory());
+	return lock.get() != nullptr && this->cache->Save();
+}
+
+int Interactive::Serial::get()
+{
+	msclr::lock l(this->serialLock);
+	if (this->_serial >= this->serialLimit && !reserveSerials(this->serialBlock))
+		throw gcnew Exception("Failed to reserve a serial");
+	return ++this->_serial;
+}
+
+bool Interactive::reserveSerials(int count)
+{
+	// Moves the serial in config.conf past a block of serials this process can then issue
+	// without going back to the file
+	msclr::auto_handle<DirectoryLock> lock(lockDirectory());
+	if (lock.get() == nullptr)
 		return false;
-	
-	//Copy files
-	String^ cert = String::Format("{0}.crt", CN);
-	String^ key = String::Format("{0}.key", CN);
 	try {
-		File::Copy(this->caPath, Path::Combine(clientPath, "ca.crt"));
+		Dictionary<String^, Object^>^ disk = JsonConvert::DeserializeObject<Dictionary<String^, Object^>^>(File::ReadAllText(this->configPath));
+		Object^ val;
+		int start = this->_serial;
+		if (disk->TryGetValue("serial", val))
+			start = Math::Max(start, Convert::ToInt32(val));
+		// The serials past the root's block belong to intermediates
+		if (disk->ContainsKey("issuers") && start + count >= (1 << IssuingCA::SerialBits))
+			count = (1 << IssuingCA::SerialBits) - 1 - start;
+		if (count <= 0)
+			throw gcnew Exception("the root CA has used every serial below its intermediates");
+		disk["serial"] = start + count;
+		DirectoryLock::WriteFile(this->configPath, JsonConvert::SerializeObject(disk));
+		this->_serial = start;
+		this->serialLimit = start + count;
 	}
 	catch (Exception^ e) {
-		Console::WriteLine("ERROR: Failed to copy CA. {0}", e->Message);
+		Console::WriteLine("ERROR: Failed to reserve serials in {0}. {1}", this->configPath, e->Message);
 		return false;
 	}
+	return true;
+}
+
+void Interactive::releaseSerials()
+{
+	// A batch reserves a window of serials at a time, give back what it didn't get to. Only if no
+	// other process has reserved since, or the serial would go back over theirs.
 	try {
-		File::Copy(Path::Combine(pkiPath, cert), Path::Combine(clientPath, cert));
+		if (this->issuingCA != nullptr) {
+			this->issuingCA->ReleaseSerials();
+			return;
+		}
+		msclr::lock l(this->serialLock);
+		if (this->_serial >= this->serialLimit)
+			return;
+		msclr::auto_handle<DirectoryLock> lock(lockDirectory());
+		if (lock.get() == nullptr)
+			return;
+		Dictionary<String^, Object^>^ disk = JsonConvert::DeserializeObject<Dictionary<String^, Object^>^>(File::ReadAllText(this->configPath));
+		Object^ val;
+		if (!disk->TryGetValue("serial", val) || Convert::ToInt32(val) != this->serialLimit)
+			return;
+		disk["serial"] = this->_serial;
+		DirectoryLock::WriteFile(this->configPath, JsonConvert::SerializeObject(disk));
+		this->serialLimit = this->_serial;
 	}
 	catch (Exception^ e) {
-		Console::WriteLine("ERROR: Failed to copy Cert. {0}", e->Message);
-		return false;
+		Console::WriteLine("WARNING: Failed to release unused serials. " + e->Message);
 	}
-	try {
-		File::Copy(Path::Combine(pkiPath, key), Path::Combine(clientPath, key));
-	}
-	catch (Exception^ e) {
-		Console::WriteLine("ERROR: Failed to copy Key. {0}", e->Message);
-		return false;
+}
+
+String^ Interactive::certSerial(String^ certData)
+{
+	// crl-verify dir mode expects the serial as a decimal file name
+	X509Certificate2^ cert = gcnew X509Certificate2(Text::Encoding::ASCII->GetBytes(certData));
+	BigInteger serial = BigInteger::Parse("0" + cert->SerialNumber, Globalization::NumberStyles::HexNumber);
+	return serial.ToString();
+}
+
+String^ Interactive::algorithmLabel()
+{
+	switch (this->keyAlg) {
+	case OpenSSLHelper::Algorithm::ECDSA:
+		return "ecdsa";
+	case OpenSSLHelper::Algorithm::EdDSA:
+		return "eddsa";
+	default:
+		return "rsa";
 	}
+}
 
-	//Create config
-	String^ file = "#-- Config Auto Generated By SparkLabs OpenVPN Certificate Generator--#\n\n";
-	file += "#viscosity name {0}@{1}\n";
-	file += "remote {1} {2} {3}\n";
-	file += "dev tun\ntls-client\n";
-	//Certs
-	file += "ca ca.crt\n";
-	file += "cert {0}.crt\n";
-	file += "key {0}.key\n";
-	file += "persist-tun\npersist-key\nnobind\npull\n";
-	if (this->keyAlg == OpenSSLHelper::Algorithm::EdDSA) {
-		file += "tls-version-min 1.3\n";
+bool Interactive::WriteMetrics()
+{
+	if (String::IsNullOrEmpty(this->MetricsPath))
+		return true;
+
+	// Expiry comes from the index rather than parsing every certificate
+	DateTime now = DateTime::UtcNow;
+	{
+		msclr::auto_handle<DirectoryLock> lock(lockDirectory());
+		if (lock.get() == nullptr)
+			return false;
+		this->index->Load(this->pkiPath);
+	}
+	this->metrics->Set("openvpn_generate_certificates_valid", "", this->index->CountValid(now));
+	this->metrics->Set("openvpn_generate_certificates_expiring", String::Format("days=\"{0}\"", this->MetricsExpiryDays),
+		this->index->CountExpiring(now, this->MetricsExpiryDays));
+
+	if (this->UseCRLDir) {
+		int entries = Directory::Exists(this->crlDirPath) ? Directory::GetFiles(this->crlDirPath)->Length : 0;
+		this->metrics->Set("openvpn_generate_crl_entries", "", entries);
+	}
+	else if (File::Exists(this->crlPath)) {
+		this->metrics->Set("openvpn_generate_crl_bytes", "", (gcnew FileInfo(this->crlPath))->Length);
+		// Counted from the DER framing, a large CRL isn't decoded just to size it
+		Int64 entries = (gcnew CRLFile(this->crlPath))->Entries();
+		if (entries < 0) {
+			Console::WriteLine("WARNING: Failed to read CRL for metrics.");
+			entries = 0;
+		}
+		this->metrics->Set("openvpn_generate_crl_entries", "", entries);
 	}
-	else if (this->keyAlg == OpenSSLHelper::Algorithm::ECDSA) {		
-		file += "tls-version-min 1.2\n";
-		file += "tls-cipher TLS-ECDHE-ECDSA-WITH-AES-256-GCM-SHA384\n";
+	this->metrics->Set("openvpn_generate_last_run_timestamp_seconds", "", (double)DateTimeOffset::UtcNow.ToUnixTimeSeconds());
+	return this->metrics->Write(this->MetricsPath);
+}
+
+bool Interactive::loadAddressPool()
+{
+	UInt32 network;
+	int prefixLength;
+	if (!AddressPool::TryParseSubnet(this->Subnet, network, prefixLength)) {
+		Console::WriteLine("ERROR: Invalid subnet {0}. Please regenerate config.", this->Subnet);
+		return false;
 	}
+	this->addressPool = gcnew AddressPool(this->addressPoolPath, network, prefixLength);
+	return this->addressPool->Load();
+}
 
-	file = String::Format(file, CN, address, port, proto);
+bool Interactive::assignAddress(String^ CN)
+{
+	// The pool writes the address it hands out through under the lock, after checking another
+	// process hasn't taken it since
+	msclr::auto_handle<DirectoryLock> lock(lockDirectory());
+	if (lock.get() == nullptr)
+		return false;
+	String^ ccdFile = Path::Combine(this->ccdPath, CN);
+	UInt32 address;
+	// Reissuing a CN keeps the address it already has
+	if (!readAssignment(ccdFile, address)) {
+		try {
+			address = this->addressPool->Allocate();
+		}
+		catch (Exception^ e) {
+			Console::WriteLine("ERROR: Failed to assign an address to {0}. {1}", CN, e->Message);
+			return false;
+		}
+	}
 
-	//Write config
 	try {
-		StreamWriter^ sw = gcnew StreamWriter(Path::Combine(clientPath, "config.conf"));
-		sw->Write(file);
-		sw->Flush();
-		sw->Close();
+		Directory::CreateDirectory(this->ccdPath);
+		DirectoryLock::WriteFile(ccdFile, ccdEntry(address, 0));
+		// Keep an existing server config in step so it doesn't need to be regenerated
+		for (int worker = 0; worker < this->Workers; worker++) {
+			String^ serverCcdDir = Path::Combine(this->path, "server", "ccd" + this->suffix + workerSuffix(worker));
+			if (!Directory::Exists(serverCcdDir))
+				continue;
+			String^ entry = ccdEntry(address, worker);
+			DirectoryLock::WriteFile(Path::Combine(serverCcdDir, CN), entry);
+			this->cache->Record("server/" + Path::GetFileName(serverCcdDir) + "/" + CN, RegenerationCache::Key(Text::Encoding::UTF8->GetBytes(TemplateVersion.ToString()), Text::Encoding::UTF8->GetBytes(entry)));
+		}
 	}
 	catch (Exception^ e) {
-		Console::WriteLine("ERROR: Failed to write client config. {0}", e->Message);
+		Console::WriteLine("ERROR: Failed to write client config dir entry for {0}. {1}", CN, e->Message);
+		this->addressPool->Free(address);
 		return false;
 	}
+	return true;
+}
 
-	//Create visc
-	this->createVisz(CN, clientPath);
-
-	//remove config
+void Interactive::releaseAddress(String^ CN)
+{
+	msclr::auto_handle<DirectoryLock> lock(lockDirectory());
+	if (lock.get() == nullptr)
+		return;
+	String^ ccdFile = Path::Combine(this->ccdPath, CN);
+	UInt32 address;
+	if (readAssignment(ccdFile, address))
+		this->addressPool->Free(address);
 	try {
-		if (Directory::Exists(clientPath)) {
-			Directory::Delete(clientPath, true);
+		File::Delete(ccdFile);
+		for (int worker = 0; worker < this->Workers; worker++) {
+			String^ serverCcdDir = "ccd" + this->suffix + workerSuffix(worker);
+			File::Delete(Path::Combine(this->path, "server", serverCcdDir, CN));
+			this->cache->Forget("server/" + serverCcdDir + "/" + CN);
 		}
 	}
-	catch (Exception^) {
-		//Do nothing
+	catch (Exception^ e) {
+		Console::WriteLine(String::Format("WARNING: Failed to remove client config dir entry. {0}", e->Message));
 	}
-
-	return true;
 }
 
-String ^ Interactive::askQuestion(String ^ question, bool allowedBlank, bool hasDefault)
+bool Interactive::assignMissingAddresses()
 {
-	while (true) {
-		Console::Write(question + " ");
-		String^ input = Console::ReadLine();
-		if (String::IsNullOrWhiteSpace(input) && !hasDefault) {
-			Console::WriteLine("This field cannot be left blank.");
+	// Clients issued before static addressing have no ccd entry and would get no address with nopool
+	if (!Directory::Exists(this->pkiPath))
+		return true;
+	for each (String^ certPath in Directory::GetFiles(this->pkiPath, "*.crt")) {
+		String^ CN = Path::GetFileNameWithoutExtension(certPath);
+		if (CN == "ca" || CN == "server" || certPath == this->crlPath)
 			continue;
-		}
-		if (input == "." && !allowedBlank) {
-			Console::WriteLine("This field cannot be left blank.");
+		UInt32 address;
+		if (readAssignment(Path::Combine(this->ccdPath, CN), address))
 			continue;
-		}
-		return input;
+		if (!assignAddress(CN))
+			return false;
 	}
+	return true;
 }
-String ^ Interactive::askQuestion(String ^ question, bool allowedBlank) {
-	return askQuestion(question, allowedBlank, true);
+
+String^ Interactive::workerSuffix(int worker)
+{
+	// A single server keeps the names it always had
+	return this->Workers > 1 ? String::Format("-{0}", worker) : "";
 }
 
-bool Interactive::saveIdentity(Identity^ identity, String^ name)
+UInt32 Interactive::workerAddress(UInt32 address, int worker)
 {
-	//Create PKI dir
-	try {
-		if (!Directory::Exists(this->pkiPath))
-			Directory::CreateDirectory(this->pkiPath);
-	}
-	catch (Exception^ e) {
-		Console::WriteLine("ERROR: Failed to create PKI dir. {0}", e->Message);
-	}
+	// A client keeps the same offset in every worker's subnet, so one pool covers them all
+	return address + (UInt32)worker * this->addressPool->Span;
+}
 
-	String^ certpath = Path::Combine(this->pkiPath, name + ".crt");
-	String^ keypath = Path::Combine(this->pkiPath, name + ".key");
+String^ Interactive::ccdEntry(UInt32 address, int worker)
+{
+	return String::Format("ifconfig-push {0} {1}\n", AddressPool::ToString(workerAddress(address, worker)), this->addressPool->Netmask);
+}
 
-	String^ cert = OpenSSLHelper::CertAsPEM(identity->cert);
-	if (cert == nullptr) {
-		Console::WriteLine("ERROR: Failed to create certificate");
+bool Interactive::readAssignment(String^ ccdFile, UInt32% address)
+{
+	if (!File::Exists(ccdFile))
 		return false;
-	}
 	try {
-		StreamWriter^ sw = gcnew StreamWriter(certpath);
-		sw->Write(cert);
-		sw->Flush();
-		sw->Close();
-	}
-	catch (Exception^ e) {
-		Console::WriteLine("ERROR: Failed to write certificate to disk. {0}", e->Message);
+		for each (String^ line in File::ReadLines(ccdFile)) {
+			array<String^>^ parts = line->Split((array<wchar_t>^)nullptr, StringSplitOptions::RemoveEmptyEntries);
+			if (parts->Length >= 2 && parts[0] == "ifconfig-push")
+				return AddressPool::TryParse(parts[1], address);
+		}
 	}
+	catch (Exception^) {}
+	return false;
+}
 
-	String^ key = OpenSSLHelper::KeyAsPEM(identity->key);
-	if (key == nullptr) {
-		Console::WriteLine("ERROR: Failed to create key");
+bool Interactive::verifyRequirements()
+{
+	Console::WriteLine("Creating Server Identity...");
+	if (this->Issuer == nullptr && !this->rootOffline) {
+		Console::WriteLine("ERROR: No issuer available.");
 		return false;
 	}
-	try {
-		StreamWriter^ sw = gcnew StreamWriter(keypath);
-		sw->Write(key);
-		sw->Flush();
-		sw->Close();
-	}
-	catch (Exception^ e) {
-		Console::WriteLine("ERROR: Failed to write key to disk. {0}", e->Message);
+	if (this->cSubject == nullptr) {
+		Console::WriteLine("ERROR: No subject available.");
+		return false;
 	}
-
 	return true;
 }
 
-bool Interactive::createNewClientIdentity(String ^ name)
+bool Interactive::requireRootKey()
 {
-	if (!verifyRequirements())
-		return false;
-	CertificateSubject^ subject = this->cSubject;
-	subject->CommonName = name;
-	Identity^ identity;
-	try {
-		identity = OpenSSLHelper::CreateCertKeyBundle(subject, this->Issuer, this->keyAlg, this->keySize, this->curveName, this->validDays, this->Serial, false);
-	}
-	catch (Exception^ e) {
-		Console::WriteLine("Failed to create server identity. {0}", e->Message);
+	if (this->rootOffline) {
+		Console::WriteLine("ERROR: The root CA key is offline, sign with an intermediate using --issuer instead.");
 		return false;
 	}
-	return saveIdentity(identity, name);
+	return true;
 }
 
-bool Interactive::createNewServerIdentity()
+bool Interactive::loadIssuingCA()
 {
-	if (!verifyRequirements())
+	if (this->cSubject == nullptr) {
+		Console::WriteLine("ERROR: No subject available.");
 		return false;
-	CertificateSubject^ subject = this->cSubject;
-	subject->CommonName = "server";
-	Identity^ identity;
+	}
+	int index;
+	if (!issuerIndexes(this->config)->TryGetValue(this->IssuerName, index)) {
+		Console::WriteLine("ERROR: No intermediate named {0}, create it with issuer first.", this->IssuerName);
+		return false;
+	}
 	try {
-		identity = OpenSSLHelper::CreateCertKeyBundle(subject, this->Issuer, this->keyAlg, this->keySize, this->curveName, this->validDays, this->Serial, true);
+		this->issuingCA = gcnew IssuingCA(this->pkiPath, this->IssuerName, index, this->metrics);
+		this->issuingCA->Load(true);
 	}
 	catch (Exception^ e) {
-		Console::WriteLine("Failed to create server identity. {0}", e->Message);
+		Console::WriteLine("ERROR: Failed to load intermediate {0}. {1}", this->IssuerName, e->Message);
+		this->issuingCA = nullptr;
 		return false;
 	}
-	return saveIdentity(identity, "server");
+	return true;
 }
 
-bool Interactive::createVisz(String^ fileName, String ^ folder)
+List<IssuingCA^>^ Interactive::issuingCAs(Dictionary<String^, Object^>^ config)
 {
-	String^ visz = Path::Combine(this->clientsPath, String::Format("{0}.visz", fileName));
-	Stream^ outStream = File::Create(visz);
-	Stream^ gzoStream = gcnew GZipOutputStream(outStream);
-	TarArchive^ tarArchive = TarArchive::CreateOutputTarArchive(gzoStream);
+	// Certificates only, in the order they were created. Throws if one can't be read.
+	List<IssuingCA^>^ result = gcnew List<IssuingCA^>();
+	for each (KeyValuePair<String^, int> item in issuerIndexes(config)) {
+		IssuingCA^ intermediate = gcnew IssuingCA(this->pkiPath, item.Key, item.Value, this->metrics);
+		intermediate->Load(false);
+		result->Add(intermediate);
+	}
+	result->Sort(gcnew Comparison<IssuingCA^>(&Interactive::compareIndex));
+	return result;
+}
 
-	String^ rootPath = Directory::GetParent(folder)->ToString();
-	tarArchive->RootPath = rootPath->Replace('\\', '/');
-	if (tarArchive->RootPath->EndsWith("/")) {
-		tarArchive->RootPath = tarArchive->RootPath->Remove(tarArchive->RootPath->Length);
-	}
+Dictionary<String^, int>^ Interactive::issuerIndexes(Dictionary<String^, Object^>^ config)
+{
+	// Name to serial block, empty until the first intermediate is created
+	Object^ val;
+	if (!config->TryGetValue("issuers", val))
+		return gcnew Dictionary<String^, int>();
+	return JsonConvert::DeserializeObject<Dictionary<String^, int>^>(JsonConvert::SerializeObject(val));
+}
 
-	//Add files
-	String^ currentDir = Directory::GetCurrentDirectory();
+int Interactive::compareIndex(IssuingCA^ a, IssuingCA^ b)
+{
+	return a->Index.CompareTo(b->Index);
+}
+
+IssuingCA^ Interactive::issuingCAFor(String^ certData)
+{
+	// nullptr when the root signed it. Issuers are read from the file, another process may have
+	// added one since this one started.
+	marshal_context ctx;
+	X509* cert = readCert(ctx.marshal_as<const char*>(certData));
+	X509* root = readCert(ctx.marshal_as<const char*>(File::ReadAllText(this->caPath)));
 	try {
-		// We can only have one directory deep in the tar, so set the current directory in case the folder isn't
-		// at the current root, then use the filename as it will be the dir name
-		Directory::SetCurrentDirectory(rootPath);
-		TarEntry^ entry = TarEntry::CreateEntryFromFile(fileName);
-		entry->Name = fileName;
-		tarArchive->WriteEntry(entry, true);
-		tarArchive->Close();
-		return true;
+		if (cert == NULL || root == NULL)
+			throw gcnew Exception("Failed to parse certificate.");
+		if (X509_NAME_cmp(X509_get_issuer_name(cert), X509_get_subject_name(root)) == 0)
+			return nullptr;
+		Dictionary<String^, Object^>^ disk = JsonConvert::DeserializeObject<Dictionary<String^, Object^>^>(File::ReadAllText(this->configPath));
+		for each (IssuingCA^ intermediate in issuingCAs(disk)) {
+			if (X509_NAME_cmp(X509_get_issuer_name(cert), X509_get_subject_name(intermediate->Certificate)) == 0) {
+				intermediate->Load(true);
+				return intermediate;
+			}
+		}
+		throw gcnew Exception("No CA in pki signed this certificate");
 	}
 	finally {
-		Directory::SetCurrentDirectory(currentDir);
+		X509_free(cert);
+		X509_free(root);
 	}
 }
 
-bool Interactive::verifyRequirements()
+X509* Interactive::readCert(const char* pem)
 {
-	Console::WriteLine("Creating Server Identity...");
-	if (this->Issuer == nullptr) {
-		Console::WriteLine("ERROR: No issuer available.");
-		return false;
-	}
-	if (this->cSubject == nullptr) {
-		Console::WriteLine("ERROR: No subject available.");
-		return false;
+	BIO* bio = BIO_new_mem_buf(pem, -1);
+	X509* cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	return cert;
+}
+
+array<Byte>^ Interactive::serverCRL()
+{
+	// One file with the root's CRL and every intermediate's, OpenVPN loads them all
+	MemoryStream^ crl = gcnew MemoryStream();
+	array<Byte>^ data = File::ReadAllBytes(this->crlPath);
+	crl->Write(data, 0, data->Length);
+	for each (IssuingCA^ intermediate in issuingCAs(this->config)) {
+		if (!File::Exists(intermediate->CRLPath))
+			continue;
+		data = File::ReadAllBytes(intermediate->CRLPath);
+		crl->Write(data, 0, data->Length);
 	}
-	return true;
+	return crl->ToArray();
 }
 
 bool Interactive::GenerateNewConfig()
@@ -663,6 +2037,10 @@ bool Interactive::GenerateNewConfig()
 		Console::WriteLine("ERROR: Config already exists, please choose a different directory");
 		return false;
 	}
+	if (!loadAddressPool())
+		return false;
+	// A DNS server beside the VPN server listens on the server's tunnel address
+	String^ localDNS = this->addressPool->Gateway;
 	Console::WriteLine("Please fill in the information below that will be incorporated into your certificate.");
 	Console::WriteLine("Some fields have a default value in square brackets, simply press Enter to use these values without entering anything.");
 	Console::WriteLine("Some fields can be left blank if desired. Enter a '.' only for a field to be left blank.");
@@ -695,7 +2073,7 @@ bool Interactive::GenerateNewConfig()
 		}
 		//Check
 		int test;
-		if (int::TryParse(input, test) && test > 0 && test < 65535) {
+		if (int::TryParse(input, test) && test > 0 && test + this->Workers - 1 < 65535) {
 			port = input;
 			break;
 		}
@@ -807,8 +2185,9 @@ bool Interactive::GenerateNewConfig()
 		}
 	}
 
+	// Compact certificates only carry a Common Name, there are no other details to ask for
 	bool useDefaults = true;
-	while (true) {
+	while (!this->CompactCerts) {
 		String^ input = askQuestion("Would you like to use anonymous defaults for certificate details? [Y/n]:", false)->ToLower();
 		if (input == String::Empty || input == "y") {
 			break;
@@ -894,6 +2273,19 @@ bool Interactive::GenerateNewConfig()
 	config->Add("algorithm", this->keyAlg);
 	config->Add("eccurve", this->curveName);
 	config->Add("suffix", this->suffix);
+	config->Add("crlmode", this->UseCRLDir ? "dir" : "file");
+	config->Add("tlscrypt", this->TLSCryptMode);
+	config->Add("subnet", this->Subnet);
+	config->Add("workers", this->Workers);
+	config->Add("profile", this->TuningProfile);
+	config->Add("dco", this->DCO);
+	config->Add("serverrsaprimes", this->ServerRSAPrimes);
+	config->Add("compactcerts", this->CompactCerts);
+	// Detected once here, the configs are generated on the server host more often than not
+	this->aesni = Tuning::HasAESNI();
+	config->Add("aesni", this->aesni);
+	if (this->Routes != nullptr && this->Routes->Count > 0)
+		config->Add("routes", this->Routes);
 
 	this->config = config;
 	this->cSubject = cs;
@@ -921,98 +2313,175 @@ bool Interactive::RevokeCert(String ^ name)
 		}
 	}
 	// Make sure we don't revoke ourself
-	if (CN == "cert") {
+	if (Array::IndexOf(protectedCNs, CN) >= 0) {
 		Console::WriteLine("ERROR: Cannot revoke this.");
 		return false;
 	}
-	// Find the certificate
-	String^ certname = String::Format("{0}.crt", CN);
-	String^ certpath = Path::Combine(pkiPath, certname);
-	String^ certData;
-	if (!File::Exists(certpath)) {
-		Console::WriteLine("ERROR: Certificate not found.");
+	if (!isValidClientName(CN)) {
+		Console::WriteLine("ERROR: \"{0}\" can't be a client.", CN);
+		return false;
+	}
+	List<String^>^ CNs = gcnew List<String^>();
+	CNs->Add(CN);
+	HashSet<String^>^ crlPaths = gcnew HashSet<String^>();
+	if (!revokeClients(CNs, crlPaths))
 		return false;
+	String^ revokedCRLPath = nullptr;
+	for each (String^ crlPath in crlPaths)
+		revokedCRLPath = crlPath;
+
+	Console::WriteLine();
+	if (this->UseCRLDir) {
+		Console::WriteLine(String::Format("\"{0}\" has been successfully revoked. The revocation entry has been saved to \"{1}\".", CN, this->crlDirPath));
+		if (Directory::Exists(Path::Combine(this->path, "server"))) {
+			Console::WriteLine("The server configuration has been updated, OpenVPN will pick up the change on the next connection.");
+			return true;
+		}
+		Console::WriteLine();
 	}
 	else {
+		Console::WriteLine(String::Format("\"{0}\" has been successfully revoked. The CRL file has been saved to \"{1}\".", CN, revokedCRLPath));
+		Console::WriteLine("Please leave a copy of the CRL file in place if you wish to update it in the future.");
+		Console::WriteLine();
+	}
+	String^ input = askQuestion("Regenerate Server configuration? [Y/n]:", false)->ToLower();
+	if (input == String::Empty || input == "y") {
+		this->CreateServerConfig();
+	}
+
+	return true;
+}
+
+bool Interactive::revokeClients(List<String^>^ CNs, HashSet<String^>^ crlPaths)
+{
+	// Held from finding the certificates to removing them, so two revokes can't both append to the
+	// CRL they read and a regenerate can't write a bundle for a client half way through revoking
+	msclr::auto_handle<DirectoryLock> lock(lockDirectory());
+	if (lock.get() == nullptr)
+		return false;
+	// Every certificate is found before anything is revoked
+	List<String^>^ certs = gcnew List<String^>();
+	for each (String^ CN in CNs) {
+		String^ certpath = Path::Combine(this->pkiPath, CN + ".crt");
+		if (!File::Exists(certpath)) {
+			Console::WriteLine("ERROR: Certificate not found for {0}.", CN);
+			return false;
+		}
 		try {
-			StreamReader^ sr = gcnew StreamReader(certpath);
-			certData = sr->ReadToEnd();
-			sr->Close();
+			certs->Add(File::ReadAllText(certpath));
 		}
 		catch (Exception^ e) {
 			Console::WriteLine("ERROR: Failed to read certificate off disk. " + e->Message);
 			return false;
 		}
 	}
-	String^ crlData;
-	if (File::Exists(this->crlPath)) {
+	if (this->UseCRLDir) {
+		List<String^>^ serials = gcnew List<String^>();
+		try {
+			for each (String^ certData in certs)
+				serials->Add(certSerial(certData));
+		}
+		catch (Exception^ e) {
+			Console::WriteLine("ERROR: Failed to read certificate serial. " + e->Message);
+			return false;
+		}
+		// Revoking is just creating an empty file named after the serial, no CRL to sign or rewrite
 		try {
-			StreamReader^ sr = gcnew StreamReader(this->crlPath);
-			crlData = sr->ReadToEnd();
-			sr->Close();
-			Console::WriteLine("Existing CRL found and will be appended to.");
+			Directory::CreateDirectory(this->crlDirPath);
+			for each (String^ serial in serials)
+				File::Create(Path::Combine(this->crlDirPath, serial))->Close();
 		}
 		catch (Exception^ e) {
-			Console::WriteLine("ERROR: Failed to read CRL off disk. " + e->Message);
+			Console::WriteLine("ERROR: Failed to write revocation entry to disk. {0}", e->Message);
 			return false;
 		}
+		// Update the server copy in place so it doesn't need to be regenerated
+		String^ serverCrlDir = Path::Combine(this->path, "server", "crl" + this->suffix);
+		try {
+			if (Directory::Exists(serverCrlDir)) {
+				for each (String^ serial in serials)
+					File::Create(Path::Combine(serverCrlDir, serial))->Close();
+			}
+		}
+		catch (Exception^ e) {
+			Console::WriteLine(String::Format("WARNING: Failed to update server revocation directory. {0}", e->Message));
+		}
 	}
 	else {
-		crlData = nullptr;
-		Console::WriteLine("No existing CRL was found, a new CRL will be created.");
-	}
-
-	// Create/Update CRL
-	try {
-		crlData = OpenSSLHelper::CreateCRL(this->Issuer, this->keyAlg, crlData, certData, this->validDays);
-	}
-	catch (Exception^ e) {
-		Console::WriteLine("Failed to create CRL. {0}", e->Message);
-		return false;
-	}
-
-	// Write the file to disk
-	try {
-		StreamWriter^ sw = gcnew StreamWriter(this->crlPath);
-		sw->Write(crlData);
-		sw->Flush();
-		sw->Close();
-	}
-	catch (Exception^ e) {
-		Console::WriteLine("ERROR: Failed to write CRL to disk. {0}", e->Message);
-		return false;
+		// Revoked on the CRL of whichever CA signed each, grouped so every CRL is signed once
+		Dictionary<String^, IssuingCA^>^ intermediates = gcnew Dictionary<String^, IssuingCA^>();
+		Dictionary<String^, List<String^>^>^ updates = gcnew Dictionary<String^, List<String^>^>();
+		for each (String^ certData in certs) {
+			IssuingCA^ intermediate;
+			try {
+				intermediate = issuingCAFor(certData);
+			}
+			catch (Exception^ e) {
+				Console::WriteLine("ERROR: " + e->Message);
+				return false;
+			}
+			if (intermediate == nullptr && this->rootOffline) {
+				Console::WriteLine("ERROR: The root CA signed this certificate and its key is offline.");
+				return false;
+			}
+			String^ crlPath = intermediate != nullptr ? intermediate->CRLPath : this->crlPath;
+			if (!updates->ContainsKey(crlPath)) {
+				updates[crlPath] = gcnew List<String^>();
+				intermediates[crlPath] = intermediate;
+			}
+			updates[crlPath]->Add(certData);
+		}
+		for each (KeyValuePair<String^, List<String^>^> update in updates) {
+			CRLFile^ crl = gcnew CRLFile(update.Key);
+			if (crl->Exists())
+				Console::WriteLine("Existing CRL found and will be appended to.");
+			else
+				Console::WriteLine("No existing CRL was found, a new CRL will be created.");
+
+			// Create/Update CRL, both the PEM and its DER copy
+			try {
+				Metrics::Timer timer(this->metrics, "openvpn_generate_crl_duration_seconds");
+				IssuingCA^ intermediate = intermediates[update.Key];
+				if (intermediate != nullptr)
+					crl->Revoke(intermediate->CertPath, intermediate->KeyPath, update.Value, this->validDays);
+				else
+					crl->Revoke(this->caPath, this->keyPath, update.Value, this->validDays);
+			}
+			catch (Exception^ e) {
+				Console::WriteLine("Failed to create CRL. {0}", e->Message);
+				return false;
+			}
+			crlPaths->Add(update.Key);
+		}
 	}
 
-	// Delete the PKI and configuration for this user
-	try {
-		File::Delete(certpath);
-	}
-	catch (Exception^ e) {
-		Console::WriteLine(String::Format("WARNING: Failed to remove revoked PKI data. {0}", e->Message));
-	}
-	String^ keypath = Path::Combine(this->pkiPath, String::Format("{0}.key", CN));
-	try {
-		File::Delete(keypath);
-	}
-	catch (Exception^ e) {
-		Console::WriteLine(String::Format("WARNING: Failed to remove revoked PKI data. {0}", e->Message));
-	}
-	String^ confPath = Path::Combine(this->clientsPath, String::Format("{0}.visz", CN));
-	try {
-		File::Delete(confPath);
-	}
-	catch (Exception^ e) {
-		Console::WriteLine(String::Format("WARNING: Failed to remove revoked PKI data. {0}", e->Message));
+	// Reloaded under the lock so issues by other processes aren't dropped when it's rewritten
+	this->index->Load(this->pkiPath);
+	for each (String^ certData in certs) {
+		this->index->Revoke(certData);
+		this->metrics->Add("openvpn_generate_certificates_revoked_total", "algorithm=\"" + algorithmLabel() + "\"");
 	}
 
-	Console::WriteLine();
-	Console::WriteLine(String::Format("\"{0}\" has been successfully revoked. The CRL file has been saved to \"{1}\".", CN, this->crlPath));
-	Console::WriteLine("Please leave a copy of the CRL file in place if you wish to update it in the future.");
-	Console::WriteLine();
-	String^ input = askQuestion("Regenerate Server configuration? [Y/n]:", false)->ToLower();
-	if (input == String::Empty || input == "y") {
-		this->CreateServerConfig();
+	// Delete the PKI and configuration for these users
+	for each (String^ CN in CNs) {
+		array<String^>^ revokedFiles = {
+			Path::Combine(this->pkiPath, CN + ".crt"),
+			Path::Combine(this->pkiPath, CN + ".key"),
+			Path::Combine(this->clientsPath, CN + ".visz"),
+		};
+		for each (String^ file in revokedFiles) {
+			try {
+				File::Delete(file);
+			}
+			catch (Exception^ e) {
+				Console::WriteLine(String::Format("WARNING: Failed to remove revoked PKI data. {0}", e->Message));
+			}
+		}
+		this->cache->Forget("clients/" + CN + ".visz");
 	}
-
+	lock.reset();
+	for each (String^ CN in CNs)
+		releaseAddress(CN);
+	saveCache();
 	return true;
 }
@@ -2,15 +2,34 @@
 
 #pragma once
 
+#include "AddressPool.h"
+#include "CertificateIndex.h"
+#include "DirectoryLock.h"
+#include "IssuanceJournal.h"
+#include "IssuingCA.h"
 #include "OpenSSLHelper.h"
+#include "OutputSink.h"
+#include "RegenerationCache.h"
+#include "KeyArena.h"
+#include "Metrics.h"
+#include "RouteAggregator.h"
+#include "TLSCrypt.h"
+#include "Tuning.h"
 #include <string>
+#include <msclr/auto_handle.h>
 
 using namespace System;
+using namespace System::Collections::Concurrent;
 using namespace System::Collections::Generic;
+using namespace System::Diagnostics;
+using namespace System::Threading;
+using namespace System::Threading::Tasks;
 using namespace ICSharpCode::SharpZipLib::GZip;
 using namespace ICSharpCode::SharpZipLib::Tar;
 using namespace Newtonsoft::Json;
 using namespace System::IO;
+using namespace System::Numerics;
+using namespace System::Security::Cryptography::X509Certificates;
 
 
 ref class Interactive
@@ -21,13 +40,77 @@ public:
 	bool LoadConfig();
 	bool SaveConfig();
 	bool CreateNewIssuer();
+	// Creates an intermediate CA signed by the root, owning the next free block of serials
+	bool CreateIssuingCA(String^ name);
 	bool CreateDH();
+	bool CreateTLSCryptKey();
 	bool CreateServerConfig();
 	bool CreateNewClientConfig(String^ name);
+	bool CreateNewClientConfigs(IEnumerable<String^>^ names);
 	bool GenerateNewConfig();
 	bool RevokeCert(String^ name);
+	// Rebuilds the server config and every client bundle, rewriting only what changed
+	bool Regenerate();
+	// Issues everyone in the roster without a certificate and revokes every client not in it, then
+	// rebuilds the server config once
+	bool Reconcile(IEnumerable<String^>^ roster);
+	// Writes counters, timings and PKI health to MetricsPath for the node_exporter textfile collector
+	bool WriteMetrics();
+
+	// Revoke by dropping a file named after the serial into a directory (crl-verify DIR dir)
+	// instead of signing a monolithic CRL
+	property bool UseCRLDir;
+	property TLSCrypt::Mode TLSCryptMode;
+	// Aggregated CIDR blocks pushed to clients as routes
+	property List<String^>^ Routes;
+	// Tunnel subnet in CIDR notation, 10.8.0.0/24 unless set at init
+	property String^ Subnet;
+	// Server processes, each on the next port, tun device and subnet along from the first
+	property int Workers;
+	// Data channel cipher order, buffer and MTU settings
+	property Tuning::Profile TuningProfile;
+	// Render configs that keep the data channel offloaded to the kernel (ovpn-dco, OpenVPN 2.6+)
+	property bool DCO;
+	// Primes in a new RSA server key. More primes make the server's half of each handshake cheaper
+	// while clients see an ordinary key of the same size.
+	property int ServerRSAPrimes;
+	// Certificates with only a Common Name and the extensions OpenVPN checks, so the chain sent on
+	// every handshake is as small as it can be
+	property bool CompactCerts;
+	// Intermediate in pki/issuers that signs new clients, the root CA when empty
+	property String^ IssuerName;
+	// Reconcile revokes every client, or more than RevokeConfirmPercent of them, without asking
+	property bool ForceRevoke;
+	// Where server files and client bundles go instead of the config directory, when set
+	property OutputSink^ Output;
+	// Prometheus textfile, nothing is written when empty
+	property String^ MetricsPath;
+	// Window for the certificates expiring gauge
+	property int MetricsExpiryDays;
 
 private:
+	// A client moving through the issue -> encode -> write stages
+	ref class ClientBundle
+	{
+	public:
+		String^ CN;
+		Identity^ identity;
+		String^ cert;
+		KeyBuffer^ key;
+		String^ config;
+		array<Byte>^ tlsCrypt;
+	};
+	// A client whose files are written beside their targets, waiting for its group to be committed
+	ref class StagedClient
+	{
+	public:
+		IssuanceJournal::Entry^ entry;
+		String^ cert;
+		String^ cacheKey;
+		// The bundle, held until the group is committed when it goes to Output
+		array<Byte>^ visz;
+	};
+
 	String ^ defaultCountry = "AU";
 	String ^ defaultState = "NSW";
 	String ^ defaultLocale = "Sydney";
@@ -42,7 +125,14 @@ private:
 	static array<String^>^ cloudflareDNS = { "1.1.1.1", "1.0.0.1" };
 	static array<String^>^ googleDNS = { "8.8.8.8", "8.8.4.4" };
 	static array<String^>^ openDNS = { "208.67.222.222", "208.67.220.220" };
-	static String^ localDNS = "10.8.0.1";
+	static String^ defaultSubnet = "10.8.0.0/24";
+	static const int defaultMaxClients = 1024;
+	// Part of every cache key. Bump it when the output format changes so cached files are rebuilt.
+	static const int TemplateVersion = 1;
+	// OpenVPN's default tls-mtu, the most handshake data a control channel packet carries
+	static const int ControlPacketSize = 1250;
+	// Share of the issued clients a reconcile can revoke before it asks, see ForceRevoke
+	static const int RevokeConfirmPercent = 25;
 
 	String ^ path;
 	String ^ configPath;
@@ -50,35 +140,123 @@ private:
 	String ^ caPath;
 	String ^ keyPath;
 	String ^ crlPath;
+	String ^ crlDirPath;
+	String ^ tlsCryptPath;
+	String ^ tlsCryptV2Path;
 	String ^ clientsPath;
+	String ^ ccdPath;
+	String ^ addressPoolPath;
+	// Taken by every process before changing state shared through the directory
+	String ^ lockPath;
 
 	CertificateSubject^ cSubject;
 	Dictionary<String^, Object^>^ config;
+	// The root CA, null with rootOffline set when ca.key has been taken offline
 	Identity^ Issuer;
+	bool rootOffline;
+	IssuingCA^ issuingCA;
+	AddressPool^ addressPool;
+	RegenerationCache^ cache;
+	CertificateIndex^ index;
+	Metrics^ metrics;
 
-	static array<String^>^ protectedCNs = gcnew array<String^>(2) { "server", "ca" };
+	static array<String^>^ protectedCNs = gcnew array<String^>(3) { "server", "ca", "crl" };
+	// Client names become file names in pki, clients and ccd, and come from batch files and rosters
+	// as well as the prompt. None of them may leave those directories or be hidden in them.
+	static bool isValidClientName(String^ CN);
 
 	int keySize;
 	int validDays;
 	int _serial = 0;
+	// Serials up to here are reserved in config.conf for this process. Other processes sharing
+	// the directory reserve past it, so no two issue the same serial.
+	int serialLimit = Int32::MaxValue;
+	int serialBlock = 1;
+	Object^ serialLock = gcnew Object();
 	OpenSSLHelper::Algorithm keyAlg;
 	String^ curveName;
 	String^ suffix;
+	// Whether the host init ran on has AES instructions, decides the cipher order of the profile
+	bool aesni;
 	property int Serial {
-		int get() {
-			int ss = _serial + 1;
-			_serial = ss;
-			return ss;
-		}
+		int get();
 	}
+	bool reserveSerials(int count);
+	void releaseSerials();
+
+	// Shared by every client bundle, loaded once by prepareClients
+	String^ clientAddress;
+	String^ clientPort;
+	String^ clientProto;
+	array<Byte>^ caData;
+	array<Byte>^ tlsCryptData;
+	String^ tlsCryptV2ServerKey;
+
+	// Bulk issuance pipeline
+	static const int BatchWindow = 256;
+	static const int KeySlotSize = 16384;
+	KeyArena^ keyArena;
+	BlockingCollection<String^>^ pendingClients;
+	BlockingCollection<ClientBundle^>^ issuedClients;
+	BlockingCollection<ClientBundle^>^ encodedClients;
+	int failedClients;
+	// Largest client chain issued this run, for reportChain
+	int clientChainBytes;
+	// Written clients are made durable and moved into place this many at a time
+	static const int CommitGroup = 64;
+	IssuanceJournal^ journal;
+	Object^ stagedLock = gcnew Object();
+	List<StagedClient^>^ stagedClients = gcnew List<StagedClient^>();
 
+	DirectoryLock^ lockDirectory();
+	bool saveCache();
 	String^ askQuestion(String^ question, bool allowedBlank);
 	String^ askQuestion(String^ question, bool allowedBlank, bool hasDefault);
 	bool saveIdentity(Identity^ identity, String^ name);
-	bool createNewClientIdentity(String^ name);
+	bool writeIdentity(String^ name, String^ cert, String^ key);
 	bool createNewServerIdentity();
-	bool createVisz(String^ fileName, String^ folder);
+	void useMultiPrimeKey(Identity^ identity);
+	void compactCert(Identity^ identity, Identity^ issuer);
+	CertificateSubject^ subjectFor(String^ CN);
+	static void reportChain(String^ who, int bytes);
+	static int derSize(X509* cert);
+	bool prepareClients();
+	ClientBundle^ issueClient(String^ CN);
+	bool encodeClient(ClientBundle^ bundle);
+	bool writeClient(ClientBundle^ bundle);
+	bool commitClients(List<StagedClient^>^ group);
+	bool flushClients();
+	// Revokes every client in CNs under one lock, signing each CRL once. Fills crlPaths with the
+	// CRLs that changed.
+	bool revokeClients(List<String^>^ CNs, HashSet<String^>^ crlPaths);
+	bool openJournal();
+	String^ renderClientConfig(String^ CN);
+	String^ clientCacheKey(String^ config, String^ cert);
+	void issueWorker();
+	void encodeWorker();
+	void writeWorker();
+	void writeVisz(String^ visz, ClientBundle^ bundle);
+	void writeVisz(Stream^ outStream, ClientBundle^ bundle);
+	static void addTarEntry(TarOutputStream^ tar, String^ name, array<Byte>^ data);
+	String^ certSerial(String^ certData);
+	String^ algorithmLabel();
+	bool loadAddressPool();
+	bool assignAddress(String^ CN);
+	void releaseAddress(String^ CN);
+	bool assignMissingAddresses();
+	static bool readAssignment(String^ ccdFile, UInt32% address);
+	String^ workerSuffix(int worker);
+	UInt32 workerAddress(UInt32 address, int worker);
+	String^ ccdEntry(UInt32 address, int worker);
 	bool verifyRequirements();
+	bool requireRootKey();
+	bool loadIssuingCA();
+	List<IssuingCA^>^ issuingCAs(Dictionary<String^, Object^>^ config);
+	static Dictionary<String^, int>^ issuerIndexes(Dictionary<String^, Object^>^ config);
+	static int compareIndex(IssuingCA^ a, IssuingCA^ b);
+	array<Byte>^ serverCRL();
+	IssuingCA^ issuingCAFor(String^ certData);
+	static X509* readCert(const char* pem);
 };
 
 
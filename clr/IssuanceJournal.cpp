@@ -0,0 +1,209 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "stdafx.h"
+#include "IssuanceJournal.h"
+#include "DirectoryLock.h"
+
+#include <msclr/lock.h>
+
+using namespace System::Diagnostics;
+using namespace System::Text;
+
+IssuanceJournal::IssuanceJournal(String^ directory)
+{
+	Directory::CreateDirectory(directory);
+	this->path = Path::Combine(directory, stem() + ".journal");
+	// Shared for reading only, recovery can't open a journal that is still in use
+	this->stream = gcnew FileStream(this->path, FileMode::Append, FileAccess::Write, FileShare::Read);
+	this->lock = gcnew Object();
+}
+
+IssuanceJournal::~IssuanceJournal()
+{
+	this->!IssuanceJournal();
+}
+
+IssuanceJournal::!IssuanceJournal()
+{
+	if (this->stream == nullptr)
+		return;
+	this->stream->Close();
+	this->stream = nullptr;
+	// Anything still pending is finished or undone by the next process to recover the directory
+	if (this->pending == 0) {
+		try {
+			File::Delete(this->path);
+		}
+		catch (Exception^) {}
+	}
+}
+
+String^ IssuanceJournal::Stage(Entry^ entry, String^ target)
+{
+	String^ temp = DirectoryLock::TempPath(target);
+	entry->files->Add(KeyValuePair<String^, String^>(temp, target));
+	return temp;
+}
+
+void IssuanceJournal::Record(Entry^ entry)
+{
+	msclr::lock l(this->lock);
+	entry->id = ++this->nextId;
+	StringBuilder^ line = gcnew StringBuilder();
+	line->Append("stage\t")->Append(entry->id)->Append("\t")->Append(entry->name);
+	for each (KeyValuePair<String^, String^> file in entry->files)
+		line->Append("\t")->Append(file.Key)->Append("\t")->Append(file.Value);
+	// Not flushed to disk here, the group's commit covers it
+	append(line->ToString());
+	this->pending++;
+}
+
+void IssuanceJournal::Commit(List<Entry^>^ group)
+{
+	if (group->Count == 0)
+		return;
+	msclr::lock l(this->lock);
+	StringBuilder^ ids = gcnew StringBuilder();
+	for each (Entry^ entry in group)
+		ids->Append("\t")->Append(entry->id);
+	try {
+		flushFiles(group);
+		append("commit" + ids->ToString());
+		this->stream->Flush(true);
+	}
+	catch (Exception^) {
+		for each (Entry^ entry in group) {
+			for each (KeyValuePair<String^, String^> file in entry->files)
+				File::Delete(file.Key);
+		}
+		try {
+			append("abort" + ids->ToString());
+		}
+		catch (Exception^) {}
+		this->pending -= group->Count;
+		throw;
+	}
+
+	// Committed, a crash from here on is finished by recovery rather than undone
+	for each (Entry^ entry in group) {
+		for each (KeyValuePair<String^, String^> file in entry->files)
+			DirectoryLock::Commit(file.Key, file.Value);
+	}
+	append("done" + ids->ToString());
+	this->pending -= group->Count;
+}
+
+List<String^>^ IssuanceJournal::Recover(String^ directory, array<String^>^ tempDirs)
+{
+	List<String^>^ undone = gcnew List<String^>();
+	if (!Directory::Exists(directory))
+		return undone;
+	for each (String^ path in Directory::GetFiles(directory, "*.journal")) {
+		String^ data;
+		try {
+			// A journal that is still open belongs to a running process
+			FileStream^ fs = gcnew FileStream(path, FileMode::Open, FileAccess::ReadWrite, FileShare::None);
+			StreamReader^ sr = gcnew StreamReader(fs);
+			data = sr->ReadToEnd();
+			sr->Close();
+		}
+		catch (IOException^) {
+			continue;
+		}
+		// A torn last line was never flushed, so it can't be a commit
+		data = data->Substring(0, data->LastIndexOf('\n') + 1);
+
+		SortedDictionary<Int64, Entry^>^ staged = gcnew SortedDictionary<Int64, Entry^>();
+		HashSet<Int64>^ committed = gcnew HashSet<Int64>();
+		for each (String^ line in data->Split(gcnew array<wchar_t>{ '\n' }, StringSplitOptions::RemoveEmptyEntries)) {
+			array<String^>^ fields = line->Split('\t');
+			if (fields[0] == "stage" && fields->Length >= 3 && fields->Length % 2 == 1) {
+				Entry^ entry = gcnew Entry();
+				entry->id = Int64::Parse(fields[1]);
+				entry->name = fields[2];
+				for (int i = 3; i + 1 < fields->Length; i += 2)
+					entry->files->Add(KeyValuePair<String^, String^>(fields[i], fields[i + 1]));
+				staged[entry->id] = entry;
+				continue;
+			}
+			for (int i = 1; i < fields->Length; i++) {
+				Int64 id;
+				if (!Int64::TryParse(fields[i], id))
+					continue;
+				if (fields[0] == "commit") {
+					committed->Add(id);
+				}
+				else if (fields[0] == "done" || fields[0] == "abort") {
+					staged->Remove(id);
+					committed->Remove(id);
+				}
+			}
+		}
+
+		for each (KeyValuePair<Int64, Entry^> item in staged) {
+			bool forward = committed->Contains(item.Key);
+			for each (KeyValuePair<String^, String^> file in item.Value->files) {
+				if (!File::Exists(file.Key))
+					continue;
+				if (forward) {
+					try {
+						DirectoryLock::Commit(file.Key, file.Value);
+					}
+					catch (Exception^) {}
+				}
+				else {
+					File::Delete(file.Key);
+				}
+			}
+			if (!forward)
+				undone->Add(item.Value->name);
+		}
+
+		// Temp files written before the process got as far as recording them
+		String^ marker = "." + Path::GetFileNameWithoutExtension(path) + ".";
+		for each (String^ tempDir in tempDirs) {
+			if (!Directory::Exists(tempDir))
+				continue;
+			for each (String^ temp in Directory::GetFiles(tempDir, "*.tmp")) {
+				if (Path::GetFileName(temp)->Contains(marker)) {
+					try {
+						File::Delete(temp);
+					}
+					catch (Exception^) {}
+				}
+			}
+		}
+		File::Delete(path);
+	}
+	return undone;
+}
+
+void IssuanceJournal::append(String^ line)
+{
+	array<Byte>^ record = Encoding::UTF8->GetBytes(line + "\n");
+	this->stream->Write(record, 0, record->Length);
+	this->stream->Flush();
+}
+
+void IssuanceJournal::flushFiles(List<Entry^>^ group)
+{
+	// Windows has no call that flushes a whole volume without administrator rights, so each temp
+	// file is flushed, all of them together once the group is complete
+	for each (Entry^ entry in group) {
+		for each (KeyValuePair<String^, String^> file in entry->files) {
+			FileStream^ fs = gcnew FileStream(file.Key, FileMode::Open, FileAccess::ReadWrite, FileShare::Read);
+			try {
+				fs->Flush(true);
+			}
+			finally {
+				fs->Close();
+			}
+		}
+	}
+}
+
+String^ IssuanceJournal::stem()
+{
+	// Matches the machine and process DirectoryLock::TempPath puts in temp file names
+	return String::Format("{0}.{1}", Environment::MachineName, Process::GetCurrentProcess()->Id);
+}
@@ -0,0 +1,56 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+using namespace System;
+using namespace System::Collections::Generic;
+using namespace System::IO;
+
+// Write-ahead journal for issuing identities. Every file of an entry is written to a temp path
+// and recorded, then a group of entries is made durable before any of them is renamed into place.
+// After a crash each entry is either wholly in place or wholly gone: the next process to recover
+// the directory finishes the renames of a committed group and removes the temp files of anything
+// that wasn't committed.
+ref class IssuanceJournal
+{
+public:
+	ref class Entry
+	{
+	public:
+		String^ name;
+		// Temp path and the target it is renamed over
+		List<KeyValuePair<String^, String^>>^ files = gcnew List<KeyValuePair<String^, String^>>();
+		Int64 id;
+	};
+
+	// One journal per process in directory, held open for as long as it's in use. Throws on failure.
+	IssuanceJournal(String^ directory);
+	// Removes the journal if everything in it was committed
+	~IssuanceJournal();
+	!IssuanceJournal();
+
+	// Adds a file to entry, returning the temp path to write it to
+	static String^ Stage(Entry^ entry, String^ target);
+	// Records an entry whose files have all been written. Safe to call from several writers.
+	void Record(Entry^ entry);
+	// Flushes the group's files, commits them in the journal and renames them into place. On
+	// failure nothing is renamed, the temp files are removed and the group is aborted. Throws.
+	void Commit(List<Entry^>^ group);
+
+	// Finishes or undoes the journals left by processes that are no longer running, removing their
+	// temp files from tempDirs. Returns the names of the entries that were undone. Call it under the
+	// directory lock, before opening this process's own journal.
+	static List<String^>^ Recover(String^ directory, array<String^>^ tempDirs);
+
+private:
+	String^ path;
+	FileStream^ stream;
+	Object^ lock;
+	Int64 nextId;
+	// Recorded and not yet committed or aborted
+	Int64 pending;
+
+	void append(String^ line);
+	static void flushFiles(List<Entry^>^ group);
+	static String^ stem();
+};
@@ -0,0 +1,245 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "stdafx.h"
+#include "IssuingCA.h"
+#include "CRLFile.h"
+#include "DirectoryLock.h"
+#include "Signing.h"
+
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#include <msclr/lock.h>
+#include <msclr/marshal.h>
+
+#include <utility>
+
+using namespace msclr::interop;
+using namespace System::Text::RegularExpressions;
+
+IssuingCA::IssuingCA(String^ pkiPath, String^ name, int index, Metrics^ metrics)
+{
+	this->directory = Directory(pkiPath);
+	this->name = name;
+	this->index = index;
+	this->metrics = metrics;
+	this->cert = NULL;
+	this->serialLock = gcnew Object();
+}
+
+IssuingCA::~IssuingCA()
+{
+	this->!IssuingCA();
+}
+
+IssuingCA::!IssuingCA()
+{
+	X509_free(this->cert);
+	this->cert = NULL;
+}
+
+String^ IssuingCA::Directory(String^ pkiPath)
+{
+	return Path::Combine(pkiPath, "issuers");
+}
+
+bool IssuingCA::ValidName(String^ name)
+{
+	// Used as a file name and a Common Name
+	return name != nullptr && name->Length <= 64 && Regex::IsMatch(name, "^[A-Za-z0-9_-][A-Za-z0-9._-]*$");
+}
+
+int IssuingCA::IndexOf(String^ pkiPath, String^ name)
+{
+	IssuingCA^ intermediate = gcnew IssuingCA(pkiPath, name, 0, nullptr);
+	Int64 serial;
+	if (!Int64::TryParse(File::ReadAllText(intermediate->serialPath())->Trim(), serial) || serial <= 0)
+		throw gcnew Exception(intermediate->serialPath() + " is damaged");
+	return (int)(serial >> SerialBits);
+}
+
+String^ IssuingCA::serialPath()
+{
+	return Path::Combine(this->directory, this->name + ".serial");
+}
+
+String^ IssuingCA::lockPath()
+{
+	return Path::Combine(this->directory, this->name + ".lock");
+}
+
+void IssuingCA::Create(Identity^ root, OpenSSLHelper::Algorithm algorithm, int keySize, String^ curve, int validDays, int serial, bool compact)
+{
+	EVP_PKEY* key = createKey(algorithm, keySize, curve);
+	X509* cert = X509_new();
+	BIO* certBio = BIO_new(BIO_s_mem());
+	BIO* keyBio = BIO_new(BIO_s_secmem());
+	try {
+		// The root's subject with this intermediate's Common Name, or only the Common Name when compact
+		X509_NAME* subject = compact ? X509_NAME_new() : X509_NAME_dup(X509_get_subject_name(root->cert));
+		int cn = X509_NAME_get_index_by_NID(subject, NID_commonName, -1);
+		if (cn >= 0)
+			X509_NAME_ENTRY_free(X509_NAME_delete_entry(subject, cn));
+		marshal_context ctx;
+		X509_NAME_add_entry_by_txt(subject, "CN", MBSTRING_UTF8, (const unsigned char*)ctx.marshal_as<const char*>(this->name), -1, -1, 0);
+		X509_set_version(cert, 2);
+		ASN1_INTEGER_set(X509_get_serialNumber(cert), serial);
+		X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+		X509_gmtime_adj(X509_getm_notAfter(cert), (long)validDays * 24 * 60 * 60);
+		X509_set_pubkey(cert, key);
+		X509_set_subject_name(cert, subject);
+		X509_NAME_free(subject);
+		X509_set_issuer_name(cert, X509_get_subject_name(root->cert));
+
+		// Can only issue end entity certificates
+		const std::pair<int, const char*> extensions[] = {
+			{ NID_basic_constraints, "critical,CA:TRUE,pathlen:0" },
+			{ NID_key_usage, "critical,keyCertSign,cRLSign" },
+			{ NID_subject_key_identifier, "hash" },
+			{ NID_authority_key_identifier, "keyid:always" },
+		};
+		// Chains are short enough to be built by name, compact ones leave out the key identifiers
+		for (const auto& extension : extensions) {
+			if (compact && (extension.first == NID_subject_key_identifier || extension.first == NID_authority_key_identifier))
+				continue;
+			X509V3_CTX v3;
+			X509V3_set_ctx_nodb(&v3);
+			X509V3_set_ctx(&v3, root->cert, cert, NULL, NULL, 0);
+			X509_EXTENSION* ext = X509V3_EXT_conf_nid(NULL, &v3, extension.first, extension.second);
+			if (ext == NULL)
+				throw gcnew Exception("Failed to create certificate extension. " + lastError());
+			X509_add_ext(cert, ext, -1);
+			X509_EXTENSION_free(ext);
+		}
+		if (!X509_sign(cert, root->key, SigningDigest(root->key)))
+			throw gcnew Exception("Failed to sign intermediate CA. " + lastError());
+
+		if (!PEM_write_bio_X509(certBio, cert) || !PEM_write_bio_PrivateKey(keyBio, key, NULL, NULL, 0, NULL, NULL))
+			throw gcnew Exception("Failed to encode intermediate CA. " + lastError());
+		char* data;
+		long length = BIO_get_mem_data(certBio, &data);
+		this->certPEM = gcnew String(data, 0, length);
+		length = BIO_get_mem_data(keyBio, &data);
+		String^ keyPEM = gcnew String(data, 0, length);
+
+		System::IO::Directory::CreateDirectory(this->directory);
+		DirectoryLock::WriteFile(KeyPath, keyPEM);
+		DirectoryLock::WriteFile(serialPath(), String::Format("{0}\n", FirstSerial));
+		this->identity = OpenSSLHelper::LoadIdentity(this->certPEM, keyPEM);
+	}
+	catch (Exception^) {
+		X509_free(cert);
+		throw;
+	}
+	finally {
+		BIO_free(certBio);
+		BIO_free(keyBio);
+		EVP_PKEY_free(key);
+	}
+	X509_free(this->cert);
+	this->cert = cert;
+	// The CRL is signed from the certificate beside its final path, which is moved into place
+	// last. A certificate in issuers is an intermediate that is ready to use.
+	String^ temp = DirectoryLock::TempPath(CertPath);
+	File::WriteAllText(temp, this->certPEM);
+	try {
+		(gcnew CRLFile(CRLPath))->Create(temp, KeyPath, validDays);
+		DirectoryLock::Commit(temp, CertPath);
+	}
+	catch (Exception^) {
+		File::Delete(temp);
+		throw;
+	}
+}
+
+void IssuingCA::Load(bool withKey)
+{
+	this->certPEM = File::ReadAllText(CertPath);
+	marshal_context ctx;
+	BIO* bio = BIO_new_mem_buf(ctx.marshal_as<const char*>(this->certPEM), -1);
+	X509_free(this->cert);
+	this->cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (this->cert == NULL)
+		throw gcnew Exception("Failed to parse certificate. " + lastError());
+	if (withKey)
+		this->identity = OpenSSLHelper::LoadIdentity(this->certPEM, File::ReadAllText(KeyPath));
+}
+
+int IssuingCA::Serial(int count)
+{
+	msclr::lock l(this->serialLock);
+	if (this->serial >= this->serialLimit)
+		reserveSerials(count);
+	return ++this->serial;
+}
+
+void IssuingCA::ReleaseSerials()
+{
+	msclr::lock l(this->serialLock);
+	if (this->serial >= this->serialLimit)
+		return;
+	DirectoryLock lock(lockPath(), this->metrics);
+	int start;
+	if (!int::TryParse(File::ReadAllText(serialPath())->Trim(), start) || start != this->serialLimit)
+		return;
+	DirectoryLock::WriteFile(serialPath(), String::Format("{0}\n", this->serial));
+	this->serialLimit = this->serial;
+}
+
+void IssuingCA::reserveSerials(int count)
+{
+	// Same scheme as the root's serial in config.conf, but under this intermediate's own lock
+	DirectoryLock lock(lockPath(), this->metrics);
+	int start = 0;
+	if (!int::TryParse(File::ReadAllText(serialPath())->Trim(), start) || start < FirstSerial || start >= LastSerial)
+		throw gcnew Exception(String::Format("Serials for intermediate {0} are used up or {1} is damaged", this->name, serialPath()));
+	count = Math::Min(count, LastSerial - start);
+	DirectoryLock::WriteFile(serialPath(), String::Format("{0}\n", start + count));
+	this->serial = start;
+	this->serialLimit = start + count;
+}
+
+EVP_PKEY* IssuingCA::createKey(OpenSSLHelper::Algorithm algorithm, int keySize, String^ curve)
+{
+	// Same key type as the root, so the chain doesn't mix algorithms
+	int id = EVP_PKEY_RSA;
+	if (algorithm == OpenSSLHelper::Algorithm::ECDSA)
+		id = EVP_PKEY_EC;
+	else if (algorithm == OpenSSLHelper::Algorithm::EdDSA)
+		id = curve->ToUpperInvariant() == "ED448" ? EVP_PKEY_ED448 : EVP_PKEY_ED25519;
+
+	marshal_context ctx;
+	EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id(id, NULL);
+	EVP_PKEY* key = NULL;
+	bool ok = pctx != NULL && EVP_PKEY_keygen_init(pctx) > 0;
+	if (ok && id == EVP_PKEY_RSA) {
+		ok = EVP_PKEY_CTX_set_rsa_keygen_bits(pctx, keySize) > 0;
+	}
+	else if (ok && id == EVP_PKEY_EC) {
+		const char* name = ctx.marshal_as<const char*>(curve);
+		int nid = OBJ_sn2nid(name);
+		if (nid == NID_undef)
+			nid = EC_curve_nist2nid(name);
+		ok = nid != NID_undef
+			&& EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, nid) > 0
+			&& EVP_PKEY_CTX_set_ec_param_enc(pctx, OPENSSL_EC_NAMED_CURVE) > 0;
+	}
+	if (ok)
+		ok = EVP_PKEY_keygen(pctx, &key) > 0;
+	EVP_PKEY_CTX_free(pctx);
+	if (!ok)
+		throw gcnew Exception("Failed to generate key. " + lastError());
+	return key;
+}
+
+String^ IssuingCA::lastError()
+{
+	char buf[256];
+	unsigned long error = ERR_get_error();
+	ERR_clear_error();
+	if (error == 0)
+		return "Unknown error";
+	ERR_error_string_n(error, buf, sizeof(buf));
+	return gcnew String(buf);
+}
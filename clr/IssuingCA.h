@@ -0,0 +1,77 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include "Metrics.h"
+#include "OpenSSLHelper.h"
+
+#include <openssl/x509.h>
+
+using namespace System;
+using namespace System::IO;
+
+// An intermediate CA in pki/issuers, signed by the root and issuing clients from its own block of
+// serials. Its serial counter and lock are its own, so processes issuing from different
+// intermediates never wait on each other, and a directory copied to another site with only the
+// intermediate's key can keep issuing without the root key.
+ref class IssuingCA
+{
+public:
+	// Serials are split on their top bits. The root keeps block 0, intermediate n issues from
+	// block n, so serials stay unique across intermediates without any coordination.
+	literal int SerialBits = 24;
+	literal int MaxIssuers = 127;
+
+	IssuingCA(String^ pkiPath, String^ name, int index, Metrics^ metrics);
+	~IssuingCA();
+	!IssuingCA();
+
+	static String^ Directory(String^ pkiPath);
+	static bool ValidName(String^ name);
+	// Index of an existing intermediate, read back from its serial counter, which never leaves the
+	// intermediate's block. For readers of pki that don't have config.conf. Throws.
+	static int IndexOf(String^ pkiPath, String^ name);
+
+	// Signs a new intermediate with the root and writes its key, certificate, serial counter and
+	// an empty CRL. Throws on failure.
+	void Create(Identity^ root, OpenSSLHelper::Algorithm algorithm, int keySize, String^ curve, int validDays, int serial, bool compact);
+	// Loads the certificate, and the key when withKey is set. Throws on failure.
+	void Load(bool withKey);
+
+	// Next serial from this intermediate's block, reserving count at a time in its counter file
+	int Serial(int count);
+	// Gives back the unused end of the last reservation, if nobody has reserved since. Throws.
+	void ReleaseSerials();
+
+	property String^ Name { String^ get() { return name; } }
+	property int Index { int get() { return index; } }
+	property int FirstSerial { int get() { return index << SerialBits; } }
+	property int LastSerial { int get() { return ((index + 1) << SerialBits) - 1; } }
+	// Null until loaded with the key
+	property Identity^ Issuer { Identity^ get() { return identity; } }
+	property X509* Certificate { X509* get() { return cert; } }
+	property String^ CertPEM { String^ get() { return certPEM; } }
+	property String^ CertPath { String^ get() { return Path::Combine(directory, name + ".crt"); } }
+	property String^ KeyPath { String^ get() { return Path::Combine(directory, name + ".key"); } }
+	property String^ CRLPath { String^ get() { return Path::Combine(directory, name + ".crl"); } }
+
+private:
+	String^ directory;
+	String^ name;
+	int index;
+	Metrics^ metrics;
+	Identity^ identity;
+	X509* cert;
+	String^ certPEM;
+
+	Object^ serialLock;
+	int serial;
+	int serialLimit;
+
+	String^ serialPath();
+	String^ lockPath();
+	void reserveSerials(int count);
+
+	static EVP_PKEY* createKey(OpenSSLHelper::Algorithm algorithm, int keySize, String^ curve);
+	static String^ lastError();
+};
@@ -0,0 +1,134 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "stdafx.h"
+#include "KeyArena.h"
+#include "DirectoryLock.h"
+
+#include <windows.h>
+#include <stdio.h>
+#include <vcclr.h>
+#include <openssl/crypto.h>
+#include <openssl/pem.h>
+
+KeyBuffer::KeyBuffer(int index, unsigned char* data, int capacity)
+{
+	this->index = index;
+	this->data = data;
+	this->capacity = capacity;
+	this->length = 0;
+}
+
+bool KeyBuffer::LoadPEM(EVP_PKEY* key)
+{
+	// Secure memory BIOs are cleansed when freed, so the only copy left is ours
+	BIO* bio = BIO_new(BIO_s_secmem());
+	if (bio == NULL)
+		return false;
+	bool ok = false;
+	if (PEM_write_bio_PrivateKey(bio, key, NULL, NULL, 0, NULL, NULL)) {
+		char* pem = NULL;
+		long len = BIO_get_mem_data(bio, &pem);
+		if (len > 0 && len <= this->capacity) {
+			memcpy(this->data, pem, len);
+			this->length = (int)len;
+			ok = true;
+		}
+	}
+	BIO_free(bio);
+	return ok;
+}
+
+bool KeyBuffer::WriteTo(String^ path)
+{
+	// Unbuffered so the CRT doesn't keep its own copy of the key
+	String^ temp = DirectoryLock::TempPath(path);
+	pin_ptr<const wchar_t> wpath = PtrToStringChars(temp);
+	FILE* f = _wfopen(wpath, L"wbx");
+	if (f == NULL)
+		return false;
+	setvbuf(f, NULL, _IONBF, 0);
+	bool ok = fwrite(this->data, 1, this->length, f) == (size_t)this->length;
+	ok = fclose(f) == 0 && ok;
+	try {
+		if (!ok)
+			throw gcnew IOException("Short write");
+		DirectoryLock::Commit(temp, path);
+	}
+	catch (Exception^) {
+		File::Delete(temp);
+		return false;
+	}
+	return true;
+}
+
+bool KeyBuffer::ReadFrom(String^ path)
+{
+	// Unbuffered, the same way it was written
+	pin_ptr<const wchar_t> wpath = PtrToStringChars(path);
+	FILE* f = _wfopen(wpath, L"rb");
+	if (f == NULL)
+		return false;
+	setvbuf(f, NULL, _IONBF, 0);
+	size_t read = fread(this->data, 1, this->capacity, f);
+	// A key that fills the whole buffer may have been cut short
+	bool ok = fclose(f) == 0 && read > 0 && read < (size_t)this->capacity;
+	this->length = ok ? (int)read : 0;
+	return ok;
+}
+
+void KeyBuffer::CopyTo(unsigned char* dest)
+{
+	memcpy(dest, this->data, this->length);
+}
+
+KeyArena::KeyArena(int slots, int slotSize)
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	size_t page = info.dwPageSize;
+	this->size = (((size_t)slots * slotSize) + page - 1) / page * page;
+	this->base = (unsigned char*)VirtualAlloc(NULL, this->size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (this->base == NULL)
+		throw gcnew OutOfMemoryException("Failed to allocate key arena");
+	// Keep key material out of the page file where the working set allows it
+	this->locked = VirtualLock(this->base, this->size) != 0;
+	if (!this->locked)
+		Console::WriteLine("WARNING: Unable to lock key memory, keys may be paged to disk.");
+
+	this->buffers = gcnew array<KeyBuffer^>(slots);
+	this->available = gcnew BlockingCollection<int>(slots);
+	for (int i = 0; i < slots; i++) {
+		this->buffers[i] = gcnew KeyBuffer(i, this->base + (size_t)i * slotSize, slotSize);
+		this->available->Add(i);
+	}
+}
+
+KeyArena::~KeyArena()
+{
+	this->!KeyArena();
+}
+
+KeyArena::!KeyArena()
+{
+	if (this->base == NULL)
+		return;
+	OPENSSL_cleanse(this->base, this->size);
+	if (this->locked)
+		VirtualUnlock(this->base, this->size);
+	VirtualFree(this->base, 0, MEM_RELEASE);
+	this->base = NULL;
+}
+
+KeyBuffer^ KeyArena::Acquire()
+{
+	return this->buffers[this->available->Take()];
+}
+
+void KeyArena::Release(KeyBuffer^ buffer)
+{
+	if (buffer == nullptr)
+		return;
+	OPENSSL_cleanse(buffer->data, buffer->capacity);
+	buffer->length = 0;
+	this->available->Add(buffer->index);
+}
@@ -0,0 +1,50 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include <openssl/evp.h>
+
+using namespace System;
+using namespace System::Collections::Concurrent;
+using namespace System::Threading;
+
+// A single private key held in locked, unmanaged memory. Never copied into a managed String.
+ref class KeyBuffer
+{
+public:
+	property int Length {
+		int get() { return length; }
+	}
+
+	bool LoadPEM(EVP_PKEY* key);
+	bool WriteTo(String^ path);
+	bool ReadFrom(String^ path);
+	void CopyTo(unsigned char* dest);
+
+internal:
+	KeyBuffer(int index, unsigned char* data, int capacity);
+	int index;
+	unsigned char* data;
+	int capacity;
+	int length;
+};
+
+// Fixed pool of key buffers in page locked memory, zeroed whenever a buffer is handed back.
+// Acquire blocks once every buffer is in use, so memory stays flat however many keys pass through.
+ref class KeyArena
+{
+public:
+	KeyArena(int slots, int slotSize);
+	~KeyArena();
+	!KeyArena();
+
+	KeyBuffer^ Acquire();
+	void Release(KeyBuffer^ buffer);
+
+private:
+	unsigned char* base;
+	size_t size;
+	bool locked;
+	array<KeyBuffer^>^ buffers;
+	BlockingCollection<int>^ available;
+};
@@ -0,0 +1,193 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "stdafx.h"
+#include "Metrics.h"
+#include "DirectoryLock.h"
+
+#include <msclr/auto_handle.h>
+#include <msclr/lock.h>
+
+using namespace System::Globalization;
+using namespace System::IO;
+using namespace System::Text;
+
+static Metrics::Metrics()
+{
+	families = gcnew array<Family^> {
+		gcnew Family("openvpn_generate_certificates_issued_total", "counter", "Certificates issued."),
+		gcnew Family("openvpn_generate_certificates_revoked_total", "counter", "Certificates revoked."),
+		gcnew Family("openvpn_generate_issue_duration_seconds", "histogram", "Time to generate a key and sign its certificate."),
+		gcnew Family("openvpn_generate_bundle_duration_seconds", "histogram", "Time to write a client .visz bundle."),
+		gcnew Family("openvpn_generate_crl_duration_seconds", "histogram", "Time to sign an updated CRL."),
+		gcnew Family("openvpn_generate_crl_bytes", "gauge", "Size of the CRL file."),
+		gcnew Family("openvpn_generate_crl_entries", "gauge", "Revoked serials in the CRL file or directory."),
+		gcnew Family("openvpn_generate_certificates_valid", "gauge", "Issued certificates that are neither revoked nor expired."),
+		gcnew Family("openvpn_generate_certificates_expiring", "gauge", "Valid certificates expiring within the given number of days."),
+		gcnew Family("openvpn_generate_lock_wait_seconds", "histogram", "Time spent waiting for the config directory lock."),
+		gcnew Family("openvpn_generate_ocsp_requests_total", "counter", "OCSP requests answered."),
+		gcnew Family("openvpn_generate_ocsp_responses", "gauge", "Precomputed OCSP responses."),
+		gcnew Family("openvpn_generate_last_run_timestamp_seconds", "gauge", "When the metrics were last written."),
+	};
+}
+
+Metrics::Metrics()
+{
+	this->order = gcnew List<String^>();
+	this->values = gcnew Dictionary<String^, double>();
+	this->gauges = gcnew HashSet<String^>();
+	this->lock = gcnew Object();
+}
+
+Metrics::Timer::Timer(Metrics^ metrics, String^ name)
+{
+	this->metrics = metrics;
+	this->name = name;
+	this->watch = Stopwatch::StartNew();
+}
+
+Metrics::Timer::~Timer()
+{
+	this->metrics->Observe(this->name, this->watch->Elapsed.TotalSeconds);
+}
+
+String^ Metrics::series(String^ name, String^ labels)
+{
+	return String::IsNullOrEmpty(labels) ? name : name + "{" + labels + "}";
+}
+
+Metrics::Family^ Metrics::family(String^ series)
+{
+	int brace = series->IndexOf('{');
+	String^ name = brace < 0 ? series : series->Substring(0, brace);
+	for each (Family^ f in families) {
+		if (!name->StartsWith(f->name, StringComparison::Ordinal))
+			continue;
+		String^ rest = name->Substring(f->name->Length);
+		if (rest->Length == 0 || (f->type == "histogram" && (rest == "_bucket" || rest == "_sum" || rest == "_count")))
+			return f;
+	}
+	return nullptr;
+}
+
+void Metrics::add(String^ series, double value)
+{
+	double current;
+	if (this->values->TryGetValue(series, current)) {
+		this->values[series] = current + value;
+	}
+	else {
+		this->order->Add(series);
+		this->values[series] = value;
+	}
+}
+
+void Metrics::Add(String^ name, String^ labels, double value)
+{
+	msclr::lock l(this->lock);
+	add(series(name, labels), value);
+}
+
+void Metrics::Add(String^ name, String^ labels)
+{
+	Add(name, labels, 1);
+}
+
+void Metrics::Set(String^ name, String^ labels, double value)
+{
+	msclr::lock l(this->lock);
+	String^ key = series(name, labels);
+	if (!this->values->ContainsKey(key))
+		this->order->Add(key);
+	this->values[key] = value;
+	this->gauges->Add(key);
+}
+
+void Metrics::Observe(String^ name, double seconds)
+{
+	msclr::lock l(this->lock);
+	for each (double bucket in buckets)
+		add(series(name + "_bucket", String::Format(CultureInfo::InvariantCulture, "le=\"{0}\"", bucket)), seconds <= bucket ? 1 : 0);
+	add(series(name + "_bucket", "le=\"+Inf\""), 1);
+	add(name + "_sum", seconds);
+	add(name + "_count", 1);
+}
+
+bool Metrics::Write(String^ path)
+{
+	// Other runs sharing the file merge into it too, one at a time or their counts are lost.
+	// Taken before this->lock, DirectoryLock observes into metrics while holding its own.
+	msclr::auto_handle<DirectoryLock> fileLock;
+	try {
+		fileLock.reset(gcnew DirectoryLock(path + ".lock", nullptr));
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to write metrics to {0}. {1}", path, e->Message);
+		return false;
+	}
+	msclr::lock l(this->lock);
+	// Start from the previous run, counters carry on from where it left off. A gauge family set
+	// this run replaces all of its old series, so a changed label doesn't leave a stale one behind.
+	HashSet<Family^>^ replaced = gcnew HashSet<Family^>();
+	for each (String^ gauge in this->gauges)
+		replaced->Add(family(gauge));
+	List<String^>^ order = gcnew List<String^>();
+	Dictionary<String^, double>^ values = gcnew Dictionary<String^, double>();
+	if (File::Exists(path)) {
+		for each (String^ line in File::ReadAllLines(path)) {
+			if (line->Length == 0 || line[0] == '#')
+				continue;
+			int space = line->LastIndexOf(' ');
+			if (space < 0)
+				continue;
+			String^ key = line->Substring(0, space);
+			Family^ f = family(key);
+			double value;
+			if (f == nullptr || replaced->Contains(f) || values->ContainsKey(key)
+				|| !Double::TryParse(line->Substring(space + 1), NumberStyles::Float, CultureInfo::InvariantCulture, value))
+				continue;
+			order->Add(key);
+			values[key] = value;
+		}
+	}
+	for each (String^ key in this->order) {
+		if (!values->ContainsKey(key)) {
+			order->Add(key);
+			values[key] = this->values[key];
+		}
+		else if (this->gauges->Contains(key)) {
+			values[key] = this->values[key];
+		}
+		else {
+			values[key] = values[key] + this->values[key];
+		}
+	}
+
+	StringBuilder^ out = gcnew StringBuilder();
+	for each (Family^ f in families) {
+		bool header = false;
+		for each (String^ key in order) {
+			if (family(key) != f)
+				continue;
+			if (!header) {
+				out->Append("# HELP " + f->name + " " + f->help + "\n");
+				out->Append("# TYPE " + f->name + " " + f->type + "\n");
+				header = true;
+			}
+			out->Append(key + " " + values[key].ToString("R", CultureInfo::InvariantCulture) + "\n");
+		}
+	}
+
+	try {
+		DirectoryLock::WriteFile(path, out->ToString());
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to write metrics to {0}. {1}", path, e->Message);
+		return false;
+	}
+	// Counts are in the file now, keep only what's added from here so the next write doesn't repeat them
+	for each (String^ key in this->order) {
+		if (!this->gauges->Contains(key))
+			this->values[key] = 0;
+	}
+	return true;
+}
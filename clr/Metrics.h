@@ -0,0 +1,62 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+using namespace System;
+using namespace System::Collections::Generic;
+using namespace System::Diagnostics;
+
+// Prometheus textfile collector output. Counters and histograms are added to whatever the file
+// already holds so they keep counting across runs, gauges are replaced.
+ref class Metrics
+{
+public:
+	Metrics();
+
+	// Counter, labels in exposition format without the braces, e.g. algorithm="rsa"
+	void Add(String^ name, String^ labels, double value);
+	void Add(String^ name, String^ labels);
+	void Set(String^ name, String^ labels, double value);
+	void Observe(String^ name, double seconds);
+	// Merges with the file already at path and replaces it in one rename, so the collector never
+	// reads half a file. Runs sharing path merge one at a time under a lock on path + ".lock".
+	// Can be called repeatedly by long running modes.
+	bool Write(String^ path);
+
+	// Observes the time from construction to disposal, use with stack semantics
+	ref class Timer
+	{
+	public:
+		Timer(Metrics^ metrics, String^ name);
+		~Timer();
+
+	private:
+		Metrics^ metrics;
+		String^ name;
+		Stopwatch^ watch;
+	};
+
+private:
+	ref class Family
+	{
+	public:
+		Family(String^ name, String^ type, String^ help) : name(name), type(type), help(help) {}
+		String^ name;
+		String^ type;
+		String^ help;
+	};
+	static array<Family^>^ families;
+	static array<double>^ buckets = { 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+
+	static Metrics();
+
+	// Series in the order first seen, so histogram buckets stay sorted
+	List<String^>^ order;
+	Dictionary<String^, double>^ values;
+	HashSet<String^>^ gauges;
+	Object^ lock;
+
+	void add(String^ series, double value);
+	static Family^ family(String^ series);
+	static String^ series(String^ name, String^ labels);
+};
@@ -0,0 +1,532 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "stdafx.h"
+#include "OCSPResponder.h"
+#include "IssuingCA.h"
+#include "Signing.h"
+
+#include <msclr/lock.h>
+#include <msclr/marshal.h>
+
+using namespace msclr::interop;
+using namespace System::Runtime::InteropServices;
+
+OCSPResponder::OCSPResponder(String^ pkiPath, int validHours)
+{
+	this->pkiPath = pkiPath;
+	this->caPath = Path::Combine(pkiPath, "ca.crt");
+	this->keyPath = Path::Combine(pkiPath, "ca.key");
+	this->crlPath = Path::Combine(pkiPath, "crl.crt");
+	this->crlDirPath = Path::Combine(pkiPath, "crl");
+	this->validHours = validHours;
+	this->issuers = gcnew List<Issuer^>();
+	this->issuersLock = gcnew Object();
+	this->signLock = gcnew Object();
+	this->metrics = gcnew Metrics();
+}
+
+OCSPResponder::~OCSPResponder()
+{
+	if (this->watcher != nullptr) {
+		this->watcher->EnableRaisingEvents = false;
+		delete this->watcher;
+	}
+	if (this->renewTimer != nullptr) {
+		delete this->renewTimer;
+	}
+	if (this->metricsTimer != nullptr) {
+		delete this->metricsTimer;
+	}
+	this->!OCSPResponder();
+}
+
+OCSPResponder::!OCSPResponder()
+{
+	for each (Issuer^ issuer in this->issuers) {
+		delete issuer;
+	}
+}
+
+OCSPResponder::Issuer::Issuer()
+{
+	this->cert = NULL;
+	this->key = NULL;
+	this->id = NULL;
+	this->cache = gcnew ConcurrentDictionary<String^, Entry^>();
+}
+
+OCSPResponder::Issuer::~Issuer()
+{
+	this->!Issuer();
+}
+
+OCSPResponder::Issuer::!Issuer()
+{
+	if (this->id != NULL) {
+		OCSP_CERTID_free(this->id);
+		this->id = NULL;
+	}
+	if (this->cert != NULL) {
+		X509_free(this->cert);
+		this->cert = NULL;
+	}
+	if (this->key != NULL) {
+		EVP_PKEY_free(this->key);
+		this->key = NULL;
+	}
+}
+
+int OCSPResponder::Count::get()
+{
+	int count = 0;
+	for each (Issuer^ issuer in signingIssuers()) {
+		count += issuer->cache->Count;
+	}
+	return count;
+}
+
+bool OCSPResponder::Load()
+{
+	// The root key can be offline once intermediates issue the clients, its certificate is still
+	// needed to tell which requests are for the root
+	try {
+		Issuer^ root = loadIssuer(this->caPath, File::Exists(this->keyPath) ? this->keyPath : nullptr);
+		root->crlPath = this->crlPath;
+		this->issuers->Add(root);
+		String^ directory = IssuingCA::Directory(this->pkiPath);
+		if (Directory::Exists(directory)) {
+			for each (String^ certPath in Directory::GetFiles(directory, "*.crt")) {
+				loadIntermediate(Path::GetFileNameWithoutExtension(certPath));
+			}
+		}
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to read issuer off disk. " + e->Message);
+		return false;
+	}
+	if (signingIssuers()->Length == 0) {
+		Console::WriteLine("ERROR: No CA key to sign responses with.");
+		return false;
+	}
+	if (this->issuers[0]->key == NULL)
+		Console::WriteLine("WARNING: {0} is offline, certificates the root CA signed get unauthorized responses.", this->keyPath);
+
+	// Revoked serials first, so certificates that are already revoked are only signed once
+	loadRevoked();
+	for each (String^ certPath in Directory::GetFiles(this->pkiPath, "*.crt")) {
+		if (String::Compare(certPath, this->caPath, true) == 0 || String::Compare(certPath, this->crlPath, true) == 0)
+			continue;
+		if (!addIssued(certPath)) {
+			Console::WriteLine("WARNING: Skipping unreadable certificate {0}", certPath);
+		}
+	}
+	Console::WriteLine("Precomputed {0} OCSP responses for {1} CAs.", this->Count, signingIssuers()->Length);
+	return true;
+}
+
+bool OCSPResponder::Serve(String^ address, int port)
+{
+	HttpListener^ listener = gcnew HttpListener();
+	listener->Prefixes->Add(String::Format("http://{0}:{1}/", address, port));
+	try {
+		listener->Start();
+		listener->TimeoutManager->HeaderWait = TimeSpan::FromSeconds(ClientTimeoutSeconds);
+		listener->TimeoutManager->EntityBody = TimeSpan::FromSeconds(ClientTimeoutSeconds);
+		listener->TimeoutManager->IdleConnection = TimeSpan::FromSeconds(ClientTimeoutSeconds);
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to listen on {0}:{1}. {2}", address, port, e->Message);
+		return false;
+	}
+
+	// Pick up new clients and revocations as they are written, re-signing only what changed
+	this->watcher = gcnew FileSystemWatcher(this->pkiPath);
+	this->watcher->IncludeSubdirectories = true;
+	this->watcher->Created += gcnew FileSystemEventHandler(this, &OCSPResponder::onChanged);
+	this->watcher->Changed += gcnew FileSystemEventHandler(this, &OCSPResponder::onChanged);
+	this->watcher->Renamed += gcnew RenamedEventHandler(this, &OCSPResponder::onRenamed);
+	this->watcher->EnableRaisingEvents = true;
+	this->renewTimer = gcnew Timer(gcnew TimerCallback(this, &OCSPResponder::renewExpiring), nullptr, TimeSpan::FromMinutes(5), TimeSpan::FromMinutes(5));
+	if (!String::IsNullOrEmpty(this->MetricsPath))
+		this->metricsTimer = gcnew Timer(gcnew TimerCallback(this, &OCSPResponder::writeMetrics), nullptr, TimeSpan::FromMinutes(1), TimeSpan::FromMinutes(1));
+
+	Console::WriteLine("OCSP responder listening on http://{0}:{1}/", address, port);
+	while (listener->IsListening) {
+		HttpListenerContext^ context;
+		try {
+			context = listener->GetContext();
+		}
+		catch (HttpListenerException^) {
+			break;
+		}
+		ThreadPool::QueueUserWorkItem(gcnew WaitCallback(this, &OCSPResponder::handle), context);
+	}
+	return true;
+}
+
+array<Byte>^ OCSPResponder::Respond(array<Byte>^ request)
+{
+	if (request == nullptr || request->Length == 0)
+		return statusOnly(OCSP_RESPONSE_STATUS_MALFORMEDREQUEST);
+
+	String^ serial = nullptr;
+	Issuer^ issuer = nullptr;
+	int count;
+	{
+		pin_ptr<Byte> pinned = &request[0];
+		const unsigned char* p = pinned;
+		OCSP_REQUEST* req = d2i_OCSP_REQUEST(NULL, &p, request->Length);
+		if (req == NULL)
+			return statusOnly(OCSP_RESPONSE_STATUS_MALFORMEDREQUEST);
+
+		// Precomputed responses can only cover a single certificate and carry no nonce
+		count = OCSP_request_onereq_count(req);
+		if (count == 1) {
+			OCSP_CERTID* id = OCSP_onereq_get0_id(OCSP_request_onereq_get0(req, 0));
+			ASN1_INTEGER* asnSerial = NULL;
+			for each (Issuer^ candidate in signingIssuers()) {
+				if (OCSP_id_issuer_cmp(candidate->id, id) == 0 && OCSP_id_get0_info(NULL, NULL, NULL, &asnSerial, id)) {
+					issuer = candidate;
+					serial = serialToHex(asnSerial);
+					break;
+				}
+			}
+		}
+		OCSP_REQUEST_free(req);
+	}
+	if (count != 1)
+		return statusOnly(OCSP_RESPONSE_STATUS_MALFORMEDREQUEST);
+
+	Entry^ entry;
+	if (issuer != nullptr && issuer->cache->TryGetValue(serial, entry))
+		return entry->der;
+	return statusOnly(OCSP_RESPONSE_STATUS_UNAUTHORIZED);
+}
+
+OCSPResponder::Issuer^ OCSPResponder::loadIssuer(String^ certPath, String^ keyPath)
+{
+	Issuer^ issuer = gcnew Issuer();
+	try {
+		BIO* bio = readFile(certPath);
+		issuer->cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+		BIO_free(bio);
+		if (keyPath != nullptr) {
+			bio = readFile(keyPath);
+			issuer->key = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+			BIO_free(bio);
+			if (issuer->key == NULL)
+				throw gcnew Exception("Failed to read " + keyPath);
+		}
+		if (issuer->cert == NULL || (issuer->id = OCSP_cert_to_id(EVP_sha1(), NULL, issuer->cert)) == NULL)
+			throw gcnew Exception("Failed to read " + certPath);
+	}
+	catch (Exception^) {
+		delete issuer;
+		throw;
+	}
+	return issuer;
+}
+
+void OCSPResponder::loadIntermediate(String^ name)
+{
+	// The key can be taken offline with the root's, then there's nothing to sign with
+	msclr::lock l(this->issuersLock);
+	for each (Issuer^ existing in this->issuers) {
+		if (String::Compare(existing->name, name, true) == 0)
+			return;
+	}
+	IssuingCA^ intermediate = gcnew IssuingCA(this->pkiPath, name, IssuingCA::IndexOf(this->pkiPath, name), nullptr);
+	Issuer^ issuer = loadIssuer(intermediate->CertPath, File::Exists(intermediate->KeyPath) ? intermediate->KeyPath : nullptr);
+	issuer->name = name;
+	issuer->index = intermediate->Index;
+	issuer->crlPath = intermediate->CRLPath;
+	if (issuer->key == NULL)
+		Console::WriteLine("WARNING: No key for intermediate {0}, certificates it signed get unauthorized responses.", name);
+	this->issuers->Add(issuer);
+}
+
+array<OCSPResponder::Issuer^>^ OCSPResponder::signingIssuers()
+{
+	List<Issuer^>^ result = gcnew List<Issuer^>();
+	msclr::lock l(this->issuersLock);
+	for each (Issuer^ issuer in this->issuers) {
+		if (issuer->key != NULL)
+			result->Add(issuer);
+	}
+	return result->ToArray();
+}
+
+bool OCSPResponder::addIssued(String^ certPath)
+{
+	BIO* bio = readFile(certPath);
+	X509* cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (cert == NULL)
+		return false;
+	Issuer^ issuer = nullptr;
+	for each (Issuer^ candidate in signingIssuers()) {
+		if (X509_check_issued(candidate->cert, cert) == X509_V_OK) {
+			issuer = candidate;
+			break;
+		}
+	}
+	String^ serial = serialToHex(X509_get0_serialNumber(cert));
+	X509_free(cert);
+	// Signed by a CA whose key is offline, nothing to answer with
+	if (issuer == nullptr)
+		return true;
+	return setStatus(issuer, serial, false, DateTime::MinValue);
+}
+
+void OCSPResponder::loadRevoked()
+{
+	for each (Issuer^ issuer in signingIssuers()) {
+		loadCRL(issuer);
+	}
+	if (Directory::Exists(this->crlDirPath)) {
+		for each (String^ entry in Directory::GetFiles(this->crlDirPath)) {
+			revokeDecimal(entry);
+		}
+	}
+}
+
+void OCSPResponder::loadCRL(Issuer^ issuer)
+{
+	if (!File::Exists(issuer->crlPath))
+		return;
+	BIO* bio = readFile(issuer->crlPath);
+	X509_CRL* crl = PEM_read_bio_X509_CRL(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (crl != NULL) {
+		STACK_OF(X509_REVOKED)* revoked = X509_CRL_get_REVOKED(crl);
+		for (int i = 0; i < sk_X509_REVOKED_num(revoked); i++) {
+			X509_REVOKED* entry = sk_X509_REVOKED_value(revoked, i);
+			setStatus(issuer, serialToHex(X509_REVOKED_get0_serialNumber(entry)), true, toDateTime(X509_REVOKED_get0_revocationDate(entry)));
+		}
+		X509_CRL_free(crl);
+	}
+}
+
+void OCSPResponder::revokeDecimal(String^ entryPath)
+{
+	// crl-verify dir entries are named after the decimal serial, and every CA's revocations share
+	// the directory. The serial's block says which CA signed it.
+	marshal_context ctx;
+	BIGNUM* bn = NULL;
+	if (!BN_dec2bn(&bn, ctx.marshal_as<const char*>(Path::GetFileName(entryPath))))
+		return;
+	char* hex = BN_bn2hex(bn);
+	String^ serial = gcnew String(hex);
+	OPENSSL_free(hex);
+	BN_rshift(bn, bn, IssuingCA::SerialBits);
+	BN_ULONG index = BN_get_word(bn);
+	BN_free(bn);
+	for each (Issuer^ issuer in signingIssuers()) {
+		if ((BN_ULONG)issuer->index == index) {
+			setStatus(issuer, serial, true, File::GetCreationTimeUtc(entryPath));
+			return;
+		}
+	}
+}
+
+bool OCSPResponder::setStatus(Issuer^ issuer, String^ serial, bool revoked, DateTime revokedAt)
+{
+	// Revocation is final, and an unchanged status keeps its signed response
+	Entry^ existing;
+	if (issuer->cache->TryGetValue(serial, existing) && (existing->revoked || !revoked))
+		return true;
+
+	DateTime expires;
+	array<Byte>^ der = sign(issuer, serial, revoked, revokedAt, expires);
+	if (der == nullptr)
+		return false;
+	Entry^ entry = gcnew Entry();
+	entry->revoked = revoked;
+	entry->revokedAt = revokedAt;
+	entry->expires = expires;
+	entry->der = der;
+	issuer->cache[serial] = entry;
+	return true;
+}
+
+array<Byte>^ OCSPResponder::sign(Issuer^ issuer, String^ serial, bool revoked, DateTime revokedAt, DateTime% expires)
+{
+	msclr::lock l(this->signLock);
+	marshal_context ctx;
+	BIGNUM* bn = NULL;
+	if (!BN_hex2bn(&bn, ctx.marshal_as<const char*>(serial)))
+		return nullptr;
+	ASN1_INTEGER* asnSerial = BN_to_ASN1_INTEGER(bn, NULL);
+	BN_free(bn);
+	OCSP_CERTID* id = OCSP_cert_id_new(EVP_sha1(), X509_get_subject_name(issuer->cert), X509_get0_pubkey_bitstr(issuer->cert), asnSerial);
+	ASN1_INTEGER_free(asnSerial);
+
+	expires = DateTime::UtcNow.AddHours(this->validHours);
+	ASN1_TIME* thisUpdate = X509_gmtime_adj(NULL, 0);
+	ASN1_TIME* nextUpdate = X509_gmtime_adj(NULL, (long)this->validHours * 3600);
+	ASN1_TIME* revokedTime = NULL;
+	if (revoked) {
+		TimeSpan epoch = revokedAt - DateTime(1970, 1, 1, 0, 0, 0, DateTimeKind::Utc);
+		revokedTime = ASN1_TIME_set(NULL, (time_t)epoch.TotalSeconds);
+	}
+	const EVP_MD* md = SigningDigest(issuer->key);
+
+	array<Byte>^ der = nullptr;
+	OCSP_BASICRESP* basic = OCSP_BASICRESP_new();
+	OCSP_RESPONSE* resp = NULL;
+	if (id != NULL && basic != NULL
+		&& OCSP_basic_add1_status(basic, id, revoked ? V_OCSP_CERTSTATUS_REVOKED : V_OCSP_CERTSTATUS_GOOD, OCSP_REVOKED_STATUS_NOSTATUS, revokedTime, thisUpdate, nextUpdate) != NULL
+		&& OCSP_basic_sign(basic, issuer->cert, issuer->key, md, NULL, OCSP_NOCERTS)
+		&& (resp = OCSP_response_create(OCSP_RESPONSE_STATUS_SUCCESSFUL, basic)) != NULL) {
+		unsigned char* buf = NULL;
+		int len = i2d_OCSP_RESPONSE(resp, &buf);
+		if (len > 0) {
+			der = gcnew array<Byte>(len);
+			Marshal::Copy(IntPtr(buf), der, 0, len);
+		}
+		OPENSSL_free(buf);
+	}
+	OCSP_RESPONSE_free(resp);
+	OCSP_BASICRESP_free(basic);
+	OCSP_CERTID_free(id);
+	ASN1_TIME_free(thisUpdate);
+	ASN1_TIME_free(nextUpdate);
+	ASN1_TIME_free(revokedTime);
+	return der;
+}
+
+void OCSPResponder::renewExpiring(Object^ state)
+{
+	// Re-sign anything past half its validity, off the request path
+	DateTime threshold = DateTime::UtcNow.AddHours(this->validHours / 2.0);
+	for each (Issuer^ issuer in signingIssuers()) {
+		for each (KeyValuePair<String^, Entry^> pair in issuer->cache) {
+			Entry^ old = pair.Value;
+			if (old->expires > threshold)
+				continue;
+			Entry^ entry = gcnew Entry();
+			entry->revoked = old->revoked;
+			entry->revokedAt = old->revokedAt;
+			entry->der = sign(issuer, pair.Key, old->revoked, old->revokedAt, entry->expires);
+			if (entry->der != nullptr)
+				issuer->cache->TryUpdate(pair.Key, entry, old);
+		}
+	}
+}
+
+void OCSPResponder::writeMetrics(Object^ state)
+{
+	this->metrics->Set("openvpn_generate_ocsp_responses", "", this->Count);
+	this->metrics->Set("openvpn_generate_last_run_timestamp_seconds", "", (double)DateTimeOffset::UtcNow.ToUnixTimeSeconds());
+	this->metrics->Write(this->MetricsPath);
+}
+
+void OCSPResponder::onChanged(Object^ sender, FileSystemEventArgs^ e)
+{
+	try {
+		if (String::Compare(Path::GetDirectoryName(e->FullPath), IssuingCA::Directory(this->pkiPath), true) == 0) {
+			// A new intermediate's certificate is written after its serial counter
+			if (File::Exists(Path::ChangeExtension(e->FullPath, ".crt")))
+				loadIntermediate(Path::GetFileNameWithoutExtension(e->FullPath));
+		}
+		for each (Issuer^ issuer in signingIssuers()) {
+			if (String::Compare(e->FullPath, issuer->crlPath, true) == 0) {
+				loadCRL(issuer);
+				return;
+			}
+		}
+		if (String::Compare(Path::GetDirectoryName(e->FullPath), this->crlDirPath, true) == 0) {
+			revokeDecimal(e->FullPath);
+		}
+		else if (String::Compare(Path::GetDirectoryName(e->FullPath), this->pkiPath, true) == 0
+			&& e->FullPath->EndsWith(".crt") && String::Compare(e->FullPath, this->caPath, true) != 0) {
+			// May still be mid-write, the following Changed event will pick it up
+			addIssued(e->FullPath);
+		}
+	}
+	catch (Exception^) {
+		// File still locked by the writer, the next event will retry
+	}
+}
+
+void OCSPResponder::onRenamed(Object^ sender, RenamedEventArgs^ e)
+{
+	// Shared files are written beside themselves and renamed into place
+	onChanged(sender, e);
+}
+
+void OCSPResponder::handle(Object^ state)
+{
+	HttpListenerContext^ context = safe_cast<HttpListenerContext^>(state);
+	HttpListenerRequest^ request = context->Request;
+	array<Byte>^ body = nullptr;
+	try {
+		if (request->HttpMethod == "POST") {
+			MemoryStream^ ms = gcnew MemoryStream();
+			request->InputStream->CopyTo(ms);
+			body = ms->ToArray();
+		}
+		else if (request->HttpMethod == "GET") {
+			// GET carries the url encoded base64 request as the path
+			body = Convert::FromBase64String(Uri::UnescapeDataString(request->RawUrl->Substring(1)));
+		}
+	}
+	catch (Exception^) {
+		body = nullptr;
+	}
+
+	array<Byte>^ response = Respond(body);
+	this->metrics->Add("openvpn_generate_ocsp_requests_total", "");
+	try {
+		context->Response->ContentType = "application/ocsp-response";
+		context->Response->ContentLength64 = response->Length;
+		context->Response->OutputStream->Write(response, 0, response->Length);
+		context->Response->Close();
+	}
+	catch (Exception^) {
+		// Client went away
+	}
+}
+
+array<Byte>^ OCSPResponder::statusOnly(int status)
+{
+	// Error statuses are unsigned, so these are cheap to build on demand
+	OCSP_RESPONSE* resp = OCSP_response_create(status, NULL);
+	unsigned char* buf = NULL;
+	int len = i2d_OCSP_RESPONSE(resp, &buf);
+	array<Byte>^ der = gcnew array<Byte>(len > 0 ? len : 0);
+	if (len > 0)
+		Marshal::Copy(IntPtr(buf), der, 0, len);
+	OPENSSL_free(buf);
+	OCSP_RESPONSE_free(resp);
+	return der;
+}
+
+String^ OCSPResponder::serialToHex(const ASN1_INTEGER* serial)
+{
+	BIGNUM* bn = ASN1_INTEGER_to_BN(serial, NULL);
+	char* hex = BN_bn2hex(bn);
+	String^ result = gcnew String(hex);
+	OPENSSL_free(hex);
+	BN_free(bn);
+	return result;
+}
+
+DateTime OCSPResponder::toDateTime(const ASN1_TIME* time)
+{
+	struct tm tm;
+	if (time == NULL || !ASN1_TIME_to_tm(time, &tm))
+		return DateTime::UtcNow;
+	return DateTime(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, DateTimeKind::Utc);
+}
+
+BIO* OCSPResponder::readFile(String^ path)
+{
+	array<Byte>^ data = File::ReadAllBytes(path);
+	BIO* bio = BIO_new(BIO_s_mem());
+	if (data->Length > 0) {
+		pin_ptr<Byte> p = &data[0];
+		BIO_write(bio, p, data->Length);
+	}
+	return bio;
+}
@@ -0,0 +1,108 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include "Metrics.h"
+
+#include <openssl/ocsp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+using namespace System;
+using namespace System::Collections::Concurrent;
+using namespace System::Collections::Generic;
+using namespace System::IO;
+using namespace System::Net;
+using namespace System::Threading;
+
+// Minimal OCSP responder (RFC 5019 profile). Every issued or revoked serial has a signed
+// response built ahead of time, so answering a request is a dictionary lookup with no signing. Answers
+// for the root CA and every intermediate in pki/issuers whose key is present, each from its own CRL.
+ref class OCSPResponder
+{
+public:
+	OCSPResponder(String^ pkiPath, int validHours);
+	~OCSPResponder();
+	!OCSPResponder();
+
+	bool Load();
+	bool Serve(String^ address, int port);
+	array<Byte>^ Respond(array<Byte>^ request);
+
+	property int Count {
+		int get();
+	}
+	// Prometheus textfile rewritten every minute, nothing is written when empty
+	property String^ MetricsPath;
+
+private:
+	ref class Entry
+	{
+	public:
+		bool revoked;
+		DateTime revokedAt;
+		DateTime expires;
+		array<Byte>^ der;
+	};
+
+	// The root or an intermediate, each with its own CRL and its own responses
+	ref class Issuer
+	{
+	public:
+		Issuer();
+		~Issuer();
+		!Issuer();
+
+		// Null for the root
+		String^ name;
+		// Block its serials come from, see IssuingCA::SerialBits
+		int index;
+		String^ crlPath;
+		X509* cert;
+		// NULL when the key is offline, nothing it signed gets a response
+		EVP_PKEY* key;
+		OCSP_CERTID* id;
+		// Keyed by upper case hex serial
+		ConcurrentDictionary<String^, Entry^>^ cache;
+	};
+
+	String^ pkiPath;
+	String^ caPath;
+	String^ keyPath;
+	String^ crlPath;
+	String^ crlDirPath;
+	int validHours;
+
+	// Root first. Only ever added to, under issuersLock.
+	List<Issuer^>^ issuers;
+	Object^ issuersLock;
+	FileSystemWatcher^ watcher;
+	Timer^ renewTimer;
+	Timer^ metricsTimer;
+	Metrics^ metrics;
+	Object^ signLock;
+
+	// Each request is answered on the thread pool, and http.sys drops a client that takes longer
+	// than this to send its request, so one that connects and goes quiet only holds up itself
+	static const int ClientTimeoutSeconds = 5;
+
+	Issuer^ loadIssuer(String^ certPath, String^ keyPath);
+	void loadIntermediate(String^ name);
+	array<Issuer^>^ signingIssuers();
+	bool addIssued(String^ certPath);
+	void loadRevoked();
+	void loadCRL(Issuer^ issuer);
+	void revokeDecimal(String^ entryPath);
+	bool setStatus(Issuer^ issuer, String^ serial, bool revoked, DateTime revokedAt);
+	array<Byte>^ sign(Issuer^ issuer, String^ serial, bool revoked, DateTime revokedAt, DateTime% expires);
+	void renewExpiring(Object^ state);
+	void writeMetrics(Object^ state);
+	void onChanged(Object^ sender, FileSystemEventArgs^ e);
+	void onRenamed(Object^ sender, RenamedEventArgs^ e);
+	void handle(Object^ state);
+
+	static array<Byte>^ statusOnly(int status);
+	static String^ serialToHex(const ASN1_INTEGER* serial);
+	static DateTime toDateTime(const ASN1_TIME* time);
+	static BIO* readFile(String^ path);
+};
@@ -5,13 +5,47 @@
 #include "stdafx.h"
 
 #include <iostream>
+#include "Auditor.h"
 #include "CLI.h"
+#include "HandshakeBench.h"
 #include "Interactive.h"
+#include "OCSPResponder.h"
+#include "RouteAggregator.h"
+#include "StressHarness.h"
 
 using namespace std;
 using namespace System;
 using namespace System::IO;
 
+static bool openOutput(Interactive^ interactive, Dictionary<CLI::OptionType, String^>^ options)
+{
+	String^ spec;
+	if (!options->TryGetValue(CLI::OptionType::Output, spec))
+		return true;
+	try {
+		interactive->Output = OutputSink::Create(spec);
+	}
+	catch (Exception^ e) {
+		Console::WriteLine(e->Message);
+		return false;
+	}
+	return true;
+}
+
+static bool closeOutput(Interactive^ interactive)
+{
+	if (interactive->Output == nullptr)
+		return true;
+	try {
+		interactive->Output->Close();
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to finish output. {0}", e->Message);
+		return false;
+	}
+	return true;
+}
+
 int main(int argc, char *argv[], char *envp[])
 {
 	CLI^ cli = gcnew CLI();
@@ -40,6 +74,11 @@ int main(int argc, char *argv[], char *envp[])
 	for (int i = 2; i < argc; i++) {
 		String^ opStr = gcnew String(argv[i]);
 		CLI::OptionType op = cli->getOption(opStr);
+		if (op == CLI::OptionType::DCO || op == CLI::OptionType::CompactCerts || op == CLI::OptionType::Force) {
+			// A switch, no argument follows
+			options[op] = "";
+			continue;
+		}
 		i++;
 		if (op == CLI::OptionType::Unknown) {
 			Console::WriteLine("Unknown Option. Exiting");
@@ -80,6 +119,18 @@ int main(int argc, char *argv[], char *envp[])
 		System::Environment::Exit(1);
 	}
 
+	String^ metricsPath;
+	if (!options->TryGetValue(CLI::OptionType::Metrics, metricsPath))
+		metricsPath = nullptr;
+	int metricsDays = 30;
+	String^ sMetricsDays;
+	if (options->TryGetValue(CLI::OptionType::MetricsDays, sMetricsDays)) {
+		if (!int::TryParse(sMetricsDays, metricsDays) || metricsDays < 0) {
+			Console::WriteLine("Metrics days is not valid");
+			Environment::Exit(1);
+		}
+	}
+
 	//Init SSL
 	OpenSSLHelper::OpenSSL_INIT();
 
@@ -108,6 +159,8 @@ int main(int argc, char *argv[], char *envp[])
 		else {
 			validDays = 3650;
 		}
+		// Compact certificates want the shortest keys and signatures, Ed25519 unless asked otherwise
+		bool compact = options->ContainsKey(CLI::OptionType::CompactCerts);
 		String^ alg;
 		OpenSSLHelper::Algorithm algorithm;
 		if (options->TryGetValue(CLI::OptionType::Algorithm, alg)) {
@@ -119,9 +172,11 @@ int main(int argc, char *argv[], char *envp[])
 				Console::WriteLine(e->Message);
 				Environment::Exit(1);
 			}
+			if (compact && algorithm == OpenSSLHelper::Algorithm::RSA)
+				Console::WriteLine("WARNING: RSA keys and signatures are several times the size of ECDSA or EdDSA ones, --compact-certs can only trim the rest of the certificate.");
 		}
 		else {
-			algorithm = OpenSSLHelper::Algorithm::RSA;
+			algorithm = compact ? OpenSSLHelper::Algorithm::EdDSA : OpenSSLHelper::Algorithm::RSA;
 		}
 		String^ ecCurve;
 		if (!options->TryGetValue(CLI::OptionType::Curve, ecCurve)) {
@@ -133,8 +188,154 @@ int main(int argc, char *argv[], char *envp[])
 		String^ suffix;
 		if (!options->TryGetValue(CLI::OptionType::Suffix, suffix))
 			suffix = nullptr;
+		bool crlDir = false;
+		String^ crlMode;
+		if (options->TryGetValue(CLI::OptionType::CRLMode, crlMode)) {
+			crlMode = crlMode->ToLower();
+			if (crlMode == "dir") {
+				crlDir = true;
+			}
+			else if (crlMode != "file") {
+				Console::WriteLine("Unknown CRL Mode: " + crlMode);
+				Environment::Exit(1);
+			}
+		}
+
+		String^ tc;
+		TLSCrypt::Mode tlsCrypt;
+		if (options->TryGetValue(CLI::OptionType::TLSCrypt, tc)) {
+			try {
+				tlsCrypt = cli->getTLSCryptMode(tc->ToLower());
+			}
+			catch (Exception ^ e) {
+				Console::WriteLine(e->Message);
+				Environment::Exit(1);
+			}
+		}
+		else {
+			tlsCrypt = TLSCrypt::Mode::V1;
+		}
+
+		String^ sProfile;
+		Tuning::Profile profile = Tuning::Profile::None;
+		if (options->TryGetValue(CLI::OptionType::Profile, sProfile)) {
+			try {
+				profile = cli->getTuningProfile(sProfile->ToLower());
+			}
+			catch (Exception ^ e) {
+				Console::WriteLine(e->Message);
+				Environment::Exit(1);
+			}
+		}
+
+		String^ subnet;
+		if (options->TryGetValue(CLI::OptionType::Subnet, subnet)) {
+			UInt32 network;
+			int prefixLength;
+			if (!AddressPool::TryParseSubnet(subnet, network, prefixLength)) {
+				Console::WriteLine("Subnet is not valid, expected a network between /8 and /29 such as 10.8.0.0/24");
+				Environment::Exit(1);
+			}
+		}
+		String^ sClients;
+		if (options->TryGetValue(CLI::OptionType::Clients, sClients)) {
+			int clients;
+			if (!int::TryParse(sClients, clients) || clients <= 0) {
+				Console::WriteLine("Clients is not valid");
+				Environment::Exit(1);
+			}
+			int prefixLength = AddressPool::PrefixForClients(clients);
+			if ((1LL << (32 - prefixLength)) - 3 < clients) {
+				Console::WriteLine("Clients is not valid, a single server can address at most {0} clients", (1LL << 24) - 3);
+				Environment::Exit(1);
+			}
+			if (subnet == nullptr) {
+				// Start from the default network, masked down to the wider prefix
+				UInt32 network;
+				AddressPool::TryParse("10.8.0.0", network);
+				network &= 0xFFFFFFFFu << (32 - prefixLength);
+				subnet = String::Format("{0}/{1}", AddressPool::ToString(network), prefixLength);
+			}
+			else if (Int32::Parse(subnet->Split('/')[1]) > prefixLength) {
+				Console::WriteLine("Subnet {0} is too small for {1} clients", subnet, clients);
+				Environment::Exit(1);
+			}
+		}
+
+		int workers = 1;
+		String^ sWorkers;
+		if (options->TryGetValue(CLI::OptionType::Workers, sWorkers)) {
+			if (!int::TryParse(sWorkers, workers) || workers < 1 || workers > 64) {
+				Console::WriteLine("Workers is not valid, expected 1 to 64");
+				Environment::Exit(1);
+			}
+			// Worker subnets follow on from the first, they all have to fit in the address space
+			UInt32 network;
+			int prefixLength;
+			AddressPool::TryParseSubnet(subnet != nullptr ? subnet : "10.8.0.0/24", network, prefixLength);
+			if ((UInt64)network + ((UInt64)workers << (32 - prefixLength)) > 0x100000000ull) {
+				Console::WriteLine("Subnet is too large for {0} workers", workers);
+				Environment::Exit(1);
+			}
+		}
+
+		bool dco = options->ContainsKey(CLI::OptionType::DCO);
+		if (dco) {
+			// None of these turn offload off, but they don't do what they would without it
+			if (profile != Tuning::Profile::None)
+				Console::WriteLine("WARNING: Offloaded traffic bypasses the socket buffer and queue settings of --profile, only its ciphers and MTU apply.");
+			if (workers > 1)
+				Console::WriteLine("WARNING: The kernel already spreads offloaded traffic across cores, --workers is unlikely to help with --dco.");
+		}
+
+		int serverPrimes = 2;
+		String^ sServerPrimes;
+		if (options->TryGetValue(CLI::OptionType::ServerRSAPrimes, sServerPrimes)) {
+			if (!int::TryParse(sServerPrimes, serverPrimes) || serverPrimes < 2 || serverPrimes > 4) {
+				Console::WriteLine("Server RSA primes is not valid, expected 2 to 4");
+				Environment::Exit(1);
+			}
+			if (algorithm != OpenSSLHelper::Algorithm::RSA) {
+				Console::WriteLine("Server RSA primes only applies to --algorithm rsa");
+				Environment::Exit(1);
+			}
+			// The same limits OpenSSL applies, each prime has to stay large enough to be safe
+			if ((serverPrimes == 3 && keySize < 1024) || (serverPrimes == 4 && keySize < 4096)) {
+				Console::WriteLine("Key Size {0} is too small for {1} primes", keySize, serverPrimes);
+				Environment::Exit(1);
+			}
+		}
+
+		String^ routesFile;
+		List<String^>^ routes = nullptr;
+		if (options->TryGetValue(CLI::OptionType::Routes, routesFile)) {
+			int count = 0;
+			try {
+				routes = RouteAggregator::Load(routesFile, count);
+			}
+			catch (Exception^ e) {
+				Console::WriteLine("ERROR: Failed to load routes from {0}. {1}", routesFile, e->Message);
+				Environment::Exit(1);
+			}
+			Console::WriteLine("Aggregated {0} routes into {1}.", count, routes->Count);
+		}
 
 		Interactive^ interactive = gcnew Interactive(path, algorithm, keySize, ecCurve, validDays, suffix);
+		// Before the questions, a tar stream moves everything else printed to stderr
+		if (!openOutput(interactive, options))
+			Environment::Exit(1);
+		interactive->UseCRLDir = crlDir;
+		interactive->TLSCryptMode = tlsCrypt;
+		interactive->Routes = routes;
+		if (subnet != nullptr)
+			interactive->Subnet = subnet;
+		interactive->Workers = workers;
+		interactive->TuningProfile = profile;
+		interactive->DCO = dco;
+		interactive->ServerRSAPrimes = serverPrimes;
+		interactive->CompactCerts = compact;
+		interactive->MetricsPath = metricsPath;
+		interactive->MetricsExpiryDays = metricsDays;
 		if (!interactive->GenerateNewConfig())
 			Environment::Exit(1);
 		Console::WriteLine();
@@ -147,10 +348,13 @@ int main(int argc, char *argv[], char *envp[])
 			if (!interactive->CreateDH())
 				Environment::Exit(1);
 		}
-		if (!interactive->CreateServerConfig())
+		if (!interactive->CreateTLSCryptKey())
+			Environment::Exit(1);
+		if (!interactive->CreateServerConfig() || !closeOutput(interactive))
 			Environment::Exit(1);
 		if (!interactive->SaveConfig())
 			Environment::Exit(1);
+		interactive->WriteMetrics();
 
 		Console::WriteLine("Successfully initialised config.");
 		Environment::Exit(0);
@@ -159,18 +363,60 @@ int main(int argc, char *argv[], char *envp[])
 		Interactive^ interactive = gcnew Interactive(path, OpenSSLHelper::Algorithm::RSA, 2048, nullptr, 3650, nullptr);
 		if (!interactive->LoadConfig())
 			Environment::Exit(1);
+		interactive->MetricsPath = metricsPath;
+		interactive->MetricsExpiryDays = metricsDays;
+		String^ issuer;
+		if (options->TryGetValue(CLI::OptionType::Issuer, issuer))
+			interactive->IssuerName = issuer;
+		if (!openOutput(interactive, options))
+			Environment::Exit(1);
+
+		String^ batch;
+		if (options->TryGetValue(CLI::OptionType::Batch, batch)) {
+			// Names are streamed from the file rather than read in up front
+			bool created = false;
+			try {
+				created = interactive->CreateNewClientConfigs(File::ReadLines(batch));
+			}
+			catch (Exception^ e) {
+				// Clients issued before the read failed still need their serials saved below
+				Console::WriteLine("ERROR: Failed to read {0}. {1}", batch, e->Message);
+				created = false;
+			}
+			// Closed either way so the stream ends cleanly with whatever was sent
+			created = closeOutput(interactive) && created;
+			// Whatever was issued before a failure still counts
+			interactive->WriteMetrics();
+			// Save the serial even on partial failure so issued serials are never reused
+			if (!interactive->SaveConfig() || !created)
+				Environment::Exit(1);
+		}
+		else {
+			String^ name;
+			if (!options->TryGetValue(CLI::OptionType::CommonName, name)) {
+				name = nullptr;
+			}
 
+			bool created = interactive->CreateNewClientConfig(name);
+			created = closeOutput(interactive) && created;
+			interactive->WriteMetrics();
+			if (!created || !interactive->SaveConfig())
+				Environment::Exit(1);
+		}
+
+		Console::WriteLine("Successfully created new client.");
+		Environment::Exit(0);
+	}
+	else if (mode == CLI::Mode::CreateIssuer) {
+		Interactive^ interactive = gcnew Interactive(path, OpenSSLHelper::Algorithm::RSA, 2048, nullptr, 3650, nullptr);
+		if (!interactive->LoadConfig())
+			Environment::Exit(1);
 		String^ name;
 		if (!options->TryGetValue(CLI::OptionType::CommonName, name)) {
 			name = nullptr;
 		}
-
-		if (!interactive->CreateNewClientConfig(name))
-			Environment::Exit(1);
-		if (!interactive->SaveConfig())
+		if (!interactive->CreateIssuingCA(name) || !interactive->SaveConfig())
 			Environment::Exit(1);
-
-		Console::WriteLine("Successfully created new client.");
 		Environment::Exit(0);
 	}
 	else if (mode == CLI::Mode::Revoke) {
@@ -181,9 +427,149 @@ int main(int argc, char *argv[], char *envp[])
 		if (!options->TryGetValue(CLI::OptionType::CommonName, name)) {
 			name = nullptr;
 		}
-		if (!interactive->RevokeCert(name))
+		interactive->MetricsPath = metricsPath;
+		interactive->MetricsExpiryDays = metricsDays;
+		bool revoked = interactive->RevokeCert(name);
+		interactive->WriteMetrics();
+		if (!revoked)
+			Environment::Exit(1);
+
+		Environment::Exit(0);
+	}
+	else if (mode == CLI::Mode::Reconcile) {
+		String^ roster;
+		if (!options->TryGetValue(CLI::OptionType::Roster, roster)) {
+			Console::WriteLine("Roster is required");
+			Environment::Exit(1);
+		}
+		Interactive^ interactive = gcnew Interactive(path, OpenSSLHelper::Algorithm::RSA, 2048, nullptr, 3650, nullptr);
+		if (!interactive->LoadConfig())
+			Environment::Exit(1);
+		interactive->MetricsPath = metricsPath;
+		interactive->MetricsExpiryDays = metricsDays;
+		String^ issuer;
+		if (options->TryGetValue(CLI::OptionType::Issuer, issuer))
+			interactive->IssuerName = issuer;
+		interactive->ForceRevoke = options->ContainsKey(CLI::OptionType::Force);
+		if (!openOutput(interactive, options))
 			Environment::Exit(1);
+		bool reconciled = false;
+		try {
+			reconciled = interactive->Reconcile(File::ReadLines(roster));
+		}
+		catch (IOException^ e) {
+			Console::WriteLine("ERROR: Failed to read {0}. {1}", roster, e->Message);
+		}
+		reconciled = closeOutput(interactive) && reconciled;
+		interactive->WriteMetrics();
+		// Saved even on partial failure so issued serials are never reused
+		if (!interactive->SaveConfig() || !reconciled)
+			Environment::Exit(1);
+		Environment::Exit(0);
+	}
+	else if (mode == CLI::Mode::OCSPServe) {
+		Interactive^ interactive = gcnew Interactive(path, OpenSSLHelper::Algorithm::RSA, 2048, nullptr, 3650, nullptr);
+		if (!interactive->LoadConfig())
+			Environment::Exit(1);
+
+		int port;
+		String^ sPort;
+		if (options->TryGetValue(CLI::OptionType::Port, sPort)) {
+			if (!int::TryParse(sPort, port) || port <= 0 || port >= 65535) {
+				Console::WriteLine("Port is not valid");
+				Environment::Exit(1);
+			}
+		}
+		else {
+			port = 8888;
+		}
+		String^ bind;
+		if (!options->TryGetValue(CLI::OptionType::Bind, bind))
+			bind = "127.0.0.1";
 
+		// Responses are valid for a day and re-signed in the background well before then
+		OCSPResponder^ responder = gcnew OCSPResponder(Path::Combine(path, "pki"), 24);
+		responder->MetricsPath = metricsPath;
+		if (!responder->Load())
+			Environment::Exit(1);
+		if (!responder->Serve(bind, port))
+			Environment::Exit(1);
+		Environment::Exit(0);
+	}
+	else if (mode == CLI::Mode::Regenerate) {
+		Interactive^ interactive = gcnew Interactive(path, OpenSSLHelper::Algorithm::RSA, 2048, nullptr, 3650, nullptr);
+		if (!interactive->LoadConfig())
+			Environment::Exit(1);
+		interactive->MetricsPath = metricsPath;
+		interactive->MetricsExpiryDays = metricsDays;
+		if (!openOutput(interactive, options))
+			Environment::Exit(1);
+		bool regenerated = interactive->Regenerate();
+		regenerated = closeOutput(interactive) && regenerated;
+		interactive->WriteMetrics();
+		if (!interactive->SaveConfig() || !regenerated)
+			Environment::Exit(1);
+		Environment::Exit(0);
+	}
+	else if (mode == CLI::Mode::Verify) {
+		Auditor^ auditor = gcnew Auditor(path);
+		String^ output;
+		auditor->RequireBundles = !options->TryGetValue(CLI::OptionType::Output, output) || output == "dir";
+		if (!auditor->Load())
+			Environment::Exit(1);
+		// The report is all that goes to stdout, so it can be piped straight into other tools
+		if (!auditor->Run(Console::Out))
+			Environment::Exit(1);
+		Environment::Exit(0);
+	}
+	else if (mode == CLI::Mode::Stress) {
+		int jobs = 8;
+		int operations = 64;
+		String^ sJobs;
+		if (options->TryGetValue(CLI::OptionType::Jobs, sJobs)) {
+			if (!int::TryParse(sJobs, jobs) || jobs < 1) {
+				Console::WriteLine("Jobs is not valid");
+				Environment::Exit(1);
+			}
+		}
+		String^ sOperations;
+		if (options->TryGetValue(CLI::OptionType::Operations, sOperations)) {
+			if (!int::TryParse(sOperations, operations) || operations < 1) {
+				Console::WriteLine("Operations is not valid");
+				Environment::Exit(1);
+			}
+		}
+		StressHarness^ harness = gcnew StressHarness(path);
+		if (!harness->Run(jobs, operations))
+			Environment::Exit(1);
+		Environment::Exit(0);
+	}
+	else if (mode == CLI::Mode::BenchHandshake) {
+		int seconds = 3;
+		String^ sSeconds;
+		if (options->TryGetValue(CLI::OptionType::Seconds, sSeconds)) {
+			if (!int::TryParse(sSeconds, seconds) || seconds < 1) {
+				Console::WriteLine("Seconds is not valid");
+				Environment::Exit(1);
+			}
+		}
+		String^ name;
+		options->TryGetValue(CLI::OptionType::CommonName, name);
+		HandshakeBench^ bench = gcnew HandshakeBench(path);
+		String^ sComparePrimes;
+		if (options->TryGetValue(CLI::OptionType::ServerRSAPrimes, sComparePrimes)) {
+			int comparePrimes;
+			if (!int::TryParse(sComparePrimes, comparePrimes) || comparePrimes < 2 || comparePrimes > 4) {
+				Console::WriteLine("Server RSA primes is not valid, expected 2 to 4");
+				Environment::Exit(1);
+			}
+			bench->ComparePrimes = comparePrimes;
+		}
+		if (!bench->Load(name))
+			Environment::Exit(1);
+		// One thread per core, each playing both ends of its handshakes
+		if (!bench->Run(Environment::ProcessorCount, seconds))
+			Environment::Exit(1);
 		Environment::Exit(0);
 	}
 	else if (mode == CLI::Mode::ShowCurves) {
@@ -0,0 +1,77 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "stdafx.h"
+#include "OutputSink.h"
+
+#include <msclr/lock.h>
+
+using namespace System::Diagnostics;
+
+OutputSink^ OutputSink::Create(String^ spec)
+{
+	if (spec == "dir")
+		return nullptr;
+	if (spec == "tar")
+		return gcnew TarOutputSink();
+	if (spec->StartsWith("exec:") && spec->Length > 5)
+		return gcnew ExecOutputSink(spec->Substring(5));
+	throw gcnew ArgumentException("Output must be dir, tar or exec:COMMAND");
+}
+
+TarOutputSink::TarOutputSink()
+{
+	Console::Out->Flush();
+	Stream^ stdout = Console::OpenStandardOutput();
+	Console::SetOut(Console::Error);
+	this->tar = gcnew TarOutputStream(stdout);
+	this->lock = gcnew Object();
+}
+
+void TarOutputSink::Write(String^ name, array<Byte>^ data, int mode)
+{
+	msclr::lock l(this->lock);
+	TarEntry^ entry = TarEntry::CreateTarEntry(name);
+	entry->Size = data->Length;
+	entry->TarHeader->Mode = mode;
+	this->tar->PutNextEntry(entry);
+	this->tar->Write(data, 0, data->Length);
+	this->tar->CloseEntry();
+}
+
+void TarOutputSink::Close()
+{
+	msclr::lock l(this->lock);
+	this->tar->Close();
+}
+
+ExecOutputSink::ExecOutputSink(String^ command)
+{
+	this->command = command;
+}
+
+void ExecOutputSink::Write(String^ name, array<Byte>^ data, int mode)
+{
+	ProcessStartInfo^ info = gcnew ProcessStartInfo("cmd.exe", "/c " + this->command);
+	info->UseShellExecute = false;
+	info->RedirectStandardInput = true;
+	info->EnvironmentVariables["OPENVPN_GENERATE_ARTIFACT"] = name;
+	info->EnvironmentVariables["OPENVPN_GENERATE_MODE"] = Convert::ToString(mode, 8)->PadLeft(4, '0');
+	Process^ process = Process::Start(info);
+	bool complete = true;
+	try {
+		Stream^ input = process->StandardInput->BaseStream;
+		input->Write(data, 0, data->Length);
+		input->Close();
+	}
+	catch (IOException^) {
+		// A command that exits without reading its input fails the artifact, not the process
+		complete = false;
+	}
+	process->WaitForExit();
+	int exitCode = process->ExitCode;
+	delete process;
+	if (exitCode != 0)
+		throw gcnew IOException("Output command failed for " + name);
+	if (!complete)
+		throw gcnew IOException("Output command didn't read all of " + name);
+}
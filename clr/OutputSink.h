@@ -0,0 +1,56 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+using namespace System;
+using namespace System::IO;
+using namespace ICSharpCode::SharpZipLib::Tar;
+
+// Where generated server files and client bundles go when they shouldn't be left in the config
+// directory. Artifacts are named relative to it, like server/server.conf or clients/name.visz.
+// pki stays on disk either way, it's the CA's state.
+ref class OutputSink abstract
+{
+public:
+	// tar streams a tar archive to stdout, exec:COMMAND runs COMMAND through the shell once per
+	// artifact with its contents on stdin. dir, the config directory, is returned as nullptr.
+	// Throws on anything else.
+	static OutputSink^ Create(String^ spec);
+
+	// Hands one artifact on. Safe to call from several writers. Throws.
+	virtual void Write(String^ name, array<Byte>^ data, int mode) = 0;
+	// Finishes the output once everything has been written
+	virtual void Close() {}
+	// Where the artifacts went, for messages
+	virtual String^ Describe() = 0;
+};
+
+// Tar archive on stdout. Everything else printed goes to stderr instead, so the stream can be
+// piped straight into tar or an uploader.
+ref class TarOutputSink : OutputSink
+{
+public:
+	TarOutputSink();
+
+	virtual void Write(String^ name, array<Byte>^ data, int mode) override;
+	virtual void Close() override;
+	virtual String^ Describe() override { return "stdout"; }
+
+private:
+	TarOutputStream^ tar;
+	Object^ lock;
+};
+
+// Runs a command per artifact with the contents on stdin and the artifact's name and mode in
+// OPENVPN_GENERATE_ARTIFACT and OPENVPN_GENERATE_MODE
+ref class ExecOutputSink : OutputSink
+{
+public:
+	ExecOutputSink(String^ command);
+
+	virtual void Write(String^ name, array<Byte>^ data, int mode) override;
+	virtual String^ Describe() override { return "\"" + this->command + "\""; }
+
+private:
+	String^ command;
+};
@@ -0,0 +1,110 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "stdafx.h"
+#include "RegenerationCache.h"
+#include "DirectoryLock.h"
+
+using namespace System::Collections::Generic;
+using namespace System::IO;
+using namespace System::Security::Cryptography;
+using namespace System::Text;
+using namespace Newtonsoft::Json;
+
+RegenerationCache::RegenerationCache(String^ root, String^ path)
+{
+	this->root = root;
+	this->path = path;
+	this->entries = gcnew ConcurrentDictionary<String^, String^>();
+	this->changes = gcnew ConcurrentDictionary<String^, String^>();
+}
+
+void RegenerationCache::read(ConcurrentDictionary<String^, String^>^ entries)
+{
+	entries->Clear();
+	if (!File::Exists(this->path))
+		return;
+	try {
+		Dictionary<String^, String^>^ dict = JsonConvert::DeserializeObject<Dictionary<String^, String^>^>(File::ReadAllText(this->path));
+		for each (KeyValuePair<String^, String^> entry in dict)
+			entries[entry.Key] = entry.Value;
+	}
+	catch (Exception^ e) {
+		// Losing the cache only costs a full rebuild
+		Console::WriteLine("WARNING: Ignoring unreadable regeneration cache. {0}", e->Message);
+		entries->Clear();
+	}
+}
+
+bool RegenerationCache::Load()
+{
+	read(this->entries);
+	this->changes->Clear();
+	return true;
+}
+
+bool RegenerationCache::Save()
+{
+	read(this->entries);
+	for each (KeyValuePair<String^, String^> change in this->changes) {
+		String^ removed;
+		if (change.Value == nullptr)
+			this->entries->TryRemove(change.Key, removed);
+		else
+			this->entries[change.Key] = change.Value;
+	}
+	// Sorted so the file diffs cleanly between runs
+	SortedDictionary<String^, String^>^ sorted = gcnew SortedDictionary<String^, String^>(this->entries, StringComparer::Ordinal);
+	try {
+		Directory::CreateDirectory(Path::GetDirectoryName(this->path));
+		DirectoryLock::WriteFile(this->path, JsonConvert::SerializeObject(sorted));
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to write regeneration cache. {0}", e->Message);
+		return false;
+	}
+	this->changes->Clear();
+	return true;
+}
+
+bool RegenerationCache::Fresh(String^ artifact, String^ key)
+{
+	String^ recorded;
+	if (!this->entries->TryGetValue(artifact, recorded) || recorded != key)
+		return false;
+	// Deleted by hand or by a revoke since, it has to be written again
+	return File::Exists(Path::Combine(this->root, artifact));
+}
+
+void RegenerationCache::Record(String^ artifact, String^ key)
+{
+	this->entries[artifact] = key;
+	this->changes[artifact] = key;
+}
+
+void RegenerationCache::Forget(String^ artifact)
+{
+	String^ removed;
+	this->entries->TryRemove(artifact, removed);
+	this->changes[artifact] = nullptr;
+}
+
+String^ RegenerationCache::Key(... array<array<Byte>^>^ inputs)
+{
+	SHA256^ sha = SHA256::Create();
+	try {
+		for each (array<Byte>^ input in inputs) {
+			// Little endian on every platform .NET runs this on, matching the native build
+			array<Byte>^ length = BitConverter::GetBytes((UInt64)input->Length);
+			sha->TransformBlock(length, 0, length->Length, nullptr, 0);
+			sha->TransformBlock(input, 0, input->Length, nullptr, 0);
+		}
+		sha->TransformFinalBlock(gcnew array<Byte>(0), 0, 0);
+		StringBuilder^ sb = gcnew StringBuilder();
+		for each (Byte b in sha->Hash)
+			sb->Append(b.ToString("x2"));
+		return sb->ToString();
+	}
+	finally {
+		delete sha;
+	}
+}
@@ -0,0 +1,37 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+using namespace System;
+using namespace System::Collections::Concurrent;
+
+// Remembers the hash of the inputs each generated file was last written from, so regenerating
+// only rewrites the files whose inputs changed. Artifacts are paths relative to the config
+// directory.
+ref class RegenerationCache
+{
+public:
+	RegenerationCache(String^ root, String^ path);
+
+	bool Load();
+	// Applies the entries recorded or forgotten since Load on top of what's on disk now, so
+	// processes sharing the directory don't drop each other's entries. Call with the directory
+	// lock held.
+	bool Save();
+	// True when the artifact is still on disk and was last written from inputs with this key
+	bool Fresh(String^ artifact, String^ key);
+	void Record(String^ artifact, String^ key);
+	void Forget(String^ artifact);
+
+	// SHA-256 over the inputs, each length prefixed so moving bytes between inputs changes the key
+	static String^ Key(... array<array<Byte>^>^ inputs);
+
+private:
+	String^ root;
+	String^ path;
+	ConcurrentDictionary<String^, String^>^ entries;
+	// Changed since Load, a null key marks a forgotten artifact
+	ConcurrentDictionary<String^, String^>^ changes;
+
+	void read(ConcurrentDictionary<String^, String^>^ entries);
+};
@@ -0,0 +1,166 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "stdafx.h"
+#include "RouteAggregator.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+// Inclusive [first, last] address ranges, 64 bit so last + 1 never wraps
+typedef std::vector<std::pair<unsigned long long, unsigned long long>> RangeList;
+
+// Merges overlapping and adjacent ranges, then splits each into the fewest aligned blocks.
+// Output is (network, prefix length) pairs in address order.
+static std::vector<std::pair<unsigned long long, int>> collapse(RangeList& ranges)
+{
+	std::vector<std::pair<unsigned long long, int>> blocks;
+	if (ranges.empty())
+		return blocks;
+
+	std::sort(ranges.begin(), ranges.end());
+	RangeList merged;
+	merged.push_back(ranges[0]);
+	for (size_t i = 1; i < ranges.size(); i++) {
+		if (ranges[i].first <= merged.back().second + 1)
+			merged.back().second = std::max(merged.back().second, ranges[i].second);
+		else
+			merged.push_back(ranges[i]);
+	}
+
+	for (const auto& range : merged) {
+		unsigned long long first = range.first;
+		while (first <= range.second) {
+			// Grow the block while it stays aligned and inside the range
+			int length = 32;
+			while (length > 0) {
+				unsigned long long size = 1ULL << (33 - length);
+				if ((first & (size - 1)) != 0 || first + size - 1 > range.second)
+					break;
+				length--;
+			}
+			blocks.push_back(std::make_pair(first, length));
+			first += 1ULL << (32 - length);
+		}
+	}
+	return blocks;
+}
+
+List<String^>^ RouteAggregator::Load(String^ path, int% count)
+{
+	List<String^>^ prefixes = gcnew List<String^>();
+	int lineNumber = 0;
+	for each (String^ raw in File::ReadLines(path)) {
+		lineNumber++;
+		String^ line = raw;
+		int comment = line->IndexOf('#');
+		if (comment >= 0)
+			line = line->Substring(0, comment);
+		line = line->Trim();
+		if (line->Length == 0)
+			continue;
+
+		UInt32 network;
+		int length;
+		bool ipv6;
+		if (!parse(line, network, length, ipv6)) {
+			if (ipv6) {
+				// The server only has an IPv4 tunnel network to route over
+				Console::WriteLine("WARNING: Skipping IPv6 route on line {0}: {1}", lineNumber, line);
+				continue;
+			}
+			throw gcnew Exception(String::Format("Invalid route on line {0}: {1}", lineNumber, line));
+		}
+		prefixes->Add(line);
+	}
+	count = prefixes->Count;
+	return Aggregate(prefixes);
+}
+
+List<String^>^ RouteAggregator::Aggregate(IEnumerable<String^>^ prefixes)
+{
+	RangeList ranges;
+	for each (String^ prefix in prefixes) {
+		UInt32 network;
+		int length;
+		bool ipv6;
+		if (!parse(prefix, network, length, ipv6))
+			throw gcnew Exception("Invalid route: " + prefix);
+		unsigned long long first = network & toMask(length);
+		ranges.push_back(std::make_pair(first, first + (1ULL << (32 - length)) - 1));
+	}
+
+	List<String^>^ result = gcnew List<String^>();
+	for (const auto& block : collapse(ranges)) {
+		result->Add(String::Format("{0}/{1}", toString((UInt32)block.first), block.second));
+	}
+	return result;
+}
+
+String^ RouteAggregator::PushLine(String^ cidr)
+{
+	UInt32 network;
+	int length;
+	bool ipv6;
+	if (!parse(cidr, network, length, ipv6))
+		throw gcnew Exception("Invalid route: " + cidr);
+	return String::Format("push \"route {0} {1}\"", toString(network), toString(toMask(length)));
+}
+
+bool RouteAggregator::parse(String^ prefix, UInt32% network, int% length, bool% ipv6)
+{
+	ipv6 = false;
+	array<String^>^ parts = prefix->Trim()->Split(gcnew array<wchar_t>{ '/', ' ', '\t' }, StringSplitOptions::RemoveEmptyEntries);
+	if (parts->Length < 1 || parts->Length > 2)
+		return false;
+
+	IPAddress^ address;
+	if (!IPAddress::TryParse(parts[0], address))
+		return false;
+	if (address->AddressFamily != Sockets::AddressFamily::InterNetwork) {
+		ipv6 = true;
+		return false;
+	}
+	network = toUInt32(address);
+
+	if (parts->Length == 1) {
+		length = 32;
+		return true;
+	}
+	// Either a prefix length or a dotted netmask
+	if (parts[1]->Contains(".")) {
+		IPAddress^ mask;
+		if (!IPAddress::TryParse(parts[1], mask) || mask->AddressFamily != Sockets::AddressFamily::InterNetwork)
+			return false;
+		UInt32 inverted = ~toUInt32(mask);
+		if ((inverted & (inverted + 1)) != 0)
+			return false; // Not contiguous
+		length = 32;
+		while (inverted != 0) {
+			inverted >>= 1;
+			length--;
+		}
+		return true;
+	}
+	int parsed;
+	if (!int::TryParse(parts[1], parsed) || parsed < 0 || parsed > 32)
+		return false;
+	length = parsed;
+	return true;
+}
+
+UInt32 RouteAggregator::toUInt32(IPAddress^ address)
+{
+	array<Byte>^ bytes = address->GetAddressBytes();
+	return ((UInt32)bytes[0] << 24) | ((UInt32)bytes[1] << 16) | ((UInt32)bytes[2] << 8) | bytes[3];
+}
+
+String^ RouteAggregator::toString(UInt32 address)
+{
+	return String::Format("{0}.{1}.{2}.{3}", address >> 24, (address >> 16) & 0xFF, (address >> 8) & 0xFF, address & 0xFF);
+}
+
+UInt32 RouteAggregator::toMask(int length)
+{
+	return length == 0 ? 0 : 0xFFFFFFFFu << (32 - length);
+}
@@ -0,0 +1,25 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+using namespace System;
+using namespace System::Collections::Generic;
+using namespace System::IO;
+using namespace System::Net;
+
+// Reduces a list of IPv4 prefixes to the smallest set of CIDR blocks covering exactly the
+// same addresses, so the server pushes (and clients install) as few routes as possible.
+ref class RouteAggregator
+{
+public:
+	// One prefix per line as a.b.c.d/nn, a.b.c.d m.m.m.m or a bare host. '#' starts a comment.
+	static List<String^>^ Load(String^ path, int% count);
+	static List<String^>^ Aggregate(IEnumerable<String^>^ prefixes);
+	static String^ PushLine(String^ cidr);
+
+private:
+	static bool parse(String^ prefix, UInt32% network, int% length, bool% ipv6);
+	static UInt32 toUInt32(IPAddress^ address);
+	static String^ toString(UInt32 address);
+	static UInt32 toMask(int length);
+};
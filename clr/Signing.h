@@ -0,0 +1,31 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include <openssl/evp.h>
+#include <openssl/x509v3.h>
+
+// Digest to sign certificates, CRLs and OCSP responses with, EdDSA signs the message directly.
+// Every signature clr makes itself goes through this, so it matches the external OpenSSLHelper.
+inline const EVP_MD* SigningDigest(EVP_PKEY* key)
+{
+	int type = EVP_PKEY_id(key);
+	return type == EVP_PKEY_ED25519 || type == EVP_PKEY_ED448 ? NULL : EVP_sha256();
+}
+
+// Puts key in cert ahead of signing it again. The external OpenSSLHelper always adds a subject key
+// identifier, which is the hash of the key being replaced, so it is derived again for the new one.
+inline bool RekeyCertificate(X509* cert, EVP_PKEY* key)
+{
+	if (X509_set_pubkey(cert, key) != 1)
+		return false;
+	int index;
+	while ((index = X509_get_ext_by_NID(cert, NID_subject_key_identifier, -1)) >= 0)
+		X509_EXTENSION_free(X509_delete_ext(cert, index));
+	X509V3_CTX ctx;
+	X509V3_set_ctx(&ctx, NULL, cert, NULL, NULL, 0);
+	X509_EXTENSION* skid = X509V3_EXT_conf_nid(NULL, &ctx, NID_subject_key_identifier, "hash");
+	bool ok = skid != NULL && X509_add_ext(cert, skid, -1) == 1;
+	X509_EXTENSION_free(skid);
+	return ok;
+}
@@ -0,0 +1,454 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "stdafx.h"
+#include "StressHarness.h"
+
+#include <openssl/bn.h>
+#include <openssl/pem.h>
+#include <msclr/marshal.h>
+
+using namespace msclr::interop;
+using namespace System::Globalization;
+using namespace System::Threading;
+using namespace ICSharpCode::SharpZipLib::GZip;
+using namespace Newtonsoft::Json;
+
+StressHarness::StressHarness(String^ path)
+{
+	// Children run this same binary
+	this->exePath = Process::GetCurrentProcess()->MainModule->FileName;
+	this->path = Path::GetFullPath(path);
+	this->pkiPath = Path::Combine(this->path, "pki");
+	this->operations = gcnew List<Operation^>();
+	this->indexed = gcnew Dictionary<String^, KeyValuePair<Char, String^>>();
+	this->problems = gcnew List<String^>();
+}
+
+void StressHarness::Operation::received(Object^ sender, DataReceivedEventArgs^ e)
+{
+	if (e->Data == nullptr)
+		return;
+	Monitor::Enter(this->log);
+	try {
+		this->log->AppendLine(e->Data);
+	}
+	finally {
+		Monitor::Exit(this->log);
+	}
+}
+
+bool StressHarness::Run(int jobs, int count)
+{
+	if (!File::Exists(Path::Combine(this->path, "config.conf"))) {
+		Console::WriteLine("ERROR: No configuration in {0}, run init first.", this->path);
+		return false;
+	}
+	try {
+		this->workPath = Path::Combine(Path::GetTempPath(), "openvpn-generate-stress." + Path::GetRandomFileName());
+		Directory::CreateDirectory(this->workPath);
+	}
+	catch (Exception^ e) {
+		Console::WriteLine("ERROR: Failed to create a work directory. {0}", e->Message);
+		return false;
+	}
+
+	Console::WriteLine("Running {0} operations, {1} at a time, against {2}.", count, jobs, this->path);
+
+	// Clients are named after this run so it can be repeated against the same directory
+	String^ prefix = String::Format("stress-{0}-", Process::GetCurrentProcess()->Id);
+	List<String^>^ created = gcnew List<String^>();
+	List<Operation^>^ running = gcnew List<Operation^>();
+	Stopwatch^ watch = Stopwatch::StartNew();
+	int next = 0;
+	while (next < count || running->Count > 0) {
+		while (running->Count < jobs && next < count) {
+			// Five clients, two revokes and a regenerate in every eight, revoking only clients
+			// that finished issuing
+			Operation^ op = gcnew Operation();
+			int slot = next % 8;
+			if (slot == 7) {
+				op->kind = Kind::Regenerate;
+			}
+			else if ((slot == 5 || slot == 6) && created->Count > 0) {
+				op->kind = Kind::Revoke;
+				op->name = created[0];
+				created->RemoveAt(0);
+			}
+			else {
+				op->kind = Kind::Client;
+				op->name = prefix + next;
+			}
+			op->metrics = Path::Combine(this->workPath, String::Format("op-{0}.prom", next));
+			op->started = watch->Elapsed.TotalSeconds;
+			this->operations->Add(op);
+			if (launch(op))
+				running->Add(op);
+			next++;
+		}
+
+		// Processes are polled rather than waited on one at a time, whichever finishes first frees a slot
+		Thread::Sleep(5);
+		for (int i = running->Count - 1; i >= 0; i--) {
+			Operation^ op = running[i];
+			if (!op->process->HasExited)
+				continue;
+			op->process->WaitForExit();
+			op->seconds = watch->Elapsed.TotalSeconds - op->started;
+			op->status = op->process->ExitCode;
+			delete op->process;
+			op->process = nullptr;
+			if (op->kind == Kind::Client && op->status == 0)
+				created->Add(op->name);
+			running->RemoveAt(i);
+		}
+	}
+	double elapsed = watch->Elapsed.TotalSeconds;
+
+	checkCertificates();
+	checkRevocations();
+	checkClients();
+	checkFiles();
+	report(elapsed);
+
+	try {
+		Directory::Delete(this->workPath, true);
+	}
+	catch (Exception^) {}
+	for each (Operation^ op in this->operations) {
+		if (op->status != 0)
+			return false;
+	}
+	return this->problems->Count == 0;
+}
+
+bool StressHarness::launch(Operation^ operation)
+{
+	ProcessStartInfo^ info = gcnew ProcessStartInfo(this->exePath);
+	String^ args = String::Format("{0} --path \"{1}\"", kindName(operation->kind), this->path);
+	if (operation->name != nullptr)
+		args += String::Format(" --name \"{0}\"", operation->name);
+	args += String::Format(" --metrics \"{0}\"", operation->metrics);
+	info->Arguments = args;
+	info->UseShellExecute = false;
+	info->CreateNoWindow = true;
+	// Nothing to answer prompts with, so revoke takes the default and regenerates the server
+	info->RedirectStandardInput = true;
+	info->RedirectStandardOutput = true;
+	info->RedirectStandardError = true;
+	try {
+		operation->process = gcnew Process();
+		operation->process->StartInfo = info;
+		operation->process->OutputDataReceived += gcnew DataReceivedEventHandler(operation, &Operation::received);
+		operation->process->ErrorDataReceived += gcnew DataReceivedEventHandler(operation, &Operation::received);
+		operation->process->Start();
+		operation->process->StandardInput->Close();
+		operation->process->BeginOutputReadLine();
+		operation->process->BeginErrorReadLine();
+	}
+	catch (Exception^ e) {
+		problem(String::Format("Failed to start {0}. {1}", kindName(operation->kind), e->Message));
+		operation->process = nullptr;
+		return false;
+	}
+	return true;
+}
+
+void StressHarness::checkCertificates()
+{
+	// Every certificate issued is in the index, even once revoked and removed from pki
+	String^ indexPath = Path::Combine(this->pkiPath, "index.txt");
+	if (File::Exists(indexPath)) {
+		for each (String^ line in File::ReadAllLines(indexPath)) {
+			array<String^>^ fields = line->Split('\t');
+			if (fields->Length < 6 || fields[0]->Length != 1) {
+				problem("Malformed index line: " + line);
+				continue;
+			}
+			KeyValuePair<Char, String^> existing;
+			if (this->indexed->TryGetValue(fields[3], existing))
+				problem(String::Format("Serial {0} issued to both {1} and {2}", fields[3], existing.Value, fields[5]));
+			this->indexed[fields[3]] = KeyValuePair<Char, String^>(fields[0][0], fields[5]);
+		}
+	}
+
+	Dictionary<String^, String^>^ serials = gcnew Dictionary<String^, String^>();
+	for each (String^ file in Directory::GetFiles(this->pkiPath, "*.crt")) {
+		String^ stem = Path::GetFileNameWithoutExtension(file);
+		if (stem == "ca" || stem == "crl")
+			continue;
+		this->certificates++;
+		BIO* bio = readFile(file);
+		X509* cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+		BIO_free(bio);
+		if (cert == NULL) {
+			problem("Torn or unreadable certificate " + Path::GetFileName(file));
+			continue;
+		}
+		String^ serial = serialToHex(X509_get0_serialNumber(cert));
+		X509_free(cert);
+		String^ existing;
+		if (serials->TryGetValue(serial, existing))
+			problem(String::Format("Serial {0} on both {1} and {2}", serial, existing, stem));
+		serials[serial] = stem;
+		if (!this->indexed->ContainsKey(serial))
+			problem(String::Format("Certificate {0} (serial {1}) missing from the index", stem, serial));
+
+		String^ keyPath = Path::Combine(this->pkiPath, stem + ".key");
+		EVP_PKEY* pkey = NULL;
+		if (File::Exists(keyPath)) {
+			bio = readFile(keyPath);
+			pkey = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+			BIO_free(bio);
+		}
+		if (pkey == NULL)
+			problem("Torn, unreadable or missing key for " + stem);
+		EVP_PKEY_free(pkey);
+	}
+}
+
+void StressHarness::checkRevocations()
+{
+	// Revoked serials the CRL or crl/ directory actually holds
+	HashSet<String^>^ listed = gcnew HashSet<String^>();
+	String^ crlPath = Path::Combine(this->pkiPath, "crl.crt");
+	if (File::Exists(crlPath)) {
+		BIO* bio = readFile(crlPath);
+		X509_CRL* crl = PEM_read_bio_X509_CRL(bio, NULL, NULL, NULL);
+		BIO_free(bio);
+		if (crl == NULL) {
+			problem("Torn or unreadable CRL");
+		}
+		else {
+			STACK_OF(X509_REVOKED)* revoked = X509_CRL_get_REVOKED(crl);
+			for (int i = 0; i < sk_X509_REVOKED_num(revoked); i++)
+				listed->Add(serialToHex(X509_REVOKED_get0_serialNumber(sk_X509_REVOKED_value(revoked, i))));
+			X509_CRL_free(crl);
+		}
+	}
+	String^ crlDir = Path::Combine(this->pkiPath, "crl");
+	if (Directory::Exists(crlDir)) {
+		marshal_context ctx;
+		for each (String^ entry in Directory::GetFiles(crlDir)) {
+			BIGNUM* bn = NULL;
+			if (BN_dec2bn(&bn, ctx.marshal_as<const char*>(Path::GetFileName(entry))) > 0) {
+				char* hex = BN_bn2hex(bn);
+				listed->Add(gcnew String(hex));
+				OPENSSL_free(hex);
+			}
+			BN_free(bn);
+		}
+	}
+
+	for each (KeyValuePair<String^, KeyValuePair<Char, String^>> entry in this->indexed) {
+		if (entry.Value.Key != 'R')
+			continue;
+		this->revocations++;
+		if (!listed->Contains(entry.Key))
+			problem(String::Format("Lost CRL entry for {0} (serial {1})", entry.Value.Value, entry.Key));
+	}
+
+	for each (Operation^ op in this->operations) {
+		if (op->kind != Kind::Revoke || op->status != 0)
+			continue;
+		bool found = false;
+		for each (KeyValuePair<String^, KeyValuePair<Char, String^>> entry in this->indexed) {
+			if (entry.Value.Key == 'R' && entry.Value.Value->EndsWith("/CN=" + op->name, StringComparison::Ordinal))
+				found = true;
+		}
+		if (!found)
+			problem(String::Format("Revocation of {0} missing from the index", op->name));
+		if (File::Exists(Path::Combine(this->pkiPath, op->name + ".crt")))
+			problem(String::Format("Revoked client {0} still has a certificate", op->name));
+		if (File::Exists(Path::Combine(this->path, "clients", op->name + ".visz")))
+			problem(String::Format("Revoked client {0} still has a bundle", op->name));
+	}
+}
+
+void StressHarness::checkClients()
+{
+	HashSet<String^>^ revoked = gcnew HashSet<String^>();
+	for each (Operation^ op in this->operations) {
+		if (op->kind == Kind::Revoke && op->status == 0)
+			revoked->Add(op->name);
+	}
+	array<Byte>^ buf = gcnew array<Byte>(16384);
+	for each (Operation^ op in this->operations) {
+		if (op->kind != Kind::Client || op->status != 0 || revoked->Contains(op->name))
+			continue;
+		if (!File::Exists(Path::Combine(this->pkiPath, op->name + ".crt")))
+			problem(String::Format("Client {0} lost its certificate", op->name));
+		if (!File::Exists(Path::Combine(this->path, "ccd", op->name)))
+			problem(String::Format("Client {0} lost its address", op->name));
+
+		// The whole archive has to inflate, a torn one ends early or fails its checksum
+		String^ visz = Path::Combine(this->path, "clients", op->name + ".visz");
+		if (!File::Exists(visz)) {
+			problem(String::Format("Client {0} has no bundle", op->name));
+			continue;
+		}
+		try {
+			GZipInputStream^ gz = gcnew GZipInputStream(File::OpenRead(visz));
+			Int64 total = 0;
+			int n;
+			try {
+				while ((n = gz->Read(buf, 0, buf->Length)) > 0)
+					total += n;
+			}
+			finally {
+				gz->Close();
+			}
+			if (total == 0)
+				throw gcnew IOException("Empty archive");
+		}
+		catch (Exception^) {
+			problem("Torn bundle for " + op->name);
+		}
+		this->bundles++;
+	}
+
+	Dictionary<String^, String^>^ addresses = gcnew Dictionary<String^, String^>();
+	String^ ccd = Path::Combine(this->path, "ccd");
+	if (!Directory::Exists(ccd))
+		return;
+	for each (String^ entry in Directory::GetFiles(ccd)) {
+		array<String^>^ parts = File::ReadAllText(entry)->Split((array<wchar_t>^)nullptr, StringSplitOptions::RemoveEmptyEntries);
+		String^ name = Path::GetFileName(entry);
+		if (parts->Length < 2 || parts[0] != "ifconfig-push") {
+			problem("Torn client config dir entry " + name);
+			continue;
+		}
+		String^ existing;
+		if (addresses->TryGetValue(parts[1], existing))
+			problem(String::Format("Address {0} given to both {1} and {2}", parts[1], existing, name));
+		addresses[parts[1]] = name;
+	}
+}
+
+void StressHarness::checkFiles()
+{
+	String^ configPath = Path::Combine(this->path, "config.conf");
+	try {
+		Dictionary<String^, Object^>^ config = JsonConvert::DeserializeObject<Dictionary<String^, Object^>^>(File::ReadAllText(configPath));
+		Object^ val;
+		if (!config->TryGetValue("serial", val)) {
+			problem("config.conf has no serial");
+		}
+		else {
+			// The next serial handed out must be past everything already issued
+			Int64 serial = Convert::ToInt64(val);
+			for each (String^ issued in this->indexed->Keys) {
+				if (Int64::Parse(issued, NumberStyles::HexNumber) > serial)
+					problem(String::Format("config.conf serial {0} is behind issued serial {1}", serial, issued));
+			}
+		}
+	}
+	catch (Exception^ e) {
+		problem("Torn or unreadable config.conf. " + e->Message);
+	}
+	String^ cache = Path::Combine(this->pkiPath, "cache.json");
+	if (File::Exists(cache)) {
+		try {
+			JsonConvert::DeserializeObject<Dictionary<String^, String^>^>(File::ReadAllText(cache));
+		}
+		catch (Exception^ e) {
+			problem("Torn or unreadable cache.json. " + e->Message);
+		}
+	}
+	for each (String^ file in Directory::GetFiles(this->path, "*.tmp", SearchOption::AllDirectories))
+		problem("Temporary file left behind: " + file->Substring(this->path->Length + 1));
+}
+
+void StressHarness::report(double elapsed)
+{
+	Console::WriteLine();
+	Console::WriteLine("Ran {0} operations in {1:F1}s, {2:F1} operations/s.", this->operations->Count, elapsed,
+		elapsed > 0 ? this->operations->Count / elapsed : 0);
+	for each (Kind kind in gcnew array<Kind> { Kind::Client, Kind::Revoke, Kind::Regenerate }) {
+		int ok = 0, failed = 0;
+		double seconds = 0;
+		for each (Operation^ op in this->operations) {
+			if (op->kind != kind)
+				continue;
+			if (op->status == 0)
+				ok++;
+			else
+				failed++;
+			seconds += op->seconds;
+		}
+		if (ok + failed > 0)
+			Console::WriteLine("  {0,-10} {1,4} ok, {2} failed, {3:F2}s mean", kindName(kind), ok, failed, seconds / (ok + failed));
+	}
+
+	// Each child wrote its own lock wait histogram
+	double waited = 0;
+	Int64 waits = 0;
+	for each (Operation^ op in this->operations) {
+		if (!File::Exists(op->metrics))
+			continue;
+		for each (String^ line in File::ReadAllLines(op->metrics)) {
+			int space = line->LastIndexOf(' ');
+			if (space < 0)
+				continue;
+			String^ name = line->Substring(0, space);
+			if (name == "openvpn_generate_lock_wait_seconds_sum")
+				waited += Double::Parse(line->Substring(space + 1), CultureInfo::InvariantCulture);
+			else if (name == "openvpn_generate_lock_wait_seconds_count")
+				waits += (Int64)Double::Parse(line->Substring(space + 1), CultureInfo::InvariantCulture);
+		}
+	}
+	Console::WriteLine("Lock waits: {0}, {1:F2}s in total, {2:F1}ms mean.", waits, waited, waits > 0 ? waited * 1000 / waits : 0);
+	Console::WriteLine("Checked {0} certificates, {1} revocations and {2} bundles.", this->certificates, this->revocations, this->bundles);
+
+	for each (Operation^ op in this->operations) {
+		if (op->status != 0)
+			Console::WriteLine("FAILED: {0} {1} exited {2}. {3}", kindName(op->kind), op->name, op->status, lastLine(op->log->ToString()));
+	}
+	for each (String^ message in this->problems)
+		Console::WriteLine("PROBLEM: " + message);
+	if (this->problems->Count == 0)
+		Console::WriteLine("No problems found.");
+}
+
+void StressHarness::problem(String^ message)
+{
+	this->problems->Add(message);
+}
+
+String^ StressHarness::kindName(Kind kind)
+{
+	switch (kind) {
+	case Kind::Client:
+		return "client";
+	case Kind::Revoke:
+		return "revoke";
+	default:
+		return "regenerate";
+	}
+}
+
+String^ StressHarness::serialToHex(const ASN1_INTEGER* serial)
+{
+	BIGNUM* bn = ASN1_INTEGER_to_BN(serial, NULL);
+	char* hex = BN_bn2hex(bn);
+	String^ result = gcnew String(hex);
+	OPENSSL_free(hex);
+	BN_free(bn);
+	return result;
+}
+
+BIO* StressHarness::readFile(String^ path)
+{
+	array<Byte>^ data = File::ReadAllBytes(path);
+	BIO* bio = BIO_new(BIO_s_mem());
+	if (data->Length > 0) {
+		pin_ptr<Byte> p = &data[0];
+		BIO_write(bio, p, data->Length);
+	}
+	return bio;
+}
+
+String^ StressHarness::lastLine(String^ log)
+{
+	array<String^>^ lines = log->Split(gcnew array<wchar_t> { '\r', '\n' }, StringSplitOptions::RemoveEmptyEntries);
+	return lines->Length > 0 ? lines[lines->Length - 1] : String::Empty;
+}
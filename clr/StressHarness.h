@@ -0,0 +1,66 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include <openssl/x509.h>
+
+using namespace System;
+using namespace System::Collections::Generic;
+using namespace System::Diagnostics;
+using namespace System::IO;
+using namespace System::Text;
+
+// Runs client, revoke and regenerate as concurrent processes against one config directory, the
+// way several provisioning hosts sharing it would, then checks what they left behind: no serial
+// issued twice, every revocation in the CRL, every address unique and every file whole.
+ref class StressHarness
+{
+public:
+	StressHarness(String^ path);
+
+	// False if any operation failed or a check found a problem
+	bool Run(int jobs, int operations);
+
+private:
+	enum class Kind { Client, Revoke, Regenerate };
+
+	ref class Operation
+	{
+	public:
+		Kind kind;
+		String^ name;
+		String^ metrics;
+		StringBuilder^ log = gcnew StringBuilder();
+		Process^ process;
+		double started;
+		double seconds;
+		int status = -1;
+
+		void received(Object^ sender, DataReceivedEventArgs^ e);
+	};
+
+	String^ exePath;
+	String^ path;
+	String^ pkiPath;
+	String^ workPath;
+	List<Operation^>^ operations;
+	// index.txt by serial, status and subject
+	Dictionary<String^, KeyValuePair<Char, String^>>^ indexed;
+	List<String^>^ problems;
+	int certificates;
+	int revocations;
+	int bundles;
+
+	bool launch(Operation^ operation);
+	void checkCertificates();
+	void checkRevocations();
+	void checkClients();
+	void checkFiles();
+	void report(double elapsed);
+	void problem(String^ message);
+
+	static String^ kindName(Kind kind);
+	static String^ serialToHex(const ASN1_INTEGER* serial);
+	static BIO* readFile(String^ path);
+	static String^ lastLine(String^ log);
+};
@@ -0,0 +1,128 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "stdafx.h"
+#include "TLSCrypt.h"
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+using namespace System::Text;
+
+// Sizes as defined by OpenVPN's struct key2 and the tls-crypt-v2 wrapping
+static const int StaticKeyLength = 256;
+static const int ServerKeyLength = 128;
+static const int TagLength = 32;
+
+String^ TLSCrypt::CreateStaticKey()
+{
+	array<Byte>^ key = randomBytes(StaticKeyLength);
+	StringBuilder^ sb = gcnew StringBuilder();
+	sb->Append("#\n# 2048 bit OpenVPN static key\n#\n");
+	sb->Append("-----BEGIN OpenVPN Static key V1-----\n");
+	for (int i = 0; i < key->Length; i++) {
+		sb->Append(key[i].ToString("x2"));
+		if (i % 16 == 15)
+			sb->Append("\n");
+	}
+	sb->Append("-----END OpenVPN Static key V1-----\n");
+	return sb->ToString();
+}
+
+String^ TLSCrypt::CreateV2ServerKey()
+{
+	return toPEM("OpenVPN tls-crypt-v2 server key", randomBytes(ServerKeyLength));
+}
+
+String^ TLSCrypt::CreateV2ClientKey(String^ serverKey)
+{
+	array<Byte>^ server = fromPEM("OpenVPN tls-crypt-v2 server key", serverKey);
+	if (server == nullptr || server->Length != ServerKeyLength)
+		throw gcnew Exception("Invalid tls-crypt-v2 server key");
+
+	// Metadata is a timestamp, matching openvpn --genkey tls-crypt-v2-client
+	array<Byte>^ metadata = gcnew array<Byte>(9);
+	Int64 now = DateTimeOffset::UtcNow.ToUnixTimeSeconds();
+	metadata[0] = 0x01;
+	for (int i = 0; i < 8; i++) {
+		metadata[1 + i] = (Byte)(now >> (56 - 8 * i));
+	}
+
+	// Kc || WKc, where WKc = T || AES-256-CTR(Ke, T[0..16], Kc || metadata) || len
+	int wrappedLength = TagLength + StaticKeyLength + metadata->Length + 2;
+	array<Byte>^ client = gcnew array<Byte>(StaticKeyLength + wrappedLength);
+	array<Byte>^ kc = randomBytes(StaticKeyLength);
+	Array::Copy(kc, client, StaticKeyLength);
+	Array::Copy(kc, 0, client, StaticKeyLength + TagLength, StaticKeyLength);
+	Array::Copy(metadata, 0, client, StaticKeyLength + TagLength + StaticKeyLength, metadata->Length);
+	client[client->Length - 2] = (Byte)(wrappedLength >> 8);
+	client[client->Length - 1] = (Byte)(wrappedLength & 0xff);
+
+	pin_ptr<Byte> pinnedClient = &client[0];
+	pin_ptr<Byte> pinnedServer = &server[0];
+	unsigned char* out = pinnedClient;
+	unsigned char* tag = out + StaticKeyLength;
+	unsigned char* plain = tag + TagLength;
+	int plainLength = StaticKeyLength + metadata->Length;
+	// Ke and Ka are the cipher and HMAC halves of the server key
+	const unsigned char* ke = pinnedServer;
+	const unsigned char* ka = ke + 64;
+
+	// T = HMAC-SHA256(Ka, len || Kc || metadata)
+	bool ok = false;
+	HMAC_CTX* hmac = HMAC_CTX_new();
+	unsigned int tagLength = 0;
+	if (hmac != NULL
+		&& HMAC_Init_ex(hmac, ka, 32, EVP_sha256(), NULL)
+		&& HMAC_Update(hmac, out + client->Length - 2, 2)
+		&& HMAC_Update(hmac, plain, plainLength)
+		&& HMAC_Final(hmac, tag, &tagLength)) {
+		// Encrypt Kc || metadata in place, using the tag as a synthetic IV
+		EVP_CIPHER_CTX* cipher = EVP_CIPHER_CTX_new();
+		int len = 0, finalLen = 0;
+		ok = cipher != NULL
+			&& EVP_EncryptInit_ex(cipher, EVP_aes_256_ctr(), NULL, ke, tag)
+			&& EVP_EncryptUpdate(cipher, plain, &len, plain, plainLength)
+			&& EVP_EncryptFinal_ex(cipher, plain + len, &finalLen);
+		EVP_CIPHER_CTX_free(cipher);
+	}
+	HMAC_CTX_free(hmac);
+	if (!ok)
+		throw gcnew Exception("Failed to wrap tls-crypt-v2 client key");
+
+	return toPEM("OpenVPN tls-crypt-v2 client key", client);
+}
+
+array<Byte>^ TLSCrypt::randomBytes(int length)
+{
+	array<Byte>^ data = gcnew array<Byte>(length);
+	pin_ptr<Byte> p = &data[0];
+	if (RAND_bytes(p, length) != 1)
+		throw gcnew Exception("Failed to generate random key material");
+	return data;
+}
+
+String^ TLSCrypt::toPEM(String^ name, array<Byte>^ data)
+{
+	String^ encoded = Convert::ToBase64String(data);
+	StringBuilder^ sb = gcnew StringBuilder();
+	sb->Append("-----BEGIN " + name + "-----\n");
+	for (int i = 0; i < encoded->Length; i += 64) {
+		sb->Append(encoded->Substring(i, Math::Min(64, encoded->Length - i)));
+		sb->Append("\n");
+	}
+	sb->Append("-----END " + name + "-----\n");
+	return sb->ToString();
+}
+
+array<Byte>^ TLSCrypt::fromPEM(String^ name, String^ pem)
+{
+	String^ begin = "-----BEGIN " + name + "-----";
+	String^ end = "-----END " + name + "-----";
+	int start = pem->IndexOf(begin);
+	int stop = pem->IndexOf(end);
+	if (start < 0 || stop < start)
+		return nullptr;
+	start += begin->Length;
+	return Convert::FromBase64String(pem->Substring(start, stop - start)->Replace("\r", "")->Replace("\n", ""));
+}
@@ -0,0 +1,24 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+using namespace System;
+
+// Control channel keys for tls-crypt / tls-crypt-v2. With these in place the server drops
+// unauthenticated packets before they ever reach the TLS stack.
+ref class TLSCrypt
+{
+public:
+	enum class Mode {
+		None, V1, V2
+	};
+
+	static String^ CreateStaticKey();
+	static String^ CreateV2ServerKey();
+	static String^ CreateV2ClientKey(String^ serverKey);
+
+private:
+	static array<Byte>^ randomBytes(int length);
+	static String^ toPEM(String^ name, array<Byte>^ data);
+	static array<Byte>^ fromPEM(String^ name, String^ pem);
+};
@@ -0,0 +1,96 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "stdafx.h"
+#include "Tuning.h"
+
+#include <windows.h>
+#include <intrin.h>
+
+// Offsets into the settings array
+static const int Buffer = 0;
+static const int TxQueueLen = 1;
+static const int TunMTU = 2;
+static const int MSSFix = 3;
+
+bool Tuning::HasAESNI()
+{
+#if defined(_M_X64) || defined(_M_IX86)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 25)) != 0;
+#elif defined(_M_ARM64)
+	return IsProcessorFeaturePresent(PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE) != 0;
+#else
+	return false;
+#endif
+}
+
+array<int>^ Tuning::settings(Profile profile)
+{
+	switch (profile) {
+	case Profile::Throughput:
+		// Deep buffers so bulk transfers aren't held back by the socket, full size packets
+		return gcnew array<int>{ 1048576, 1000, 1500, 1450 };
+	case Profile::Latency:
+		// Short queues so interactive traffic doesn't wait behind bulk transfers
+		return gcnew array<int>{ 262144, 100, 1500, 1450 };
+	case Profile::Mobile:
+		// Cellular links often carry less than 1500 bytes, smaller packets avoid fragmenting
+		return gcnew array<int>{ 393216, 500, 1400, 1360 };
+	default:
+		return gcnew array<int>{ 0, 0, 0, 0 };
+	}
+}
+
+String^ Tuning::dataCiphers(bool aesni)
+{
+	// The server picks the first cipher in its own list that the client also supports
+	if (aesni)
+		return "AES-256-GCM:AES-128-GCM:CHACHA20-POLY1305";
+	return "CHACHA20-POLY1305:AES-256-GCM:AES-128-GCM";
+}
+
+String^ Tuning::ServerDirectives(Profile profile, bool aesni, bool dco, String^ proto)
+{
+	String^ file = "";
+	if (dco) {
+		// A pushed or requested compression setting would move the peer back to userspace
+		file += "allow-compression no\n";
+	}
+	if (profile == Profile::None && !dco)
+		return file;
+	file += "data-ciphers " + dataCiphers(aesni) + "\n";
+	if (profile == Profile::None)
+		return file;
+	array<int>^ s = settings(profile);
+	file += String::Format("sndbuf {0}\nrcvbuf {0}\n", s[Buffer]);
+	file += String::Format("push \"sndbuf {0}\"\npush \"rcvbuf {0}\"\n", s[Buffer]);
+	file += String::Format("txqueuelen {0}\n", s[TxQueueLen]);
+	file += String::Format("tun-mtu {0}\nmssfix {1}\n", s[TunMTU], s[MSSFix]);
+	if (proto == "udp") {
+		// Non-blocking writes to the UDP socket, skipping a poll per packet. Offloaded packets
+		// never pass through the process so there's nothing to gain with dco.
+		if (!dco)
+			file += "fast-io\n";
+	}
+	else if (profile == Profile::Latency) {
+		file += "tcp-nodelay\n";
+	}
+	return file;
+}
+
+String^ Tuning::ClientDirectives(Profile profile, bool aesni, bool dco)
+{
+	String^ file = "";
+	if (dco)
+		file += "allow-compression no\n";
+	if (profile == Profile::None && !dco)
+		return file;
+	file += "data-ciphers " + dataCiphers(aesni) + "\n";
+	if (profile == Profile::None)
+		return file;
+	array<int>^ s = settings(profile);
+	// tun-mtu has to match the server's, buffers are pushed
+	file += String::Format("tun-mtu {0}\nmssfix {1}\n", s[TunMTU], s[MSSFix]);
+	return file;
+}
@@ -0,0 +1,27 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+using namespace System;
+
+// Data channel tuning. A profile picks the cipher order and the socket buffer, queue and MTU
+// settings written into the server and client configs.
+ref class Tuning
+{
+public:
+	enum class Profile {
+		None, Throughput, Latency, Mobile
+	};
+
+	// Whether this CPU has AES instructions. AES-GCM is only faster than ChaCha20-Poly1305 with them.
+	static bool HasAESNI();
+
+	// With dco the data channel is offloaded to the kernel (OpenVPN 2.6+), which only handles AEAD
+	// ciphers and no compression
+	static String^ ServerDirectives(Profile profile, bool aesni, bool dco, String^ proto);
+	static String^ ClientDirectives(Profile profile, bool aesni, bool dco);
+
+private:
+	static array<int>^ settings(Profile profile);
+	static String^ dataCiphers(bool aesni);
+};
@@ -0,0 +1,242 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "AddressPool.h"
+#include "DirectoryLock.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <sys/stat.h>
+
+AddressPool::AddressPool(const std::string& path, uint32_t network, int prefixLength)
+{
+	this->path = path;
+	this->mask = prefixLength == 0 ? 0 : 0xFFFFFFFFu << (32 - prefixLength);
+	this->network = network & this->mask;
+	this->size = ~this->mask + 1;
+	this->words.assign((this->size + 63) / 64, 0);
+	this->hint = 0;
+	reserveFixed();
+}
+
+bool AddressPool::Load()
+{
+	struct stat st;
+	if (stat(this->path.c_str(), &st) != 0)
+		return true;
+	std::ifstream in(this->path, std::ios::binary);
+	std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	if (!in.good() && !in.eof()) {
+		printf("ERROR: Failed to read address pool. %s\n", strerror(errno));
+		return false;
+	}
+	// A bitmap for a different sized subnet can't be trusted
+	if (data.size() != this->words.size() * 8) {
+		printf("ERROR: Address pool %s does not match the server subnet.\n", this->path.c_str());
+		return false;
+	}
+	// Stored little endian, bit i of the file is address offset i
+	for (size_t i = 0; i < this->words.size(); i++) {
+		uint64_t word = 0;
+		for (int b = 7; b >= 0; b--)
+			word = (word << 8) | (unsigned char)data[i * 8 + b];
+		this->words[i] = word;
+	}
+	reserveFixed();
+	this->hint = 0;
+	return true;
+}
+
+bool AddressPool::Save()
+{
+	std::lock_guard<std::mutex> l(this->lock);
+	return write();
+}
+
+bool AddressPool::write()
+{
+	std::string data(this->words.size() * 8, '\0');
+	for (size_t i = 0; i < this->words.size(); i++) {
+		for (int b = 0; b < 8; b++)
+			data[i * 8 + b] = (char)(this->words[i] >> (b * 8));
+	}
+	std::error_code ec;
+	std::filesystem::create_directories(std::filesystem::path(this->path).parent_path(), ec);
+	try {
+		DirectoryLock::WriteFile(this->path, data);
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to write address pool. %s\n", e.what());
+		return false;
+	}
+	return true;
+}
+
+uint32_t AddressPool::Allocate()
+{
+	std::lock_guard<std::mutex> l(this->lock);
+	// Another process may have taken addresses since Load, the file has the last word on each
+	int fd = open(this->path.c_str(), O_RDONLY | O_CLOEXEC);
+	for (size_t i = this->hint; i < this->words.size(); i++) {
+		if (this->words[i] == ~0ULL)
+			continue;
+		if (fd >= 0 && !readWord(fd, i)) {
+			close(fd);
+			throw std::runtime_error(std::string("Failed to read address pool. ") + strerror(errno));
+		}
+		uint64_t word = this->words[i];
+		if (word == ~0ULL)
+			continue;
+		int bit = __builtin_ctzll(~word);
+		this->words[i] = word | (1ULL << bit);
+		this->hint = i;
+		if (fd >= 0)
+			close(fd);
+		if (!writeWord(i))
+			throw std::runtime_error("Failed to save address pool");
+		return this->network + (uint32_t)i * 64 + bit;
+	}
+	if (fd >= 0)
+		close(fd);
+	throw std::runtime_error("No free addresses left in the server subnet");
+}
+
+bool AddressPool::Reserve(uint32_t address)
+{
+	std::lock_guard<std::mutex> l(this->lock);
+	uint32_t offset = address - this->network;
+	if ((address & this->mask) != this->network || isFixed(offset))
+		return false;
+	int fd = open(this->path.c_str(), O_RDONLY | O_CLOEXEC);
+	bool read = fd < 0 || readWord(fd, offset / 64);
+	if (fd >= 0)
+		close(fd);
+	uint64_t bit = 1ULL << (offset % 64);
+	if (!read || (this->words[offset / 64] & bit) != 0)
+		return false;
+	this->words[offset / 64] |= bit;
+	return writeWord(offset / 64);
+}
+
+bool AddressPool::Free(uint32_t address)
+{
+	std::lock_guard<std::mutex> l(this->lock);
+	uint32_t offset = address - this->network;
+	if ((address & this->mask) != this->network || isFixed(offset))
+		return true;
+	int fd = open(this->path.c_str(), O_RDONLY | O_CLOEXEC);
+	bool read = fd < 0 || readWord(fd, offset / 64);
+	if (fd >= 0)
+		close(fd);
+	if (!read) {
+		printf("ERROR: Failed to read address pool. %s\n", strerror(errno));
+		return false;
+	}
+	this->words[offset / 64] &= ~(1ULL << (offset % 64));
+	if (offset / 64 < this->hint)
+		this->hint = offset / 64;
+	return writeWord(offset / 64);
+}
+
+std::string AddressPool::ToString(uint32_t address)
+{
+	char buf[INET_ADDRSTRLEN];
+	in_addr addr;
+	addr.s_addr = htonl(address);
+	inet_ntop(AF_INET, &addr, buf, sizeof(buf));
+	return buf;
+}
+
+bool AddressPool::TryParse(const std::string& address, uint32_t& result)
+{
+	in_addr addr;
+	if (inet_pton(AF_INET, address.c_str(), &addr) != 1)
+		return false;
+	result = ntohl(addr.s_addr);
+	return true;
+}
+
+bool AddressPool::TryParseSubnet(const std::string& cidr, uint32_t& network, int& prefixLength)
+{
+	size_t slash = cidr.find('/');
+	if (slash == std::string::npos)
+		return false;
+	uint32_t address;
+	std::string lengthStr = cidr.substr(slash + 1);
+	char* end = nullptr;
+	long length = strtol(lengthStr.c_str(), &end, 10);
+	if (!TryParse(cidr.substr(0, slash), address) || lengthStr.empty() || *end != '\0' || length < 8 || length > 29)
+		return false;
+	uint32_t mask = 0xFFFFFFFFu << (32 - length);
+	if ((address & ~mask) != 0)
+		return false;
+	network = address;
+	prefixLength = (int)length;
+	return true;
+}
+
+int AddressPool::PrefixForClients(long long clients)
+{
+	// Network, server and broadcast addresses come out of every subnet
+	int length = 29;
+	while (length > 8 && ((1LL << (32 - length)) - 3) < clients)
+		length--;
+	return length;
+}
+
+void AddressPool::reserveFixed()
+{
+	// Network address, the server's own address and broadcast are never handed out,
+	// nor is the padding past the end of the subnet in the last word
+	this->words[0] |= 3;
+	uint32_t last = this->size - 1;
+	this->words[last / 64] |= 1ULL << (last % 64);
+	for (uint64_t offset = this->size; offset < this->words.size() * 64; offset++)
+		this->words[offset / 64] |= 1ULL << (offset % 64);
+}
+
+bool AddressPool::readWord(int fd, size_t i)
+{
+	unsigned char data[8];
+	if (pread(fd, data, sizeof(data), (off_t)(i * 8)) != (ssize_t)sizeof(data))
+		return false;
+	uint64_t word = 0;
+	for (int b = 7; b >= 0; b--)
+		word = (word << 8) | data[b];
+	this->words[i] = word;
+	if (i == 0 || i == this->words.size() - 1)
+		reserveFixed();
+	return true;
+}
+
+bool AddressPool::writeWord(size_t i)
+{
+	int fd = open(this->path.c_str(), O_WRONLY | O_CLOEXEC);
+	if (fd < 0 && errno == ENOENT) {
+		// Nothing saved yet, the first write is the whole bitmap
+		return write();
+	}
+	unsigned char data[8];
+	for (int b = 0; b < 8; b++)
+		data[b] = (unsigned char)(this->words[i] >> (b * 8));
+	bool ok = fd >= 0 && pwrite(fd, data, sizeof(data), (off_t)(i * 8)) == (ssize_t)sizeof(data);
+	if (!ok)
+		printf("ERROR: Failed to write address pool. %s\n", strerror(errno));
+	if (fd >= 0)
+		close(fd);
+	return ok;
+}
+
+bool AddressPool::isFixed(uint32_t offset) const
+{
+	return offset <= 1 || offset >= this->size - 1;
+}
@@ -0,0 +1,64 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Persistent allocator for static client addresses in the server subnet. One bit per address,
+// saved as a raw bitmap. Allocation resumes from the lowest word that may have a free bit, so
+// handing out an address doesn't rescan the addresses already taken.
+//
+// The bitmap is read once per run. Allocate, Reserve and Free then write just the word they change
+// back to the file, re-reading it first so addresses other processes took since are seen. Call
+// them with the directory lock held.
+class AddressPool
+{
+public:
+	AddressPool(const std::string& path, uint32_t network, int prefixLength);
+
+	bool Load();
+	// Writes the whole bitmap
+	bool Save();
+	// Next free address. Throws once the subnet is exhausted or the file can't be updated.
+	uint32_t Allocate();
+	// Marks an address taken, false if it already was, is outside the pool or can't be saved
+	bool Reserve(uint32_t address);
+	// False if the file couldn't be updated
+	bool Free(uint32_t address);
+	bool Contains(uint32_t address) const { return (address & this->mask) == this->network; }
+
+	std::string Network() const { return ToString(this->network); }
+	std::string Netmask() const { return ToString(this->mask); }
+	std::string Gateway() const { return ToString(this->network + 1); }
+	// Addresses in the subnet, including the reserved ones
+	uint32_t Span() const { return this->size; }
+	// Addresses available to clients
+	int Capacity() const { return (int)(this->size - 3); }
+
+	static std::string ToString(uint32_t address);
+	static bool TryParse(const std::string& address, uint32_t& result);
+	// a.b.c.d/nn with no host bits set, between /8 and /29
+	static bool TryParseSubnet(const std::string& cidr, uint32_t& network, int& prefixLength);
+	// Smallest prefix length with room for the given number of clients
+	static int PrefixForClients(long long clients);
+
+private:
+	std::string path;
+	uint32_t network;
+	uint32_t mask;
+	uint32_t size;
+	std::vector<uint64_t> words;
+	size_t hint;
+	std::mutex lock;
+
+	void reserveFixed();
+	bool isFixed(uint32_t offset) const;
+	// Takes word i from the file into words, false if it couldn't be read
+	bool readWord(int fd, size_t i);
+	// Writes word i through to the file, the whole bitmap if there is no file yet
+	bool writeWord(size_t i);
+	bool write();
+};
@@ -0,0 +1,177 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "Archive.h"
+#include "DirectoryLock.h"
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+
+static const size_t BlockSize = 512;
+
+TarGzWriter::TarGzWriter(const std::string& path)
+{
+	this->path = path;
+	this->temp = DirectoryLock::TempPath(path);
+	this->file = gzopen(this->temp.c_str(), "wb");
+	if (this->file == NULL)
+		throw std::runtime_error("Failed to create " + path);
+}
+
+TarGzWriter::TarGzWriter()
+{
+	memset(&this->stream, 0, sizeof(this->stream));
+	// 16 over the window bits asks for a gzip header, as gzopen writes
+	if (deflateInit2(&this->stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		throw std::runtime_error("Failed to start archive");
+	this->deflating = true;
+}
+
+TarGzWriter::~TarGzWriter()
+{
+	// Abandoned part way, the old archive stays as it was
+	if (this->file != NULL) {
+		gzclose(this->file);
+		remove(this->temp.c_str());
+	}
+	if (this->deflating)
+		deflateEnd(&this->stream);
+}
+
+void TarWriter::AddDirectory(const std::string& name)
+{
+	std::string dir = name;
+	if (dir.empty() || dir[dir.size() - 1] != '/')
+		dir += "/";
+	writeHeader(dir, 0, 0755, '5');
+}
+
+void TarWriter::AddFile(const std::string& name, const void* data, size_t length, unsigned int mode)
+{
+	writeHeader(name, length, mode, '0');
+	write(data, length);
+	static const char padding[BlockSize] = { 0 };
+	if (length % BlockSize != 0)
+		write(padding, BlockSize - length % BlockSize);
+}
+
+void TarWriter::AddFile(const std::string& name, const std::string& data, unsigned int mode)
+{
+	AddFile(name, data.data(), data.size(), mode);
+}
+
+void TarWriter::writeEnd()
+{
+	static const char end[BlockSize * 2] = { 0 };
+	write(end, sizeof(end));
+}
+
+void TarGzWriter::Close()
+{
+	writeEnd();
+	if (this->deflating) {
+		deflateTo(Z_FINISH);
+		deflateEnd(&this->stream);
+		this->deflating = false;
+		return;
+	}
+	int result = gzclose(this->file);
+	this->file = NULL;
+	if (result != Z_OK || rename(this->temp.c_str(), this->path.c_str()) != 0) {
+		remove(this->temp.c_str());
+		throw std::runtime_error("Failed to finish archive");
+	}
+}
+
+void TarWriter::writeHeader(const std::string& name, size_t length, unsigned int mode, char type)
+{
+	char header[BlockSize];
+	memset(header, 0, sizeof(header));
+
+	// Names over 100 characters are split into the ustar prefix field
+	std::string prefix;
+	std::string shortName = name;
+	if (name.size() > 100) {
+		size_t split = name.rfind('/', name.size() - 2);
+		if (split == std::string::npos || split > 155 || name.size() - split - 1 > 100)
+			throw std::runtime_error("Archive entry name too long: " + name);
+		prefix = name.substr(0, split);
+		shortName = name.substr(split + 1);
+	}
+	memcpy(header, shortName.data(), shortName.size());
+	snprintf(header + 100, 8, "%07o", mode);
+	snprintf(header + 108, 8, "%07o", 0);
+	snprintf(header + 116, 8, "%07o", 0);
+	snprintf(header + 124, 12, "%011lo", (unsigned long)length);
+	snprintf(header + 136, 12, "%011lo", (unsigned long)time(NULL));
+	header[156] = type;
+	memcpy(header + 257, "ustar", 6);
+	memcpy(header + 263, "00", 2);
+	memcpy(header + 345, prefix.data(), prefix.size());
+
+	// Checksum is computed with the checksum field itself set to spaces
+	memset(header + 148, ' ', 8);
+	unsigned int sum = 0;
+	for (size_t i = 0; i < BlockSize; i++)
+		sum += (unsigned char)header[i];
+	snprintf(header + 148, 8, "%06o", sum);
+	header[155] = ' ';
+
+	write(header, sizeof(header));
+}
+
+void TarGzWriter::write(const void* data, size_t length)
+{
+	if (length == 0)
+		return;
+	if (this->deflating) {
+		this->stream.next_in = (Bytef*)data;
+		this->stream.avail_in = (uInt)length;
+		deflateTo(Z_NO_FLUSH);
+		return;
+	}
+	if (gzwrite(this->file, data, (unsigned int)length) != (int)length)
+		throw std::runtime_error("Failed to write archive");
+}
+
+void TarGzWriter::deflateTo(int flush)
+{
+	char out[16384];
+	int result;
+	do {
+		this->stream.next_out = (Bytef*)out;
+		this->stream.avail_out = sizeof(out);
+		result = deflate(&this->stream, flush);
+		if (result == Z_STREAM_ERROR)
+			throw std::runtime_error("Failed to write archive");
+		this->data.append(out, sizeof(out) - this->stream.avail_out);
+	} while (this->stream.avail_out == 0 || (flush == Z_FINISH && result != Z_STREAM_END));
+}
+
+TarStreamWriter::TarStreamWriter(int fd)
+{
+	this->fd = fd;
+}
+
+void TarStreamWriter::Close()
+{
+	writeEnd();
+}
+
+void TarStreamWriter::write(const void* data, size_t length)
+{
+	const char* bytes = (const char*)data;
+	while (length > 0) {
+		ssize_t n = ::write(this->fd, bytes, length);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			throw std::runtime_error(std::string("Failed to write archive. ") + strerror(errno));
+		bytes += n;
+		length -= (size_t)n;
+	}
+}
@@ -0,0 +1,73 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include <zlib.h>
+
+#include <string>
+
+// Writes ustar entries, the format .visz bundles and tar output streams share
+class TarWriter
+{
+public:
+	virtual ~TarWriter() = default;
+
+	void AddDirectory(const std::string& name);
+	void AddFile(const std::string& name, const void* data, size_t length, unsigned int mode = 0644);
+	void AddFile(const std::string& name, const std::string& data, unsigned int mode = 0644);
+
+protected:
+	// The two empty blocks that end an archive
+	void writeEnd();
+	virtual void write(const void* data, size_t length) = 0;
+
+private:
+	void writeHeader(const std::string& name, size_t length, unsigned int mode, char type);
+};
+
+// Writes a gzipped ustar archive, used for .visz bundles. Nothing appears at path until Close.
+class TarGzWriter : public TarWriter
+{
+public:
+	explicit TarGzWriter(const std::string& path);
+	// Compressed into memory, the archive is in Data after Close
+	TarGzWriter();
+	~TarGzWriter();
+	TarGzWriter(const TarGzWriter&) = delete;
+	TarGzWriter& operator=(const TarGzWriter&) = delete;
+
+	void Close();
+	const std::string& Data() const { return this->data; }
+
+protected:
+	void write(const void* data, size_t length) override;
+
+private:
+	gzFile file = NULL;
+	std::string path;
+	std::string temp;
+	// In-memory archives deflate through stream into data
+	z_stream stream;
+	bool deflating = false;
+	std::string data;
+
+	void deflateTo(int flush);
+};
+
+// Writes an uncompressed ustar archive to a file descriptor as entries are added, so it can be
+// piped into the next stage while it is still being generated
+class TarStreamWriter : public TarWriter
+{
+public:
+	explicit TarStreamWriter(int fd);
+	TarStreamWriter(const TarStreamWriter&) = delete;
+	TarStreamWriter& operator=(const TarStreamWriter&) = delete;
+
+	void Close();
+
+protected:
+	void write(const void* data, size_t length) override;
+
+private:
+	int fd;
+};
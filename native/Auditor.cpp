@@ -0,0 +1,250 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "Auditor.h"
+#include "Json.h"
+
+#include <openssl/bn.h>
+#include <openssl/pem.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <set>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+Auditor::Auditor(const std::string& path)
+{
+	this->path = path;
+	this->pkiPath = (fs::path(path) / "pki").string();
+	this->clientsPath = (fs::path(path) / "clients").string();
+	this->now = time(NULL);
+}
+
+Auditor::~Auditor()
+{
+	if (this->store != NULL)
+		X509_STORE_free(this->store);
+	if (this->intermediates != NULL)
+		sk_X509_pop_free(this->intermediates, X509_free);
+	if (this->ca != NULL)
+		X509_free(this->ca);
+}
+
+bool Auditor::Load()
+{
+	std::string caPath = (fs::path(this->pkiPath) / "ca.crt").string();
+	BIO* bio = BIO_new_file(caPath.c_str(), "r");
+	if (bio != NULL) {
+		this->ca = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+		BIO_free(bio);
+	}
+	if (this->ca == NULL) {
+		printf("ERROR: Failed to load CA from %s.\n", caPath.c_str());
+		return false;
+	}
+
+	// Expiry is reported separately, so the store only judges the signatures
+	this->store = X509_STORE_new();
+	if (this->store == NULL || !X509_STORE_add_cert(this->store, this->ca)) {
+		printf("ERROR: Failed to build trust store.\n");
+		return false;
+	}
+	X509_STORE_set_flags(this->store, X509_V_FLAG_NO_CHECK_TIME);
+
+	this->intermediates = sk_X509_new_null();
+	std::error_code ec;
+	for (const auto& entry : fs::directory_iterator(fs::path(this->pkiPath) / "issuers", ec)) {
+		if (entry.path().extension() != ".crt")
+			continue;
+		bio = BIO_new_file(entry.path().string().c_str(), "r");
+		X509* intermediate = bio != NULL ? PEM_read_bio_X509(bio, NULL, NULL, NULL) : NULL;
+		BIO_free(bio);
+		if (intermediate == NULL) {
+			printf("ERROR: Failed to load intermediate from %s.\n", entry.path().string().c_str());
+			return false;
+		}
+		sk_X509_push(this->intermediates, intermediate);
+		this->intermediateCRLs.push_back(fs::path(entry.path()).replace_extension(".crl").string());
+	}
+
+	loadRevoked();
+	return true;
+}
+
+void Auditor::loadRevoked()
+{
+	loadCRL((fs::path(this->pkiPath) / "crl.crt").string(), this->ca);
+	for (int i = 0; i < sk_X509_num(this->intermediates); i++)
+		loadCRL(this->intermediateCRLs[i], sk_X509_value(this->intermediates, i));
+
+	// crl-verify dir entries are named after the decimal serial
+	std::error_code ec;
+	for (const auto& entry : fs::directory_iterator(fs::path(this->pkiPath) / "crl", ec)) {
+		BIGNUM* bn = NULL;
+		if (!BN_dec2bn(&bn, entry.path().filename().string().c_str()))
+			continue;
+		char* hex = BN_bn2hex(bn);
+		this->revoked.insert(hex);
+		OPENSSL_free(hex);
+		BN_free(bn);
+	}
+}
+
+void Auditor::loadCRL(const std::string& crlPath, X509* issuer)
+{
+	BIO* bio = BIO_new_file(crlPath.c_str(), "r");
+	if (bio == NULL)
+		return;
+	X509_CRL* crl = PEM_read_bio_X509_CRL(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	// A CRL the CA didn't sign would be rejected by OpenVPN, the revocations in it don't count
+	if (crl == NULL || X509_CRL_verify(crl, X509_get0_pubkey(issuer)) != 1)
+		this->crlValid = false;
+	if (crl != NULL) {
+		STACK_OF(X509_REVOKED)* entries = X509_CRL_get_REVOKED(crl);
+		for (int i = 0; i < sk_X509_REVOKED_num(entries); i++)
+			this->revoked.insert(serialToHex(X509_REVOKED_get0_serialNumber(sk_X509_REVOKED_value(entries, i))));
+		X509_CRL_free(crl);
+	}
+}
+
+std::vector<std::string> Auditor::identities()
+{
+	// Anything with a cert or a key, so a key left without its cert shows up too
+	std::set<std::string> names;
+	for (const auto& entry : fs::directory_iterator(this->pkiPath)) {
+		std::string extension = entry.path().extension().string();
+		if (extension != ".crt" && extension != ".key")
+			continue;
+		std::string name = entry.path().stem().string();
+		if (name == "ca" || name == "crl" || name.rfind("tls-crypt", 0) == 0 || name == "ta")
+			continue;
+		names.insert(name);
+	}
+	return std::vector<std::string>(names.begin(), names.end());
+}
+
+bool Auditor::Run(std::ostream& report, size_t threads)
+{
+	std::vector<Result> results;
+	try {
+		for (const std::string& name : identities()) {
+			results.emplace_back();
+			results.back().name = name;
+		}
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to list identities. %s\n", e.what());
+		return false;
+	}
+
+	// Work is handed out one identity at a time, the parse/verify cost varies with key type
+	std::atomic<size_t> next{ 0 };
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i < std::max<size_t>(1, threads); i++) {
+		workers.emplace_back([&] {
+			size_t index;
+			while ((index = next++) < results.size())
+				check(results[index]);
+		});
+	}
+	for (std::thread& t : workers)
+		t.join();
+
+	size_t failed = 0;
+	for (const Result& result : results) {
+		Json line = Json::object();
+		line["name"] = result.name;
+		line["serial"] = result.serial;
+		line["notAfter"] = (long long)result.notAfter;
+		line["chain"] = result.chain;
+		line["key"] = result.key;
+		line["revoked"] = result.revoked;
+		line["expired"] = result.expired;
+		line["bundle"] = result.bundle;
+		line["ok"] = result.ok();
+		if (!result.error.empty())
+			line["error"] = result.error;
+		report << line.dump() << "\n";
+		if (!result.ok())
+			failed++;
+	}
+
+	Json summary = Json::object();
+	summary["identities"] = (long long)results.size();
+	summary["failed"] = (long long)failed;
+	summary["revocations"] = (long long)this->revoked.size();
+	summary["crlValid"] = this->crlValid;
+	summary["caNotAfter"] = (long long)toTime(X509_get0_notAfter(this->ca));
+	summary["caExpired"] = toTime(X509_get0_notAfter(this->ca)) < this->now;
+	report << summary.dump() << "\n";
+	report.flush();
+	return failed == 0 && this->crlValid;
+}
+
+void Auditor::check(Result& result)
+{
+	std::string certPath = (fs::path(this->pkiPath) / (result.name + ".crt")).string();
+	std::string keyPath = (fs::path(this->pkiPath) / (result.name + ".key")).string();
+
+	X509* cert = NULL;
+	BIO* bio = BIO_new_file(certPath.c_str(), "r");
+	if (bio != NULL) {
+		cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+		BIO_free(bio);
+	}
+	if (cert == NULL) {
+		result.error = "certificate missing or unreadable";
+		return;
+	}
+
+	result.serial = serialToHex(X509_get0_serialNumber(cert));
+	result.notAfter = toTime(X509_get0_notAfter(cert));
+	result.expired = result.notAfter < this->now;
+	result.revoked = this->revoked.count(result.serial) > 0;
+
+	// The store is only read here, each thread verifies with its own context
+	X509_STORE_CTX* ctx = X509_STORE_CTX_new();
+	if (ctx != NULL && X509_STORE_CTX_init(ctx, this->store, cert, this->intermediates)) {
+		result.chain = X509_verify_cert(ctx) == 1;
+		if (!result.chain)
+			result.error = X509_verify_cert_error_string(X509_STORE_CTX_get_error(ctx));
+	}
+	X509_STORE_CTX_free(ctx);
+
+	bio = BIO_new_file(keyPath.c_str(), "r");
+	if (bio != NULL) {
+		EVP_PKEY* key = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+		BIO_free(bio);
+		if (key != NULL) {
+			result.key = X509_check_private_key(cert, key) == 1;
+			EVP_PKEY_free(key);
+		}
+	}
+	X509_free(cert);
+
+	// The server's files live in server/, everyone else gets a bundle
+	if (result.name != "server" && this->RequireBundles)
+		result.bundle = fs::exists(fs::path(this->clientsPath) / (result.name + ".visz"));
+}
+
+std::string Auditor::serialToHex(const ASN1_INTEGER* serial)
+{
+	BIGNUM* bn = ASN1_INTEGER_to_BN(serial, NULL);
+	char* hex = BN_bn2hex(bn);
+	std::string result(hex);
+	OPENSSL_free(hex);
+	BN_free(bn);
+	return result;
+}
+
+time_t Auditor::toTime(const ASN1_TIME* time)
+{
+	struct tm tm;
+	if (time == NULL || !ASN1_TIME_to_tm(time, &tm))
+		return 0;
+	return timegm(&tm);
+}
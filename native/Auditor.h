@@ -0,0 +1,69 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include <openssl/x509.h>
+
+#include <ctime>
+#include <ostream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// Checks every identity in pki: chains to the CA, matches its key, isn't revoked or expired and
+// (for clients) has a bundle. The trust store and revocation list are built once up front and
+// shared read-only by the worker threads.
+class Auditor
+{
+public:
+	explicit Auditor(const std::string& path);
+	~Auditor();
+	Auditor(const Auditor&) = delete;
+	Auditor& operator=(const Auditor&) = delete;
+
+	bool Load();
+	// Writes one JSON object per identity followed by a summary, one per line. False if any
+	// identity failed a check.
+	bool Run(std::ostream& report, size_t threads);
+
+	// Off when bundles are sent to an output sink rather than kept in clients/
+	bool RequireBundles = true;
+
+private:
+	struct Result
+	{
+		std::string name;
+		std::string serial;
+		std::string error;
+		time_t notAfter = 0;
+		bool chain = false;
+		bool key = false;
+		bool revoked = false;
+		bool expired = false;
+		bool bundle = true;
+		bool ok() const { return error.empty() && chain && key && !revoked && !expired && bundle; }
+	};
+
+	std::string path;
+	std::string pkiPath;
+	std::string clientsPath;
+	time_t now;
+
+	X509* ca = nullptr;
+	X509_STORE* store = nullptr;
+	// Intermediates from pki/issuers, offered as untrusted links between a client and the CA
+	STACK_OF(X509)* intermediates = nullptr;
+	std::vector<std::string> intermediateCRLs;
+	// Upper case hex serials from crl.crt, the intermediates' CRLs and the crl/ directory. Serials
+	// are unique across intermediates, so one set covers every issuer.
+	std::unordered_set<std::string> revoked;
+	bool crlValid = true;
+
+	std::vector<std::string> identities();
+	void check(Result& result);
+	void loadRevoked();
+	void loadCRL(const std::string& crlPath, X509* issuer);
+
+	static std::string serialToHex(const ASN1_INTEGER* serial);
+	static time_t toTime(const ASN1_TIME* time);
+};
@@ -0,0 +1,51 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// Blocking producer/consumer queue. Add blocks while full, Take blocks while empty and returns
+// false once the queue has been completed and drained.
+template <typename T>
+class BoundedQueue
+{
+public:
+	explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+	void Add(T item)
+	{
+		std::unique_lock<std::mutex> l(lock);
+		notFull.wait(l, [this] { return items.size() < capacity; });
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+	}
+
+	bool Take(T& item)
+	{
+		std::unique_lock<std::mutex> l(lock);
+		notEmpty.wait(l, [this] { return !items.empty() || completed; });
+		if (items.empty())
+			return false;
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	void CompleteAdding()
+	{
+		std::lock_guard<std::mutex> l(lock);
+		completed = true;
+		notEmpty.notify_all();
+	}
+
+private:
+	size_t capacity;
+	bool completed = false;
+	std::deque<T> items;
+	std::mutex lock;
+	std::condition_variable notFull;
+	std::condition_variable notEmpty;
+};
@@ -0,0 +1,217 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "CLI.h"
+
+#include <cstdio>
+#include <stdexcept>
+
+CLI::CLI(const std::string& exePath)
+{
+	size_t slash = exePath.find_last_of("/\\");
+	this->name = slash == std::string::npos ? exePath : exePath.substr(slash + 1);
+
+	OptionTypeStrings = {
+		"--name", "--path", "--keysize", "--days", "--algorithm", "--curve", "--suffix", "--crl-mode",
+		"--port", "--bind", "--tls-crypt", "--batch", "--routes", "--subnet", "--clients", "--workers", "--profile", "--dco",
+		"--metrics", "--metrics-days", "--jobs", "--operations", "--seconds", "--issuer", "--output", "--roster", "--server-rsa-primes", "--compact-certs", "--force"
+	};
+	ModeStrings = { "client", "init", "revoke", "--show-curves", "--help", "--about", "ocsp-serve", "regenerate", "verify", "stress", "bench-handshake", "issuer", "reconcile" };
+	AlgStrings = { "rsa", "ecdsa", "eddsa" };
+	TLSCryptStrings = { "none", "v1", "v2" };
+	ProfileStrings = { "none", "throughput", "latency", "mobile" };
+}
+
+int CLI::indexOf(const std::vector<std::string>& list, const std::string& value)
+{
+	for (size_t i = 0; i < list.size(); i++) {
+		if (list[i] == value)
+			return (int)i;
+	}
+	return -1;
+}
+
+CLI::OptionType CLI::getOption(const std::string& option) const
+{
+	int raw = indexOf(OptionTypeStrings, option);
+	if (raw >= 0)
+		return static_cast<OptionType>(raw);
+	return OptionType::Unknown;
+}
+
+CLI::Mode CLI::getMode(const std::string& mode) const
+{
+	int raw = indexOf(ModeStrings, mode);
+	if (raw >= 0)
+		return static_cast<Mode>(raw);
+	return Mode::Unknown;
+}
+
+OpenSSLHelper::Algorithm CLI::getAlgorithm(const std::string& alg) const
+{
+	int raw = indexOf(AlgStrings, alg);
+	if (raw >= 0)
+		return static_cast<OpenSSLHelper::Algorithm>(raw);
+	throw std::runtime_error("Unknown Algorithm: " + alg);
+}
+
+TLSCrypt::Mode CLI::getTLSCryptMode(const std::string& mode) const
+{
+	int raw = indexOf(TLSCryptStrings, mode);
+	if (raw >= 0)
+		return static_cast<TLSCrypt::Mode>(raw);
+	throw std::runtime_error("Unknown tls-crypt mode: " + mode);
+}
+
+Tuning::Profile CLI::getTuningProfile(const std::string& profile) const
+{
+	int raw = indexOf(ProfileStrings, profile);
+	if (raw >= 0)
+		return static_cast<Tuning::Profile>(raw);
+	throw std::runtime_error("Unknown profile: " + profile);
+}
+
+void CLI::printUsage() const
+{
+	const char* n = name.c_str();
+	printf("\n");
+	printf("Usage: %s init\n", n);
+	printf("Initialise configuration, creates server configuration\n");
+	printf("Optional:\n");
+	printf("  --path DIR      Directory configurations are stored (Current Directory default)\n");
+	printf("  --keysize size  Change Keysize (2048 default)\n");
+	printf("  --days days     Days certificates are valid (3650 default)\n");
+	printf("  --algorithm (rsa|ecdsa|eddsa) Algorithm to use (RSA default)\n");
+	printf("                                ECDSA defaults to secp384r1. EDDSA defaults to ED25519\n");
+	printf("  --curve curve_name            ECDSA/EDDSA curve to use\n");
+	printf("  --suffix suffix  Appends suffix to server file names. Simplifies running multiple servers slightly.\n");
+	printf("  --crl-mode (file|dir)         Revocation list format (file default)\n");
+	printf("                                dir revokes by creating a file per serial, no CRL signing required\n");
+	printf("  --tls-crypt (none|v1|v2)      Control channel key (v1 default)\n");
+	printf("                                v2 issues a unique key per client and requires OpenVPN 2.5+\n");
+	printf("  --routes FILE   Push routes for the prefixes in FILE, one per line, merged into the fewest CIDR blocks\n");
+	printf("  --subnet CIDR   Tunnel subnet clients are addressed from (10.8.0.0/24 default)\n");
+	printf("  --clients count Size the tunnel subnet for this many clients\n");
+	printf("  --workers count Server processes to run, one per core (1 default)\n");
+	printf("                                Each listens on the next port with its own tun device and subnet\n");
+	printf("  --profile (throughput|latency|mobile) Tune ciphers, buffers and MTU (none default)\n");
+	printf("                                Requires OpenVPN 2.5+\n");
+	printf("  --dco           Keep the data channel offloaded to the kernel, AEAD ciphers and no compression\n");
+	printf("                                Requires OpenVPN 2.6+ with the ovpn-dco module\n");
+	printf("  --server-rsa-primes (2|3|4) Primes in the RSA server key, more make server handshakes faster (2 default)\n");
+	printf("                                3 needs a key size of 1024+, 4 needs 4096+\n");
+	printf("  --compact-certs Certificates with only a Common Name and the extensions OpenVPN checks\n");
+	printf("                                Keeps the handshake small, eddsa is the default algorithm with it\n");
+	printf("  --output (dir|tar|exec:COMMAND) Where server files go (dir default)\n");
+	printf("                                tar streams them to stdout, exec runs COMMAND per file with it on stdin\n");
+	printf("\n");
+	printf("Usage: %s client\n", n);
+	printf("Creates client configurations\n");
+	printf("Optional:\n");
+	printf("  --path DIR      Directory configurations are stored (Current Directory default)\n");
+	printf("  --name NAME     Prefill Common Name\n");
+	printf("  --batch FILE    Create a client for every Common Name in FILE, one per line\n");
+	printf("  --issuer NAME   Sign with the intermediate NAME instead of the root CA\n");
+	printf("  --output (dir|tar|exec:COMMAND) Where client bundles go (dir default)\n");
+	printf("\n");
+	printf("Usage: %s issuer\n", n);
+	printf("Create an intermediate CA signed by the root, issuing from its own block of serials\n");
+	printf("Optional:\n");
+	printf("  --path DIR      Directory configurations are stored (Current Directory default)\n");
+	printf("  --name NAME     Name of the intermediate, for example a site or worker\n");
+	printf("\n");
+	printf("Usage: %s revoke\n", n);
+	printf("Revoke a client and create/update the CRL\n");
+	printf("Optional:\n");
+	printf("  --path DIR      Directory configurations are stored (Current Directory default)\n");
+	printf("  --name NAME     Prefill Common Name\n");
+	printf("\n");
+	printf("Usage: %s reconcile\n", n);
+	printf("Issue every client in a roster that hasn't got a certificate and revoke every client that isn't in it\n");
+	printf("Revocations share one CRL update and the server configuration is rebuilt once\n");
+	printf("Required:\n");
+	printf("  --roster FILE   Common Names that should have access, one per line\n");
+	printf("Optional:\n");
+	printf("  --path DIR      Directory configurations are stored (Current Directory default)\n");
+	printf("  --issuer NAME   Sign new clients with the intermediate NAME instead of the root CA\n");
+	printf("  --output (dir|tar|exec:COMMAND) Where new client bundles and server files go (dir default)\n");
+	printf("  --force         Revoke every client or more than a quarter of them without asking\n");
+	printf("\n");
+	printf("Usage: %s ocsp-serve\n", n);
+	printf("Run an OCSP responder answering from precomputed responses\n");
+	printf("Optional:\n");
+	printf("  --path DIR      Directory configurations are stored (Current Directory default)\n");
+	printf("  --port port     Port to listen on (8888 default)\n");
+	printf("  --bind address  Address to listen on (127.0.0.1 default)\n");
+	printf("\n");
+	printf("Usage: %s regenerate\n", n);
+	printf("Rebuild the server configuration and every client bundle, rewriting only what changed\n");
+	printf("Optional:\n");
+	printf("  --path DIR      Directory configurations are stored (Current Directory default)\n");
+	printf("  --output (dir|tar|exec:COMMAND) Send everything, changed or not, somewhere other than the directory\n");
+	printf("\n");
+	printf("Usage: %s verify\n", n);
+	printf("Check every identity chains to the CA, matches its key, isn't revoked or expired and has a bundle\n");
+	printf("Writes one JSON object per identity and a summary, one per line\n");
+	printf("Optional:\n");
+	printf("  --path DIR      Directory configurations are stored (Current Directory default)\n");
+	printf("  --output (dir|tar|exec:COMMAND) Where client bundles were sent, only dir expects them in clients/\n");
+	printf("\n");
+	printf("Usage: %s stress\n", n);
+	printf("Run client, revoke and regenerate as concurrent processes, then check the PKI is consistent\n");
+	printf("Issues and revokes real clients, use a scratch directory made with init\n");
+	printf("Optional:\n");
+	printf("  --path DIR      Directory configurations are stored (Current Directory default)\n");
+	printf("  --jobs count    Processes to run at once (8 default)\n");
+	printf("  --operations count            Operations to run in total (64 default)\n");
+	printf("\n");
+	printf("Usage: %s bench-handshake\n", n);
+	printf("Time full TLS handshakes between the server and a client identity in memory, per core\n");
+	printf("Uses the TLS settings of the generated server config\n");
+	printf("Optional:\n");
+	printf("  --path DIR      Directory configurations are stored (Current Directory default)\n");
+	printf("  --name NAME     Client identity to connect with (first client default)\n");
+	printf("  --seconds count How long to run for (3 default)\n");
+	printf("  --server-rsa-primes (2|3|4) Run again with a server key of this many primes, signed by the CA, and compare\n");
+	printf("\n");
+	printf("Metrics, for init, client, revoke, reconcile, regenerate and ocsp-serve:\n");
+	printf("  --metrics FILE  Write Prometheus metrics to FILE for the node_exporter textfile collector\n");
+	printf("                                Counters carry on from the values already in FILE\n");
+	printf("  --metrics-days days           Window for the certificates expiring gauge (30 default)\n");
+	printf("\n");
+	printf("Usage: %s --show-curves\n", n);
+	printf("Show available ECDSA/EdDSA curves\n");
+	printf("\n");
+	printf("Usage: %s --help\n", n);
+	printf("Displays this information\n");
+	printf("\n");
+	printf("Usage: %s --about\n", n);
+	printf("Displays information about this tool\n");
+}
+
+void CLI::printAbout() const
+{
+	printf("\n");
+	printf("%s Tool\n", name.c_str());
+	printf("Using %s\n", OpenSSLHelper::OpenSSLVersion().c_str());
+	printf("\n");
+	printf("Copyright SparkLabs Pty Ltd 2018\n");
+	printf("Licensed under Creative Commons Attribution-NoDerivatives 4.0 International (CC BY-ND 4.0)\n");
+	printf("Portions of the code included in or with this tool may container, or may be derived from, third-party code, including without limitation, open source software. All use of third-party software is subject to and governed by the respective licenses for the third-party software. These licenses are available at https://github.com/thesparklabs/openvpn-configuration-generator/blob/master/LICENSE\n");
+}
+
+void CLI::showCurves() const
+{
+	printf("EdDSA Curves:\n");
+	for (const std::string& ed : OpenSSLHelper::GetEdCurves()) {
+		printf("\t%s\n", ed.c_str());
+	}
+	printf("NOTE: EdDSA support requires OpenVPN 2.4.7+, OpenSSL 1.1.1+ and Viscosity 1.8.2+.\n");
+	printf("\n");
+
+	printf("ECDSA Curves:\n");
+	for (const std::string& ec : OpenSSLHelper::GetECCurves()) {
+		printf("\t%s\n", ec.c_str());
+	}
+	printf("NOTE: Not all curves may be supported.\n");
+	printf("Check 'openvpn --show-curves' on your server and ensure you are using the latest verison of Viscosity.\n");
+}
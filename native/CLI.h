@@ -0,0 +1,42 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include "OpenSSLHelper.h"
+#include "TLSCrypt.h"
+#include "Tuning.h"
+
+#include <string>
+#include <vector>
+
+class CLI
+{
+public:
+	explicit CLI(const std::string& exePath);
+
+	enum class OptionType {
+		CommonName, Path, KeySize, ValidDays, Algorithm, Curve, Suffix, CRLMode, Port, Bind, TLSCrypt, Batch, Routes, Subnet, Clients, Workers, Profile, DCO, Metrics, MetricsDays, Jobs, Operations, Seconds, Issuer, Output, Roster, ServerRSAPrimes, CompactCerts, Force, Unknown
+	};
+	enum class Mode {
+		CreateClient, InitSetup, Revoke, ShowCurves, Help, About, OCSPServe, Regenerate, Verify, Stress, BenchHandshake, CreateIssuer, Reconcile, Unknown
+	};
+
+	OptionType getOption(const std::string& option) const;
+	Mode getMode(const std::string& mode) const;
+	OpenSSLHelper::Algorithm getAlgorithm(const std::string& alg) const;
+	TLSCrypt::Mode getTLSCryptMode(const std::string& mode) const;
+	Tuning::Profile getTuningProfile(const std::string& profile) const;
+	void printUsage() const;
+	void printAbout() const;
+	void showCurves() const;
+
+private:
+	std::string name;
+	std::vector<std::string> OptionTypeStrings;
+	std::vector<std::string> ModeStrings;
+	std::vector<std::string> AlgStrings;
+	std::vector<std::string> TLSCryptStrings;
+	std::vector<std::string> ProfileStrings;
+
+	static int indexOf(const std::vector<std::string>& list, const std::string& value);
+};
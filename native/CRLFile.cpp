@@ -0,0 +1,410 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "CRLFile.h"
+#include "DirectoryLock.h"
+
+#include <openssl/pem.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+// A file mapped read only for as long as this is in scope
+class MappedFile
+{
+public:
+	explicit MappedFile(const std::string& path)
+	{
+		int fd = open(path.c_str(), O_RDONLY);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) != 0) {
+			std::string error = strerror(errno);
+			if (fd >= 0)
+				close(fd);
+			throw std::runtime_error(path + ": " + error);
+		}
+		this->size = (size_t)st.st_size;
+		if (this->size > 0) {
+			void* mapped = mmap(NULL, this->size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (mapped == MAP_FAILED) {
+				std::string error = strerror(errno);
+				close(fd);
+				throw std::runtime_error(path + ": " + error);
+			}
+			this->data = (const unsigned char*)mapped;
+		}
+		close(fd);
+	}
+	~MappedFile()
+	{
+		if (this->data != nullptr)
+			munmap((void*)this->data, this->size);
+	}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const unsigned char* data = nullptr;
+	size_t size = 0;
+};
+
+// One DER element: where it starts, where its contents start and where it ends
+struct Element
+{
+	unsigned char tag;
+	size_t start;
+	size_t content;
+	size_t end;
+};
+
+bool readElement(const unsigned char* data, size_t end, size_t offset, Element& element)
+{
+	if (offset + 2 > end)
+		return false;
+	element.tag = data[offset];
+	element.start = offset;
+	size_t length = data[offset + 1];
+	offset += 2;
+	if (length & 0x80) {
+		// Long form, nothing in a CRL needs more than four length bytes
+		size_t count = length & 0x7F;
+		if (count == 0 || count > 4 || offset + count > end)
+			return false;
+		length = 0;
+		for (size_t i = 0; i < count; i++)
+			length = (length << 8) | data[offset++];
+	}
+	if (length > end - offset)
+		return false;
+	element.content = offset;
+	element.end = offset + length;
+	return true;
+}
+
+std::string encodeTime(const ASN1_TIME* time)
+{
+	unsigned char* der = NULL;
+	int length = i2d_ASN1_TIME(time, &der);
+	if (length <= 0)
+		throw std::runtime_error("Failed to encode time. " + OpenSSLHelper::LastError());
+	std::string out((const char*)der, length);
+	OPENSSL_free(der);
+	return out;
+}
+
+// The parts of a CRL that are carried over or replaced, as offsets into the mapped DER.
+// RFC 5280 section 5.1: CertificateList and TBSCertList.
+struct CRLLayout
+{
+	Element tbs;
+	Element signatureAlgorithm;
+	Element version;
+	Element tbsSignature;
+	Element issuer;
+	Element revoked;
+	Element extensions;
+	bool hasVersion = false;
+	bool hasRevoked = false;
+	bool hasExtensions = false;
+};
+
+bool isTime(const Element& element)
+{
+	return element.tag == V_ASN1_UTCTIME || element.tag == V_ASN1_GENERALIZEDTIME;
+}
+
+bool parseLayout(const unsigned char* data, size_t size, CRLLayout& layout)
+{
+	Element outer;
+	if (!readElement(data, size, 0, outer) || outer.tag != 0x30 || outer.end != size)
+		return false;
+	if (!readElement(data, outer.end, outer.content, layout.tbs) || layout.tbs.tag != 0x30)
+		return false;
+	if (!readElement(data, outer.end, layout.tbs.end, layout.signatureAlgorithm) || layout.signatureAlgorithm.tag != 0x30)
+		return false;
+
+	size_t end = layout.tbs.end;
+	Element element;
+	if (!readElement(data, end, layout.tbs.content, element))
+		return false;
+	if (element.tag == V_ASN1_INTEGER) {
+		layout.version = element;
+		layout.hasVersion = true;
+		if (!readElement(data, end, element.end, element))
+			return false;
+	}
+	layout.tbsSignature = element;
+	if (layout.tbsSignature.tag != 0x30 || !readElement(data, end, element.end, layout.issuer) || layout.issuer.tag != 0x30)
+		return false;
+	// thisUpdate, then nextUpdate which is optional
+	if (!readElement(data, end, layout.issuer.end, element) || !isTime(element))
+		return false;
+	size_t offset = element.end;
+	if (offset < end && readElement(data, end, offset, element) && isTime(element))
+		offset = element.end;
+	if (offset < end) {
+		if (!readElement(data, end, offset, element))
+			return false;
+		if (element.tag == 0x30) {
+			layout.revoked = element;
+			layout.hasRevoked = true;
+			offset = element.end;
+		}
+	}
+	if (offset < end) {
+		if (!readElement(data, end, offset, element) || element.tag != 0xA0 || element.end != end)
+			return false;
+		layout.extensions = element;
+		layout.hasExtensions = true;
+	}
+	return true;
+}
+
+std::string slice(const unsigned char* data, const Element& element)
+{
+	return std::string((const char*)data + element.start, element.end - element.start);
+}
+
+long long countEntries(const unsigned char* data, size_t size)
+{
+	CRLLayout layout;
+	if (!parseLayout(data, size, layout))
+		return -1;
+	long long entries = 0;
+	Element element;
+	for (size_t offset = layout.revoked.content; layout.hasRevoked && offset < layout.revoked.end; offset = element.end) {
+		if (!readElement(data, layout.revoked.end, offset, element))
+			return -1;
+		entries++;
+	}
+	return entries;
+}
+
+// Only the base64 is decoded, the entries are left alone
+std::string pemToDER(BIO* bio)
+{
+	unsigned char* der = NULL;
+	long length = 0;
+	if (bio == NULL || PEM_bytes_read_bio(&der, &length, NULL, PEM_STRING_X509_CRL, bio, NULL, NULL) != 1)
+		throw std::runtime_error("Failed to read CRL. " + OpenSSLHelper::LastError());
+	std::string data((const char*)der, length);
+	OPENSSL_free(der);
+	return data;
+}
+
+}
+
+CRLFile::CRLFile(const std::string& pemPath)
+{
+	this->pemPath = pemPath;
+	size_t dot = pemPath.rfind('.');
+	this->derPath = (dot == std::string::npos ? pemPath : pemPath.substr(0, dot)) + ".der";
+}
+
+bool CRLFile::Exists() const
+{
+	struct stat st;
+	return stat(this->pemPath.c_str(), &st) == 0 || stat(this->derPath.c_str(), &st) == 0;
+}
+
+bool CRLFile::derCurrent() const
+{
+	// The PEM is always written after the DER, so a PEM that is newer was replaced by something else
+	struct stat der, pem;
+	if (stat(this->derPath.c_str(), &der) != 0)
+		return false;
+	if (stat(this->pemPath.c_str(), &pem) != 0)
+		return true;
+	return der.st_mtime >= pem.st_mtime;
+}
+
+void CRLFile::Create(const Identity& issuer, int validDays)
+{
+	if (Exists())
+		return;
+	X509_CRL* crl = X509_CRL_new();
+	ASN1_TIME* now = X509_gmtime_adj(NULL, 0);
+	ASN1_TIME* next = X509_gmtime_adj(NULL, (long)validDays * 24 * 60 * 60);
+	X509_CRL_set_version(crl, 1);
+	X509_CRL_set_issuer_name(crl, X509_get_subject_name(issuer.cert));
+	X509_CRL_set1_lastUpdate(crl, now);
+	X509_CRL_set1_nextUpdate(crl, next);
+	ASN1_TIME_free(now);
+	ASN1_TIME_free(next);
+	unsigned char* der = NULL;
+	int length = X509_CRL_sign(crl, issuer.key, OpenSSLHelper::SigningDigest(issuer.key)) ? i2d_X509_CRL(crl, &der) : 0;
+	X509_CRL_free(crl);
+	if (length <= 0)
+		throw std::runtime_error("Failed to sign CRL. " + OpenSSLHelper::LastError());
+	std::string data((const char*)der, length);
+	OPENSSL_free(der);
+	write(data);
+}
+
+void CRLFile::convertPEM()
+{
+	BIO* bio = BIO_new_file(this->pemPath.c_str(), "r");
+	std::string der;
+	try {
+		der = pemToDER(bio);
+	}
+	catch (...) {
+		BIO_free(bio);
+		throw;
+	}
+	BIO_free(bio);
+	DirectoryLock::WriteFile(this->derPath, der);
+}
+
+void CRLFile::Revoke(const Identity& issuer, const std::string& certData, int validDays)
+{
+	Revoke(issuer, std::vector<std::string>{ certData }, validDays);
+}
+
+void CRLFile::Revoke(const Identity& issuer, const std::vector<std::string>& certs, int validDays)
+{
+	if (certs.empty())
+		return;
+	size_t first = 0;
+	if (!Exists()) {
+		// Nothing to splice onto, the first CRL is built whole with the first certificate
+		std::string pem = OpenSSLHelper::CreateCRL(issuer, nullptr, certs[0], validDays);
+		BIO* bio = BIO_new_mem_buf(pem.data(), (int)pem.size());
+		std::string data;
+		try {
+			data = pemToDER(bio);
+		}
+		catch (...) {
+			BIO_free(bio);
+			throw;
+		}
+		BIO_free(bio);
+		write(data);
+		if (certs.size() == 1)
+			return;
+		first = 1;
+	}
+	if (!derCurrent())
+		convertPEM();
+
+	// revokedCertificate: serial and revocation date, one per certificate, all signed together
+	ASN1_TIME* now = X509_gmtime_adj(NULL, 0);
+	ASN1_TIME* next = X509_gmtime_adj(NULL, (long)validDays * 24 * 60 * 60);
+	std::string entry;
+	std::string failure;
+	for (size_t i = first; i < certs.size() && failure.empty(); i++) {
+		BIO* bio = BIO_new_mem_buf(certs[i].data(), (int)certs[i].size());
+		X509* cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+		BIO_free(bio);
+		if (cert == NULL) {
+			failure = "Failed to parse certificate. " + OpenSSLHelper::LastError();
+			break;
+		}
+		X509_REVOKED* revoked = X509_REVOKED_new();
+		X509_REVOKED_set_serialNumber(revoked, X509_get_serialNumber(cert));
+		X509_REVOKED_set_revocationDate(revoked, now);
+		X509_free(cert);
+		unsigned char* entryDER = NULL;
+		int entryLength = i2d_X509_REVOKED(revoked, &entryDER);
+		X509_REVOKED_free(revoked);
+		if (entryLength <= 0) {
+			failure = "Failed to encode revocation. " + OpenSSLHelper::LastError();
+			break;
+		}
+		entry.append((const char*)entryDER, entryLength);
+		OPENSSL_free(entryDER);
+	}
+	std::string thisUpdate = encodeTime(now);
+	std::string nextUpdate = encodeTime(next);
+	ASN1_TIME_free(now);
+	ASN1_TIME_free(next);
+	if (!failure.empty())
+		throw std::runtime_error(failure);
+
+	unsigned char* nameDER = NULL;
+	int nameLength = i2d_X509_NAME(X509_get_subject_name(issuer.cert), &nameDER);
+	std::string issuerName(nameLength > 0 ? (const char*)nameDER : "", nameLength > 0 ? nameLength : 0);
+	OPENSSL_free(nameDER);
+
+	std::string tbs;
+	std::string signatureAlgorithm;
+	{
+		MappedFile mapped(this->derPath);
+		CRLLayout layout;
+		if (!parseLayout(mapped.data, mapped.size, layout))
+			throw std::runtime_error("Failed to parse existing CRL " + this->derPath);
+		if (slice(mapped.data, layout.issuer) != issuerName)
+			throw std::runtime_error("Existing CRL was not issued by this CA");
+		signatureAlgorithm = slice(mapped.data, layout.signatureAlgorithm);
+		if (slice(mapped.data, layout.tbsSignature) != signatureAlgorithm)
+			throw std::runtime_error("Existing CRL has mismatched signature algorithms");
+
+		// Everything up to the issuer is kept, the update times are replaced and the new entry goes
+		// after the existing ones. Order doesn't matter, OpenSSL sorts entries when it looks one up.
+		std::string revokedList;
+		if (layout.hasRevoked)
+			revokedList.assign((const char*)mapped.data + layout.revoked.content, layout.revoked.end - layout.revoked.content);
+		revokedList += entry;
+		std::string content;
+		content.reserve(layout.tbs.end - layout.tbs.content + entry.size() + 64);
+		if (layout.hasVersion)
+			content += slice(mapped.data, layout.version);
+		content += signatureAlgorithm;
+		content += issuerName;
+		content += thisUpdate;
+		content += nextUpdate;
+		content += OpenSSLHelper::EncodeDER(0x30, revokedList);
+		if (layout.hasExtensions)
+			content += slice(mapped.data, layout.extensions);
+		tbs = OpenSSLHelper::EncodeDER(0x30, content);
+	}
+
+	// Signed the same way X509_CRL_sign would, over the encoded TBSCertList
+	write(OpenSSLHelper::SignDER(tbs, signatureAlgorithm, issuer.key));
+}
+
+long long CRLFile::Entries()
+{
+	try {
+		if (derCurrent()) {
+			MappedFile mapped(this->derPath);
+			return countEntries(mapped.data, mapped.size);
+		}
+		// Not converted yet, decoded in memory and left for the next revoke to write out
+		BIO* bio = BIO_new_file(this->pemPath.c_str(), "r");
+		std::string der;
+		try {
+			der = pemToDER(bio);
+		}
+		catch (...) {
+			BIO_free(bio);
+			throw;
+		}
+		BIO_free(bio);
+		return countEntries((const unsigned char*)der.data(), der.size());
+	}
+	catch (const std::exception&) {
+		return -1;
+	}
+}
+
+void CRLFile::write(const std::string& der)
+{
+	// DER first, so a PEM that is newer than it can only have come from somewhere else
+	BIO* bio = BIO_new(BIO_s_mem());
+	PEM_write_bio(bio, PEM_STRING_X509_CRL, "", (const unsigned char*)der.data(), (long)der.size());
+	char* data;
+	long length = BIO_get_mem_data(bio, &data);
+	std::string pem(data, length);
+	BIO_free(bio);
+
+	DirectoryLock::WriteFile(this->derPath, der);
+	DirectoryLock::WriteFile(this->pemPath, pem);
+}
@@ -0,0 +1,40 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include "OpenSSLHelper.h"
+
+#include <string>
+#include <vector>
+
+// The CRL at pki/crl.crt together with a DER copy beside it in pki/crl.der. Revoking maps the DER
+// and splices the new entry onto the end of the revoked list, then signs the result, so existing
+// entries are never decoded or converted through base64. The PEM is written from the same bytes
+// for OpenVPN. A PEM newer than the DER, or one without a DER, is converted once.
+class CRLFile
+{
+public:
+	explicit CRLFile(const std::string& pemPath);
+
+	bool Exists() const;
+	// Writes a CRL with no entries if there isn't one. OpenVPN checks every certificate in a chain
+	// against a CRL from its issuer, so each CA needs one once any CRL is in use. Throws on failure.
+	void Create(const Identity& issuer, int validDays);
+	// Adds the certificate to the CRL, creating it if there isn't one, and writes both copies.
+	// Throws on failure. Call with the directory lock held.
+	void Revoke(const Identity& issuer, const std::string& certData, int validDays);
+	// Adds every certificate with a single signature
+	void Revoke(const Identity& issuer, const std::vector<std::string>& certs, int validDays);
+	// Number of revoked entries, counted from the DER framing. -1 if the CRL can't be read.
+	long long Entries();
+
+	const std::string& DERPath() const { return derPath; }
+
+private:
+	std::string pemPath;
+	std::string derPath;
+
+	bool derCurrent() const;
+	void convertPEM();
+	void write(const std::string& der);
+};
@@ -0,0 +1,198 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "CertificateIndex.h"
+#include "DirectoryLock.h"
+
+#include <openssl/asn1.h>
+#include <openssl/bn.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+bool CertificateIndex::Load(const std::string& pkiPath)
+{
+	std::lock_guard<std::mutex> l(this->lock);
+	this->entries.clear();
+
+	std::ifstream in(this->path);
+	if (in) {
+		std::string line;
+		while (std::getline(in, line)) {
+			// status, expiry, revocation date, serial, file name, subject
+			std::vector<std::string> fields;
+			std::stringstream ss(line);
+			std::string field;
+			while (std::getline(ss, field, '\t'))
+				fields.push_back(field);
+			if (fields.size() < 6 || fields[0].size() != 1)
+				continue;
+			Entry entry;
+			entry.status = fields[0][0];
+			entry.notAfter = parseTime(fields[1]);
+			entry.revoked = fields[2];
+			entry.serial = fields[3];
+			entry.subject = fields[5];
+			this->entries.push_back(entry);
+		}
+		return true;
+	}
+
+	// No index yet, build one from whatever has been issued so far
+	try {
+		if (fs::exists(pkiPath)) {
+			for (const auto& file : fs::directory_iterator(pkiPath)) {
+				if (file.path().extension() != ".crt" || file.path().stem() == "ca" || file.path().stem() == "crl")
+					continue;
+				std::ifstream cert(file.path(), std::ios::binary);
+				std::stringstream data;
+				data << cert.rdbuf();
+				try {
+					this->entries.push_back(parse(data.str()));
+				}
+				catch (const std::exception& e) {
+					printf("WARNING: Skipping %s. %s\n", file.path().string().c_str(), e.what());
+				}
+			}
+		}
+	}
+	catch (const std::exception& e) {
+		printf("WARNING: Failed to build certificate index. %s\n", e.what());
+		return false;
+	}
+	return save();
+}
+
+void CertificateIndex::Add(const std::string& certData)
+{
+	Entry entry;
+	try {
+		entry = parse(certData);
+	}
+	catch (const std::exception& e) {
+		printf("WARNING: Failed to index certificate. %s\n", e.what());
+		return;
+	}
+	std::lock_guard<std::mutex> l(this->lock);
+	this->entries.push_back(entry);
+	std::ofstream out(this->path, std::ios::binary | std::ios::app);
+	out << format(entry);
+	if (!out)
+		printf("WARNING: Failed to update certificate index %s.\n", this->path.c_str());
+}
+
+void CertificateIndex::Revoke(const std::string& certData)
+{
+	Entry revoked;
+	try {
+		revoked = parse(certData);
+	}
+	catch (const std::exception& e) {
+		printf("WARNING: Failed to index certificate. %s\n", e.what());
+		return;
+	}
+	ASN1_TIME* now = ASN1_TIME_set(NULL, time(NULL));
+	std::string when((const char*)ASN1_STRING_get0_data(now), ASN1_STRING_length(now));
+	ASN1_TIME_free(now);
+
+	std::lock_guard<std::mutex> l(this->lock);
+	bool found = false;
+	for (Entry& entry : this->entries) {
+		if (entry.serial == revoked.serial) {
+			entry.status = 'R';
+			entry.revoked = when;
+			found = true;
+		}
+	}
+	if (!found) {
+		revoked.status = 'R';
+		revoked.revoked = when;
+		this->entries.push_back(revoked);
+	}
+	save();
+}
+
+int CertificateIndex::CountValid(time_t now) const
+{
+	int count = 0;
+	for (const Entry& entry : this->entries) {
+		if (entry.status == 'V' && entry.notAfter > now)
+			count++;
+	}
+	return count;
+}
+
+int CertificateIndex::CountExpiring(time_t now, int days) const
+{
+	time_t horizon = now + (time_t)days * 86400;
+	int count = 0;
+	for (const Entry& entry : this->entries) {
+		if (entry.status == 'V' && entry.notAfter > now && entry.notAfter <= horizon)
+			count++;
+	}
+	return count;
+}
+
+bool CertificateIndex::save() const
+{
+	std::string data;
+	for (const Entry& entry : this->entries)
+		data += format(entry);
+	try {
+		DirectoryLock::WriteFile(this->path, data);
+	}
+	catch (const std::exception&) {
+		printf("WARNING: Failed to write certificate index %s.\n", this->path.c_str());
+		return false;
+	}
+	return true;
+}
+
+CertificateIndex::Entry CertificateIndex::parse(const std::string& certData)
+{
+	BIO* bio = BIO_new_mem_buf(certData.data(), (int)certData.size());
+	X509* cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (cert == NULL)
+		throw std::runtime_error("Failed to parse certificate.");
+
+	Entry entry;
+	const ASN1_TIME* notAfter = X509_get0_notAfter(cert);
+	entry.notAfter = parseTime(std::string((const char*)ASN1_STRING_get0_data(notAfter), ASN1_STRING_length(notAfter)));
+	BIGNUM* bn = ASN1_INTEGER_to_BN(X509_get0_serialNumber(cert), NULL);
+	char* hex = BN_bn2hex(bn);
+	entry.serial = hex;
+	OPENSSL_free(hex);
+	BN_free(bn);
+	char* subject = X509_NAME_oneline(X509_get_subject_name(cert), NULL, 0);
+	entry.subject = subject;
+	OPENSSL_free(subject);
+	X509_free(cert);
+	return entry;
+}
+
+std::string CertificateIndex::format(const Entry& entry)
+{
+	ASN1_TIME* notAfter = ASN1_TIME_set(NULL, entry.notAfter);
+	std::string expiry((const char*)ASN1_STRING_get0_data(notAfter), ASN1_STRING_length(notAfter));
+	ASN1_TIME_free(notAfter);
+	return std::string(1, entry.status) + "\t" + expiry + "\t" + entry.revoked + "\t" + entry.serial + "\tunknown\t" + entry.subject + "\n";
+}
+
+time_t CertificateIndex::parseTime(const std::string& time)
+{
+	// UTCTime or GeneralizedTime, as written by format
+	ASN1_TIME* parsed = ASN1_TIME_new();
+	struct tm tm;
+	time_t result = 0;
+	if (ASN1_TIME_set_string(parsed, time.c_str()) && ASN1_TIME_to_tm(parsed, &tm))
+		result = timegm(&tm);
+	ASN1_TIME_free(parsed);
+	return result;
+}
@@ -0,0 +1,44 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// pki/index.txt in the layout of openssl ca, one line per issued certificate with its status,
+// expiry, serial and subject. Answers expiry questions without parsing every certificate and
+// keeps a record of revoked certificates after their files are removed.
+class CertificateIndex
+{
+public:
+	explicit CertificateIndex(const std::string& path) : path(path) {}
+
+	// Builds the index from the certificates in pkiPath the first time it's needed
+	bool Load(const std::string& pkiPath);
+	// Appends one line, safe to call from several writers
+	void Add(const std::string& certData);
+	void Revoke(const std::string& certData);
+	int CountValid(time_t now) const;
+	int CountExpiring(time_t now, int days) const;
+
+private:
+	struct Entry
+	{
+		char status = 'V';
+		time_t notAfter = 0;
+		std::string revoked;
+		std::string serial;
+		std::string subject;
+	};
+
+	std::string path;
+	std::vector<Entry> entries;
+	std::mutex lock;
+
+	bool save() const;
+	static Entry parse(const std::string& certData);
+	static std::string format(const Entry& entry);
+	static time_t parseTime(const std::string& time);
+};
@@ -0,0 +1,67 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "DirectoryLock.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+std::mutex DirectoryLock::processLock;
+
+DirectoryLock::DirectoryLock(const std::string& path, Metrics* metrics)
+{
+	auto start = std::chrono::steady_clock::now();
+	this->held = std::unique_lock<std::mutex>(processLock);
+
+	this->fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+	if (this->fd < 0)
+		throw std::runtime_error("Failed to open lock " + path + ". " + strerror(errno));
+	struct flock lock;
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+	while (fcntl(this->fd, F_SETLKW, &lock) != 0) {
+		if (errno == EINTR)
+			continue;
+		int error = errno;
+		close(this->fd);
+		throw std::runtime_error("Failed to lock " + path + ". " + strerror(error));
+	}
+
+	if (metrics != nullptr)
+		metrics->Observe("openvpn_generate_lock_wait_seconds", std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+}
+
+DirectoryLock::~DirectoryLock()
+{
+	// Closing the descriptor drops the fcntl lock
+	close(this->fd);
+}
+
+std::string DirectoryLock::TempPath(const std::string& path)
+{
+	static std::atomic<unsigned int> counter{ 0 };
+	char host[64] = { 0 };
+	gethostname(host, sizeof(host) - 1);
+	return path + "." + host + "." + std::to_string(getpid()) + "." + std::to_string(++counter) + ".tmp";
+}
+
+void DirectoryLock::WriteFile(const std::string& path, const std::string& data)
+{
+	std::string temp = TempPath(path);
+	FILE* out = fopen(temp.c_str(), "wb");
+	bool ok = out != NULL && fwrite(data.data(), 1, data.size(), out) == data.size();
+	if (out != NULL)
+		ok = fclose(out) == 0 && ok;
+	if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+		std::string error = strerror(errno);
+		remove(temp.c_str());
+		throw std::runtime_error(path + ": " + error);
+	}
+}
@@ -0,0 +1,33 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include "Metrics.h"
+
+#include <mutex>
+#include <string>
+
+// Exclusive lock on a file shared by every process working on one config directory, including
+// processes on other hosts when the directory is on NFS (fcntl locks go through the NFS lock
+// manager). Held for one read-modify-write of shared state at a time, never nested.
+class DirectoryLock
+{
+public:
+	// Blocks until the lock is held, observing the wait in metrics when given
+	DirectoryLock(const std::string& path, Metrics* metrics = nullptr);
+	~DirectoryLock();
+	DirectoryLock(const DirectoryLock&) = delete;
+	DirectoryLock& operator=(const DirectoryLock&) = delete;
+
+	// A name next to path that no other thread or host will pick, for writing a file in full
+	// before renaming it over path. Readers then see the old file or the new one, never part.
+	static std::string TempPath(const std::string& path);
+	// Writes data to a TempPath and renames it over path. Throws, leaving path as it was.
+	static void WriteFile(const std::string& path, const std::string& data);
+
+private:
+	// fcntl locks belong to the process, so threads of one process also take this first
+	static std::mutex processLock;
+	std::unique_lock<std::mutex> held;
+	int fd = -1;
+};
@@ -0,0 +1,426 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "HandshakeBench.h"
+#include "OpenSSLHelper.h"
+
+#include <openssl/err.h>
+#include <openssl/pem.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+HandshakeBench::HandshakeBench(const std::string& path)
+{
+	this->path = path;
+	this->pkiPath = (fs::path(path) / "pki").string();
+}
+
+HandshakeBench::~HandshakeBench()
+{
+	SSL_CTX_free(this->serverCtx);
+	SSL_CTX_free(this->clientCtx);
+}
+
+bool HandshakeBench::Load(const std::string& clientName)
+{
+	// Every worker's config has the same TLS settings, the first one will do
+	fs::path serverPath = fs::path(this->path) / "server";
+	std::vector<fs::path> configs;
+	if (fs::exists(serverPath)) {
+		for (const auto& entry : fs::directory_iterator(serverPath)) {
+			if (entry.path().extension() == ".conf")
+				configs.push_back(entry.path());
+		}
+	}
+	if (configs.empty()) {
+		printf("ERROR: No server configuration in %s, run init or regenerate first.\n", serverPath.string().c_str());
+		return false;
+	}
+	std::sort(configs.begin(), configs.end());
+	this->serverConfig = configs.front().string();
+
+	this->clientName = clientName;
+	if (this->clientName.empty()) {
+		std::vector<std::string> names;
+		for (const auto& entry : fs::directory_iterator(this->pkiPath)) {
+			std::string stem = entry.path().stem().string();
+			if (entry.path().extension() == ".crt" && stem != "ca" && stem != "server" && stem != "crl"
+				&& fs::exists(fs::path(this->pkiPath) / (stem + ".key")))
+				names.push_back(stem);
+		}
+		if (names.empty()) {
+			printf("ERROR: No client identity in %s, create one with client first.\n", this->pkiPath.c_str());
+			return false;
+		}
+		std::sort(names.begin(), names.end());
+		this->clientName = names.front();
+	}
+	else if (!fs::exists(fs::path(this->pkiPath) / (this->clientName + ".crt"))) {
+		printf("ERROR: Client %s not found.\n", this->clientName.c_str());
+		return false;
+	}
+
+	this->serverCtx = createContext(true);
+	if (this->serverCtx == nullptr)
+		return false;
+	this->clientCtx = createContext(false);
+	return this->clientCtx != nullptr;
+}
+
+SSL_CTX* HandshakeBench::createContext(bool server)
+{
+	// The server loads exactly what OpenVPN would from its config, relative to the server directory
+	fs::path serverPath = fs::path(this->serverConfig).parent_path();
+	std::string ca, cert, key, dh, crl;
+	std::istringstream lines(readFile(this->serverConfig));
+	std::string line;
+	while (std::getline(lines, line)) {
+		std::istringstream ss(line);
+		std::string directive, value, extra;
+		ss >> directive >> value >> extra;
+		if (directive == "ca")
+			ca = (serverPath / value).string();
+		else if (directive == "cert")
+			cert = (serverPath / value).string();
+		else if (directive == "key")
+			key = (serverPath / value).string();
+		else if (directive == "dh" && value != "none")
+			dh = (serverPath / value).string();
+		else if (directive == "crl-verify" && extra != "dir")
+			crl = (serverPath / value).string();
+		else if (directive == "tls-version-min")
+			this->minVersion = value;
+		else if (directive == "tls-cipher")
+			this->cipher = value;
+		else if (directive == "ecdh-curve")
+			this->curve = value;
+	}
+	if (!server) {
+		cert = (fs::path(this->pkiPath) / (this->clientName + ".crt")).string();
+		key = (fs::path(this->pkiPath) / (this->clientName + ".key")).string();
+	}
+
+	SSL_CTX* ctx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+	bool ok = ctx != nullptr
+		&& SSL_CTX_use_certificate_chain_file(ctx, cert.c_str()) == 1
+		&& SSL_CTX_use_PrivateKey_file(ctx, key.c_str(), SSL_FILETYPE_PEM) == 1
+		&& SSL_CTX_check_private_key(ctx) == 1
+		&& SSL_CTX_load_verify_locations(ctx, ca.c_str(), NULL) == 1;
+	if (!ok) {
+		printf("ERROR: Failed to load the %s identity. %s\n", server ? "server" : "client", OpenSSLHelper::LastError().c_str());
+		SSL_CTX_free(ctx);
+		return nullptr;
+	}
+	// Both ends verify each other the way OpenVPN does, and every handshake is a full one
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | (server ? SSL_VERIFY_FAIL_IF_NO_PEER_CERT : 0), NULL);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+
+	if (server && !dh.empty()) {
+		BIO* bio = BIO_new_file(dh.c_str(), "r");
+		EVP_PKEY* params = bio != NULL ? PEM_read_bio_Parameters(bio, NULL) : NULL;
+		BIO_free(bio);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		ok = params != NULL && SSL_CTX_set0_tmp_dh_pkey(ctx, params) == 1;
+#else
+		DH* params_dh = params != NULL ? EVP_PKEY_get1_DH(params) : NULL;
+		ok = params_dh != NULL && SSL_CTX_set_tmp_dh(ctx, params_dh) == 1;
+		DH_free(params_dh);
+		EVP_PKEY_free(params);
+#endif
+		if (!ok) {
+			printf("ERROR: Failed to load DH parameters from %s. %s\n", dh.c_str(), OpenSSLHelper::LastError().c_str());
+			SSL_CTX_free(ctx);
+			return nullptr;
+		}
+	}
+	if (server && !crl.empty() && fs::exists(crl)) {
+		// crl-verify checks every client against the CRL, a large one costs on every handshake
+		X509_STORE* store = SSL_CTX_get_cert_store(ctx);
+		if (X509_load_crl_file(X509_STORE_add_lookup(store, X509_LOOKUP_file()), crl.c_str(), X509_FILETYPE_PEM) <= 0) {
+			printf("ERROR: Failed to load CRL from %s. %s\n", crl.c_str(), OpenSSLHelper::LastError().c_str());
+			SSL_CTX_free(ctx);
+			return nullptr;
+		}
+		X509_STORE_set_flags(store, X509_V_FLAG_CRL_CHECK);
+	}
+	if (!configure(ctx)) {
+		SSL_CTX_free(ctx);
+		return nullptr;
+	}
+	return ctx;
+}
+
+bool HandshakeBench::configure(SSL_CTX* ctx)
+{
+	int version = this->minVersion == "1.3" ? TLS1_3_VERSION : this->minVersion == "1.1" ? TLS1_1_VERSION : TLS1_2_VERSION;
+	if (SSL_CTX_set_min_proto_version(ctx, version) != 1) {
+		printf("ERROR: Unsupported tls-version-min %s.\n", this->minVersion.c_str());
+		return false;
+	}
+	if (!this->cipher.empty()) {
+		// TLS 1.3 suites go through their own list, older ciphers use OpenVPN's IANA style names
+		bool ok = this->cipher.compare(0, 4, "TLS_") == 0
+			? SSL_CTX_set_ciphersuites(ctx, this->cipher.c_str()) == 1
+			: SSL_CTX_set_cipher_list(ctx, cipherName(this->cipher).c_str()) == 1;
+		if (!ok) {
+			printf("ERROR: Unsupported tls-cipher %s. %s\n", this->cipher.c_str(), OpenSSLHelper::LastError().c_str());
+			return false;
+		}
+	}
+	if (!this->curve.empty() && SSL_CTX_set1_groups_list(ctx, this->curve.c_str()) != 1) {
+		// Not a key exchange group, OpenVPN falls back to secp384r1 the same way
+		ERR_clear_error();
+		SSL_CTX_set1_groups_list(ctx, "secp384r1");
+	}
+	return true;
+}
+
+bool HandshakeBench::Run(size_t threads, double seconds)
+{
+	threads = std::max<size_t>(1, threads);
+	printf("Server identity: %s, from %s\n", describeKey().c_str(), fs::path(this->serverConfig).filename().string().c_str());
+	printf("Client identity: %s\n", this->clientName.c_str());
+
+	// One handshake up front catches a config that can't work and shows what was negotiated
+	Tally first;
+	if (!handshake(first)) {
+		printf("ERROR: Handshake failed. %s\n", first.error.c_str());
+		return false;
+	}
+	printf("Negotiated: %s\n", first.negotiated.c_str());
+	// Certificates included, this is what has to cross the link before the client can answer
+	printf("Largest server flight: %zu bytes\n", first.serverFlight);
+	double serverRate;
+	if (!measure(threads, seconds, serverRate))
+		return false;
+	if (this->ComparePrimes == 0)
+		return true;
+
+	printf("\n");
+	if (!useMultiPrimeKey())
+		return false;
+	printf("Server identity: %s, generated for comparison\n", describeKey().c_str());
+	double compareRate;
+	if (!measure(threads, seconds, compareRate))
+		return false;
+	printf("\n");
+	printf("Server side with %d primes: %.2fx the handshakes per core\n", this->ComparePrimes, compareRate / serverRate);
+	return true;
+}
+
+bool HandshakeBench::measure(size_t threads, double seconds, double& serverRate)
+{
+	printf("Running handshakes for %.0fs on %zu threads...\n", seconds, threads);
+	fflush(stdout);
+
+	std::vector<Tally> tallies(threads);
+	std::vector<std::thread> workers;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < threads; i++)
+		workers.emplace_back(&HandshakeBench::run, this, std::ref(tallies[i]), seconds);
+	for (std::thread& t : workers)
+		t.join();
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	Tally total;
+	for (const Tally& tally : tallies) {
+		total.handshakes += tally.handshakes;
+		total.serverSeconds += tally.serverSeconds;
+		total.clientSeconds += tally.clientSeconds;
+		if (!tally.error.empty())
+			total.error = tally.error;
+	}
+	if (!total.error.empty()) {
+		printf("ERROR: Handshake failed. %s\n", total.error.c_str());
+		return false;
+	}
+	if (total.handshakes == 0) {
+		printf("ERROR: No handshakes completed.\n");
+		return false;
+	}
+
+	printf("\n");
+	printf("%lld handshakes in %.1fs.\n", total.handshakes, elapsed);
+	printf("  Both ends:   %.1f handshakes/s, %.1f per core\n", total.handshakes / elapsed, total.handshakes / elapsed / threads);
+	// Each thread plays both ends, the time in the server's half is what a server core would spend
+	printf("  Server side: %.1f handshakes/s per core, %.2fms each\n", total.handshakes / total.serverSeconds,
+		total.serverSeconds * 1000 / total.handshakes);
+	printf("  Client side: %.2fms each\n", total.clientSeconds * 1000 / total.handshakes);
+	serverRate = total.handshakes / total.serverSeconds;
+	return true;
+}
+
+bool HandshakeBench::useMultiPrimeKey()
+{
+	EVP_PKEY* current = X509_get0_pubkey(SSL_CTX_get0_certificate(this->serverCtx));
+	if (EVP_PKEY_base_id(current) != EVP_PKEY_RSA) {
+		printf("ERROR: Comparing primes needs an RSA server key.\n");
+		return false;
+	}
+	int keySize = EVP_PKEY_bits(current);
+	if (this->ComparePrimes > OpenSSLHelper::MaxRSAPrimes(keySize)) {
+		printf("ERROR: A %d bit key is too small for %d primes.\n", keySize, this->ComparePrimes);
+		return false;
+	}
+	std::string caKey = (fs::path(this->pkiPath) / "ca.key").string();
+	if (!fs::exists(caKey)) {
+		printf("ERROR: Comparing primes needs the CA key to sign the test key, %s not found.\n", caKey.c_str());
+		return false;
+	}
+
+	// Nothing is written, the key only lives in the server context
+	std::unique_ptr<Identity> identity;
+	try {
+		std::unique_ptr<Identity> ca = OpenSSLHelper::LoadIdentity(readFile((fs::path(this->pkiPath) / "ca.crt").string()), readFile(caKey));
+		CertificateSubject subject("server");
+		identity = OpenSSLHelper::CreateCertKeyBundle(subject, *ca, OpenSSLHelper::Algorithm::RSA, keySize, "", 1, 1, true, this->ComparePrimes);
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to create a %d prime server key. %s\n", this->ComparePrimes, e.what());
+		return false;
+	}
+	if (SSL_CTX_use_certificate(this->serverCtx, identity->cert) != 1
+		|| SSL_CTX_use_PrivateKey(this->serverCtx, identity->key) != 1
+		|| SSL_CTX_check_private_key(this->serverCtx) != 1) {
+		printf("ERROR: Failed to load the %d prime server key. %s\n", this->ComparePrimes, OpenSSLHelper::LastError().c_str());
+		return false;
+	}
+	return true;
+}
+
+void HandshakeBench::run(Tally& tally, double seconds)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+	while (std::chrono::steady_clock::now() < deadline) {
+		if (!handshake(tally))
+			return;
+	}
+}
+
+bool HandshakeBench::handshake(Tally& tally)
+{
+	SSL* server = SSL_new(this->serverCtx);
+	SSL* client = SSL_new(this->clientCtx);
+	BIO* serverBio = NULL;
+	BIO* clientBio = NULL;
+	if (server == NULL || client == NULL || BIO_new_bio_pair(&serverBio, 0, &clientBio, 0) != 1) {
+		tally.error = OpenSSLHelper::LastError();
+		SSL_free(server);
+		SSL_free(client);
+		return false;
+	}
+	SSL_set_bio(server, serverBio, serverBio);
+	SSL_set_bio(client, clientBio, clientBio);
+	SSL_set_accept_state(server);
+	SSL_set_connect_state(client);
+
+	// Each side runs until it needs the other's next flight, both finish within a few rounds
+	bool serverDone = false, clientDone = false, ok = true;
+	for (int round = 0; round < 16 && ok && !(serverDone && clientDone); round++) {
+		SSL* sides[] = { client, server };
+		for (SSL* ssl : sides) {
+			bool& done = ssl == server ? serverDone : clientDone;
+			if (done)
+				continue;
+			auto start = std::chrono::steady_clock::now();
+			int result = SSL_do_handshake(ssl);
+			double spent = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			(ssl == server ? tally.serverSeconds : tally.clientSeconds) += spent;
+			if (ssl == server && tally.handshakes == 0)
+				tally.serverFlight = std::max(tally.serverFlight, BIO_ctrl_pending(clientBio));
+			if (result == 1) {
+				done = true;
+				continue;
+			}
+			int error = SSL_get_error(ssl, result);
+			if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+				tally.error = std::string(ssl == server ? "Server: " : "Client: ") + OpenSSLHelper::LastError();
+				ok = false;
+				break;
+			}
+		}
+	}
+	if (ok && !(serverDone && clientDone)) {
+		tally.error = "Handshake did not complete";
+		ok = false;
+	}
+	if (ok) {
+		if (tally.handshakes == 0)
+			tally.negotiated = std::string(SSL_get_version(client)) + ", " + SSL_get_cipher_name(client);
+		tally.handshakes++;
+	}
+	SSL_free(server);
+	SSL_free(client);
+	return ok;
+}
+
+std::string HandshakeBench::describeKey() const
+{
+	EVP_PKEY* key = X509_get0_pubkey(SSL_CTX_get0_certificate(this->serverCtx));
+	switch (EVP_PKEY_base_id(key)) {
+	case EVP_PKEY_RSA: {
+		std::string description = "RSA " + std::to_string(EVP_PKEY_bits(key));
+		int primes = OpenSSLHelper::RSAPrimes(SSL_CTX_get0_privatekey(this->serverCtx));
+		if (primes > 2)
+			description += ", " + std::to_string(primes) + " primes";
+		return description;
+	}
+	case EVP_PKEY_EC: {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		char name[64] = { 0 };
+		size_t length = 0;
+		EVP_PKEY_get_group_name(key, name, sizeof(name), &length);
+		return std::string("ECDSA ") + name;
+#else
+		return std::string("ECDSA ") + OBJ_nid2sn(EC_GROUP_get_curve_name(EC_KEY_get0_group(EVP_PKEY_get0_EC_KEY(key))));
+#endif
+	}
+	case EVP_PKEY_ED25519:
+		return "Ed25519";
+	case EVP_PKEY_ED448:
+		return "Ed448";
+	default:
+		return OBJ_nid2sn(EVP_PKEY_base_id(key));
+	}
+}
+
+std::string HandshakeBench::readFile(const std::string& path)
+{
+	std::ifstream in(path, std::ios::binary);
+	std::ostringstream ss;
+	ss << in.rdbuf();
+	return ss.str();
+}
+
+std::string HandshakeBench::cipherName(const std::string& ianaName)
+{
+	// OpenVPN accepts names like TLS-ECDHE-ECDSA-WITH-AES-256-GCM-SHA384 and translates them to
+	// OpenSSL's, this covers the ones written by this generator. Anything else is passed through.
+	static const std::pair<const char*, const char*> names[] = {
+		{ "TLS-ECDHE-ECDSA-WITH-AES-256-GCM-SHA384", "ECDHE-ECDSA-AES256-GCM-SHA384" },
+		{ "TLS-ECDHE-ECDSA-WITH-AES-128-GCM-SHA256", "ECDHE-ECDSA-AES128-GCM-SHA256" },
+		{ "TLS-ECDHE-ECDSA-WITH-CHACHA20-POLY1305-SHA256", "ECDHE-ECDSA-CHACHA20-POLY1305" },
+		{ "TLS-ECDHE-RSA-WITH-AES-256-GCM-SHA384", "ECDHE-RSA-AES256-GCM-SHA384" },
+		{ "TLS-DHE-RSA-WITH-AES-256-GCM-SHA384", "DHE-RSA-AES256-GCM-SHA384" },
+	};
+	std::string result;
+	std::istringstream ss(ianaName);
+	std::string name;
+	while (std::getline(ss, name, ':')) {
+		for (const auto& entry : names) {
+			if (name == entry.first)
+				name = entry.second;
+		}
+		result += (result.empty() ? "" : ":") + name;
+	}
+	return result;
+}
@@ -0,0 +1,60 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include <openssl/ssl.h>
+
+#include <string>
+
+// Runs full TLS handshakes between the server identity and a client identity entirely in memory,
+// over a BIO pair, with the TLS settings from the generated server config. Measures how many
+// handshakes a core can complete, no network or OpenVPN needed.
+class HandshakeBench
+{
+public:
+	explicit HandshakeBench(const std::string& path);
+	~HandshakeBench();
+	HandshakeBench(const HandshakeBench&) = delete;
+	HandshakeBench& operator=(const HandshakeBench&) = delete;
+
+	// Reads the server config and both identities. The client is the first one in pki unless named.
+	bool Load(const std::string& clientName);
+	bool Run(size_t threads, double seconds);
+
+	// When set, Run goes again with an RSA server key of this many primes and the same modulus size,
+	// generated in memory and signed by the CA, and compares the server side
+	int ComparePrimes = 0;
+
+private:
+	struct Tally
+	{
+		long long handshakes = 0;
+		double serverSeconds = 0;
+		double clientSeconds = 0;
+		// Most bytes the server sent in one round of the first handshake
+		size_t serverFlight = 0;
+		std::string negotiated;
+		std::string error;
+	};
+
+	std::string path;
+	std::string pkiPath;
+	std::string serverConfig;
+	std::string clientName;
+	SSL_CTX* serverCtx = nullptr;
+	SSL_CTX* clientCtx = nullptr;
+	std::string minVersion = "1.2";
+	std::string cipher;
+	std::string curve;
+
+	SSL_CTX* createContext(bool server);
+	bool configure(SSL_CTX* ctx);
+	bool measure(size_t threads, double seconds, double& serverRate);
+	bool useMultiPrimeKey();
+	void run(Tally& tally, double seconds);
+	bool handshake(Tally& tally);
+	std::string describeKey() const;
+
+	static std::string readFile(const std::string& path);
+	static std::string cipherName(const std::string& ianaName);
+};
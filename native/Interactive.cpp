@@ -0,0 +1,2365 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "Interactive.h"
+#include "CRLFile.h"
+
+#include <openssl/bn.h>
+#include <openssl/pem.h>
+
+#include <arpa/inet.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <unordered_set>
+
+namespace fs = std::filesystem;
+
+const std::vector<std::string> Interactive::cloudflareDNS = { "1.1.1.1", "1.0.0.1" };
+const std::vector<std::string> Interactive::googleDNS = { "8.8.8.8", "8.8.4.4" };
+const std::vector<std::string> Interactive::openDNS = { "208.67.222.222", "208.67.220.220" };
+const std::string Interactive::defaultSubnet = "10.8.0.0/24";
+
+static std::string readFile(const std::string& path)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+		throw std::runtime_error(path + ": " + strerror(errno));
+	std::ostringstream ss;
+	ss << in.rdbuf();
+	return ss.str();
+}
+
+static std::string toLower(std::string value)
+{
+	std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+	return value;
+}
+
+static std::string trim(const std::string& value)
+{
+	size_t start = value.find_first_not_of(" \t\r\n");
+	if (start == std::string::npos)
+		return std::string();
+	size_t end = value.find_last_not_of(" \t\r\n");
+	return value.substr(start, end - start + 1);
+}
+
+static bool isWhiteSpace(const std::string& value)
+{
+	return trim(value).empty();
+}
+
+// Names of the files in pki that aren't clients, a client with one would overwrite them
+static bool isProtectedCN(const std::string& CN)
+{
+	return CN == "ca" || CN == "server" || CN == "crl";
+}
+
+// Client names become file names in pki, clients and ccd, and come from batch files and rosters
+// as well as the prompt. None of them may leave those directories or be hidden in them.
+static bool isValidClientName(const std::string& CN)
+{
+	if (CN.empty() || CN[0] == '.' || isProtectedCN(CN) || CN.find("..") != std::string::npos)
+		return false;
+	for (char c : CN) {
+		if (c == '/' || c == '\\' || (unsigned char)c < 0x20 || c == 0x7F)
+			return false;
+	}
+	return true;
+}
+
+static std::string join(const std::vector<std::string>& values, const std::string& separator)
+{
+	std::string out;
+	for (size_t i = 0; i < values.size(); i++) {
+		if (i > 0)
+			out += separator;
+		out += values[i];
+	}
+	return out;
+}
+
+Interactive::Interactive(const std::string& path, OpenSSLHelper::Algorithm algorithm, int keySize, const std::string& ecCurve, int validDays, const std::string& suffix)
+{
+	this->path = path;
+	this->keySize = keySize;
+	this->validDays = validDays;
+	this->keyAlg = algorithm;
+	this->curveName = ecCurve;
+	this->suffix = suffix;
+	//Init other paths
+	this->configPath = (fs::path(path) / "config.conf").string();
+	this->pkiPath = (fs::path(path) / "pki").string();
+	this->caPath = (fs::path(this->pkiPath) / "ca.crt").string();
+	this->keyPath = (fs::path(this->pkiPath) / "ca.key").string();
+	this->crlPath = (fs::path(this->pkiPath) / "crl.crt").string();
+	this->crlDirPath = (fs::path(this->pkiPath) / "crl").string();
+	this->tlsCryptPath = (fs::path(this->pkiPath) / "ta.key").string();
+	this->tlsCryptV2Path = (fs::path(this->pkiPath) / "tls-crypt-v2-server.key").string();
+	this->clientsPath = (fs::path(path) / "clients").string();
+	this->ccdPath = (fs::path(path) / "ccd").string();
+	this->addressPoolPath = (fs::path(this->pkiPath) / "addresses.bin").string();
+	this->cache.reset(new RegenerationCache(path, (fs::path(this->pkiPath) / "cache.json").string()));
+	this->index.reset(new CertificateIndex((fs::path(this->pkiPath) / "index.txt").string()));
+	this->lockPath = (fs::path(path) / "config.lock").string();
+}
+
+bool Interactive::LoadConfig()
+{
+	if (!fs::exists(this->configPath)) {
+		return false;
+	}
+
+	Json dict;
+	try {
+		dict = Json::parse(readFile(this->configPath));
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to load config at %s. %s\n", this->configPath.c_str(), e.what());
+		return false;
+	}
+
+	//Load in object
+	if ((this->cSubject = CertificateSubject::fromDict(dict)) == nullptr) {
+		printf("ERROR: Failed to load subject from config\n");
+		return false;
+	}
+	this->config = dict;
+
+	//Load in fixed defaults
+	try {
+		const Json* val;
+		if ((val = dict.find("keysize")) != nullptr)
+			this->keySize = (int)val->asInt();
+		else
+			this->keySize = 2048;
+		if ((val = dict.find("validdays")) != nullptr)
+			this->validDays = (int)val->asInt();
+		else
+			this->validDays = 3650;
+		if ((val = dict.find("serial")) != nullptr) {
+			this->_serial = (int)val->asInt();
+			// Nothing reserved yet, the first serial issued reserves a block
+			this->serialLimit = this->_serial;
+		}
+		else {
+			printf("ERROR: Failed to load serial from config\n");
+			return false;
+		}
+		this->keyAlg = OpenSSLHelper::Algorithm::RSA;
+		if ((val = dict.find("algorithm")) != nullptr) {
+			if (val->type() == Json::Type::Number) {
+				this->keyAlg = static_cast<OpenSSLHelper::Algorithm>(val->asInt());
+			}
+			else if (val->type() == Json::Type::String) {
+				std::string alg = toLower(val->asString());
+				if (alg == "ecdsa")
+					this->keyAlg = OpenSSLHelper::Algorithm::ECDSA;
+				else if (alg == "eddsa")
+					this->keyAlg = OpenSSLHelper::Algorithm::EdDSA;
+			}
+		}
+		if ((val = dict.find("eccurve")) != nullptr && val->type() == Json::Type::String)
+			this->curveName = val->asString();
+		else if (this->keyAlg == OpenSSLHelper::Algorithm::EdDSA)
+			this->curveName = "ED25519";
+		else
+			this->curveName = "secp384r1";
+
+		if ((val = dict.find("suffix")) != nullptr && val->type() == Json::Type::String)
+			this->suffix = val->asString();
+		else
+			this->suffix = "";
+
+		if ((val = dict.find("crlmode")) != nullptr && val->type() == Json::Type::String)
+			this->UseCRLDir = val->asString() == "dir";
+		else
+			this->UseCRLDir = false;
+
+		// Configs from before tls-crypt support keep working without it
+		if ((val = dict.find("tlscrypt")) != nullptr)
+			this->TLSCryptMode = static_cast<TLSCrypt::Mode>(val->asInt());
+		else
+			this->TLSCryptMode = TLSCrypt::Mode::None;
+
+		// Configs from before the subnet was configurable are all 10.8.0.0/24
+		if ((val = dict.find("subnet")) != nullptr)
+			this->Subnet = val->asString();
+		else
+			this->Subnet = defaultSubnet;
+
+		if ((val = dict.find("workers")) != nullptr)
+			this->Workers = (int)val->asInt();
+		else
+			this->Workers = 1;
+
+		if ((val = dict.find("profile")) != nullptr)
+			this->TuningProfile = static_cast<Tuning::Profile>(val->asInt());
+		else
+			this->TuningProfile = Tuning::Profile::None;
+
+		if ((val = dict.find("dco")) != nullptr)
+			this->DCO = val->asBool();
+		else
+			this->DCO = false;
+
+		if ((val = dict.find("serverrsaprimes")) != nullptr)
+			this->ServerRSAPrimes = (int)val->asInt();
+		else
+			this->ServerRSAPrimes = 2;
+
+		if ((val = dict.find("compactcerts")) != nullptr)
+			this->CompactCerts = val->asBool();
+		else
+			this->CompactCerts = false;
+
+		if ((val = dict.find("aesni")) != nullptr)
+			this->aesni = val->asBool();
+		else
+			this->aesni = false;
+
+		this->Routes.clear();
+		if ((val = dict.find("routes")) != nullptr)
+			this->Routes = val->asStringList();
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Invalid config. %s\n", e.what());
+		return false;
+	}
+
+	//Load in CA
+	std::string certData;
+	try {
+		certData = readFile(this->caPath);
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to read cert off disk. %s\n", e.what());
+		return false;
+	}
+	// Once intermediates issue the clients the root key can be kept offline, the root
+	// certificate is all that's needed to bundle the chain
+	if (!fs::exists(this->keyPath) && this->config.find("issuers") != nullptr) {
+		BIO* bio = BIO_new_mem_buf(certData.data(), (int)certData.size());
+		X509* cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+		BIO_free(bio);
+		if (cert == NULL) {
+			printf("ERROR: Failed to load issuer identity. %s\n", OpenSSLHelper::LastError().c_str());
+			return false;
+		}
+		this->Issuer.reset(new Identity(cert, NULL));
+		return loadAddressPool();
+	}
+	std::string keyData;
+	try {
+		keyData = readFile(this->keyPath);
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to read key off disk. %s\n", e.what());
+		return false;
+	}
+
+	try {
+		this->Issuer = OpenSSLHelper::LoadIdentity(certData, keyData);
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to load issuer identity. %s\n", e.what());
+		return false;
+	}
+	OPENSSL_cleanse(&keyData[0], keyData.size());
+
+	return loadAddressPool();
+}
+
+bool Interactive::SaveConfig()
+{
+	std::unique_ptr<DirectoryLock> lock = lockDirectory();
+	if (lock == nullptr)
+		return false;
+	// Another process may have reserved serials past ours since we loaded, never go backwards.
+	// The address pool is saved as each address is handed out.
+	int serial = this->_serial;
+	try {
+		if (fs::exists(this->configPath)) {
+			Json disk = Json::parse(readFile(this->configPath));
+			const Json* val = disk.find("serial");
+			if (val != nullptr)
+				serial = std::max(serial, (int)val->asInt());
+			// Intermediates are only ever added straight to the file, under the lock
+			if ((val = disk.find("issuers")) != nullptr)
+				this->config["issuers"] = *val;
+		}
+	}
+	catch (const std::exception& e) {
+		printf("WARNING: Failed to reread config at %s. %s\n", this->configPath.c_str(), e.what());
+	}
+	this->config["serial"] = serial;
+	try {
+		DirectoryLock::WriteFile(this->configPath, this->config.dump());
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to write config to %s. %s\n", this->configPath.c_str(), e.what());
+		return false;
+	}
+
+	return true;
+}
+
+bool Interactive::CreateNewIssuer()
+{
+	if (cSubject == nullptr) {
+		printf("ERROR: No Subject available.\n");
+		return false;
+	}
+	try {
+		this->Issuer = OpenSSLHelper::CreateCAAndKey(*cSubject, this->keyAlg, this->keySize, this->curveName, this->validDays, this->Serial());
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to create CA. %s\n", e.what());
+		return false;
+	}
+	return this->saveIdentity(*this->Issuer, "ca");
+}
+
+bool Interactive::CreateIssuingCA(const std::string& name)
+{
+	if (!verifyRequirements() || !requireRootKey())
+		return false;
+	std::string CN = name;
+	if (isWhiteSpace(CN)) {
+		CN = askQuestion("Intermediate name, for example a site or worker [site1]:", false);
+		if (isWhiteSpace(CN))
+			CN = "site1";
+	}
+	if (!IssuingCA::ValidName(CN)) {
+		printf("ERROR: Intermediate names can only use letters, digits, '-', '_' and '.'.\n");
+		return false;
+	}
+	// The subject is the root's with this Common Name, the two have to be told apart
+	if (CN == this->cSubject->CommonName) {
+		printf("ERROR: An intermediate can't have the same name as the root CA.\n");
+		return false;
+	}
+	// Taken from the root's block before the lock, reserving it takes the lock too
+	int serial;
+	try {
+		serial = this->Serial();
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: %s\n", e.what());
+		return false;
+	}
+
+	std::unique_ptr<DirectoryLock> lock = lockDirectory();
+	if (lock == nullptr)
+		return false;
+	Json disk;
+	try {
+		disk = Json::parse(readFile(this->configPath));
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to reread config at %s. %s\n", this->configPath.c_str(), e.what());
+		return false;
+	}
+	// The root's own serials have to fit below the first intermediate's block
+	const Json* val = disk.find("serial");
+	if (val != nullptr && val->asInt() >= (1 << IssuingCA::SerialBits) - 1) {
+		printf("ERROR: The root CA has issued too many serials to split them with intermediates.\n");
+		return false;
+	}
+	Json issuers = Json::object();
+	int index = 1;
+	if ((val = disk.find("issuers")) != nullptr) {
+		issuers = *val;
+		for (const auto& item : issuers.items()) {
+			if (item.first == CN) {
+				printf("ERROR: Intermediate %s already exists.\n", CN.c_str());
+				return false;
+			}
+			index = std::max(index, (int)item.second.asInt() + 1);
+		}
+	}
+	if (index > IssuingCA::MaxIssuers) {
+		printf("ERROR: No serial blocks left for another intermediate.\n");
+		return false;
+	}
+
+	CertificateSubject subject = subjectFor(CN);
+	IssuingCA intermediate(this->pkiPath, CN, index, &this->metrics);
+	try {
+		// OpenVPN checks the intermediate against the root's CRL as well as the client against the
+		// intermediate's, so both have to exist before the first client is issued
+		if (!this->UseCRLDir)
+			CRLFile(this->crlPath).Create(*this->Issuer, this->validDays);
+		intermediate.Create(subject, *this->Issuer, this->keyAlg, this->keySize, this->curveName, this->validDays, serial, this->CompactCerts);
+		issuers[CN] = index;
+		disk["issuers"] = issuers;
+		DirectoryLock::WriteFile(this->configPath, disk.dump());
+		this->config["issuers"] = issuers;
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to create intermediate %s. %s\n", CN.c_str(), e.what());
+		return false;
+	}
+	lock.reset();
+
+	printf("\nIntermediate \"%s\" created at %s, issuing serials %d to %d.\n", CN.c_str(), intermediate.CertPath().c_str(),
+		intermediate.FirstSerial() + 1, intermediate.LastSerial());
+	printf("Use client --issuer %s to sign clients with it. The root key in %s is only needed to create\n", CN.c_str(), this->keyPath.c_str());
+	printf("more intermediates, sign the server or revoke certificates the root issued.\n");
+	return true;
+}
+
+bool Interactive::CreateDH()
+{
+	printf("Creating DH Params. This will take a while...\n");
+	fflush(stdout);
+	try {
+		std::string dhPem = OpenSSLHelper::CreateDH(this->keySize);
+
+		//Save to disk
+		DirectoryLock::WriteFile((fs::path(this->pkiPath) / "dh.pem").string(), dhPem);
+		printf("\n"); //Write blank line to gap the dots
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to generate DH params. %s\n", e.what());
+		return false;
+	}
+	return true;
+}
+
+bool Interactive::CreateTLSCryptKey()
+{
+	if (this->TLSCryptMode == TLSCrypt::Mode::None)
+		return true;
+	try {
+		if (this->TLSCryptMode == TLSCrypt::Mode::V2)
+			DirectoryLock::WriteFile(this->tlsCryptV2Path, TLSCrypt::CreateV2ServerKey());
+		else
+			DirectoryLock::WriteFile(this->tlsCryptPath, TLSCrypt::CreateStaticKey());
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to generate tls-crypt key. %s\n", e.what());
+		return false;
+	}
+	return true;
+}
+
+bool Interactive::CreateServerConfig()
+{
+	std::string caName = "ca" + this->suffix + ".crt";
+	std::string crlName = "crl" + this->suffix + ".crt";
+	std::string crlDirName = "crl" + this->suffix;
+	std::string ccdDirName = "ccd" + this->suffix;
+	std::string certName = "server" + this->suffix + ".crt";
+	std::string certpath = (fs::path(this->pkiPath) / "server.crt").string();
+	std::string keyName = "server" + this->suffix + ".key";
+	std::string keypath = (fs::path(this->pkiPath) / "server.key").string();
+	std::string dhName = "dh" + this->suffix + ".pem";
+	std::string dhPath = (fs::path(this->pkiPath) / "dh.pem").string();
+	std::string tlsCryptName;
+	std::string tlsCryptKeyPath;
+	if (this->TLSCryptMode == TLSCrypt::Mode::V2) {
+		tlsCryptName = "tls-crypt-v2-server" + this->suffix + ".key";
+		tlsCryptKeyPath = this->tlsCryptV2Path;
+	}
+	else if (this->TLSCryptMode == TLSCrypt::Mode::V1) {
+		tlsCryptName = "ta" + this->suffix + ".key";
+		tlsCryptKeyPath = this->tlsCryptPath;
+	}
+
+	if (!fs::exists(this->caPath)) {
+		printf("ERROR: Missing CA. Please regenerate config\n");
+		return false;
+	}
+	if (this->keyAlg == OpenSSLHelper::Algorithm::RSA && !fs::exists(dhPath)) {
+		printf("ERROR: Missing DH. Please regenerate config\n");
+		return false;
+	}
+	if (!tlsCryptKeyPath.empty() && !fs::exists(tlsCryptKeyPath)) {
+		printf("ERROR: Missing tls-crypt key. Please regenerate config\n");
+		return false;
+	}
+
+	if (!fs::exists(certpath) || !fs::exists(keypath)) {
+		if (!this->createNewServerIdentity()) {
+			printf("ERROR: Failed to generate server identity.\n");
+			return false;
+		}
+	}
+	if (!this->assignMissingAddresses())
+		return false;
+
+	std::string port;
+	std::string proto;
+	try {
+		port = this->config["port"].asString();
+		proto = this->config["proto"].asString();
+		if (proto == "tcp") {
+			proto = "tcp-server";
+		}
+		else {
+			proto = "udp";
+		}
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Invalid config. Please regenerate config. %s\n", e.what());
+		return false;
+	}
+	if (!fs::exists(certpath)) {
+		printf("ERROR: Missing Cert. Please regenerate config\n");
+		return false;
+	}
+	if (!fs::exists(keypath)) {
+		printf("ERROR: Missing Key. Please regenerate config\n");
+		return false;
+	}
+
+	// Each worker is a separate OpenVPN process, so the data channel of each gets its own core
+	std::vector<std::string> files(this->Workers);
+	for (int worker = 0; worker < this->Workers; worker++) {
+		std::string workerName = workerSuffix(worker);
+		std::string& file = files[worker];
+		file = "#-- Config Auto Generated by SparkLabs OpenVPN Certificate Generator --#\n";
+		if (this->DCO)
+			file += "#--                   Config for OpenVPN 2.6 Server                  --#\n\n";
+		else
+			file += "#--                   Config for OpenVPN 2.4 Server                  --#\n\n";
+		file += "proto " + proto + "\n";
+		file += "keepalive 10 120\n";
+		file += "user nobody\ngroup nogroup\n";
+		file += "persist-key\npersist-tun\n";
+		file += "status openvpn-status" + this->suffix + workerName + ".log\n";
+		file += "verb 3\n";
+		file += "mute 10\n";
+		file += "ca " + caName + "\ncert " + certName + "\nkey " + keyName + "\n";
+		if (this->UseCRLDir) {
+			file += "crl-verify " + crlDirName + " dir\n";
+		}
+		else if (fs::exists(this->crlPath)) {
+			file += "crl-verify " + crlName + "\n";
+		}
+		if (this->TLSCryptMode == TLSCrypt::Mode::V2) {
+			file += "tls-crypt-v2 " + tlsCryptName + "\n";
+		}
+		else if (this->TLSCryptMode == TLSCrypt::Mode::V1) {
+			file += "tls-crypt " + tlsCryptName + "\n";
+		}
+		if (this->keyAlg == OpenSSLHelper::Algorithm::RSA) {
+			file += "dh " + dhName + "\n";
+		}
+		else if (this->keyAlg == OpenSSLHelper::Algorithm::EdDSA) {
+			file += "tls-version-min 1.3\n";
+			file += "dh none\n";
+			file += "# Note this curve probably isn't supported (yet), however OpenVPN will fall back to another (secp384r1)\n";
+			file += "ecdh-curve " + this->curveName + "\n";
+			file += "tls-cipher TLS_AES_256_GCM_SHA384\n";
+		}
+		else { // ecdsa
+			file += "tls-version-min 1.2\n";
+			file += "dh none\n";
+			file += "ecdh-curve " + this->curveName + "\n";
+			file += "tls-cipher TLS-ECDHE-ECDSA-WITH-AES-256-GCM-SHA384\n";
+		}
+		file += Tuning::ServerDirectives(this->TuningProfile, this->aesni, this->DCO, proto);
+		file += "port " + std::to_string(atoi(port.c_str()) + worker) + "\n";
+		file += "dev tun" + std::to_string(worker) + "\n";
+		file += "topology subnet\n";
+		// Every client has a static address in ccd, so there is no dynamic pool for them to collide with
+		uint32_t network;
+		AddressPool::TryParse(this->addressPool->Network(), network);
+		file += "server " + AddressPool::ToString(workerAddress(network, worker)) + " " + this->addressPool->Netmask() + " nopool\n";
+		if (this->addressPool->Capacity() > defaultMaxClients) {
+			// OpenVPN turns clients away past 1024 unless told otherwise
+			file += "max-clients " + std::to_string(this->addressPool->Capacity()) + "\n";
+		}
+		file += "client-config-dir " + ccdDirName + workerName + "\n";
+
+		try {
+			const Json* dns = this->config.find("dns");
+			if (dns != nullptr) {
+				for (std::string var : dns->asStringList()) {
+					// A local DNS server is reached on this worker's own tunnel address
+					uint32_t dnsAddress;
+					if (AddressPool::TryParse(var, dnsAddress) && this->addressPool->Contains(dnsAddress))
+						var = AddressPool::ToString(workerAddress(dnsAddress, worker));
+					file += "push \"dhcp-option DNS " + var + "\"\n";
+				}
+			}
+		}
+		catch (const std::exception&) {}
+
+		try {
+			const Json* redirect = this->config.find("redirect");
+			if (redirect != nullptr && redirect->asBool()) {
+				file += "push \"redirect-gateway def1\"\n";
+			}
+		}
+		catch (const std::exception&) {}
+
+		file += "#Uncomment the below to allow client to client communication\n#client-to-client\n";
+		if (!this->Routes.empty()) {
+			try {
+				for (const std::string& route : this->Routes) {
+					file += RouteAggregator::PushLine(route) + "\n";
+				}
+			}
+			catch (const std::exception& e) {
+				printf("ERROR: Invalid route in config. Please regenerate config. %s\n", e.what());
+				return false;
+			}
+		}
+		else {
+			file += "#Uncomment the below and modify the command to allow access to your internal network\n#push \"route 192.168.0.0 255.255.255.0\"\n";
+		}
+	}
+
+	//Make a new directory for the server
+	fs::path serverPath = fs::path(this->path) / "server";
+	try {
+		if (this->Output == nullptr)
+			fs::create_directories(serverPath);
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to make directory for server configuration. %s\n", e.what());
+		return false;
+	}
+
+	// Everything the server directory should hold, relative to it. Files with a source are copied
+	// from pki so they keep its permissions.
+	struct ServerFile
+	{
+		std::string data;
+		std::string source;
+	};
+	std::map<std::string, ServerFile> outputs;
+	std::set<std::string> outputDirs;
+	// Held to the end so the inputs read, the files written and the stale files removed all agree,
+	// a client issued meanwhile by another process would otherwise lose its ccd entry
+	std::unique_ptr<DirectoryLock> lock = lockDirectory();
+	if (lock == nullptr)
+		return false;
+	for (int worker = 0; worker < this->Workers; worker++)
+		outputs["server" + this->suffix + workerSuffix(worker) + ".conf"] = { files[worker], "" };
+
+	//Copy Files
+	try {
+		outputs[caName] = { readFile(this->caPath), this->caPath };
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to copy CA. %s\n", e.what());
+		return false;
+	}
+	try {
+		outputs[certName] = { readFile(certpath), certpath };
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to copy Cert. %s\n", e.what());
+		return false;
+	}
+	try {
+		if (this->keyAlg == OpenSSLHelper::Algorithm::RSA)
+			outputs[dhName] = { readFile(dhPath), dhPath };
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to copy DH. %s\n", e.what());
+		return false;
+	}
+	try {
+		outputs[keyName] = { readFile(keypath), keypath };
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to copy Key. %s\n", e.what());
+		return false;
+	}
+	try {
+		if (!tlsCryptKeyPath.empty())
+			outputs[tlsCryptName] = { readFile(tlsCryptKeyPath), tlsCryptKeyPath };
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to copy tls-crypt key. %s\n", e.what());
+		return false;
+	}
+	try {
+		if (this->UseCRLDir) {
+			// OpenVPN requires the directory to exist even if nothing has been revoked yet
+			outputDirs.insert(crlDirName);
+			if (fs::exists(this->crlDirPath)) {
+				for (const auto& entry : fs::directory_iterator(this->crlDirPath)) {
+					std::string source = entry.path().string();
+					outputs[crlDirName + "/" + entry.path().filename().string()] = { readFile(source), source };
+				}
+			}
+		}
+		else if (fs::exists(this->crlPath)) {
+			if (this->config.find("issuers") != nullptr)
+				outputs[crlName] = { serverCRL(), "" };
+			else
+				outputs[crlName] = { readFile(this->crlPath), this->crlPath };
+		}
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to copy CRL. %s\n", e.what());
+		return false;
+	}
+	try {
+		for (int worker = 0; worker < this->Workers; worker++) {
+			std::string serverCcdDir = ccdDirName + workerSuffix(worker);
+			outputDirs.insert(serverCcdDir);
+			if (!fs::exists(this->ccdPath))
+				continue;
+			for (const auto& entry : fs::directory_iterator(this->ccdPath)) {
+				uint32_t address;
+				if (readAssignment(entry.path().string(), address))
+					outputs[serverCcdDir + "/" + entry.path().filename().string()] = { ccdEntry(address, worker), "" };
+			}
+		}
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to copy client config dir. %s\n", e.what());
+		return false;
+	}
+
+	if (this->Output != nullptr) {
+		// Everything is handed on each time, there's no directory to compare against or clean up
+		try {
+			for (const auto& output : outputs) {
+				unsigned int mode = 0644;
+				if (!output.second.source.empty())
+					mode = (unsigned int)(fs::status(output.second.source).permissions() & fs::perms::mask);
+				this->Output->Write("server/" + output.first, output.second.data, mode);
+			}
+		}
+		catch (const std::exception& e) {
+			printf("ERROR: Failed to write server configuration. %s\n", e.what());
+			return false;
+		}
+		printf("Successfully sent %zu server files to %s.\n", outputs.size(), this->Output->Describe().c_str());
+		return true;
+	}
+
+	// Only files whose content changed since the last run are written
+	this->cache->Load();
+	int written = 0;
+	try {
+		for (const std::string& dir : outputDirs)
+			fs::create_directories(serverPath / dir);
+		const fs::copy_options overwrite = fs::copy_options::overwrite_existing;
+		for (const auto& output : outputs) {
+			std::string artifact = "server/" + output.first;
+			std::string key = RegenerationCache::Key({ std::to_string(TemplateVersion), output.second.data });
+			if (this->cache->Fresh(artifact, key))
+				continue;
+			fs::path target = serverPath / output.first;
+			if (output.second.source.empty()) {
+				DirectoryLock::WriteFile(target.string(), output.second.data);
+			}
+			else {
+				std::string temp = DirectoryLock::TempPath(target.string());
+				fs::copy_file(output.second.source, temp, overwrite);
+				fs::rename(temp, target);
+			}
+			this->cache->Record(artifact, key);
+			written++;
+		}
+
+		// Anything else is left from an earlier run, like an old worker's config or a revoked client's ccd entry
+		std::vector<fs::path> stale;
+		for (const auto& entry : fs::recursive_directory_iterator(serverPath)) {
+			std::string name = fs::relative(entry.path(), serverPath).generic_string();
+			if (entry.is_directory() ? !outputDirs.count(name) : !outputs.count(name))
+				stale.push_back(entry.path());
+		}
+		for (const fs::path& file : stale) {
+			std::error_code ec;
+			fs::remove_all(file, ec);
+			this->cache->Forget("server/" + fs::relative(file, serverPath).generic_string());
+		}
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to write server configuration. %s\n", e.what());
+		this->cache->Save();
+		return false;
+	}
+	this->cache->Save();
+	printf("Successfully generated server configuration at %s.\n", serverPath.string().c_str());
+	printf("%d of %zu server files changed.\n", written, outputs.size());
+	return true;
+}
+
+bool Interactive::CreateNewClientConfig(const std::string& name)
+{
+	if (!prepareClients() || (this->issuingCA == nullptr && !requireRootKey()) || !prepareTemplate() || !openJournal())
+		return false;
+
+	std::string CN;
+	if (!isWhiteSpace(name)) {
+		CN = name;
+	}
+	else {
+		std::string input = askQuestion("Common Name. This should be unique, for example a username [client1]:", false);
+		if (isWhiteSpace(input)) {
+			CN = "client1";
+		}
+		else {
+			CN = input;
+		}
+	}
+	if (!isValidClientName(CN)) {
+		printf("ERROR: \"%s\" can't be a client.\n", CN.c_str());
+		this->journal.reset();
+		return false;
+	}
+
+	this->keyArena.reset(new KeyArena(1, KeySlotSize));
+	this->clientChainBytes = 0;
+	std::unique_ptr<ClientBundle> bundle = issueClient(CN);
+	bool ok = bundle != nullptr && encodeClient(*bundle) && writeClient(*bundle);
+	ok = flushClients() && ok;
+	this->keyArena.reset();
+	this->journal.reset();
+	saveCache();
+	if (ok)
+		reportChain("Client", this->clientChainBytes);
+	return ok;
+}
+
+bool Interactive::CreateNewClientConfigs(std::istream& names)
+{
+	if (!prepareClients() || (this->issuingCA == nullptr && !requireRootKey()) || !prepareTemplate() || !openJournal())
+		return false;
+	this->serialBlock = (int)BatchWindow;
+
+	// Keygen/signing is CPU bound and gets a worker per core, encoding is cheap and writing/gzip
+	// is mostly waiting on disk. Bounded queues between stages keep a fast stage from running ahead,
+	// and names are read a window at a time, so memory use doesn't grow with the number of clients.
+	size_t cores = std::max(1u, std::thread::hardware_concurrency());
+	size_t issueWorkers = cores;
+	size_t encodeWorkers = std::max<size_t>(1, cores / 4);
+	size_t writeWorkers = 2;
+	BoundedQueue<std::string> pendingClients(BatchWindow);
+	BoundedQueue<std::unique_ptr<ClientBundle>> issuedClients(issueWorkers * 4);
+	BoundedQueue<std::unique_ptr<ClientBundle>> encodedClients(writeWorkers * 4);
+	this->failedClients = 0;
+	this->clientChainBytes = 0;
+	// Private keys only exist between encoding and writing, so that is all the arena has to cover
+	this->keyArena.reset(new KeyArena(encodeWorkers + writeWorkers * 5, KeySlotSize));
+
+	printf("Creating clients...\n");
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> issuers;
+	for (size_t i = 0; i < issueWorkers; i++) {
+		issuers.emplace_back([&] {
+			std::string CN;
+			while (pendingClients.Take(CN)) {
+				std::unique_ptr<ClientBundle> bundle = issueClient(CN);
+				if (bundle == nullptr) {
+					this->failedClients++;
+					continue;
+				}
+				issuedClients.Add(std::move(bundle));
+			}
+		});
+	}
+	std::vector<std::thread> encoders;
+	for (size_t i = 0; i < encodeWorkers; i++) {
+		encoders.emplace_back([&] {
+			std::unique_ptr<ClientBundle> bundle;
+			while (issuedClients.Take(bundle)) {
+				if (!encodeClient(*bundle)) {
+					this->failedClients++;
+					continue;
+				}
+				encodedClients.Add(std::move(bundle));
+			}
+		});
+	}
+	std::vector<std::thread> writers;
+	for (size_t i = 0; i < writeWorkers; i++) {
+		writers.emplace_back([&] {
+			std::unique_ptr<ClientBundle> bundle;
+			while (encodedClients.Take(bundle)) {
+				if (!writeClient(*bundle))
+					this->failedClients++;
+			}
+		});
+	}
+
+	// A repeated name would be issued twice, the second key overwriting the first and leaving its
+	// certificate valid with nothing to revoke it by, so names are remembered for the whole run.
+	// They are small next to the keys and bundles the windows bound.
+	int total = 0;
+	std::unordered_set<std::string> seen;
+	std::string line;
+	while (std::getline(names, line)) {
+		std::string name = trim(line);
+		if (name.empty() || name[0] == '#')
+			continue;
+		if (!seen.insert(name).second)
+			continue;
+		total++;
+		if (!isValidClientName(name)) {
+			printf("ERROR: \"%s\" can't be a client.\n", name.c_str());
+			this->failedClients++;
+			continue;
+		}
+		pendingClients.Add(name);
+	}
+
+	// Drain each stage in order, closing the next stage's input once its producers are done
+	pendingClients.CompleteAdding();
+	for (std::thread& t : issuers)
+		t.join();
+	issuedClients.CompleteAdding();
+	for (std::thread& t : encoders)
+		t.join();
+	encodedClients.CompleteAdding();
+	for (std::thread& t : writers)
+		t.join();
+	flushClients();
+	this->keyArena.reset();
+	this->journal.reset();
+	releaseSerials();
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	saveCache();
+
+	int created = total - this->failedClients;
+	printf("Created %d of %d clients in %.1fs.\n", created, total, elapsed);
+	if (created > 0)
+		reportChain(created > 1 ? "Largest client" : "Client", this->clientChainBytes);
+	return this->failedClients == 0;
+}
+
+bool Interactive::prepareTemplate()
+{
+	// Only the Common Name, serial, validity and key differ between clients
+	try {
+		const Identity& issuer = this->issuingCA != nullptr ? this->issuingCA->Issuer() : *this->Issuer;
+		this->clientTemplate.reset(new CertTemplate(subjectFor(""), issuer, this->validDays, false, this->CompactCerts));
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to prepare the client certificate template. %s\n", e.what());
+		return false;
+	}
+	return true;
+}
+
+bool Interactive::prepareClients()
+{
+	if (this->IssuerName.empty() ? !verifyRequirements() : !loadIssuingCA())
+		return false;
+	if (!fs::exists(this->caPath)) {
+		printf("ERROR: Missing CA. Please regenerate config.\n");
+		return false;
+	}
+
+	try {
+		this->clientAddress = this->config["server"].asString();
+		this->clientPort = this->config["port"].asString();
+		std::string proto = this->config["proto"].asString();
+		if (proto == "tcp") {
+			this->clientProto = "tcp-client";
+		}
+		else {
+			this->clientProto = "udp";
+		}
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Invalid config. Please regenerate config. %s\n", e.what());
+		return false;
+	}
+
+	//Try and make dir for all clients if not exists
+	try {
+		if (this->Output == nullptr)
+			fs::create_directories(this->clientsPath);
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to make clients directory. %s\n", e.what());
+		return false;
+	}
+
+	this->cache->Load();
+	{
+		// Building a missing index writes it
+		std::unique_ptr<DirectoryLock> lock = lockDirectory();
+		if (lock == nullptr)
+			return false;
+		this->index->Load(this->pkiPath);
+	}
+	// Everything shared by every bundle is read once up front
+	try {
+		this->caData = readFile(this->caPath);
+		this->tlsCryptData.clear();
+		this->tlsCryptV2ServerKey.clear();
+		if (this->TLSCryptMode == TLSCrypt::Mode::V2) {
+			this->tlsCryptV2ServerKey = readFile(this->tlsCryptV2Path);
+		}
+		else if (this->TLSCryptMode == TLSCrypt::Mode::V1) {
+			this->tlsCryptData = readFile(this->tlsCryptPath);
+		}
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to read shared client files. %s\n", e.what());
+		return false;
+	}
+	return true;
+}
+
+std::unique_ptr<Interactive::ClientBundle> Interactive::issueClient(const std::string& CN)
+{
+	std::unique_ptr<ClientBundle> bundle(new ClientBundle());
+	bundle->CN = CN;
+	try {
+		Metrics::Timer timer(this->metrics, "openvpn_generate_issue_duration_seconds");
+		int serial = this->issuingCA != nullptr ? this->issuingCA->Serial(this->serialBlock) : this->Serial();
+		bundle->identity = OpenSSLHelper::CreateCertKeyBundle(*this->clientTemplate, CN, this->keyAlg, this->keySize, this->curveName, serial);
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to create client identity for %s. %s\n", CN.c_str(), e.what());
+		return nullptr;
+	}
+	this->metrics.Add("openvpn_generate_certificates_issued_total", "algorithm=\"" + algorithmLabel() + "\"");
+	return bundle;
+}
+
+bool Interactive::encodeClient(ClientBundle& bundle)
+{
+	bundle.cert = OpenSSLHelper::CertAsPEM(bundle.identity->certDER);
+	if (bundle.cert.empty()) {
+		printf("ERROR: Failed to create certificate for %s\n", bundle.CN.c_str());
+		return false;
+	}
+	size_t chainBytes = bundle.identity->certDER.size();
+	// The intermediate follows the client's own certificate, so OpenVPN sends the chain and the
+	// server only has to trust the root
+	if (this->issuingCA != nullptr) {
+		bundle.cert += this->issuingCA->CertPEM();
+		chainBytes += OpenSSLHelper::CertDERSize(this->issuingCA->Issuer().cert);
+	}
+	size_t largest = this->clientChainBytes;
+	while (chainBytes > largest && !this->clientChainBytes.compare_exchange_weak(largest, chainBytes)) {}
+	// The key goes straight from OpenSSL into locked memory
+	bundle.key = this->keyArena->Acquire();
+	if (!bundle.key->LoadPEM(bundle.identity->key)) {
+		printf("ERROR: Failed to create key for %s\n", bundle.CN.c_str());
+		this->keyArena->Release(bundle.key);
+		bundle.key = nullptr;
+		return false;
+	}
+	bundle.identity.reset();
+
+	try {
+		if (this->TLSCryptMode == TLSCrypt::Mode::V2) {
+			// Each client gets its own key wrapped with the server key, nothing to keep in pki
+			bundle.tlsCrypt = TLSCrypt::CreateV2ClientKey(this->tlsCryptV2ServerKey);
+		}
+		else {
+			bundle.tlsCrypt = this->tlsCryptData;
+		}
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to create tls-crypt key for %s. %s\n", bundle.CN.c_str(), e.what());
+		this->keyArena->Release(bundle.key);
+		bundle.key = nullptr;
+		return false;
+	}
+
+	bundle.config = renderClientConfig(bundle.CN);
+	return true;
+}
+
+bool Interactive::writeClient(ClientBundle& bundle)
+{
+	// Take an address first, a client that can't get one shouldn't be issued at all
+	bool ok = assignAddress(bundle.CN);
+	StagedClient staged;
+	staged.entry.name = bundle.CN;
+	try {
+		if (ok) {
+			// Written beside their targets, nothing is in place until the client's group is committed
+			fs::create_directories(this->pkiPath);
+			DirectoryLock::WriteFile(IssuanceJournal::Stage(staged.entry, (fs::path(this->pkiPath) / (bundle.CN + ".crt")).string()), bundle.cert);
+			if (!bundle.key->WriteTo(IssuanceJournal::Stage(staged.entry, (fs::path(this->pkiPath) / (bundle.CN + ".key")).string())))
+				throw std::runtime_error("Failed to write key to disk");
+			if (this->Output != nullptr) {
+				TarGzWriter tar;
+				writeVisz(tar, bundle);
+				staged.visz = tar.Data();
+			}
+			else {
+				TarGzWriter tar(IssuanceJournal::Stage(staged.entry, (fs::path(this->clientsPath) / (bundle.CN + ".visz")).string()));
+				writeVisz(tar, bundle);
+			}
+			staged.cert = bundle.cert;
+			staged.cacheKey = clientCacheKey(bundle.config, bundle.cert);
+			this->journal->Record(staged.entry);
+		}
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to write client %s. %s\n", bundle.CN.c_str(), e.what());
+		for (const auto& file : staged.entry.files)
+			remove(file.first.c_str());
+		releaseAddress(bundle.CN);
+		ok = false;
+	}
+	this->keyArena->Release(bundle.key);
+	bundle.key = nullptr;
+	if (!ok)
+		return false;
+
+	std::vector<StagedClient> group;
+	{
+		std::lock_guard<std::mutex> l(this->stagedLock);
+		this->stagedClients.push_back(std::move(staged));
+		if (this->stagedClients.size() >= CommitGroup)
+			group.swap(this->stagedClients);
+	}
+	// A group that fails is counted in failedClients, this client was written
+	commitClients(std::move(group));
+	return true;
+}
+
+bool Interactive::commitClients(std::vector<StagedClient> group)
+{
+	if (group.empty())
+		return true;
+	std::vector<IssuanceJournal::Entry> entries;
+	for (const StagedClient& staged : group)
+		entries.push_back(staged.entry);
+	try {
+		this->journal->Commit(entries);
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to commit %zu clients. %s\n", group.size(), e.what());
+		for (const StagedClient& staged : group)
+			releaseAddress(staged.entry.name);
+		this->failedClients += (int)group.size();
+		return false;
+	}
+	// Issued now whatever happens to the bundle, a bundle the sink refuses can be sent again by
+	// regenerate
+	bool ok = true;
+	for (const StagedClient& staged : group) {
+		if (this->Output == nullptr) {
+			this->cache->Record("clients/" + staged.entry.name + ".visz", staged.cacheKey);
+			continue;
+		}
+		try {
+			this->Output->Write("clients/" + staged.entry.name + ".visz", staged.visz, 0600);
+		}
+		catch (const std::exception& e) {
+			printf("ERROR: Failed to write client %s. %s\n", staged.entry.name.c_str(), e.what());
+			this->failedClients++;
+			ok = false;
+		}
+	}
+	std::unique_ptr<DirectoryLock> lock = lockDirectory();
+	if (lock == nullptr)
+		return false;
+	for (const StagedClient& staged : group)
+		this->index->Add(staged.cert);
+	return ok;
+}
+
+bool Interactive::flushClients()
+{
+	std::vector<StagedClient> group;
+	{
+		std::lock_guard<std::mutex> l(this->stagedLock);
+		group.swap(this->stagedClients);
+	}
+	return commitClients(std::move(group));
+}
+
+bool Interactive::openJournal()
+{
+	if (this->journal != nullptr)
+		return true;
+	// Recovered and opened under the lock, so no other process takes this journal for a crashed one
+	// before it is locked
+	std::vector<std::string> undone;
+	{
+		std::unique_ptr<DirectoryLock> lock = lockDirectory();
+		if (lock == nullptr)
+			return false;
+		try {
+			std::string directory = (fs::path(this->pkiPath) / "journal").string();
+			undone = IssuanceJournal::Recover(directory, { this->pkiPath, this->clientsPath });
+			this->journal.reset(new IssuanceJournal(directory));
+		}
+		catch (const std::exception& e) {
+			printf("ERROR: Failed to open the issuance journal. %s\n", e.what());
+			return false;
+		}
+	}
+	// Clients a crashed process never committed give their addresses back
+	for (const std::string& CN : undone) {
+		if (!fs::exists(fs::path(this->pkiPath) / (CN + ".crt")) && this->addressPool != nullptr)
+			releaseAddress(CN);
+	}
+	return true;
+}
+
+std::string Interactive::renderClientConfig(const std::string& CN)
+{
+	std::string file = "#-- Config Auto Generated By SparkLabs OpenVPN Certificate Generator--#\n\n";
+	file += "#viscosity name " + CN + "@" + this->clientAddress + "\n";
+	if (this->Workers > 1) {
+		// One remote per worker process, picked at random so clients spread across them
+		for (int worker = 0; worker < this->Workers; worker++) {
+			file += "remote " + this->clientAddress + " " + std::to_string(atoi(this->clientPort.c_str()) + worker) + " " + this->clientProto + "\n";
+		}
+		file += "remote-random\n";
+	}
+	else {
+		file += "remote " + this->clientAddress + " " + this->clientPort + " " + this->clientProto + "\n";
+	}
+	file += "dev tun\ntls-client\n";
+	//Certs
+	file += "ca ca.crt\n";
+	file += "cert " + CN + ".crt\n";
+	file += "key " + CN + ".key\n";
+	file += "persist-tun\npersist-key\nnobind\npull\n";
+	if (this->TLSCryptMode == TLSCrypt::Mode::V2) {
+		file += "tls-crypt-v2 tls-crypt-v2.key\n";
+	}
+	else if (this->TLSCryptMode == TLSCrypt::Mode::V1) {
+		file += "tls-crypt ta.key\n";
+	}
+	if (this->keyAlg == OpenSSLHelper::Algorithm::EdDSA) {
+		file += "tls-version-min 1.3\n";
+	}
+	else if (this->keyAlg == OpenSSLHelper::Algorithm::ECDSA) {
+		file += "tls-version-min 1.2\n";
+		file += "tls-cipher TLS-ECDHE-ECDSA-WITH-AES-256-GCM-SHA384\n";
+	}
+	file += Tuning::ClientDirectives(this->TuningProfile, this->aesni, this->DCO);
+	return file;
+}
+
+std::string Interactive::clientCacheKey(const std::string& config, const std::string& cert)
+{
+	// The key isn't part of it, a new key always comes with a new cert. A v2 client's tls-crypt
+	// key is random, so the server key it's wrapped with stands in for it.
+	const std::string& tlsCrypt = this->TLSCryptMode == TLSCrypt::Mode::V2 ? this->tlsCryptV2ServerKey : this->tlsCryptData;
+	return RegenerationCache::Key({ std::to_string(TemplateVersion), config, this->caData, cert, tlsCrypt });
+}
+
+bool Interactive::Regenerate()
+{
+	if (!CreateServerConfig())
+		return false;
+	if (!prepareClients())
+		return false;
+
+	// Every client with a cert and key still in pki, revoking removes them
+	std::vector<std::string> names;
+	try {
+		for (const auto& entry : fs::directory_iterator(this->pkiPath)) {
+			if (entry.path().extension() != ".crt")
+				continue;
+			std::string CN = entry.path().stem().string();
+			if (isProtectedCN(CN))
+				continue;
+			if (fs::exists(fs::path(this->pkiPath) / (CN + ".key")))
+				names.push_back(CN);
+		}
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to list clients. %s\n", e.what());
+		return false;
+	}
+	std::sort(names.begin(), names.end());
+
+	this->keyArena.reset(new KeyArena(1, KeySlotSize));
+	int rebuilt = 0;
+	int failed = 0;
+	for (const std::string& CN : names) {
+		ClientBundle bundle;
+		bundle.CN = CN;
+		std::string visz = (fs::path(this->clientsPath) / (CN + ".visz")).string();
+		try {
+			// A client revoked by another process since the listing is skipped, not brought back
+			std::unique_ptr<DirectoryLock> lock = lockDirectory();
+			if (lock == nullptr)
+				throw std::runtime_error("Failed to lock the config directory");
+			if (!fs::exists(fs::path(this->pkiPath) / (CN + ".crt")))
+				continue;
+			bundle.cert = readFile((fs::path(this->pkiPath) / (CN + ".crt")).string());
+			bundle.config = renderClientConfig(CN);
+			std::string key = clientCacheKey(bundle.config, bundle.cert);
+			if (this->Output == nullptr && this->cache->Fresh("clients/" + CN + ".visz", key))
+				continue;
+
+			bundle.key = this->keyArena->Acquire();
+			if (!bundle.key->ReadFrom((fs::path(this->pkiPath) / (CN + ".key")).string()))
+				throw std::runtime_error("Failed to read key");
+			if (this->TLSCryptMode == TLSCrypt::Mode::V2)
+				bundle.tlsCrypt = TLSCrypt::CreateV2ClientKey(this->tlsCryptV2ServerKey);
+			else
+				bundle.tlsCrypt = this->tlsCryptData;
+			if (this->Output != nullptr) {
+				TarGzWriter tar;
+				writeVisz(tar, bundle);
+				this->Output->Write("clients/" + CN + ".visz", tar.Data(), 0600);
+			}
+			else {
+				TarGzWriter tar(visz);
+				writeVisz(tar, bundle);
+				this->cache->Record("clients/" + CN + ".visz", key);
+			}
+			rebuilt++;
+		}
+		catch (const std::exception& e) {
+			printf("ERROR: Failed to regenerate client %s. %s\n", CN.c_str(), e.what());
+			failed++;
+		}
+		if (bundle.key != nullptr)
+			this->keyArena->Release(bundle.key);
+	}
+	this->keyArena.reset();
+	saveCache();
+
+	printf("%d of %zu client bundles changed.\n", rebuilt, names.size());
+	return failed == 0;
+}
+
+bool Interactive::Reconcile(std::istream& roster)
+{
+	// Read the way client --batch reads names, duplicates don't matter here
+	std::set<std::string> wanted;
+	std::string line;
+	while (std::getline(roster, line)) {
+		std::string name = trim(line);
+		if (name.empty() || name[0] == '#')
+			continue;
+		if (!isValidClientName(name)) {
+			printf("ERROR: \"%s\" can't be a client.\n", name.c_str());
+			return false;
+		}
+		wanted.insert(name);
+	}
+	// Most likely an export or upload that failed, not a decision to revoke everyone
+	if (wanted.empty()) {
+		printf("ERROR: The roster has no clients in it.\n");
+		return false;
+	}
+
+	// Issued clients are the certificates still in pki, revoking removes them
+	std::set<std::string> issued;
+	try {
+		if (fs::exists(this->pkiPath)) {
+			for (const auto& entry : fs::directory_iterator(this->pkiPath)) {
+				if (entry.path().extension() != ".crt")
+					continue;
+				std::string CN = entry.path().stem().string();
+				if (!isProtectedCN(CN))
+					issued.insert(CN);
+			}
+		}
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to list clients. %s\n", e.what());
+		return false;
+	}
+
+	std::vector<std::string> missing;
+	std::vector<std::string> removed;
+	std::set_difference(wanted.begin(), wanted.end(), issued.begin(), issued.end(), std::back_inserter(missing));
+	std::set_difference(issued.begin(), issued.end(), wanted.begin(), wanted.end(), std::back_inserter(removed));
+	printf("%zu to issue, %zu to revoke, %zu unchanged.\n", missing.size(), removed.size(), wanted.size() - missing.size());
+	if (missing.empty() && removed.empty())
+		return true;
+	// A roster missing most of its names looks the same as one revoking them on purpose
+	if (!this->ForceRevoke && !removed.empty() && (removed.size() == issued.size() || removed.size() * 100 > issued.size() * RevokeConfirmPercent)) {
+		std::string input = toLower(askQuestion("Revoke " + std::to_string(removed.size()) + " of " + std::to_string(issued.size()) + " clients? [y/N]:", false, true));
+		if (input != "y") {
+			printf("Nothing changed. Use --force to revoke them without asking.\n");
+			return false;
+		}
+	}
+
+	// Revoked first so the addresses they free can go to the new clients
+	if (!removed.empty()) {
+		std::set<std::string> crlPaths;
+		if (!revokeClients(removed, crlPaths))
+			return false;
+		printf("Revoked %zu clients.\n", removed.size());
+	}
+	bool ok = true;
+	if (!missing.empty()) {
+		std::stringstream names;
+		for (const std::string& CN : missing)
+			names << CN << "\n";
+		ok = CreateNewClientConfigs(names);
+	}
+	// Once, after both, so the new CRL and every address change land in one rebuild
+	return CreateServerConfig() && ok;
+}
+
+void Interactive::writeVisz(TarGzWriter& tar, const ClientBundle& bundle)
+{
+	Metrics::Timer timer(this->metrics, "openvpn_generate_bundle_duration_seconds");
+	// One directory deep, as Viscosity expects
+	tar.AddDirectory(bundle.CN);
+	tar.AddFile(bundle.CN + "/ca.crt", this->caData);
+	tar.AddFile(bundle.CN + "/" + bundle.CN + ".crt", bundle.cert);
+	tar.AddFile(bundle.CN + "/" + bundle.CN + ".key", bundle.key->Data(), bundle.key->Length(), 0600);
+	if (!bundle.tlsCrypt.empty()) {
+		std::string name = this->TLSCryptMode == TLSCrypt::Mode::V2 ? "tls-crypt-v2.key" : "ta.key";
+		tar.AddFile(bundle.CN + "/" + name, bundle.tlsCrypt, 0600);
+	}
+	tar.AddFile(bundle.CN + "/config.conf", bundle.config);
+	tar.Close();
+}
+
+std::unique_ptr<DirectoryLock> Interactive::lockDirectory()
+{
+	try {
+		return std::unique_ptr<DirectoryLock>(new DirectoryLock(this->lockPath, &this->metrics));
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: %s\n", e.what());
+		return nullptr;
+	}
+}
+
+bool Interactive::saveCache()
+{
+	std::unique_ptr<DirectoryLock> lock = lockDirectory();
+	return lock != nullptr && this->cache->Save();
+}
+
+int Interactive::Serial()
+{
+	std::lock_guard<std::mutex> l(this->serialLock);
+	if (this->_serial >= this->serialLimit && !reserveSerials(this->serialBlock))
+		throw std::runtime_error("Failed to reserve a serial");
+	return ++this->_serial;
+}
+
+bool Interactive::reserveSerials(int count)
+{
+	// Moves the serial in config.conf past a block of serials this process can then issue
+	// without going back to the file
+	std::unique_ptr<DirectoryLock> lock = lockDirectory();
+	if (lock == nullptr)
+		return false;
+	try {
+		Json disk = Json::parse(readFile(this->configPath));
+		const Json* val = disk.find("serial");
+		int start = std::max((int)this->_serial, val != nullptr ? (int)val->asInt() : 0);
+		// The serials past the root's block belong to intermediates
+		if (disk.find("issuers") != nullptr && start + count >= (1 << IssuingCA::SerialBits))
+			count = (1 << IssuingCA::SerialBits) - 1 - start;
+		if (count <= 0)
+			throw std::runtime_error("the root CA has used every serial below its intermediates");
+		disk["serial"] = start + count;
+		DirectoryLock::WriteFile(this->configPath, disk.dump());
+		this->_serial = start;
+		this->serialLimit = start + count;
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to reserve serials in %s. %s\n", this->configPath.c_str(), e.what());
+		return false;
+	}
+	return true;
+}
+
+void Interactive::releaseSerials()
+{
+	// A batch reserves a window of serials at a time, give back what it didn't get to. Only if no
+	// other process has reserved since, or the serial would go back over theirs.
+	try {
+		if (this->issuingCA != nullptr) {
+			this->issuingCA->ReleaseSerials();
+			return;
+		}
+		std::lock_guard<std::mutex> l(this->serialLock);
+		if (this->_serial >= this->serialLimit)
+			return;
+		std::unique_ptr<DirectoryLock> lock = lockDirectory();
+		if (lock == nullptr)
+			return;
+		Json disk = Json::parse(readFile(this->configPath));
+		const Json* val = disk.find("serial");
+		if (val == nullptr || (int)val->asInt() != this->serialLimit)
+			return;
+		disk["serial"] = (int)this->_serial;
+		DirectoryLock::WriteFile(this->configPath, disk.dump());
+		this->serialLimit = this->_serial;
+	}
+	catch (const std::exception& e) {
+		printf("WARNING: Failed to release unused serials. %s\n", e.what());
+	}
+}
+
+std::string Interactive::askQuestion(const std::string& question, bool allowedBlank, bool hasDefault)
+{
+	while (true) {
+		printf("%s ", question.c_str());
+		fflush(stdout);
+		std::string input;
+		if (!std::getline(std::cin, input)) {
+			if (hasDefault)
+				return std::string();
+			printf("\nERROR: Input closed.\n");
+			exit(1);
+		}
+		if (!input.empty() && input[input.size() - 1] == '\r')
+			input.erase(input.size() - 1);
+		if (isWhiteSpace(input) && !hasDefault) {
+			printf("This field cannot be left blank.\n");
+			continue;
+		}
+		if (input == "." && !allowedBlank) {
+			printf("This field cannot be left blank.\n");
+			continue;
+		}
+		return input;
+	}
+}
+
+bool Interactive::saveIdentity(const Identity& identity, const std::string& name)
+{
+	std::string cert = OpenSSLHelper::CertAsPEM(identity.cert);
+	if (cert.empty()) {
+		printf("ERROR: Failed to create certificate\n");
+		return false;
+	}
+	std::string key = OpenSSLHelper::KeyAsPEM(identity.key);
+	if (key.empty()) {
+		printf("ERROR: Failed to create key\n");
+		return false;
+	}
+	bool ok = writeIdentity(name, cert, key);
+	OPENSSL_cleanse(&key[0], key.size());
+	return ok;
+}
+
+bool Interactive::writeIdentity(const std::string& name, const std::string& cert, const std::string& key)
+{
+	//Create PKI dir
+	try {
+		fs::create_directories(this->pkiPath);
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to create PKI dir. %s\n", e.what());
+	}
+
+	// Committed through the journal like clients, so the certificate and key land together
+	bool opened = this->journal == nullptr;
+	if (!openJournal())
+		return false;
+	IssuanceJournal::Entry entry;
+	entry.name = name;
+	bool ok = true;
+	try {
+		DirectoryLock::WriteFile(IssuanceJournal::Stage(entry, (fs::path(this->pkiPath) / (name + ".crt")).string()), cert);
+		std::string keyTemp = IssuanceJournal::Stage(entry, (fs::path(this->pkiPath) / (name + ".key")).string());
+		DirectoryLock::WriteFile(keyTemp, key);
+		fs::permissions(keyTemp, fs::perms::owner_read | fs::perms::owner_write);
+		this->journal->Record(entry);
+		this->journal->Commit({ entry });
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to write %s certificate and key to disk. %s\n", name.c_str(), e.what());
+		for (const auto& file : entry.files)
+			remove(file.first.c_str());
+		ok = false;
+	}
+	if (opened)
+		this->journal.reset();
+	return ok;
+}
+
+bool Interactive::createNewServerIdentity()
+{
+	if (!verifyRequirements() || !requireRootKey())
+		return false;
+	CertificateSubject subject = subjectFor("server");
+	std::unique_ptr<Identity> identity;
+	try {
+		Metrics::Timer timer(this->metrics, "openvpn_generate_issue_duration_seconds");
+		identity = OpenSSLHelper::CreateCertKeyBundle(subject, *this->Issuer, this->keyAlg, this->keySize, this->curveName, this->validDays, this->Serial(), true, this->keyAlg == OpenSSLHelper::Algorithm::RSA ? this->ServerRSAPrimes : 2, this->CompactCerts);
+	}
+	catch (const std::exception& e) {
+		printf("Failed to create server identity. %s\n", e.what());
+		return false;
+	}
+	this->metrics.Add("openvpn_generate_certificates_issued_total", "algorithm=\"" + algorithmLabel() + "\"");
+	// Opening the journal takes the lock, so it's opened first
+	if (!openJournal())
+		return false;
+	std::unique_ptr<DirectoryLock> lock = lockDirectory();
+	if (lock == nullptr)
+		return false;
+	// Load before saving, a missing index is built from the certificates already in pki
+	this->index->Load(this->pkiPath);
+	bool saved = saveIdentity(*identity, "server");
+	this->journal.reset();
+	if (!saved)
+		return false;
+	this->index->Add(OpenSSLHelper::CertAsPEM(identity->cert));
+	reportChain("Server", OpenSSLHelper::CertDERSize(identity->cert));
+	return true;
+}
+
+CertificateSubject Interactive::subjectFor(const std::string& CN) const
+{
+	if (this->CompactCerts)
+		return CertificateSubject(CN);
+	CertificateSubject subject = *this->cSubject;
+	subject.CommonName = CN;
+	return subject;
+}
+
+void Interactive::reportChain(const char* who, size_t bytes)
+{
+	// The chain shares its flight with the rest of the handshake, past a packet it is fragmented
+	// and a lost fragment holds up the whole flight
+	size_t packets = (bytes + ControlPacketSize - 1) / ControlPacketSize;
+	if (packets <= 1)
+		printf("%s certificate chain: %zu bytes, fits in one %zu byte control packet.\n", who, bytes, ControlPacketSize);
+	else
+		printf("%s certificate chain: %zu bytes, spans %zu control packets of %zu bytes.\n", who, bytes, packets, ControlPacketSize);
+}
+
+std::string Interactive::certSerial(const std::string& certData)
+{
+	// crl-verify dir mode expects the serial as a decimal file name
+	BIO* bio = BIO_new_mem_buf(certData.data(), (int)certData.size());
+	X509* cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (cert == NULL)
+		throw std::runtime_error("Failed to parse certificate. " + OpenSSLHelper::LastError());
+	BIGNUM* bn = ASN1_INTEGER_to_BN(X509_get0_serialNumber(cert), NULL);
+	X509_free(cert);
+	char* dec = BN_bn2dec(bn);
+	std::string serial(dec);
+	OPENSSL_free(dec);
+	BN_free(bn);
+	return serial;
+}
+
+std::string Interactive::algorithmLabel() const
+{
+	switch (this->keyAlg) {
+	case OpenSSLHelper::Algorithm::ECDSA:
+		return "ecdsa";
+	case OpenSSLHelper::Algorithm::EdDSA:
+		return "eddsa";
+	default:
+		return "rsa";
+	}
+}
+
+bool Interactive::WriteMetrics()
+{
+	if (this->MetricsPath.empty())
+		return true;
+
+	// Expiry comes from the index rather than parsing every certificate
+	time_t now = time(NULL);
+	{
+		std::unique_ptr<DirectoryLock> lock = lockDirectory();
+		if (lock == nullptr)
+			return false;
+		this->index->Load(this->pkiPath);
+	}
+	this->metrics.Set("openvpn_generate_certificates_valid", "", this->index->CountValid(now));
+	this->metrics.Set("openvpn_generate_certificates_expiring", "days=\"" + std::to_string(this->MetricsExpiryDays) + "\"",
+		this->index->CountExpiring(now, this->MetricsExpiryDays));
+
+	std::error_code ec;
+	if (this->UseCRLDir) {
+		int entries = 0;
+		if (fs::exists(this->crlDirPath, ec)) {
+			for (const auto& entry : fs::directory_iterator(this->crlDirPath, ec)) {
+				(void)entry;
+				entries++;
+			}
+		}
+		this->metrics.Set("openvpn_generate_crl_entries", "", entries);
+	}
+	else if (fs::exists(this->crlPath, ec)) {
+		this->metrics.Set("openvpn_generate_crl_bytes", "", (double)fs::file_size(this->crlPath, ec));
+		// Counted from the DER framing, a large CRL isn't decoded just to size it
+		long long entries = CRLFile(this->crlPath).Entries();
+		if (entries < 0) {
+			printf("WARNING: Failed to read CRL for metrics.\n");
+			entries = 0;
+		}
+		this->metrics.Set("openvpn_generate_crl_entries", "", (double)entries);
+	}
+	this->metrics.Set("openvpn_generate_last_run_timestamp_seconds", "", (double)now);
+	return this->metrics.Write(this->MetricsPath);
+}
+
+bool Interactive::loadAddressPool()
+{
+	uint32_t network;
+	int prefixLength;
+	if (!AddressPool::TryParseSubnet(this->Subnet, network, prefixLength)) {
+		printf("ERROR: Invalid subnet %s. Please regenerate config.\n", this->Subnet.c_str());
+		return false;
+	}
+	this->addressPool.reset(new AddressPool(this->addressPoolPath, network, prefixLength));
+	return this->addressPool->Load();
+}
+
+bool Interactive::assignAddress(const std::string& CN)
+{
+	// The pool writes the address it hands out through under the lock, after checking another
+	// process hasn't taken it since
+	std::unique_ptr<DirectoryLock> lock = lockDirectory();
+	if (lock == nullptr)
+		return false;
+	std::string ccdFile = (fs::path(this->ccdPath) / CN).string();
+	uint32_t address;
+	// Reissuing a CN keeps the address it already has
+	if (!readAssignment(ccdFile, address)) {
+		try {
+			address = this->addressPool->Allocate();
+		}
+		catch (const std::exception& e) {
+			printf("ERROR: Failed to assign an address to %s. %s\n", CN.c_str(), e.what());
+			return false;
+		}
+	}
+
+	try {
+		fs::create_directories(this->ccdPath);
+		DirectoryLock::WriteFile(ccdFile, ccdEntry(address, 0));
+		// Keep an existing server config in step so it doesn't need to be regenerated
+		for (int worker = 0; worker < this->Workers; worker++) {
+			fs::path serverCcdDir = fs::path(this->path) / "server" / ("ccd" + this->suffix + workerSuffix(worker));
+			if (!fs::exists(serverCcdDir))
+				continue;
+			std::string entry = ccdEntry(address, worker);
+			DirectoryLock::WriteFile((serverCcdDir / CN).string(), entry);
+			this->cache->Record("server/" + serverCcdDir.filename().string() + "/" + CN, RegenerationCache::Key({ std::to_string(TemplateVersion), entry }));
+		}
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to write client config dir entry for %s. %s\n", CN.c_str(), e.what());
+		this->addressPool->Free(address);
+		return false;
+	}
+	return true;
+}
+
+void Interactive::releaseAddress(const std::string& CN)
+{
+	std::unique_ptr<DirectoryLock> lock = lockDirectory();
+	if (lock == nullptr)
+		return;
+	std::string ccdFile = (fs::path(this->ccdPath) / CN).string();
+	uint32_t address;
+	if (readAssignment(ccdFile, address))
+		this->addressPool->Free(address);
+	std::error_code ec;
+	fs::remove(ccdFile, ec);
+	for (int worker = 0; worker < this->Workers && !ec; worker++) {
+		std::string serverCcdDir = "ccd" + this->suffix + workerSuffix(worker);
+		fs::remove(fs::path(this->path) / "server" / serverCcdDir / CN, ec);
+		this->cache->Forget("server/" + serverCcdDir + "/" + CN);
+	}
+	if (ec)
+		printf("WARNING: Failed to remove client config dir entry. %s\n", ec.message().c_str());
+}
+
+bool Interactive::assignMissingAddresses()
+{
+	// Clients issued before static addressing have no ccd entry and would get no address with nopool
+	if (!fs::exists(this->pkiPath))
+		return true;
+	for (const auto& entry : fs::directory_iterator(this->pkiPath)) {
+		if (entry.path().extension() != ".crt" || entry.path().string() == this->crlPath)
+			continue;
+		std::string CN = entry.path().stem().string();
+		if (CN == "ca" || CN == "server")
+			continue;
+		uint32_t address;
+		if (readAssignment((fs::path(this->ccdPath) / CN).string(), address))
+			continue;
+		if (!assignAddress(CN))
+			return false;
+	}
+	return true;
+}
+
+std::string Interactive::workerSuffix(int worker) const
+{
+	// A single server keeps the names it always had
+	return this->Workers > 1 ? "-" + std::to_string(worker) : "";
+}
+
+uint32_t Interactive::workerAddress(uint32_t address, int worker) const
+{
+	// A client keeps the same offset in every worker's subnet, so one pool covers them all
+	return address + (uint32_t)worker * this->addressPool->Span();
+}
+
+std::string Interactive::ccdEntry(uint32_t address, int worker) const
+{
+	return "ifconfig-push " + AddressPool::ToString(workerAddress(address, worker)) + " " + this->addressPool->Netmask() + "\n";
+}
+
+bool Interactive::readAssignment(const std::string& ccdFile, uint32_t& address)
+{
+	std::ifstream in(ccdFile);
+	std::string line;
+	while (in && std::getline(in, line)) {
+		std::istringstream words(line);
+		std::string directive, value;
+		if (words >> directive >> value && directive == "ifconfig-push")
+			return AddressPool::TryParse(value, address);
+	}
+	return false;
+}
+
+bool Interactive::verifyRequirements()
+{
+	printf("Creating Server Identity...\n");
+	if (this->Issuer == nullptr) {
+		printf("ERROR: No issuer available.\n");
+		return false;
+	}
+	if (this->cSubject == nullptr) {
+		printf("ERROR: No subject available.\n");
+		return false;
+	}
+	return true;
+}
+
+bool Interactive::requireRootKey()
+{
+	if (this->Issuer != nullptr && this->Issuer->key == NULL) {
+		printf("ERROR: The root CA key is offline, sign with an intermediate using --issuer instead.\n");
+		return false;
+	}
+	return true;
+}
+
+bool Interactive::loadIssuingCA()
+{
+	if (this->cSubject == nullptr) {
+		printf("ERROR: No subject available.\n");
+		return false;
+	}
+	const Json* issuers = this->config.find("issuers");
+	const Json* index = issuers != nullptr ? issuers->find(this->IssuerName) : nullptr;
+	if (index == nullptr) {
+		printf("ERROR: No intermediate named %s, create it with issuer first.\n", this->IssuerName.c_str());
+		return false;
+	}
+	try {
+		this->issuingCA.reset(new IssuingCA(this->pkiPath, this->IssuerName, (int)index->asInt(), &this->metrics));
+		this->issuingCA->Load(true);
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to load intermediate %s. %s\n", this->IssuerName.c_str(), e.what());
+		this->issuingCA.reset();
+		return false;
+	}
+	return true;
+}
+
+std::vector<std::unique_ptr<IssuingCA>> Interactive::issuingCAs(const Json& config)
+{
+	// Certificates only, in the order they were created. Throws if one can't be read.
+	std::vector<std::pair<int, std::string>> names;
+	const Json* issuers = config.find("issuers");
+	if (issuers != nullptr) {
+		for (const auto& item : issuers->items())
+			names.emplace_back((int)item.second.asInt(), item.first);
+	}
+	std::sort(names.begin(), names.end());
+	std::vector<std::unique_ptr<IssuingCA>> result;
+	for (const auto& name : names) {
+		result.emplace_back(new IssuingCA(this->pkiPath, name.second, name.first, &this->metrics));
+		result.back()->Load(false);
+	}
+	return result;
+}
+
+std::unique_ptr<IssuingCA> Interactive::issuingCAFor(const std::string& certData)
+{
+	// nullptr when the root signed it. Issuers are read from the file, another process may have
+	// added one since this one started.
+	BIO* bio = BIO_new_mem_buf(certData.data(), (int)certData.size());
+	X509* cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (cert == NULL)
+		throw std::runtime_error("Failed to parse certificate. " + OpenSSLHelper::LastError());
+	bool root = X509_NAME_cmp(X509_get_issuer_name(cert), X509_get_subject_name(this->Issuer->cert)) == 0;
+	std::unique_ptr<IssuingCA> found;
+	if (!root) {
+		try {
+			for (auto& intermediate : issuingCAs(Json::parse(readFile(this->configPath)))) {
+				if (X509_NAME_cmp(X509_get_issuer_name(cert), X509_get_subject_name(intermediate->Issuer().cert)) == 0) {
+					found = std::move(intermediate);
+					break;
+				}
+			}
+		}
+		catch (...) {
+			X509_free(cert);
+			throw;
+		}
+	}
+	X509_free(cert);
+	if (root)
+		return nullptr;
+	if (found == nullptr)
+		throw std::runtime_error("No CA in pki signed this certificate");
+	found->Load(true);
+	return found;
+}
+
+std::string Interactive::serverCRL()
+{
+	// One file with the root's CRL and every intermediate's, OpenVPN loads them all
+	std::string crl = readFile(this->crlPath);
+	for (const auto& intermediate : issuingCAs(this->config)) {
+		std::string path = intermediate->CRLPath();
+		if (fs::exists(path))
+			crl += readFile(path);
+	}
+	return crl;
+}
+
+bool Interactive::GenerateNewConfig()
+{
+	//First check a config doesn't already exist here
+	if (LoadConfig()) {
+		printf("ERROR: Config already exists, please choose a different directory\n");
+		return false;
+	}
+	if (!loadAddressPool())
+		return false;
+	// A DNS server beside the VPN server listens on the server's tunnel address
+	std::string localDNS = this->addressPool->Gateway();
+	printf("Please fill in the information below that will be incorporated into your certificate.\n");
+	printf("Some fields have a default value in square brackets, simply press Enter to use these values without entering anything.\n");
+	printf("Some fields can be left blank if desired. Enter a '.' only for a field to be left blank.\n");
+	printf("---\n");
+
+	if (this->keyAlg == OpenSSLHelper::Algorithm::EdDSA) {
+		while (true) {
+			printf("IMPORTANT!!!\n");
+			printf("You have selected to use EdDSA. EdDSA support is currently experimental.\n");
+			printf("Please note EdDSA keys and configurations will only work with Viscosity 1.8.2+, and OpenVPN 2.4.7+ & OpenSSL 1.1.1+ on your server.\n");
+			std::string input = toLower(askQuestion("Continue? [Y/n]:", false));
+			if (input.empty() || input == "y") {
+				break;
+			}
+			else if (input == "n") {
+				exit(0);
+			}
+			printf("Invalid input, try again.\n");
+		}
+	}
+
+	std::string address = askQuestion("Server address, e.g. myserver.mydomain.com:", false, false);
+
+	std::string port;
+	while (true) {
+		std::string input = askQuestion("Server Port [" + defaultPort + "]:", false);
+		if (input.empty()) {
+			port = defaultPort;
+			break;
+		}
+		//Check
+		char* end = nullptr;
+		long test = strtol(input.c_str(), &end, 10);
+		if (end != nullptr && *end == '\0' && test > 0 && test + this->Workers - 1 < 65535) {
+			port = input;
+			break;
+		}
+		else {
+			printf("Invalid input, try again.\n");
+		}
+	}
+
+	std::string proto;
+	while (true) {
+		std::string input = askQuestion("Protocol, 1=UDP, 2=TCP [" + defaultProtocol + "]:", false);
+		if (input.empty()) {
+			proto = toLower(defaultProtocol);
+			break;
+		}
+		if (input == "1") {
+			proto = "udp";
+			break;
+		}
+		else if (input == "2") {
+			proto = "tcp";
+			break;
+		}
+		printf("Invalid input, try again\n");
+	}
+
+	bool redirectTraffic = true;
+	while (true) {
+		std::string input = toLower(askQuestion("Redirect all traffic through VPN? [Y/n]:", false));
+		if (input.empty() || input == "y") {
+			break;
+		}
+		else if (input == "n") {
+			redirectTraffic = false;
+			break;
+		}
+		printf("Invalid input, try again.\n");
+	}
+
+	std::vector<std::string> dns;
+
+	int defaultDNSChoice;
+	bool customDNS = false;
+	if (redirectTraffic)
+		defaultDNSChoice = 1;
+	else
+		defaultDNSChoice = 4;
+
+	printf("Please specify DNS servers to push to connecting clients:\n");
+	printf("\t1 - CloudFlare (%s)\n", join(cloudflareDNS, " & ").c_str());
+	printf("\t2 - Google (%s)\n", join(googleDNS, " & ").c_str());
+	printf("\t3 - OpenDNS (%s)\n", join(openDNS, " & ").c_str());
+	printf("\t4 - Local Server (%s). You will need a DNS server running beside your VPN server\n", localDNS.c_str());
+	printf("\t5 - Custom\n");
+	printf("\t6 - None\n");
+
+	while (true) {
+		std::string input = askQuestion("Please select an option [" + std::to_string(defaultDNSChoice) + "]:", true);
+		if (input.empty()) {
+			if (defaultDNSChoice == 1)
+				dns = cloudflareDNS;
+			else
+				dns.push_back(localDNS);
+		}
+		else if (input == "1")
+			dns = cloudflareDNS;
+		else if (input == "2")
+			dns = googleDNS;
+		else if (input == "3")
+			dns = openDNS;
+		else if (input == "4")
+			dns.push_back(localDNS);
+		else if (input == "5")
+			customDNS = true;
+		else if (input == "6" || input == ".")
+			break;
+		else {
+			printf("%s is not a valid choice\n", input.c_str());
+			continue;
+		}
+		// Default will continue, so we can break here
+		break;
+	}
+
+	if (customDNS) {
+		while (true) {
+			std::string input = askQuestion("Enter Custom DNS Servers, comma separated for multiple:", false);
+			if (isWhiteSpace(input))
+				continue;
+			//Try and split whatever input was given
+			dns.clear();
+			std::stringstream ss(input);
+			std::string var;
+			bool valid = true;
+			while (std::getline(ss, var, ',')) {
+				std::string tmp = trim(var);
+				if (tmp.empty())
+					continue;
+				unsigned char discard[16];
+				if (inet_pton(AF_INET, tmp.c_str(), discard) == 1 || inet_pton(AF_INET6, tmp.c_str(), discard) == 1) {
+					dns.push_back(tmp);
+				}
+				else {
+					printf("%s is not a valid IP Address.\n", tmp.c_str());
+					valid = false;
+					break;
+				}
+			}
+			if (valid)
+				break;
+		}
+	}
+
+	// Compact certificates only carry a Common Name, there are no other details to ask for
+	bool useDefaults = true;
+	while (!this->CompactCerts) {
+		std::string input = toLower(askQuestion("Would you like to use anonymous defaults for certificate details? [Y/n]:", false));
+		if (input.empty() || input == "y") {
+			break;
+		}
+		else if (input == "n") {
+			useDefaults = false;
+			break;
+		}
+		printf("Invalid input, try again.\n");
+	}
+
+	std::unique_ptr<CertificateSubject> cs;
+	if (useDefaults) {
+		cs.reset(new CertificateSubject(address));
+	}
+	else {
+		std::string input = askQuestion("Common Name, e.g. your servers name [" + address + "]:", false);
+		if (input.empty()) {
+			input = address;
+		}
+		cs.reset(new CertificateSubject(input));
+
+		const struct {
+			const char* question;
+			const std::string& defaultValue;
+			std::string& field;
+		} fields[] = {
+			{ "Country Name, 2 letter ISO code", defaultCountry, cs->Country },
+			{ "State or Province", defaultState, cs->State },
+			{ "Locality Name, e.g. a City", defaultLocale, cs->Location },
+			{ "Organisation Name", defaultON, cs->Organisation },
+			{ "Organisation Unit, e.g. department", defaultOU, cs->OrganisationUnit },
+			{ "Email Address", defaultEmail, cs->Email },
+		};
+		for (const auto& field : fields) {
+			input = askQuestion(std::string(field.question) + " [" + field.defaultValue + "]:", true);
+			if (input.empty()) {
+				input = field.defaultValue;
+			}
+			if (input != ".") {
+				field.field = input;
+			}
+		}
+	}
+
+	Json config = cs->toDict();
+	config["proto"] = proto;
+	config["port"] = port;
+	config["server"] = address;
+	config["redirect"] = redirectTraffic;
+	config["keysize"] = this->keySize;
+	config["validdays"] = this->validDays;
+	config["dns"] = Json(dns);
+	config["algorithm"] = (int)this->keyAlg;
+	config["eccurve"] = this->curveName;
+	config["suffix"] = this->suffix;
+	config["crlmode"] = this->UseCRLDir ? "dir" : "file";
+	config["tlscrypt"] = (int)this->TLSCryptMode;
+	config["subnet"] = this->Subnet;
+	config["workers"] = this->Workers;
+	config["profile"] = (int)this->TuningProfile;
+	config["dco"] = this->DCO;
+	config["serverrsaprimes"] = this->ServerRSAPrimes;
+	config["compactcerts"] = this->CompactCerts;
+	// Detected once here, the configs are generated on the server host more often than not
+	this->aesni = Tuning::HasAESNI();
+	config["aesni"] = this->aesni;
+	if (!this->Routes.empty())
+		config["routes"] = Json(this->Routes);
+
+	this->config = config;
+	this->cSubject = std::move(cs);
+
+	return this->SaveConfig();
+}
+
+bool Interactive::RevokeCert(const std::string& name)
+{
+	if (!fs::exists(this->pkiPath)) {
+		printf("ERROR: There are no certificates to revoke.\n");
+		return false;
+	}
+	std::string CN;
+	if (!isWhiteSpace(name)) {
+		CN = name;
+	}
+	else {
+		std::string input = askQuestion("Common Name of certificate to revoke:", false);
+		if (isWhiteSpace(input)) {
+			return false;
+		}
+		else {
+			CN = input;
+		}
+	}
+	// Make sure we don't revoke ourself
+	if (isProtectedCN(CN)) {
+		printf("ERROR: Cannot revoke this.\n");
+		return false;
+	}
+	if (!isValidClientName(CN)) {
+		printf("ERROR: \"%s\" can't be a client.\n", CN.c_str());
+		return false;
+	}
+	std::set<std::string> crlPaths;
+	if (!revokeClients({ CN }, crlPaths))
+		return false;
+	std::string revokedCRLPath = crlPaths.empty() ? std::string() : *crlPaths.begin();
+
+	printf("\n");
+	if (this->UseCRLDir) {
+		printf("\"%s\" has been successfully revoked. The revocation entry has been saved to \"%s\".\n", CN.c_str(), this->crlDirPath.c_str());
+		if (fs::exists(fs::path(this->path) / "server")) {
+			printf("The server configuration has been updated, OpenVPN will pick up the change on the next connection.\n");
+			return true;
+		}
+		printf("\n");
+	}
+	else {
+		printf("\"%s\" has been successfully revoked. The CRL file has been saved to \"%s\".\n", CN.c_str(), revokedCRLPath.c_str());
+		printf("Please leave a copy of the CRL file in place if you wish to update it in the future.\n");
+		printf("\n");
+	}
+	std::string input = toLower(askQuestion("Regenerate Server configuration? [Y/n]:", false));
+	if (input.empty() || input == "y") {
+		this->CreateServerConfig();
+	}
+
+	return true;
+}
+
+bool Interactive::revokeClients(const std::vector<std::string>& CNs, std::set<std::string>& crlPaths)
+{
+	// Held from finding the certificates to removing them, so two revokes can't both append to the
+	// CRL they read and a regenerate can't write a bundle for a client half way through revoking
+	std::unique_ptr<DirectoryLock> lock = lockDirectory();
+	if (lock == nullptr)
+		return false;
+	// Every certificate is found before anything is revoked
+	std::vector<std::string> certs;
+	for (const std::string& CN : CNs) {
+		std::string certpath = (fs::path(this->pkiPath) / (CN + ".crt")).string();
+		if (!fs::exists(certpath)) {
+			printf("ERROR: Certificate not found for %s.\n", CN.c_str());
+			return false;
+		}
+		try {
+			certs.push_back(readFile(certpath));
+		}
+		catch (const std::exception& e) {
+			printf("ERROR: Failed to read certificate off disk. %s\n", e.what());
+			return false;
+		}
+	}
+	if (this->UseCRLDir) {
+		std::vector<std::string> serials;
+		try {
+			for (const std::string& certData : certs)
+				serials.push_back(certSerial(certData));
+		}
+		catch (const std::exception& e) {
+			printf("ERROR: Failed to read certificate serial. %s\n", e.what());
+			return false;
+		}
+		// Revoking is just creating an empty file named after the serial, no CRL to sign or rewrite
+		try {
+			fs::create_directories(this->crlDirPath);
+			for (const std::string& serial : serials)
+				DirectoryLock::WriteFile((fs::path(this->crlDirPath) / serial).string(), std::string());
+		}
+		catch (const std::exception& e) {
+			printf("ERROR: Failed to write revocation entry to disk. %s\n", e.what());
+			return false;
+		}
+		// Update the server copy in place so it doesn't need to be regenerated
+		fs::path serverCrlDir = fs::path(this->path) / "server" / ("crl" + this->suffix);
+		try {
+			if (fs::exists(serverCrlDir)) {
+				for (const std::string& serial : serials)
+					DirectoryLock::WriteFile((serverCrlDir / serial).string(), std::string());
+			}
+		}
+		catch (const std::exception& e) {
+			printf("WARNING: Failed to update server revocation directory. %s\n", e.what());
+		}
+	}
+	else {
+		// Revoked on the CRL of whichever CA signed each, grouped so every CRL is signed once
+		struct CRLUpdate
+		{
+			std::unique_ptr<IssuingCA> intermediate;
+			std::vector<std::string> certs;
+		};
+		std::map<std::string, CRLUpdate> updates;
+		for (const std::string& certData : certs) {
+			std::unique_ptr<IssuingCA> intermediate;
+			try {
+				intermediate = issuingCAFor(certData);
+			}
+			catch (const std::exception& e) {
+				printf("ERROR: %s\n", e.what());
+				return false;
+			}
+			if (intermediate == nullptr && this->Issuer->key == NULL) {
+				printf("ERROR: The root CA signed this certificate and its key is offline.\n");
+				return false;
+			}
+			CRLUpdate& update = updates[intermediate != nullptr ? intermediate->CRLPath() : this->crlPath];
+			if (update.intermediate == nullptr)
+				update.intermediate = std::move(intermediate);
+			update.certs.push_back(certData);
+		}
+		for (auto& item : updates) {
+			CRLFile crl(item.first);
+			if (crl.Exists())
+				printf("Existing CRL found and will be appended to.\n");
+			else
+				printf("No existing CRL was found, a new CRL will be created.\n");
+
+			// Create/Update CRL, both the PEM and its DER copy
+			try {
+				Metrics::Timer timer(this->metrics, "openvpn_generate_crl_duration_seconds");
+				const CRLUpdate& update = item.second;
+				crl.Revoke(update.intermediate != nullptr ? update.intermediate->Issuer() : *this->Issuer, update.certs, this->validDays);
+			}
+			catch (const std::exception& e) {
+				printf("Failed to create CRL. %s\n", e.what());
+				return false;
+			}
+			crlPaths.insert(item.first);
+		}
+	}
+
+	// Reloaded under the lock so issues by other processes aren't dropped when it's rewritten
+	this->index->Load(this->pkiPath);
+	for (const std::string& certData : certs) {
+		this->index->Revoke(certData);
+		this->metrics.Add("openvpn_generate_certificates_revoked_total", "algorithm=\"" + algorithmLabel() + "\"");
+	}
+
+	// Delete the PKI and configuration for these users
+	std::error_code ec;
+	for (const std::string& CN : CNs) {
+		const std::string revokedFiles[] = {
+			(fs::path(this->pkiPath) / (CN + ".crt")).string(),
+			(fs::path(this->pkiPath) / (CN + ".key")).string(),
+			(fs::path(this->clientsPath) / (CN + ".visz")).string(),
+		};
+		for (const std::string& file : revokedFiles) {
+			if (!fs::remove(file, ec) && ec)
+				printf("WARNING: Failed to remove revoked PKI data. %s\n", ec.message().c_str());
+		}
+		this->cache->Forget("clients/" + CN + ".visz");
+	}
+	lock.reset();
+	for (const std::string& CN : CNs)
+		releaseAddress(CN);
+	saveCache();
+	return true;
+}
@@ -0,0 +1,234 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include "AddressPool.h"
+#include "Archive.h"
+#include "BoundedQueue.h"
+#include "CertificateIndex.h"
+#include "DirectoryLock.h"
+#include "IssuanceJournal.h"
+#include "IssuingCA.h"
+#include "Json.h"
+#include "KeyArena.h"
+#include "Metrics.h"
+#include "OpenSSLHelper.h"
+#include "OutputSink.h"
+#include "RegenerationCache.h"
+#include "RouteAggregator.h"
+#include "TLSCrypt.h"
+#include "Tuning.h"
+
+#include <atomic>
+#include <climits>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+class Interactive
+{
+public:
+	Interactive(const std::string& path, OpenSSLHelper::Algorithm algorithm, int keySize, const std::string& ecCurve, int validDays, const std::string& suffix);
+
+	bool LoadConfig();
+	bool SaveConfig();
+	bool CreateNewIssuer();
+	// Creates an intermediate CA signed by the root, owning the next free block of serials
+	bool CreateIssuingCA(const std::string& name);
+	bool CreateDH();
+	bool CreateTLSCryptKey();
+	bool CreateServerConfig();
+	bool CreateNewClientConfig(const std::string& name);
+	bool CreateNewClientConfigs(std::istream& names);
+	bool GenerateNewConfig();
+	bool RevokeCert(const std::string& name);
+	// Rebuilds the server config and every client bundle, rewriting only what changed
+	bool Regenerate();
+	// Issues everyone in the roster without a certificate and revokes every client not in it, then
+	// rebuilds the server config once
+	bool Reconcile(std::istream& roster);
+	// Writes counters, timings and PKI health to MetricsPath for the node_exporter textfile collector
+	bool WriteMetrics();
+
+	// Revoke by dropping a file named after the serial into a directory (crl-verify DIR dir)
+	// instead of signing a monolithic CRL
+	bool UseCRLDir = false;
+	TLSCrypt::Mode TLSCryptMode = TLSCrypt::Mode::None;
+	// Aggregated CIDR blocks pushed to clients as routes
+	std::vector<std::string> Routes;
+	// Tunnel subnet in CIDR notation, 10.8.0.0/24 unless set at init
+	std::string Subnet = defaultSubnet;
+	// Server processes, each on the next port, tun device and subnet along from the first
+	int Workers = 1;
+	// Data channel cipher order, buffer and MTU settings
+	Tuning::Profile TuningProfile = Tuning::Profile::None;
+	// Render configs that keep the data channel offloaded to the kernel (ovpn-dco, OpenVPN 2.6+)
+	bool DCO = false;
+	// Primes in a new RSA server key. More primes make the server's half of each handshake cheaper
+	// while clients see an ordinary key of the same size.
+	int ServerRSAPrimes = 2;
+	// Certificates with only a Common Name and the extensions OpenVPN checks, so the chain sent on
+	// every handshake is as small as it can be
+	bool CompactCerts = false;
+	// Intermediate in pki/issuers that signs new clients, the root CA when empty
+	std::string IssuerName;
+	// Reconcile revokes every client, or more than RevokeConfirmPercent of them, without asking
+	bool ForceRevoke = false;
+	// Where server files and client bundles go instead of the config directory, when set
+	std::unique_ptr<OutputSink> Output;
+	// Prometheus textfile, nothing is written when empty
+	std::string MetricsPath;
+	// Window for the certificates expiring gauge
+	int MetricsExpiryDays = 30;
+
+private:
+	// A client moving through the issue -> encode -> write stages
+	struct ClientBundle
+	{
+		std::string CN;
+		std::unique_ptr<Identity> identity;
+		std::string cert;
+		KeyBuffer* key = nullptr;
+		std::string config;
+		std::string tlsCrypt;
+	};
+	// A client whose files are written beside their targets, waiting for its group to be committed
+	struct StagedClient
+	{
+		IssuanceJournal::Entry entry;
+		std::string cert;
+		std::string cacheKey;
+		// The bundle, held until the group is committed when it goes to Output
+		std::string visz;
+	};
+
+	std::string defaultCountry = "AU";
+	std::string defaultState = "NSW";
+	std::string defaultLocale = "Sydney";
+	std::string defaultON = "My Company";
+	std::string defaultOU = "Networks";
+	std::string defaultCN = "My OpenVPN Server";
+	std::string defaultEmail = "me@host.domain";
+
+	std::string defaultProtocol = "UDP";
+	std::string defaultPort = "1194";
+
+	static const std::vector<std::string> cloudflareDNS;
+	static const std::vector<std::string> googleDNS;
+	static const std::vector<std::string> openDNS;
+	static const std::string defaultSubnet;
+	static const int defaultMaxClients = 1024;
+	// Part of every cache key. Bump it when the output format changes so cached files are rebuilt.
+	static const int TemplateVersion = 1;
+	// OpenVPN's default tls-mtu, the most handshake data a control channel packet carries
+	static const size_t ControlPacketSize = 1250;
+	// Share of the issued clients a reconcile can revoke before it asks, see ForceRevoke
+	static const size_t RevokeConfirmPercent = 25;
+
+	std::string path;
+	std::string configPath;
+	std::string pkiPath;
+	std::string caPath;
+	std::string keyPath;
+	std::string crlPath;
+	std::string crlDirPath;
+	std::string tlsCryptPath;
+	std::string tlsCryptV2Path;
+	std::string clientsPath;
+	std::string ccdPath;
+	std::string addressPoolPath;
+	// Taken by every process before changing state shared through the directory
+	std::string lockPath;
+
+	std::unique_ptr<CertificateSubject> cSubject;
+	Json config;
+	// The root CA, without a key when ca.key has been taken offline
+	std::unique_ptr<Identity> Issuer;
+	std::unique_ptr<IssuingCA> issuingCA;
+	// Encoded once per run from the subject and the issuer that signs clients
+	std::unique_ptr<CertTemplate> clientTemplate;
+	std::unique_ptr<AddressPool> addressPool;
+	std::unique_ptr<RegenerationCache> cache;
+	std::unique_ptr<CertificateIndex> index;
+	Metrics metrics;
+
+	int keySize;
+	int validDays;
+	std::atomic<int> _serial{ 0 };
+	// Serials up to here are reserved in config.conf for this process. Other processes sharing
+	// the directory reserve past it, so no two issue the same serial.
+	int serialLimit = INT_MAX;
+	int serialBlock = 1;
+	std::mutex serialLock;
+	OpenSSLHelper::Algorithm keyAlg;
+	std::string curveName;
+	std::string suffix;
+	// Whether the host init ran on has AES instructions, decides the cipher order of the profile
+	bool aesni = false;
+	int Serial();
+	bool reserveSerials(int count);
+	void releaseSerials();
+
+	// Shared by every client bundle, loaded once by prepareClients
+	std::string clientAddress;
+	std::string clientPort;
+	std::string clientProto;
+	std::string caData;
+	std::string tlsCryptData;
+	std::string tlsCryptV2ServerKey;
+
+	// Bulk issuance pipeline
+	static const size_t BatchWindow = 256;
+	static const size_t KeySlotSize = 16384;
+	std::unique_ptr<KeyArena> keyArena;
+	std::atomic<int> failedClients{ 0 };
+	// Largest client chain issued this run, for reportChain
+	std::atomic<size_t> clientChainBytes{ 0 };
+	// Written clients are made durable and moved into place this many at a time, with one sync
+	static const size_t CommitGroup = 64;
+	std::unique_ptr<IssuanceJournal> journal;
+	std::mutex stagedLock;
+	std::vector<StagedClient> stagedClients;
+
+	std::unique_ptr<DirectoryLock> lockDirectory();
+	bool saveCache();
+	std::string askQuestion(const std::string& question, bool allowedBlank, bool hasDefault = true);
+	bool saveIdentity(const Identity& identity, const std::string& name);
+	bool writeIdentity(const std::string& name, const std::string& cert, const std::string& key);
+	bool createNewServerIdentity();
+	CertificateSubject subjectFor(const std::string& CN) const;
+	static void reportChain(const char* who, size_t bytes);
+	bool prepareClients();
+	bool prepareTemplate();
+	std::unique_ptr<ClientBundle> issueClient(const std::string& CN);
+	bool encodeClient(ClientBundle& bundle);
+	bool writeClient(ClientBundle& bundle);
+	bool commitClients(std::vector<StagedClient> group);
+	bool flushClients();
+	// Revokes every client in CNs under one lock, signing each CRL once. Fills crlPaths with the
+	// CRLs that changed.
+	bool revokeClients(const std::vector<std::string>& CNs, std::set<std::string>& crlPaths);
+	bool openJournal();
+	std::string renderClientConfig(const std::string& CN);
+	std::string clientCacheKey(const std::string& config, const std::string& cert);
+	void writeVisz(TarGzWriter& tar, const ClientBundle& bundle);
+	std::string certSerial(const std::string& certData);
+	std::string algorithmLabel() const;
+	bool loadAddressPool();
+	bool assignAddress(const std::string& CN);
+	void releaseAddress(const std::string& CN);
+	bool assignMissingAddresses();
+	static bool readAssignment(const std::string& ccdFile, uint32_t& address);
+	std::string workerSuffix(int worker) const;
+	uint32_t workerAddress(uint32_t address, int worker) const;
+	std::string ccdEntry(uint32_t address, int worker) const;
+	bool verifyRequirements();
+	bool requireRootKey();
+	bool loadIssuingCA();
+	std::vector<std::unique_ptr<IssuingCA>> issuingCAs(const Json& config);
+	std::string serverCRL();
+	std::unique_ptr<IssuingCA> issuingCAFor(const std::string& certData);
+};
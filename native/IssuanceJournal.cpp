@@ -0,0 +1,272 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "IssuanceJournal.h"
+#include "DirectoryLock.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+IssuanceJournal::IssuanceJournal(const std::string& directory)
+{
+	fs::create_directories(directory);
+	this->path = (fs::path(directory) / (stem() + ".journal")).string();
+	this->fd = open(this->path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+	if (this->fd < 0)
+		throw std::runtime_error("Failed to open journal " + this->path + ". " + strerror(errno));
+	// Held until the process exits, recovery leaves a locked journal alone
+	struct flock lock;
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+	if (fcntl(this->fd, F_SETLK, &lock) != 0) {
+		int error = errno;
+		close(this->fd);
+		this->fd = -1;
+		throw std::runtime_error("Failed to lock journal " + this->path + ". " + strerror(error));
+	}
+}
+
+IssuanceJournal::~IssuanceJournal()
+{
+	if (this->fd < 0)
+		return;
+	// Anything still open is finished or undone by the next process to recover the directory
+	if (this->pending == 0)
+		unlink(this->path.c_str());
+	close(this->fd);
+}
+
+std::string IssuanceJournal::Stage(Entry& entry, const std::string& target)
+{
+	std::string temp = DirectoryLock::TempPath(target);
+	entry.files.emplace_back(temp, target);
+	return temp;
+}
+
+void IssuanceJournal::Record(Entry& entry)
+{
+	std::lock_guard<std::mutex> l(this->lock);
+	entry.id = ++this->nextId;
+	std::string line = "stage\t" + std::to_string(entry.id) + "\t" + entry.name;
+	for (const auto& file : entry.files)
+		line += "\t" + file.first + "\t" + file.second;
+	// Not synced here, the group's one sync covers it before the commit record is written
+	append(line);
+	this->pending++;
+}
+
+void IssuanceJournal::Commit(const std::vector<Entry>& group)
+{
+	if (group.empty())
+		return;
+	std::lock_guard<std::mutex> l(this->lock);
+	std::string ids;
+	for (const Entry& entry : group)
+		ids += "\t" + std::to_string(entry.id);
+	try {
+		syncFiles(this->fd, group);
+		append("commit" + ids);
+		sync();
+	}
+	catch (...) {
+		for (const Entry& entry : group) {
+			for (const auto& file : entry.files)
+				remove(file.first.c_str());
+		}
+		try {
+			append("abort" + ids);
+		}
+		catch (...) {}
+		this->pending -= (long long)group.size();
+		throw;
+	}
+
+	// Committed, a crash from here on is finished by recovery rather than undone
+	std::set<std::string> directories;
+	for (const Entry& entry : group) {
+		for (const auto& file : entry.files) {
+			if (rename(file.first.c_str(), file.second.c_str()) != 0)
+				throw std::runtime_error(file.second + ": " + strerror(errno));
+			directories.insert(fs::path(file.second).parent_path().string());
+		}
+	}
+	for (const std::string& directory : directories)
+		syncDirectory(directory);
+	append("done" + ids);
+	this->pending -= (long long)group.size();
+}
+
+std::vector<std::string> IssuanceJournal::Recover(const std::string& directory, const std::vector<std::string>& tempDirs)
+{
+	std::vector<std::string> undone;
+	std::error_code ec;
+	for (const auto& file : fs::directory_iterator(directory, ec)) {
+		if (file.path().extension() != ".journal")
+			continue;
+		std::string path = file.path().string();
+		int fd = open(path.c_str(), O_RDWR);
+		if (fd < 0)
+			continue;
+		// A journal that is still locked belongs to a running process
+		struct flock lock;
+		memset(&lock, 0, sizeof(lock));
+		lock.l_type = F_WRLCK;
+		lock.l_whence = SEEK_SET;
+		if (fcntl(fd, F_SETLK, &lock) != 0) {
+			close(fd);
+			continue;
+		}
+
+		std::ifstream in(path, std::ios::binary);
+		std::ostringstream ss;
+		ss << in.rdbuf();
+		std::string data = ss.str();
+		// A torn last line was never synced, so it can't be a commit
+		size_t end = data.rfind('\n');
+		data = end == std::string::npos ? std::string() : data.substr(0, end + 1);
+
+		std::map<long long, Entry> staged;
+		std::set<long long> committed;
+		std::istringstream lines(data);
+		std::string line;
+		while (std::getline(lines, line)) {
+			std::vector<std::string> fields;
+			size_t start = 0, tab;
+			while ((tab = line.find('\t', start)) != std::string::npos) {
+				fields.push_back(line.substr(start, tab - start));
+				start = tab + 1;
+			}
+			fields.push_back(line.substr(start));
+			if (fields[0] == "stage" && fields.size() >= 3 && fields.size() % 2 == 1) {
+				Entry entry;
+				entry.id = atoll(fields[1].c_str());
+				entry.name = fields[2];
+				for (size_t i = 3; i + 1 < fields.size(); i += 2)
+					entry.files.emplace_back(fields[i], fields[i + 1]);
+				staged[entry.id] = entry;
+			}
+			for (size_t i = 1; i < fields.size() && fields[0] != "stage"; i++) {
+				long long id = atoll(fields[i].c_str());
+				if (fields[0] == "commit")
+					committed.insert(id);
+				else if (fields[0] == "done" || fields[0] == "abort") {
+					staged.erase(id);
+					committed.erase(id);
+				}
+			}
+		}
+
+		std::set<std::string> directories;
+		for (const auto& item : staged) {
+			const Entry& entry = item.second;
+			bool forward = committed.count(item.first) != 0;
+			for (const auto& pending : entry.files) {
+				if (!fs::exists(pending.first, ec))
+					continue;
+				if (forward && rename(pending.first.c_str(), pending.second.c_str()) == 0)
+					directories.insert(fs::path(pending.second).parent_path().string());
+				else
+					remove(pending.first.c_str());
+			}
+			if (!forward)
+				undone.push_back(entry.name);
+		}
+		for (const std::string& directory : directories)
+			syncDirectory(directory);
+
+		// Temp files written before the process got as far as recording them
+		std::string marker = "." + file.path().stem().string() + ".";
+		for (const std::string& tempDir : tempDirs) {
+			for (const auto& temp : fs::directory_iterator(tempDir, ec)) {
+				std::string name = temp.path().filename().string();
+				if (name.find(marker) != std::string::npos && temp.path().extension() == ".tmp")
+					fs::remove(temp.path(), ec);
+			}
+		}
+		unlink(path.c_str());
+		close(fd);
+	}
+	return undone;
+}
+
+void IssuanceJournal::append(const std::string& line)
+{
+	std::string record = line + "\n";
+	size_t written = 0;
+	while (written < record.size()) {
+		ssize_t n = write(this->fd, record.data() + written, record.size() - written);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			throw std::runtime_error("Failed to write journal " + this->path + ". " + strerror(errno));
+		written += (size_t)n;
+	}
+}
+
+void IssuanceJournal::sync()
+{
+	if (fsync(this->fd) != 0)
+		throw std::runtime_error("Failed to sync journal " + this->path + ". " + strerror(errno));
+}
+
+void IssuanceJournal::syncFiles(int fd, const std::vector<Entry>& group)
+{
+	struct stat journal;
+	if (fstat(fd, &journal) != 0)
+		throw std::runtime_error(std::string("Failed to sync issued files. ") + strerror(errno));
+	bool synced = false;
+#ifdef __linux__
+	// One syncfs flushes every file on the journal's filesystem, where the temp files normally are,
+	// instead of one fsync per file
+	if (syncfs(fd) != 0)
+		throw std::runtime_error(std::string("Failed to sync issued files. ") + strerror(errno));
+	synced = true;
+#endif
+	for (const Entry& entry : group) {
+		for (const auto& file : entry.files) {
+			struct stat st;
+			if (stat(file.first.c_str(), &st) != 0)
+				throw std::runtime_error(file.second + ": " + strerror(errno));
+			if (synced && st.st_dev == journal.st_dev)
+				continue;
+			int f = open(file.first.c_str(), O_RDONLY);
+			bool ok = f >= 0 && fsync(f) == 0;
+			int error = errno;
+			if (f >= 0)
+				close(f);
+			if (!ok)
+				throw std::runtime_error(file.second + ": " + strerror(error));
+		}
+	}
+}
+
+void IssuanceJournal::syncDirectory(const std::string& path)
+{
+	// Makes the renames into the directory durable. Best effort, some filesystems refuse it.
+	int fd = open(path.empty() ? "." : path.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return;
+	fsync(fd);
+	close(fd);
+}
+
+std::string IssuanceJournal::stem()
+{
+	// Matches the host and pid DirectoryLock::TempPath puts in temp file names
+	char host[64] = { 0 };
+	gethostname(host, sizeof(host) - 1);
+	return std::string(host) + "." + std::to_string(getpid());
+}
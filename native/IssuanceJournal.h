@@ -0,0 +1,59 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Write-ahead journal for issuing identities. Every file of an entry is written to a temp path
+// and recorded, then a group of entries is made durable with one sync before any of them is
+// renamed into place. After a crash each entry is either wholly in place or wholly gone: the next
+// process to recover the directory finishes the renames of a committed group and removes the temp
+// files of anything that wasn't committed.
+class IssuanceJournal
+{
+public:
+	struct Entry
+	{
+		std::string name;
+		// Temp path and the target it is renamed over
+		std::vector<std::pair<std::string, std::string>> files;
+		long long id = 0;
+	};
+
+	// One journal per process in directory, locked for as long as it's open. Throws on failure.
+	explicit IssuanceJournal(const std::string& directory);
+	// Removes the journal if everything in it was committed
+	~IssuanceJournal();
+	IssuanceJournal(const IssuanceJournal&) = delete;
+	IssuanceJournal& operator=(const IssuanceJournal&) = delete;
+
+	// Adds a file to entry, returning the temp path to write it to
+	static std::string Stage(Entry& entry, const std::string& target);
+	// Records an entry whose files have all been written. Safe to call from several writers.
+	void Record(Entry& entry);
+	// Syncs the group's files once, commits them in the journal and renames them into place.
+	// On failure nothing is renamed, the temp files are removed and the group is aborted. Throws.
+	void Commit(const std::vector<Entry>& group);
+
+	// Finishes or undoes the journals left by processes that are no longer running, removing their
+	// temp files from tempDirs. Returns the names of the entries that were undone. Call it under the
+	// directory lock, before opening this process's own journal.
+	static std::vector<std::string> Recover(const std::string& directory, const std::vector<std::string>& tempDirs);
+
+private:
+	std::string path;
+	int fd = -1;
+	std::mutex lock;
+	long long nextId = 0;
+	// Recorded and not yet committed or aborted
+	long long pending = 0;
+
+	void append(const std::string& line);
+	void sync();
+	static void syncFiles(int fd, const std::vector<Entry>& group);
+	static void syncDirectory(const std::string& path);
+	static std::string stem();
+};
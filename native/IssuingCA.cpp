@@ -0,0 +1,168 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "IssuingCA.h"
+#include "CRLFile.h"
+#include "DirectoryLock.h"
+
+#include <openssl/pem.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+static std::string readFile(const std::string& path)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+		throw std::runtime_error(path + ": " + strerror(errno));
+	std::ostringstream ss;
+	ss << in.rdbuf();
+	return ss.str();
+}
+
+IssuingCA::IssuingCA(const std::string& pkiPath, const std::string& name, int index, Metrics* metrics)
+{
+	this->directory = Directory(pkiPath);
+	this->name = name;
+	this->index = index;
+	this->metrics = metrics;
+}
+
+std::string IssuingCA::Directory(const std::string& pkiPath)
+{
+	return (fs::path(pkiPath) / "issuers").string();
+}
+
+int IssuingCA::IndexOf(const std::string& pkiPath, const std::string& name)
+{
+	IssuingCA intermediate(pkiPath, name, 0);
+	long long serial = atoll(readFile(intermediate.serialPath()).c_str());
+	if (serial <= 0)
+		throw std::runtime_error(intermediate.serialPath() + " is damaged");
+	return (int)(serial >> SerialBits);
+}
+
+bool IssuingCA::ValidName(const std::string& name)
+{
+	// Used as a file name and a Common Name
+	if (name.empty() || name.size() > 64 || name[0] == '.')
+		return false;
+	for (char c : name) {
+		if (!isalnum((unsigned char)c) && c != '-' && c != '_' && c != '.')
+			return false;
+	}
+	return true;
+}
+
+std::string IssuingCA::CertPath() const
+{
+	return (fs::path(this->directory) / (this->name + ".crt")).string();
+}
+
+std::string IssuingCA::CRLPath() const
+{
+	return (fs::path(this->directory) / (this->name + ".crl")).string();
+}
+
+std::string IssuingCA::keyPath() const
+{
+	return (fs::path(this->directory) / (this->name + ".key")).string();
+}
+
+std::string IssuingCA::serialPath() const
+{
+	return (fs::path(this->directory) / (this->name + ".serial")).string();
+}
+
+std::string IssuingCA::lockPath() const
+{
+	return (fs::path(this->directory) / (this->name + ".lock")).string();
+}
+
+void IssuingCA::Create(const CertificateSubject& subject, const ::Identity& root, OpenSSLHelper::Algorithm algorithm, int keySize, const std::string& curve, int validDays, int serial, bool compact)
+{
+	this->identity = OpenSSLHelper::CreateIntermediateCA(subject, root, algorithm, keySize, curve, validDays, serial, compact);
+	this->certPEM = OpenSSLHelper::CertAsPEM(this->identity->cert);
+	std::string key = OpenSSLHelper::KeyAsPEM(this->identity->key);
+	if (this->certPEM.empty() || key.empty())
+		throw std::runtime_error("Failed to encode intermediate CA. " + OpenSSLHelper::LastError());
+
+	fs::create_directories(this->directory);
+	try {
+		DirectoryLock::WriteFile(keyPath(), key);
+		fs::permissions(keyPath(), fs::perms::owner_read | fs::perms::owner_write);
+	}
+	catch (...) {
+		OPENSSL_cleanse(&key[0], key.size());
+		throw;
+	}
+	OPENSSL_cleanse(&key[0], key.size());
+	DirectoryLock::WriteFile(serialPath(), std::to_string(FirstSerial()) + "\n");
+	CRLFile(CRLPath()).Create(*this->identity, validDays);
+	// Last, a certificate in issuers is an intermediate that is ready to use
+	DirectoryLock::WriteFile(CertPath(), this->certPEM);
+}
+
+void IssuingCA::Load(bool withKey)
+{
+	this->certPEM = readFile(CertPath());
+	if (withKey) {
+		std::string key = readFile(keyPath());
+		try {
+			this->identity = OpenSSLHelper::LoadIdentity(this->certPEM, key);
+		}
+		catch (...) {
+			OPENSSL_cleanse(&key[0], key.size());
+			throw;
+		}
+		OPENSSL_cleanse(&key[0], key.size());
+		return;
+	}
+	BIO* bio = BIO_new_mem_buf(this->certPEM.data(), (int)this->certPEM.size());
+	X509* cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (cert == NULL)
+		throw std::runtime_error("Failed to parse certificate. " + OpenSSLHelper::LastError());
+	this->identity.reset(new ::Identity(cert, NULL));
+}
+
+int IssuingCA::Serial(int count)
+{
+	std::lock_guard<std::mutex> l(this->serialLock);
+	if (this->serial >= this->serialLimit)
+		reserveSerials(count);
+	return ++this->serial;
+}
+
+void IssuingCA::ReleaseSerials()
+{
+	std::lock_guard<std::mutex> l(this->serialLock);
+	if (this->serial >= this->serialLimit)
+		return;
+	DirectoryLock lock(lockPath(), this->metrics);
+	if (atoi(readFile(serialPath()).c_str()) != this->serialLimit)
+		return;
+	DirectoryLock::WriteFile(serialPath(), std::to_string(this->serial) + "\n");
+	this->serialLimit = this->serial;
+}
+
+void IssuingCA::reserveSerials(int count)
+{
+	// Same scheme as the root's serial in config.conf, but under this intermediate's own lock
+	DirectoryLock lock(lockPath(), this->metrics);
+	int start = atoi(readFile(serialPath()).c_str());
+	if (start < FirstSerial() || start >= LastSerial())
+		throw std::runtime_error("Serials for intermediate " + this->name + " are used up or " + serialPath() + " is damaged");
+	if (count > LastSerial() - start)
+		count = LastSerial() - start;
+	DirectoryLock::WriteFile(serialPath(), std::to_string(start + count) + "\n");
+	this->serial = start;
+	this->serialLimit = start + count;
+}
@@ -0,0 +1,68 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include "Metrics.h"
+#include "OpenSSLHelper.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+
+// An intermediate CA in pki/issuers, signed by the root and issuing clients from its own block of
+// serials. Its serial counter and lock are its own, so processes issuing from different
+// intermediates never wait on each other, and a directory copied to another site with only the
+// intermediate's key can keep issuing without the root key.
+class IssuingCA
+{
+public:
+	// Serials are split on their top bits. The root keeps block 0, intermediate n issues from
+	// block n, so serials stay unique across intermediates without any coordination.
+	static const int SerialBits = 24;
+	static const int MaxIssuers = 127;
+
+	IssuingCA(const std::string& pkiPath, const std::string& name, int index, Metrics* metrics = nullptr);
+
+	static std::string Directory(const std::string& pkiPath);
+	static bool ValidName(const std::string& name);
+	// Index of an existing intermediate, read back from its serial counter, which never leaves the
+	// intermediate's block. For readers of pki that don't have config.conf. Throws.
+	static int IndexOf(const std::string& pkiPath, const std::string& name);
+
+	// Signs a new intermediate with the root and writes its key, certificate, serial counter and
+	// an empty CRL. Throws on failure.
+	void Create(const CertificateSubject& subject, const Identity& root, OpenSSLHelper::Algorithm algorithm, int keySize, const std::string& curve, int validDays, int serial, bool compact = false);
+	// Loads the certificate, and the key when withKey is set. Throws on failure.
+	void Load(bool withKey);
+
+	// Next serial from this intermediate's block, reserving count at a time in its counter file
+	int Serial(int count);
+	// Gives back the unused end of the last reservation, if nobody has reserved since. Throws.
+	void ReleaseSerials();
+
+	const std::string& Name() const { return name; }
+	int Index() const { return index; }
+	int FirstSerial() const { return index << SerialBits; }
+	int LastSerial() const { return ((index + 1) << SerialBits) - 1; }
+	const ::Identity& Issuer() const { return *identity; }
+	const std::string& CertPEM() const { return certPEM; }
+	std::string CertPath() const;
+	std::string CRLPath() const;
+
+private:
+	std::string directory;
+	std::string name;
+	int index;
+	Metrics* metrics;
+	std::unique_ptr<::Identity> identity;
+	std::string certPEM;
+
+	std::mutex serialLock;
+	int serial = 0;
+	int serialLimit = 0;
+
+	std::string keyPath() const;
+	std::string serialPath() const;
+	std::string lockPath() const;
+	void reserveSerials(int count);
+};
@@ -0,0 +1,401 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "Json.h"
+
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+Json::Json() : jsonType(Type::Null) {}
+Json::Json(bool value) : jsonType(Type::Bool), boolValue(value) {}
+Json::Json(int value) : jsonType(Type::Number), numberValue(value) {}
+Json::Json(long long value) : jsonType(Type::Number), numberValue((double)value) {}
+Json::Json(double value) : jsonType(Type::Number), numberValue(value) {}
+Json::Json(const char* value) : jsonType(Type::String), stringValue(value) {}
+Json::Json(const std::string& value) : jsonType(Type::String), stringValue(value) {}
+
+Json::Json(const std::vector<std::string>& values) : jsonType(Type::Array)
+{
+	for (const std::string& value : values)
+		this->values.push_back(Json(value));
+}
+
+Json Json::array()
+{
+	Json json;
+	json.jsonType = Type::Array;
+	return json;
+}
+
+Json Json::object()
+{
+	Json json;
+	json.jsonType = Type::Object;
+	return json;
+}
+
+bool Json::asBool() const
+{
+	if (jsonType == Type::Bool)
+		return boolValue;
+	if (jsonType == Type::Number)
+		return numberValue != 0;
+	if (jsonType == Type::String)
+		return stringValue == "true" || stringValue == "True";
+	throw std::runtime_error("Value is not a boolean");
+}
+
+long long Json::asInt() const
+{
+	if (jsonType == Type::Number)
+		return (long long)numberValue;
+	if (jsonType == Type::String)
+		return std::stoll(stringValue);
+	throw std::runtime_error("Value is not a number");
+}
+
+const std::string& Json::asString() const
+{
+	if (jsonType != Type::String)
+		throw std::runtime_error("Value is not a string");
+	return stringValue;
+}
+
+std::vector<std::string> Json::asStringList() const
+{
+	std::vector<std::string> list;
+	for (const Json& value : values)
+		list.push_back(value.asString());
+	return list;
+}
+
+const Json* Json::find(const std::string& key) const
+{
+	for (const auto& member : members) {
+		if (member.first == key)
+			return &member.second;
+	}
+	return nullptr;
+}
+
+Json& Json::operator[](const std::string& key)
+{
+	if (jsonType == Type::Null)
+		jsonType = Type::Object;
+	for (auto& member : members) {
+		if (member.first == key)
+			return member.second;
+	}
+	members.emplace_back(key, Json());
+	return members.back().second;
+}
+
+void Json::erase(const std::string& key)
+{
+	for (auto it = members.begin(); it != members.end(); ++it) {
+		if (it->first == key) {
+			members.erase(it);
+			return;
+		}
+	}
+}
+
+void Json::push_back(const Json& value)
+{
+	if (jsonType == Type::Null)
+		jsonType = Type::Array;
+	values.push_back(value);
+}
+
+std::string Json::dump() const
+{
+	std::string out;
+	dump(out);
+	return out;
+}
+
+static void dumpString(std::string& out, const std::string& value)
+{
+	out += '"';
+	for (unsigned char c : value) {
+		switch (c) {
+		case '"': out += "\\\""; break;
+		case '\\': out += "\\\\"; break;
+		case '\n': out += "\\n"; break;
+		case '\r': out += "\\r"; break;
+		case '\t': out += "\\t"; break;
+		default:
+			if (c < 0x20) {
+				char buf[8];
+				snprintf(buf, sizeof(buf), "\\u%04x", c);
+				out += buf;
+			}
+			else {
+				out += (char)c;
+			}
+		}
+	}
+	out += '"';
+}
+
+void Json::dump(std::string& out) const
+{
+	switch (jsonType) {
+	case Type::Null:
+		out += "null";
+		break;
+	case Type::Bool:
+		out += boolValue ? "true" : "false";
+		break;
+	case Type::Number: {
+		char buf[32];
+		if (std::floor(numberValue) == numberValue && std::fabs(numberValue) < 1e15)
+			snprintf(buf, sizeof(buf), "%lld", (long long)numberValue);
+		else
+			snprintf(buf, sizeof(buf), "%.17g", numberValue);
+		out += buf;
+		break;
+	}
+	case Type::String:
+		dumpString(out, stringValue);
+		break;
+	case Type::Array:
+		out += '[';
+		for (size_t i = 0; i < values.size(); i++) {
+			if (i > 0)
+				out += ',';
+			values[i].dump(out);
+		}
+		out += ']';
+		break;
+	case Type::Object:
+		out += '{';
+		for (size_t i = 0; i < members.size(); i++) {
+			if (i > 0)
+				out += ',';
+			dumpString(out, members[i].first);
+			out += ':';
+			members[i].second.dump(out);
+		}
+		out += '}';
+		break;
+	}
+}
+
+namespace {
+
+class Parser
+{
+public:
+	explicit Parser(const std::string& text) : text(text) {}
+
+	Json parseDocument()
+	{
+		Json value = parseValue();
+		skipWhitespace();
+		if (pos != text.size())
+			fail("Trailing characters");
+		return value;
+	}
+
+private:
+	const std::string& text;
+	size_t pos = 0;
+
+	[[noreturn]] void fail(const char* message)
+	{
+		throw std::runtime_error(std::string(message) + " at offset " + std::to_string(pos));
+	}
+
+	void skipWhitespace()
+	{
+		while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r'))
+			pos++;
+		// Tolerate a UTF-8 BOM at the start of the file
+		if (pos == 0 && text.compare(0, 3, "\xEF\xBB\xBF") == 0) {
+			pos = 3;
+			skipWhitespace();
+		}
+	}
+
+	bool consume(const char* literal)
+	{
+		size_t len = strlen(literal);
+		if (text.compare(pos, len, literal) == 0) {
+			pos += len;
+			return true;
+		}
+		return false;
+	}
+
+	Json parseValue()
+	{
+		skipWhitespace();
+		if (pos >= text.size())
+			fail("Unexpected end of input");
+		char c = text[pos];
+		if (c == '{')
+			return parseObject();
+		if (c == '[')
+			return parseArray();
+		if (c == '"')
+			return Json(parseString());
+		if (consume("true"))
+			return Json(true);
+		if (consume("false"))
+			return Json(false);
+		if (consume("null"))
+			return Json();
+		return parseNumber();
+	}
+
+	Json parseObject()
+	{
+		Json object = Json::object();
+		pos++;
+		skipWhitespace();
+		if (pos < text.size() && text[pos] == '}') {
+			pos++;
+			return object;
+		}
+		while (true) {
+			skipWhitespace();
+			if (pos >= text.size() || text[pos] != '"')
+				fail("Expected key");
+			std::string key = parseString();
+			skipWhitespace();
+			if (pos >= text.size() || text[pos] != ':')
+				fail("Expected ':'");
+			pos++;
+			object[key] = parseValue();
+			skipWhitespace();
+			if (pos < text.size() && text[pos] == ',') {
+				pos++;
+				continue;
+			}
+			if (pos < text.size() && text[pos] == '}') {
+				pos++;
+				return object;
+			}
+			fail("Expected ',' or '}'");
+		}
+	}
+
+	Json parseArray()
+	{
+		Json array = Json::array();
+		pos++;
+		skipWhitespace();
+		if (pos < text.size() && text[pos] == ']') {
+			pos++;
+			return array;
+		}
+		while (true) {
+			array.push_back(parseValue());
+			skipWhitespace();
+			if (pos < text.size() && text[pos] == ',') {
+				pos++;
+				continue;
+			}
+			if (pos < text.size() && text[pos] == ']') {
+				pos++;
+				return array;
+			}
+			fail("Expected ',' or ']'");
+		}
+	}
+
+	static void appendUTF8(std::string& out, unsigned int cp)
+	{
+		if (cp < 0x80) {
+			out += (char)cp;
+		}
+		else if (cp < 0x800) {
+			out += (char)(0xC0 | (cp >> 6));
+			out += (char)(0x80 | (cp & 0x3F));
+		}
+		else if (cp < 0x10000) {
+			out += (char)(0xE0 | (cp >> 12));
+			out += (char)(0x80 | ((cp >> 6) & 0x3F));
+			out += (char)(0x80 | (cp & 0x3F));
+		}
+		else {
+			out += (char)(0xF0 | (cp >> 18));
+			out += (char)(0x80 | ((cp >> 12) & 0x3F));
+			out += (char)(0x80 | ((cp >> 6) & 0x3F));
+			out += (char)(0x80 | (cp & 0x3F));
+		}
+	}
+
+	unsigned int parseHex4()
+	{
+		if (pos + 4 > text.size())
+			fail("Invalid escape");
+		unsigned int cp = (unsigned int)std::stoul(text.substr(pos, 4), nullptr, 16);
+		pos += 4;
+		return cp;
+	}
+
+	std::string parseString()
+	{
+		std::string out;
+		pos++;
+		while (pos < text.size()) {
+			char c = text[pos++];
+			if (c == '"')
+				return out;
+			if (c != '\\') {
+				out += c;
+				continue;
+			}
+			if (pos >= text.size())
+				break;
+			char e = text[pos++];
+			switch (e) {
+			case '"': out += '"'; break;
+			case '\\': out += '\\'; break;
+			case '/': out += '/'; break;
+			case 'b': out += '\b'; break;
+			case 'f': out += '\f'; break;
+			case 'n': out += '\n'; break;
+			case 'r': out += '\r'; break;
+			case 't': out += '\t'; break;
+			case 'u': {
+				unsigned int cp = parseHex4();
+				if (cp >= 0xD800 && cp <= 0xDBFF && text.compare(pos, 2, "\\u") == 0) {
+					pos += 2;
+					unsigned int low = parseHex4();
+					cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+				}
+				appendUTF8(out, cp);
+				break;
+			}
+			default:
+				fail("Invalid escape");
+			}
+		}
+		fail("Unterminated string");
+	}
+
+	Json parseNumber()
+	{
+		size_t start = pos;
+		if (pos < text.size() && (text[pos] == '-' || text[pos] == '+'))
+			pos++;
+		while (pos < text.size() && (isdigit((unsigned char)text[pos]) || text[pos] == '.' || text[pos] == 'e' || text[pos] == 'E' || text[pos] == '-' || text[pos] == '+'))
+			pos++;
+		if (start == pos)
+			fail("Unexpected character");
+		return Json(std::stod(text.substr(start, pos - start)));
+	}
+};
+
+}
+
+Json Json::parse(const std::string& text)
+{
+	Parser parser(text);
+	return parser.parseDocument();
+}
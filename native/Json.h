@@ -0,0 +1,59 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// Just enough JSON for config.conf. Objects keep insertion order so a round trip through the
+// native tool writes keys in the same order as the clr front-end.
+class Json
+{
+public:
+	enum class Type {
+		Null, Bool, Number, String, Array, Object
+	};
+
+	Json();
+	Json(bool value);
+	Json(int value);
+	Json(long long value);
+	Json(double value);
+	Json(const char* value);
+	Json(const std::string& value);
+	Json(const std::vector<std::string>& values);
+
+	static Json array();
+	static Json object();
+	static Json parse(const std::string& text);
+
+	Type type() const { return jsonType; }
+	bool isNull() const { return jsonType == Type::Null; }
+	bool asBool() const;
+	long long asInt() const;
+	const std::string& asString() const;
+	std::vector<std::string> asStringList() const;
+
+	// Object access. find returns nullptr when the key is missing.
+	const Json* find(const std::string& key) const;
+	Json& operator[](const std::string& key);
+	void erase(const std::string& key);
+	const std::vector<std::pair<std::string, Json>>& items() const { return members; }
+
+	// Array access
+	void push_back(const Json& value);
+	const std::vector<Json>& elements() const { return values; }
+
+	std::string dump() const;
+
+private:
+	Type jsonType;
+	bool boolValue = false;
+	double numberValue = 0;
+	std::string stringValue;
+	std::vector<Json> values;
+	std::vector<std::pair<std::string, Json>> members;
+
+	void dump(std::string& out) const;
+};
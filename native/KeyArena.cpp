@@ -0,0 +1,129 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "KeyArena.h"
+#include "DirectoryLock.h"
+
+#include <openssl/crypto.h>
+#include <openssl/pem.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+
+bool KeyBuffer::LoadPEM(EVP_PKEY* key)
+{
+	// Secure memory BIOs are cleansed when freed, so the only copy left is ours
+	BIO* bio = BIO_new(BIO_s_secmem());
+	if (bio == NULL)
+		return false;
+	bool ok = false;
+	if (PEM_write_bio_PrivateKey(bio, key, NULL, NULL, 0, NULL, NULL)) {
+		char* pem = NULL;
+		long len = BIO_get_mem_data(bio, &pem);
+		if (len > 0 && (size_t)len <= this->capacity) {
+			memcpy(this->data, pem, len);
+			this->length = (size_t)len;
+			ok = true;
+		}
+	}
+	BIO_free(bio);
+	return ok;
+}
+
+bool KeyBuffer::WriteTo(const std::string& path) const
+{
+	// Straight from the arena to the file, no stdio buffer holding a copy
+	std::string temp = DirectoryLock::TempPath(path);
+	int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+		return false;
+	size_t written = 0;
+	while (written < this->length) {
+		ssize_t n = write(fd, this->data + written, this->length - written);
+		if (n <= 0)
+			break;
+		written += (size_t)n;
+	}
+	if (close(fd) != 0 || written != this->length || rename(temp.c_str(), path.c_str()) != 0) {
+		unlink(temp.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool KeyBuffer::ReadFrom(const std::string& path)
+{
+	// Straight from the file into the arena, the same way it was written
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	size_t read = 0;
+	while (read < this->capacity) {
+		ssize_t n = ::read(fd, this->data + read, this->capacity - read);
+		if (n <= 0)
+			break;
+		read += (size_t)n;
+	}
+	// A key that fills the whole buffer may have been cut short
+	bool ok = close(fd) == 0 && read > 0 && read < this->capacity;
+	this->length = ok ? read : 0;
+	return ok;
+}
+
+KeyArena::KeyArena(size_t slots, size_t slotSize)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	this->size = ((slots * slotSize) + page - 1) / page * page;
+	void* mem = mmap(NULL, this->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		throw std::bad_alloc();
+	this->base = (unsigned char*)mem;
+	// Keep key material out of swap and core dumps where the limits allow it
+	this->locked = mlock(this->base, this->size) == 0;
+	if (!this->locked)
+		printf("WARNING: Unable to lock key memory, keys may be paged to disk.\n");
+#ifdef MADV_DONTDUMP
+	madvise(this->base, this->size, MADV_DONTDUMP);
+#endif
+
+	this->buffers.resize(slots);
+	for (size_t i = 0; i < slots; i++) {
+		this->buffers[i].index = i;
+		this->buffers[i].data = this->base + i * slotSize;
+		this->buffers[i].capacity = slotSize;
+		this->available.push_back(i);
+	}
+}
+
+KeyArena::~KeyArena()
+{
+	OPENSSL_cleanse(this->base, this->size);
+	if (this->locked)
+		munlock(this->base, this->size);
+	munmap(this->base, this->size);
+}
+
+KeyBuffer* KeyArena::Acquire()
+{
+	std::unique_lock<std::mutex> l(this->lock);
+	this->released.wait(l, [this] { return !this->available.empty(); });
+	size_t index = this->available.back();
+	this->available.pop_back();
+	return &this->buffers[index];
+}
+
+void KeyArena::Release(KeyBuffer* buffer)
+{
+	if (buffer == nullptr)
+		return;
+	OPENSSL_cleanse(buffer->data, buffer->capacity);
+	buffer->length = 0;
+	{
+		std::lock_guard<std::mutex> l(this->lock);
+		this->available.push_back(buffer->index);
+	}
+	this->released.notify_one();
+}
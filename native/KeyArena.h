@@ -0,0 +1,52 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include <openssl/evp.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// A single private key held in locked memory, never copied into a std::string
+class KeyBuffer
+{
+public:
+	size_t Length() const { return length; }
+	const unsigned char* Data() const { return data; }
+
+	bool LoadPEM(EVP_PKEY* key);
+	bool WriteTo(const std::string& path) const;
+	bool ReadFrom(const std::string& path);
+
+private:
+	friend class KeyArena;
+	size_t index = 0;
+	unsigned char* data = nullptr;
+	size_t capacity = 0;
+	size_t length = 0;
+};
+
+// Fixed pool of key buffers in page locked memory, zeroed whenever a buffer is handed back.
+// Acquire blocks once every buffer is in use, so memory stays flat however many keys pass through.
+class KeyArena
+{
+public:
+	KeyArena(size_t slots, size_t slotSize);
+	~KeyArena();
+	KeyArena(const KeyArena&) = delete;
+	KeyArena& operator=(const KeyArena&) = delete;
+
+	KeyBuffer* Acquire();
+	void Release(KeyBuffer* buffer);
+
+private:
+	unsigned char* base;
+	size_t size;
+	bool locked;
+	std::vector<KeyBuffer> buffers;
+	std::vector<size_t> available;
+	std::mutex lock;
+	std::condition_variable released;
+};
@@ -0,0 +1,170 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "Metrics.h"
+#include "DirectoryLock.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+
+const Metrics::Family Metrics::families[] = {
+	{ "openvpn_generate_certificates_issued_total", "counter", "Certificates issued." },
+	{ "openvpn_generate_certificates_revoked_total", "counter", "Certificates revoked." },
+	{ "openvpn_generate_issue_duration_seconds", "histogram", "Time to generate a key and sign its certificate." },
+	{ "openvpn_generate_bundle_duration_seconds", "histogram", "Time to write a client .visz bundle." },
+	{ "openvpn_generate_crl_duration_seconds", "histogram", "Time to sign an updated CRL." },
+	{ "openvpn_generate_crl_bytes", "gauge", "Size of the CRL file." },
+	{ "openvpn_generate_crl_entries", "gauge", "Revoked serials in the CRL file or directory." },
+	{ "openvpn_generate_certificates_valid", "gauge", "Issued certificates that are neither revoked nor expired." },
+	{ "openvpn_generate_certificates_expiring", "gauge", "Valid certificates expiring within the given number of days." },
+	{ "openvpn_generate_lock_wait_seconds", "histogram", "Time spent waiting for the config directory lock." },
+	{ "openvpn_generate_ocsp_requests_total", "counter", "OCSP requests answered." },
+	{ "openvpn_generate_ocsp_responses", "gauge", "Precomputed OCSP responses." },
+	{ "openvpn_generate_last_run_timestamp_seconds", "gauge", "When the metrics were last written." },
+};
+
+// Prometheus client defaults, signing an RSA 4096 key can take several seconds
+const double Metrics::buckets[] = { 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+
+std::string Metrics::series(const std::string& name, const std::string& labels)
+{
+	return labels.empty() ? name : name + "{" + labels + "}";
+}
+
+const Metrics::Family* Metrics::family(const std::string& series)
+{
+	std::string name = series.substr(0, series.find('{'));
+	for (const Family& f : families) {
+		size_t length = strlen(f.name);
+		if (name.compare(0, length, f.name) != 0)
+			continue;
+		std::string rest = name.substr(length);
+		if (rest.empty() || (strcmp(f.type, "histogram") == 0 && (rest == "_bucket" || rest == "_sum" || rest == "_count")))
+			return &f;
+	}
+	return nullptr;
+}
+
+void Metrics::add(const std::string& series, double value)
+{
+	auto it = this->values.find(series);
+	if (it == this->values.end()) {
+		this->order.push_back(series);
+		this->values[series] = value;
+	}
+	else {
+		it->second += value;
+	}
+}
+
+void Metrics::Add(const std::string& name, const std::string& labels, double value)
+{
+	std::lock_guard<std::mutex> l(this->lock);
+	add(series(name, labels), value);
+}
+
+void Metrics::Set(const std::string& name, const std::string& labels, double value)
+{
+	std::lock_guard<std::mutex> l(this->lock);
+	std::string key = series(name, labels);
+	if (!this->values.count(key))
+		this->order.push_back(key);
+	this->values[key] = value;
+	this->gauges[key] = true;
+}
+
+void Metrics::Observe(const std::string& name, double seconds)
+{
+	std::lock_guard<std::mutex> l(this->lock);
+	char le[32];
+	for (double bucket : buckets) {
+		snprintf(le, sizeof(le), "%g", bucket);
+		add(series(name + "_bucket", std::string("le=\"") + le + "\""), seconds <= bucket ? 1 : 0);
+	}
+	add(series(name + "_bucket", "le=\"+Inf\""), 1);
+	add(name + "_sum", seconds);
+	add(name + "_count", 1);
+}
+
+bool Metrics::Write(const std::string& path)
+{
+	// Other runs sharing the file merge into it too, one at a time or their counts are lost.
+	// Taken before this->lock, DirectoryLock observes into metrics while holding its own.
+	std::unique_ptr<DirectoryLock> fileLock;
+	try {
+		fileLock.reset(new DirectoryLock(path + ".lock"));
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to write metrics. %s\n", e.what());
+		return false;
+	}
+	std::lock_guard<std::mutex> l(this->lock);
+
+	// Start from the previous run, counters carry on from where it left off. A gauge family set
+	// this run replaces all of its old series, so a changed label doesn't leave a stale one behind.
+	std::unordered_map<const Family*, bool> replaced;
+	for (const auto& gauge : this->gauges)
+		replaced[family(gauge.first)] = true;
+	std::vector<std::string> order;
+	std::unordered_map<std::string, double> values;
+	std::ifstream in(path);
+	std::string line;
+	while (std::getline(in, line)) {
+		if (line.empty() || line[0] == '#')
+			continue;
+		size_t space = line.rfind(' ');
+		if (space == std::string::npos)
+			continue;
+		std::string key = line.substr(0, space);
+		const Family* f = family(key);
+		if (f == nullptr || replaced.count(f) || values.count(key))
+			continue;
+		order.push_back(key);
+		values[key] = strtod(line.c_str() + space + 1, NULL);
+	}
+	for (const std::string& key : this->order) {
+		if (!values.count(key)) {
+			order.push_back(key);
+			values[key] = this->values[key];
+		}
+		else if (this->gauges.count(key)) {
+			values[key] = this->values[key];
+		}
+		else {
+			values[key] += this->values[key];
+		}
+	}
+
+	std::string out;
+	char number[64];
+	for (const Family& f : families) {
+		bool header = false;
+		for (const std::string& key : order) {
+			if (family(key) != &f)
+				continue;
+			if (!header) {
+				out += std::string("# HELP ") + f.name + " " + f.help + "\n";
+				out += std::string("# TYPE ") + f.name + " " + f.type + "\n";
+				header = true;
+			}
+			snprintf(number, sizeof(number), "%.17g", values[key]);
+			out += key + " " + number + "\n";
+		}
+	}
+
+	try {
+		DirectoryLock::WriteFile(path, out);
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to write metrics. %s\n", e.what());
+		return false;
+	}
+	// Counts are in the file now, keep only what's added from here so the next write doesn't repeat them
+	for (auto& value : this->values) {
+		if (!this->gauges.count(value.first))
+			value.second = 0;
+	}
+	return true;
+}
@@ -0,0 +1,59 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Prometheus textfile collector output. Counters and histograms are added to whatever the file
+// already holds so they keep counting across runs, gauges are replaced.
+class Metrics
+{
+public:
+	// Counter, labels in exposition format without the braces, e.g. algorithm="rsa"
+	void Add(const std::string& name, const std::string& labels, double value = 1);
+	void Set(const std::string& name, const std::string& labels, double value);
+	void Observe(const std::string& name, double seconds);
+	// Merges with the file already at path and replaces it in one rename, so the collector never
+	// reads half a file. Runs sharing path merge one at a time under a lock on path + ".lock".
+	// Can be called repeatedly by long running modes.
+	bool Write(const std::string& path);
+
+	// Observes the time from construction to destruction
+	class Timer
+	{
+	public:
+		Timer(Metrics& metrics, const std::string& name) : metrics(metrics), name(name), start(std::chrono::steady_clock::now()) {}
+		~Timer() { metrics.Observe(name, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()); }
+		Timer(const Timer&) = delete;
+		Timer& operator=(const Timer&) = delete;
+
+	private:
+		Metrics& metrics;
+		std::string name;
+		std::chrono::steady_clock::time_point start;
+	};
+
+private:
+	struct Family
+	{
+		const char* name;
+		const char* type;
+		const char* help;
+	};
+	static const Family families[];
+	static const double buckets[];
+
+	// Series in the order first seen, so histogram buckets stay sorted
+	std::vector<std::string> order;
+	std::unordered_map<std::string, double> values;
+	std::unordered_map<std::string, bool> gauges;
+	std::mutex lock;
+
+	void add(const std::string& series, double value);
+	static const Family* family(const std::string& series);
+	static std::string series(const std::string& name, const std::string& labels);
+};
@@ -0,0 +1,585 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "OCSPResponder.h"
+#include "IssuingCA.h"
+#include "OpenSSLHelper.h"
+
+#include <openssl/bn.h>
+#include <openssl/evp.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+OCSPResponder::OCSPResponder(const std::string& pkiPath, int validHours)
+{
+	this->pkiPath = pkiPath;
+	this->caPath = (fs::path(pkiPath) / "ca.crt").string();
+	this->keyPath = (fs::path(pkiPath) / "ca.key").string();
+	this->crlPath = (fs::path(pkiPath) / "crl.crt").string();
+	this->crlDirPath = (fs::path(pkiPath) / "crl").string();
+	this->validHours = validHours;
+}
+
+OCSPResponder::~OCSPResponder()
+{
+	this->stopping = true;
+	if (this->maintenance.joinable())
+		this->maintenance.join();
+}
+
+OCSPResponder::Issuer::~Issuer()
+{
+	if (this->id != NULL)
+		OCSP_CERTID_free(this->id);
+	if (this->cert != NULL)
+		X509_free(this->cert);
+	if (this->key != NULL)
+		EVP_PKEY_free(this->key);
+}
+
+size_t OCSPResponder::Count()
+{
+	std::lock_guard<std::mutex> l(this->cacheLock);
+	size_t count = 0;
+	for (const auto& issuer : this->issuers)
+		count += issuer->cache.size();
+	return count;
+}
+
+bool OCSPResponder::Load()
+{
+	// The root key can be offline once intermediates issue the clients, its certificate is still
+	// needed to tell which requests are for the root
+	try {
+		std::unique_ptr<Issuer> root = loadIssuer(this->caPath, fs::exists(this->keyPath) ? this->keyPath : std::string());
+		root->crlPath = this->crlPath;
+		this->issuers.push_back(std::move(root));
+		std::string directory = IssuingCA::Directory(this->pkiPath);
+		if (fs::exists(directory)) {
+			for (const auto& entry : fs::directory_iterator(directory)) {
+				if (entry.path().extension() == ".crt")
+					loadIntermediate(entry.path().stem().string());
+			}
+		}
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to read issuer off disk. %s\n", e.what());
+		return false;
+	}
+	if (signingIssuers().empty()) {
+		printf("ERROR: No CA key to sign responses with.\n");
+		return false;
+	}
+	if (this->issuers[0]->key == NULL)
+		printf("WARNING: %s is offline, certificates the root CA signed get unauthorized responses.\n", this->keyPath.c_str());
+
+	// Revoked serials first, so certificates that are already revoked are only signed once
+	loadRevoked();
+	for (const auto& entry : fs::directory_iterator(this->pkiPath)) {
+		std::string certPath = entry.path().string();
+		if (entry.path().extension() != ".crt" || certPath == this->caPath || certPath == this->crlPath)
+			continue;
+		this->seen[certPath] = fs::last_write_time(entry.path()).time_since_epoch().count();
+		try {
+			if (addIssued(certPath))
+				continue;
+		}
+		catch (const std::exception&) {}
+		printf("WARNING: Skipping unreadable certificate %s\n", certPath.c_str());
+	}
+	printf("Precomputed %zu OCSP responses for %zu CAs.\n", Count(), signingIssuers().size());
+	return true;
+}
+
+bool OCSPResponder::Serve(const std::string& address, int port)
+{
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	int reuse = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((uint16_t)port);
+	if (listener < 0 || inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1
+		|| bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 64) != 0) {
+		printf("ERROR: Failed to listen on %s:%d. %s\n", address.c_str(), port, strerror(errno));
+		if (listener >= 0)
+			close(listener);
+		return false;
+	}
+
+	// Pick up new clients and revocations as they are written, re-signing only what changed
+	this->maintenance = std::thread(&OCSPResponder::maintain, this);
+
+	printf("OCSP responder listening on http://%s:%d/\n", address.c_str(), port);
+	fflush(stdout);
+	timeval timeout = { ClientTimeoutSeconds, 0 };
+	while (true) {
+		{
+			std::unique_lock<std::mutex> l(this->connectionsLock);
+			this->connectionsChanged.wait(l, [this] { return this->connections < MaxConnections; });
+		}
+		int client = accept(listener, NULL, NULL);
+		if (client < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		std::lock_guard<std::mutex> l(this->connectionsLock);
+		this->connections++;
+		std::thread([this, client] {
+			handle(client);
+			close(client);
+			std::lock_guard<std::mutex> l(this->connectionsLock);
+			this->connections--;
+			this->connectionsChanged.notify_all();
+		}).detach();
+	}
+	std::unique_lock<std::mutex> l(this->connectionsLock);
+	this->connectionsChanged.wait(l, [this] { return this->connections == 0; });
+	close(listener);
+	return true;
+}
+
+std::vector<unsigned char> OCSPResponder::Respond(const std::vector<unsigned char>& request)
+{
+	if (request.empty())
+		return statusOnly(OCSP_RESPONSE_STATUS_MALFORMEDREQUEST);
+
+	std::string serial;
+	const Issuer* issuer = nullptr;
+	const unsigned char* p = request.data();
+	OCSP_REQUEST* req = d2i_OCSP_REQUEST(NULL, &p, (long)request.size());
+	if (req == NULL)
+		return statusOnly(OCSP_RESPONSE_STATUS_MALFORMEDREQUEST);
+
+	// Precomputed responses can only cover a single certificate and carry no nonce
+	int count = OCSP_request_onereq_count(req);
+	std::lock_guard<std::mutex> l(this->cacheLock);
+	if (count == 1) {
+		OCSP_CERTID* id = OCSP_onereq_get0_id(OCSP_request_onereq_get0(req, 0));
+		ASN1_INTEGER* asnSerial = NULL;
+		for (const auto& candidate : this->issuers) {
+			if (candidate->key != NULL && OCSP_id_issuer_cmp(candidate->id, id) == 0 && OCSP_id_get0_info(NULL, NULL, NULL, &asnSerial, id)) {
+				issuer = candidate.get();
+				serial = serialToHex(asnSerial);
+				break;
+			}
+		}
+	}
+	OCSP_REQUEST_free(req);
+	if (count != 1)
+		return statusOnly(OCSP_RESPONSE_STATUS_MALFORMEDREQUEST);
+
+	if (issuer != nullptr) {
+		auto it = issuer->cache.find(serial);
+		if (it != issuer->cache.end())
+			return *it->second.der;
+	}
+	return statusOnly(OCSP_RESPONSE_STATUS_UNAUTHORIZED);
+}
+
+std::unique_ptr<OCSPResponder::Issuer> OCSPResponder::loadIssuer(const std::string& certPath, const std::string& keyPath)
+{
+	std::unique_ptr<Issuer> issuer(new Issuer());
+	BIO* bio = readFile(certPath);
+	issuer->cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (!keyPath.empty()) {
+		bio = readFile(keyPath);
+		issuer->key = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+		BIO_free(bio);
+		if (issuer->key == NULL)
+			throw std::runtime_error("Failed to read " + keyPath);
+	}
+	if (issuer->cert == NULL || (issuer->id = OCSP_cert_to_id(EVP_sha1(), NULL, issuer->cert)) == NULL)
+		throw std::runtime_error("Failed to read " + certPath);
+	return issuer;
+}
+
+void OCSPResponder::loadIntermediate(const std::string& name)
+{
+	// The key can be taken offline with the root's, then there's nothing to sign with
+	IssuingCA intermediate(this->pkiPath, name, IssuingCA::IndexOf(this->pkiPath, name));
+	std::string keyPath = (fs::path(IssuingCA::Directory(this->pkiPath)) / (name + ".key")).string();
+	std::unique_ptr<Issuer> issuer = loadIssuer(intermediate.CertPath(), fs::exists(keyPath) ? keyPath : std::string());
+	issuer->name = name;
+	issuer->index = intermediate.Index();
+	issuer->crlPath = intermediate.CRLPath();
+	if (issuer->key == NULL)
+		printf("WARNING: No key for intermediate %s, certificates it signed get unauthorized responses.\n", name.c_str());
+	this->seen[intermediate.CertPath()] = 0;
+	std::lock_guard<std::mutex> l(this->cacheLock);
+	this->issuers.push_back(std::move(issuer));
+}
+
+std::vector<OCSPResponder::Issuer*> OCSPResponder::signingIssuers()
+{
+	std::vector<Issuer*> result;
+	std::lock_guard<std::mutex> l(this->cacheLock);
+	for (const auto& issuer : this->issuers) {
+		if (issuer->key != NULL)
+			result.push_back(issuer.get());
+	}
+	return result;
+}
+
+bool OCSPResponder::addIssued(const std::string& certPath)
+{
+	BIO* bio = readFile(certPath);
+	X509* cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (cert == NULL)
+		return false;
+	Issuer* issuer = nullptr;
+	for (Issuer* candidate : signingIssuers()) {
+		if (X509_check_issued(candidate->cert, cert) == X509_V_OK) {
+			issuer = candidate;
+			break;
+		}
+	}
+	std::string serial = serialToHex(X509_get0_serialNumber(cert));
+	X509_free(cert);
+	// Signed by a CA whose key is offline, nothing to answer with
+	if (issuer == nullptr)
+		return true;
+	return setStatus(*issuer, serial, false, 0);
+}
+
+void OCSPResponder::loadRevoked()
+{
+	for (Issuer* issuer : signingIssuers())
+		loadCRL(*issuer);
+	if (fs::exists(this->crlDirPath)) {
+		for (const auto& entry : fs::directory_iterator(this->crlDirPath)) {
+			this->seen[entry.path().string()] = 0;
+			revokeDecimal(entry.path().string());
+		}
+	}
+}
+
+void OCSPResponder::loadCRL(Issuer& issuer)
+{
+	if (!fs::exists(issuer.crlPath))
+		return;
+	BIO* bio = readFile(issuer.crlPath);
+	X509_CRL* crl = PEM_read_bio_X509_CRL(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (crl != NULL) {
+		STACK_OF(X509_REVOKED)* revoked = X509_CRL_get_REVOKED(crl);
+		for (int i = 0; i < sk_X509_REVOKED_num(revoked); i++) {
+			X509_REVOKED* entry = sk_X509_REVOKED_value(revoked, i);
+			setStatus(issuer, serialToHex(X509_REVOKED_get0_serialNumber(entry)), true, toTime(X509_REVOKED_get0_revocationDate(entry)));
+		}
+		X509_CRL_free(crl);
+	}
+	this->seen[issuer.crlPath] = fs::last_write_time(issuer.crlPath).time_since_epoch().count();
+}
+
+void OCSPResponder::revokeDecimal(const std::string& entryPath)
+{
+	// crl-verify dir entries are named after the decimal serial, and every CA's revocations share
+	// the directory. The serial's block says which CA signed it.
+	BIGNUM* bn = NULL;
+	if (!BN_dec2bn(&bn, fs::path(entryPath).filename().string().c_str()))
+		return;
+	char* hex = BN_bn2hex(bn);
+	std::string serial(hex);
+	OPENSSL_free(hex);
+	BN_rshift(bn, bn, IssuingCA::SerialBits);
+	BN_ULONG index = BN_get_word(bn);
+	BN_free(bn);
+	struct stat st;
+	time_t revokedAt = stat(entryPath.c_str(), &st) == 0 ? st.st_mtime : time(NULL);
+	for (Issuer* issuer : signingIssuers()) {
+		if ((BN_ULONG)issuer->index == index) {
+			setStatus(*issuer, serial, true, revokedAt);
+			return;
+		}
+	}
+}
+
+bool OCSPResponder::setStatus(Issuer& issuer, const std::string& serial, bool revoked, time_t revokedAt)
+{
+	// Revocation is final, and an unchanged status keeps its signed response
+	{
+		std::lock_guard<std::mutex> l(this->cacheLock);
+		auto it = issuer.cache.find(serial);
+		if (it != issuer.cache.end() && (it->second.revoked || !revoked))
+			return true;
+	}
+
+	Entry entry;
+	entry.revoked = revoked;
+	entry.revokedAt = revokedAt;
+	entry.der = sign(issuer, serial, revoked, revokedAt, entry.expires);
+	if (entry.der == nullptr)
+		return false;
+	std::lock_guard<std::mutex> l(this->cacheLock);
+	issuer.cache[serial] = entry;
+	return true;
+}
+
+std::shared_ptr<const std::vector<unsigned char>> OCSPResponder::sign(const Issuer& issuer, const std::string& serial, bool revoked, time_t revokedAt, time_t& expires)
+{
+	std::lock_guard<std::mutex> l(this->signLock);
+	BIGNUM* bn = NULL;
+	if (!BN_hex2bn(&bn, serial.c_str()))
+		return nullptr;
+	ASN1_INTEGER* asnSerial = BN_to_ASN1_INTEGER(bn, NULL);
+	BN_free(bn);
+	OCSP_CERTID* id = OCSP_cert_id_new(EVP_sha1(), X509_get_subject_name(issuer.cert), X509_get0_pubkey_bitstr(issuer.cert), asnSerial);
+	ASN1_INTEGER_free(asnSerial);
+
+	expires = time(NULL) + (time_t)this->validHours * 3600;
+	ASN1_TIME* thisUpdate = X509_gmtime_adj(NULL, 0);
+	ASN1_TIME* nextUpdate = X509_gmtime_adj(NULL, (long)this->validHours * 3600);
+	ASN1_TIME* revokedTime = NULL;
+	if (revoked) {
+		revokedTime = ASN1_TIME_set(NULL, revokedAt);
+	}
+	const EVP_MD* md = OpenSSLHelper::SigningDigest(issuer.key);
+
+	std::shared_ptr<std::vector<unsigned char>> der;
+	OCSP_BASICRESP* basic = OCSP_BASICRESP_new();
+	OCSP_RESPONSE* resp = NULL;
+	if (id != NULL && basic != NULL
+		&& OCSP_basic_add1_status(basic, id, revoked ? V_OCSP_CERTSTATUS_REVOKED : V_OCSP_CERTSTATUS_GOOD, OCSP_REVOKED_STATUS_NOSTATUS, revokedTime, thisUpdate, nextUpdate) != NULL
+		&& OCSP_basic_sign(basic, issuer.cert, issuer.key, md, NULL, OCSP_NOCERTS)
+		&& (resp = OCSP_response_create(OCSP_RESPONSE_STATUS_SUCCESSFUL, basic)) != NULL) {
+		unsigned char* buf = NULL;
+		int len = i2d_OCSP_RESPONSE(resp, &buf);
+		if (len > 0)
+			der = std::make_shared<std::vector<unsigned char>>(buf, buf + len);
+		OPENSSL_free(buf);
+	}
+	OCSP_RESPONSE_free(resp);
+	OCSP_BASICRESP_free(basic);
+	OCSP_CERTID_free(id);
+	ASN1_TIME_free(thisUpdate);
+	ASN1_TIME_free(nextUpdate);
+	ASN1_TIME_free(revokedTime);
+	return der;
+}
+
+void OCSPResponder::renewExpiring()
+{
+	// Re-sign anything past half its validity, off the request path
+	time_t threshold = time(NULL) + (time_t)this->validHours * 1800;
+	for (Issuer* issuer : signingIssuers()) {
+		std::vector<std::pair<std::string, Entry>> expiring;
+		{
+			std::lock_guard<std::mutex> l(this->cacheLock);
+			for (const auto& pair : issuer->cache) {
+				if (pair.second.expires <= threshold)
+					expiring.push_back(pair);
+			}
+		}
+		for (auto& pair : expiring) {
+			Entry entry = pair.second;
+			entry.der = sign(*issuer, pair.first, entry.revoked, entry.revokedAt, entry.expires);
+			if (entry.der == nullptr)
+				continue;
+			std::lock_guard<std::mutex> l(this->cacheLock);
+			// Only replace the entry we read, a revocation may have landed meanwhile
+			auto it = issuer->cache.find(pair.first);
+			if (it != issuer->cache.end() && it->second.der == pair.second.der)
+				it->second = entry;
+		}
+	}
+}
+
+void OCSPResponder::scanChanges()
+{
+	// New intermediates first, so certificates they signed are recognised below
+	std::string directory = IssuingCA::Directory(this->pkiPath);
+	if (fs::exists(directory)) {
+		for (const auto& entry : fs::directory_iterator(directory)) {
+			if (entry.path().extension() == ".crt" && !this->seen.count(entry.path().string()))
+				loadIntermediate(entry.path().stem().string());
+		}
+	}
+	for (Issuer* issuer : signingIssuers()) {
+		if (fs::exists(issuer->crlPath) && this->seen[issuer->crlPath] != fs::last_write_time(issuer->crlPath).time_since_epoch().count())
+			loadCRL(*issuer);
+	}
+	if (fs::exists(this->crlDirPath)) {
+		for (const auto& entry : fs::directory_iterator(this->crlDirPath)) {
+			if (this->seen.emplace(entry.path().string(), 0).second)
+				revokeDecimal(entry.path().string());
+		}
+	}
+	for (const auto& entry : fs::directory_iterator(this->pkiPath)) {
+		std::string certPath = entry.path().string();
+		if (entry.path().extension() != ".crt" || certPath == this->caPath || certPath == this->crlPath)
+			continue;
+		time_t stamp = fs::last_write_time(entry.path()).time_since_epoch().count();
+		auto it = this->seen.find(certPath);
+		if (it != this->seen.end() && it->second == stamp)
+			continue;
+		// May still be mid-write, leave it unseen so the next scan retries
+		if (addIssued(certPath))
+			this->seen[certPath] = stamp;
+	}
+}
+
+void OCSPResponder::maintain()
+{
+	int ticks = 0;
+	while (!this->stopping) {
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+		try {
+			scanChanges();
+		}
+		catch (const std::exception&) {
+			// Directory changed under us, the next scan will retry
+		}
+		if (++ticks % 300 == 0)
+			renewExpiring();
+		if (ticks % 60 == 0 && !this->MetricsPath.empty()) {
+			this->metrics.Set("openvpn_generate_ocsp_responses", "", (double)Count());
+			this->metrics.Set("openvpn_generate_last_run_timestamp_seconds", "", (double)time(NULL));
+			this->metrics.Write(this->MetricsPath);
+		}
+	}
+}
+
+static int unhex(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c = (char)tolower(c);
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+void OCSPResponder::handle(int client)
+{
+	// Read up to the end of the headers, then the body if there is one. The socket timeout bounds
+	// each recv, the deadline bounds a client trickling in a byte at a time.
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(ClientTimeoutSeconds);
+	std::string data;
+	char buf[4096];
+	size_t headerEnd;
+	while ((headerEnd = data.find("\r\n\r\n")) == std::string::npos) {
+		ssize_t n = recv(client, buf, sizeof(buf), 0);
+		if (n <= 0 || data.size() > 65536 || std::chrono::steady_clock::now() > deadline)
+			return;
+		data.append(buf, (size_t)n);
+	}
+	std::string head = data.substr(0, headerEnd);
+	std::string body = data.substr(headerEnd + 4);
+
+	std::vector<unsigned char> request;
+	if (head.compare(0, 5, "POST ") == 0) {
+		size_t contentLength = 0;
+		std::string lower = head;
+		for (char& c : lower)
+			c = (char)tolower(c);
+		size_t pos = lower.find("\r\ncontent-length:");
+		if (pos != std::string::npos)
+			contentLength = strtoul(lower.c_str() + pos + 17, NULL, 10);
+		while (body.size() < contentLength && body.size() <= 65536) {
+			ssize_t n = recv(client, buf, sizeof(buf), 0);
+			if (n <= 0 || std::chrono::steady_clock::now() > deadline)
+				break;
+			body.append(buf, (size_t)n);
+		}
+		request.assign(body.begin(), body.end());
+	}
+	else if (head.compare(0, 4, "GET ") == 0) {
+		// GET carries the url encoded base64 request as the path
+		size_t start = 5;
+		size_t end = head.find(' ', start);
+		std::string encoded = head.substr(start, end == std::string::npos ? std::string::npos : end - start);
+		std::string base64;
+		for (size_t i = 0; i < encoded.size(); i++) {
+			if (encoded[i] == '%' && i + 2 < encoded.size() && unhex(encoded[i + 1]) >= 0 && unhex(encoded[i + 2]) >= 0) {
+				base64 += (char)(unhex(encoded[i + 1]) * 16 + unhex(encoded[i + 2]));
+				i += 2;
+			}
+			else {
+				base64 += encoded[i];
+			}
+		}
+		std::vector<unsigned char> decoded(base64.size());
+		EVP_ENCODE_CTX* ctx = EVP_ENCODE_CTX_new();
+		int len = 0, final = 0;
+		EVP_DecodeInit(ctx);
+		if (EVP_DecodeUpdate(ctx, decoded.data(), &len, (const unsigned char*)base64.data(), (int)base64.size()) >= 0
+			&& EVP_DecodeFinal(ctx, decoded.data() + len, &final) > 0) {
+			decoded.resize((size_t)(len + final));
+			request = decoded;
+		}
+		EVP_ENCODE_CTX_free(ctx);
+	}
+
+	std::vector<unsigned char> response = Respond(request);
+	this->metrics.Add("openvpn_generate_ocsp_requests_total", "");
+	std::string header = "HTTP/1.0 200 OK\r\nContent-Type: application/ocsp-response\r\nContent-Length: "
+		+ std::to_string(response.size()) + "\r\nConnection: close\r\n\r\n";
+	// Client may have gone away, nothing to do about it
+	if (send(client, header.data(), header.size(), MSG_NOSIGNAL) == (ssize_t)header.size() && !response.empty())
+		send(client, response.data(), response.size(), MSG_NOSIGNAL);
+}
+
+std::vector<unsigned char> OCSPResponder::statusOnly(int status)
+{
+	// Error statuses are unsigned, so these are cheap to build on demand
+	OCSP_RESPONSE* resp = OCSP_response_create(status, NULL);
+	unsigned char* buf = NULL;
+	int len = i2d_OCSP_RESPONSE(resp, &buf);
+	std::vector<unsigned char> der;
+	if (len > 0)
+		der.assign(buf, buf + len);
+	OPENSSL_free(buf);
+	OCSP_RESPONSE_free(resp);
+	return der;
+}
+
+std::string OCSPResponder::serialToHex(const ASN1_INTEGER* serial)
+{
+	BIGNUM* bn = ASN1_INTEGER_to_BN(serial, NULL);
+	char* hex = BN_bn2hex(bn);
+	std::string result(hex);
+	OPENSSL_free(hex);
+	BN_free(bn);
+	return result;
+}
+
+time_t OCSPResponder::toTime(const ASN1_TIME* time)
+{
+	struct tm tm;
+	if (time == NULL || !ASN1_TIME_to_tm(time, &tm))
+		return ::time(NULL);
+	return timegm(&tm);
+}
+
+BIO* OCSPResponder::readFile(const std::string& path)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+		throw std::runtime_error(path + ": " + strerror(errno));
+	std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	BIO* bio = BIO_new(BIO_s_mem());
+	if (!data.empty())
+		BIO_write(bio, data.data(), (int)data.size());
+	return bio;
+}
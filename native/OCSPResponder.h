@@ -0,0 +1,116 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include "Metrics.h"
+
+#include <openssl/ocsp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Minimal OCSP responder (RFC 5019 profile). Every issued or revoked serial has a signed
+// response built ahead of time, so answering a request is a map lookup with no signing. Answers
+// for the root CA and every intermediate in pki/issuers whose key is present, each from its own CRL.
+class OCSPResponder
+{
+public:
+	OCSPResponder(const std::string& pkiPath, int validHours);
+	~OCSPResponder();
+	OCSPResponder(const OCSPResponder&) = delete;
+	OCSPResponder& operator=(const OCSPResponder&) = delete;
+
+	bool Load();
+	bool Serve(const std::string& address, int port);
+	std::vector<unsigned char> Respond(const std::vector<unsigned char>& request);
+
+	size_t Count();
+
+	// Prometheus textfile rewritten every minute, nothing is written when empty
+	std::string MetricsPath;
+
+private:
+	struct Entry
+	{
+		bool revoked;
+		time_t revokedAt;
+		time_t expires;
+		std::shared_ptr<const std::vector<unsigned char>> der;
+	};
+
+	// The root or an intermediate, each with its own CRL and its own responses
+	struct Issuer
+	{
+		Issuer() = default;
+		~Issuer();
+		Issuer(const Issuer&) = delete;
+		Issuer& operator=(const Issuer&) = delete;
+
+		// Empty for the root
+		std::string name;
+		// Block its serials come from, see IssuingCA::SerialBits
+		int index = 0;
+		std::string crlPath;
+		X509* cert = nullptr;
+		// NULL when the key is offline, nothing it signed gets a response
+		EVP_PKEY* key = nullptr;
+		OCSP_CERTID* id = nullptr;
+		// Keyed by upper case hex serial
+		std::unordered_map<std::string, Entry> cache;
+	};
+
+	std::string pkiPath;
+	std::string caPath;
+	std::string keyPath;
+	std::string crlPath;
+	std::string crlDirPath;
+	int validHours;
+
+	// Root first. Only ever added to, under cacheLock, so an Issuer* stays valid.
+	std::vector<std::unique_ptr<Issuer>> issuers;
+	std::mutex cacheLock;
+	std::mutex signLock;
+
+	// Stand in for a filesystem watcher, polled by the maintenance thread
+	std::map<std::string, time_t> seen;
+	std::thread maintenance;
+	std::atomic<bool> stopping{ false };
+	Metrics metrics;
+
+	// Each connection is answered on its own thread and has this long to send its request and
+	// take the response, so a client that connects and goes quiet only holds up itself
+	static const int ClientTimeoutSeconds = 5;
+	static const size_t MaxConnections = 1024;
+	size_t connections = 0;
+	std::mutex connectionsLock;
+	std::condition_variable connectionsChanged;
+
+	std::unique_ptr<Issuer> loadIssuer(const std::string& certPath, const std::string& keyPath);
+	void loadIntermediate(const std::string& name);
+	std::vector<Issuer*> signingIssuers();
+	bool addIssued(const std::string& certPath);
+	void loadRevoked();
+	void loadCRL(Issuer& issuer);
+	void revokeDecimal(const std::string& entryPath);
+	bool setStatus(Issuer& issuer, const std::string& serial, bool revoked, time_t revokedAt);
+	std::shared_ptr<const std::vector<unsigned char>> sign(const Issuer& issuer, const std::string& serial, bool revoked, time_t revokedAt, time_t& expires);
+	void renewExpiring();
+	void scanChanges();
+	void maintain();
+	void handle(int client);
+
+	static std::vector<unsigned char> statusOnly(int status);
+	static std::string serialToHex(const ASN1_INTEGER* serial);
+	static time_t toTime(const ASN1_TIME* time);
+	static BIO* readFile(const std::string& path);
+};
@@ -0,0 +1,759 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "OpenSSLHelper.h"
+
+#include <openssl/bio.h>
+#include <openssl/crypto.h>
+#include <openssl/ec.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/sha.h>
+#include <openssl/x509v3.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+#include <strings.h>
+
+CertificateSubject::CertificateSubject(const std::string& commonName) : CommonName(commonName) {}
+
+static const char* const SubjectKeys[] = {
+	"commonname", "country", "state", "location", "organisation", "organisationunit", "email"
+};
+
+Json CertificateSubject::toDict() const
+{
+	Json dict = Json::object();
+	const std::string* fields[] = { &CommonName, &Country, &State, &Location, &Organisation, &OrganisationUnit, &Email };
+	for (size_t i = 0; i < sizeof(SubjectKeys) / sizeof(SubjectKeys[0]); i++) {
+		if (!fields[i]->empty())
+			dict[SubjectKeys[i]] = *fields[i];
+	}
+	return dict;
+}
+
+std::unique_ptr<CertificateSubject> CertificateSubject::fromDict(const Json& dict)
+{
+	if (dict.type() != Json::Type::Object)
+		return nullptr;
+	std::string values[sizeof(SubjectKeys) / sizeof(SubjectKeys[0])];
+	for (const auto& item : dict.items()) {
+		for (size_t i = 0; i < sizeof(SubjectKeys) / sizeof(SubjectKeys[0]); i++) {
+			if (strcasecmp(item.first.c_str(), SubjectKeys[i]) == 0 && item.second.type() == Json::Type::String)
+				values[i] = item.second.asString();
+		}
+	}
+	if (values[0].empty())
+		return nullptr;
+	std::unique_ptr<CertificateSubject> subject(new CertificateSubject(values[0]));
+	subject->Country = values[1];
+	subject->State = values[2];
+	subject->Location = values[3];
+	subject->Organisation = values[4];
+	subject->OrganisationUnit = values[5];
+	subject->Email = values[6];
+	return subject;
+}
+
+Identity::Identity(X509* cert, EVP_PKEY* key) : cert(cert), key(key) {}
+
+Identity::Identity(const std::string& certDER, EVP_PKEY* key) : cert(NULL), key(key), certDER(certDER) {}
+
+Identity::~Identity()
+{
+	X509_free(cert);
+	EVP_PKEY_free(key);
+}
+
+void OpenSSLHelper::OpenSSL_INIT()
+{
+	OPENSSL_init_crypto(OPENSSL_INIT_LOAD_CRYPTO_STRINGS, NULL);
+}
+
+std::string OpenSSLHelper::OpenSSLVersion()
+{
+	return OpenSSL_version(OPENSSL_VERSION);
+}
+
+std::vector<std::string> OpenSSLHelper::GetECCurves()
+{
+	std::vector<std::string> curves;
+	size_t count = EC_get_builtin_curves(NULL, 0);
+	std::vector<EC_builtin_curve> builtin(count);
+	EC_get_builtin_curves(builtin.data(), count);
+	for (const EC_builtin_curve& curve : builtin) {
+		const char* name = OBJ_nid2sn(curve.nid);
+		if (name != NULL)
+			curves.push_back(name);
+	}
+	return curves;
+}
+
+std::vector<std::string> OpenSSLHelper::GetEdCurves()
+{
+	return { "ED25519", "ED448" };
+}
+
+std::string OpenSSLHelper::LastError()
+{
+	unsigned long err = ERR_get_error();
+	ERR_clear_error();
+	if (err == 0)
+		return "Unknown error";
+	char buf[256];
+	ERR_error_string_n(err, buf, sizeof(buf));
+	return buf;
+}
+
+const EVP_MD* OpenSSLHelper::SigningDigest(EVP_PKEY* key)
+{
+	int type = EVP_PKEY_id(key);
+	if (type == EVP_PKEY_ED25519 || type == EVP_PKEY_ED448)
+		return NULL;
+	return EVP_sha256();
+}
+
+int OpenSSLHelper::MaxRSAPrimes(int keySize)
+{
+	// The same limits OpenSSL applies, each prime has to stay large enough to be safe
+	if (keySize < 1024)
+		return 2;
+	if (keySize < 4096)
+		return 3;
+	if (keySize < 8192)
+		return 4;
+	return 5;
+}
+
+int OpenSSLHelper::RSAPrimes(EVP_PKEY* key)
+{
+	if (key == NULL || EVP_PKEY_base_id(key) != EVP_PKEY_RSA)
+		return 0;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	// rsa-factor1, rsa-factor2 and so on, one per prime
+	int primes = 0;
+	for (int i = 1; i <= 10; i++) {
+		BIGNUM* factor = NULL;
+		std::string name = "rsa-factor" + std::to_string(i);
+		if (EVP_PKEY_get_bn_param(key, name.c_str(), &factor) != 1)
+			break;
+		BN_free(factor);
+		primes++;
+	}
+	return primes;
+#else
+	return RSA_get_multi_prime_extra_count(EVP_PKEY_get0_RSA(key)) + 2;
+#endif
+}
+
+EVP_PKEY* OpenSSLHelper::createKey(Algorithm algorithm, int keySize, const std::string& curve, int rsaPrimes)
+{
+	int id;
+	if (algorithm == Algorithm::RSA) {
+		id = EVP_PKEY_RSA;
+	}
+	else if (algorithm == Algorithm::ECDSA) {
+		id = EVP_PKEY_EC;
+	}
+	else {
+		std::string upper = curve;
+		std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+		if (upper == "ED25519")
+			id = EVP_PKEY_ED25519;
+		else if (upper == "ED448")
+			id = EVP_PKEY_ED448;
+		else
+			throw std::runtime_error("Unknown EdDSA curve: " + curve);
+	}
+
+	EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(id, NULL);
+	EVP_PKEY* key = NULL;
+	bool ok = ctx != NULL && EVP_PKEY_keygen_init(ctx) > 0;
+	if (ok && algorithm == Algorithm::RSA) {
+		ok = EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, keySize) > 0
+			&& (rsaPrimes == 2 || EVP_PKEY_CTX_set_rsa_keygen_primes(ctx, rsaPrimes) > 0);
+	}
+	else if (ok && algorithm == Algorithm::ECDSA) {
+		int nid = OBJ_sn2nid(curve.c_str());
+		if (nid == NID_undef)
+			nid = EC_curve_nist2nid(curve.c_str());
+		if (nid == NID_undef) {
+			EVP_PKEY_CTX_free(ctx);
+			throw std::runtime_error("Unknown ECDSA curve: " + curve);
+		}
+		ok = EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, nid) > 0
+			&& EVP_PKEY_CTX_set_ec_param_enc(ctx, OPENSSL_EC_NAMED_CURVE) > 0;
+	}
+	if (ok)
+		ok = EVP_PKEY_keygen(ctx, &key) > 0;
+	EVP_PKEY_CTX_free(ctx);
+	if (!ok)
+		throw std::runtime_error("Failed to generate key. " + LastError());
+	return key;
+}
+
+// Subject fields in the order they appear in a name, CommonNameField is CN's place
+static const size_t CommonNameField = 5;
+static const size_t SubjectFields = 7;
+
+static void addSubjectFields(X509_NAME* name, const CertificateSubject& subject, size_t first, size_t last)
+{
+	const std::pair<const char*, const std::string*> fields[SubjectFields] = {
+		{ "C", &subject.Country },
+		{ "ST", &subject.State },
+		{ "L", &subject.Location },
+		{ "O", &subject.Organisation },
+		{ "OU", &subject.OrganisationUnit },
+		{ "CN", &subject.CommonName },
+		{ "emailAddress", &subject.Email },
+	};
+	for (size_t i = first; i < last; i++) {
+		if (fields[i].second->empty())
+			continue;
+		if (!X509_NAME_add_entry_by_txt(name, fields[i].first, MBSTRING_UTF8, (const unsigned char*)fields[i].second->c_str(), -1, -1, 0))
+			throw std::runtime_error(std::string("Invalid subject field ") + fields[i].first + ". " + OpenSSLHelper::LastError());
+	}
+}
+
+X509* OpenSSLHelper::createCert(const CertificateSubject& subject, EVP_PKEY* key, int validDays, int serial)
+{
+	X509* cert = X509_new();
+	if (cert == NULL)
+		throw std::runtime_error("Failed to allocate certificate");
+	X509_set_version(cert, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(cert), serial);
+	X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+	X509_gmtime_adj(X509_getm_notAfter(cert), (long)validDays * 24 * 60 * 60);
+	X509_set_pubkey(cert, key);
+	try {
+		addSubjectFields(X509_get_subject_name(cert), subject, 0, SubjectFields);
+	}
+	catch (...) {
+		X509_free(cert);
+		throw;
+	}
+	return cert;
+}
+
+void OpenSSLHelper::addExtension(X509* cert, X509* issuer, int nid, const char* value)
+{
+	X509V3_CTX ctx;
+	X509V3_set_ctx_nodb(&ctx);
+	X509V3_set_ctx(&ctx, issuer, cert, NULL, NULL, 0);
+	X509_EXTENSION* ext = X509V3_EXT_conf_nid(NULL, &ctx, nid, value);
+	if (ext == NULL)
+		throw std::runtime_error("Failed to create certificate extension. " + LastError());
+	X509_add_ext(cert, ext, -1);
+	X509_EXTENSION_free(ext);
+}
+
+std::unique_ptr<Identity> OpenSSLHelper::CreateCAAndKey(const CertificateSubject& subject, Algorithm algorithm, int keySize, const std::string& curve, int validDays, int serial)
+{
+	EVP_PKEY* key = createKey(algorithm, keySize, curve);
+	X509* cert;
+	try {
+		cert = createCert(subject, key, validDays, serial);
+	}
+	catch (...) {
+		EVP_PKEY_free(key);
+		throw;
+	}
+	std::unique_ptr<Identity> identity(new Identity(cert, key));
+
+	X509_set_issuer_name(cert, X509_get_subject_name(cert));
+	addExtension(cert, cert, NID_basic_constraints, "critical,CA:TRUE");
+	addExtension(cert, cert, NID_key_usage, "critical,keyCertSign,cRLSign");
+	addExtension(cert, cert, NID_subject_key_identifier, "hash");
+	addExtension(cert, cert, NID_authority_key_identifier, "keyid:always");
+	if (!X509_sign(cert, key, SigningDigest(key)))
+		throw std::runtime_error("Failed to sign CA. " + LastError());
+	return identity;
+}
+
+std::unique_ptr<Identity> OpenSSLHelper::CreateIntermediateCA(const CertificateSubject& subject, const Identity& issuer, Algorithm algorithm, int keySize, const std::string& curve, int validDays, int serial, bool compact)
+{
+	EVP_PKEY* key = createKey(algorithm, keySize, curve);
+	X509* cert;
+	try {
+		cert = createCert(subject, key, validDays, serial);
+	}
+	catch (...) {
+		EVP_PKEY_free(key);
+		throw;
+	}
+	std::unique_ptr<Identity> identity(new Identity(cert, key));
+
+	X509_set_issuer_name(cert, X509_get_subject_name(issuer.cert));
+	addExtension(cert, issuer.cert, NID_basic_constraints, "critical,CA:TRUE,pathlen:0");
+	addExtension(cert, issuer.cert, NID_key_usage, "critical,keyCertSign,cRLSign");
+	// Chains are short enough to be built by name, the key identifiers only add bytes
+	if (!compact) {
+		addExtension(cert, issuer.cert, NID_subject_key_identifier, "hash");
+		addExtension(cert, issuer.cert, NID_authority_key_identifier, "keyid:always");
+	}
+	if (!X509_sign(cert, issuer.key, SigningDigest(issuer.key)))
+		throw std::runtime_error("Failed to sign intermediate CA. " + LastError());
+	return identity;
+}
+
+std::unique_ptr<Identity> OpenSSLHelper::CreateCertKeyBundle(const CertificateSubject& subject, const Identity& issuer, Algorithm algorithm, int keySize, const std::string& curve, int validDays, int serial, bool server, int rsaPrimes, bool compact)
+{
+	EVP_PKEY* key = createKey(algorithm, keySize, curve, rsaPrimes);
+	X509* cert;
+	try {
+		cert = createCert(subject, key, validDays, serial);
+	}
+	catch (...) {
+		EVP_PKEY_free(key);
+		throw;
+	}
+	std::unique_ptr<Identity> identity(new Identity(cert, key));
+
+	X509_set_issuer_name(cert, X509_get_subject_name(issuer.cert));
+	addEndEntityExtensions(cert, issuer.cert, server, compact);
+	if (!compact)
+		addExtension(cert, issuer.cert, NID_subject_key_identifier, "hash");
+	if (!X509_sign(cert, issuer.key, SigningDigest(issuer.key)))
+		throw std::runtime_error("Failed to sign certificate. " + LastError());
+	return identity;
+}
+
+std::unique_ptr<Identity> OpenSSLHelper::CreateCertKeyBundle(const CertTemplate& tmpl, const std::string& commonName, Algorithm algorithm, int keySize, const std::string& curve, int serial)
+{
+	EVP_PKEY* key = createKey(algorithm, keySize, curve);
+	std::string cert;
+	try {
+		cert = tmpl.Issue(commonName, key, serial);
+	}
+	catch (...) {
+		EVP_PKEY_free(key);
+		throw;
+	}
+	return std::unique_ptr<Identity>(new Identity(cert, key));
+}
+
+void OpenSSLHelper::addEndEntityExtensions(X509* cert, X509* issuer, bool server, bool compact)
+{
+	// Not being a CA is the default, and the key identifiers and Netscape type are for older or
+	// stricter clients than OpenVPN, which only checks the key usages
+	if (!compact) {
+		addExtension(cert, issuer, NID_basic_constraints, "CA:FALSE");
+		addExtension(cert, issuer, NID_authority_key_identifier, "keyid,issuer");
+	}
+	if (server) {
+		addExtension(cert, issuer, NID_key_usage, "critical,digitalSignature,keyEncipherment");
+		addExtension(cert, issuer, NID_ext_key_usage, "serverAuth");
+		if (!compact)
+			addExtension(cert, issuer, NID_netscape_cert_type, "server");
+	}
+	else {
+		addExtension(cert, issuer, NID_key_usage, "critical,digitalSignature");
+		addExtension(cert, issuer, NID_ext_key_usage, "clientAuth");
+	}
+}
+
+static std::string nameDER(const X509_NAME* name)
+{
+	unsigned char* der = NULL;
+	int length = i2d_X509_NAME(name, &der);
+	if (length <= 0)
+		throw std::runtime_error("Failed to encode name. " + OpenSSLHelper::LastError());
+	std::string out((const char*)der, length);
+	OPENSSL_free(der);
+	return out;
+}
+
+static std::string timeDER(long offset)
+{
+	// X509_gmtime_adj picks UTCTime or GeneralizedTime by year, the same as a certificate built
+	// with it
+	ASN1_TIME* time = X509_gmtime_adj(NULL, offset);
+	unsigned char* der = NULL;
+	int length = time != NULL ? i2d_ASN1_TIME(time, &der) : 0;
+	ASN1_TIME_free(time);
+	if (length <= 0)
+		throw std::runtime_error("Failed to encode time. " + OpenSSLHelper::LastError());
+	std::string out((const char*)der, length);
+	OPENSSL_free(der);
+	return out;
+}
+
+// The contents of a DER element, without its tag and length
+static std::string contentsDER(const std::string& der)
+{
+	if (der.size() < 2)
+		return std::string();
+	size_t header = 2;
+	if ((unsigned char)der[1] & 0x80)
+		header += (unsigned char)der[1] & 0x7F;
+	return der.substr(std::min(header, der.size()));
+}
+
+CertTemplate::CertTemplate(const CertificateSubject& subject, const Identity& issuer, int validDays, bool server, bool compact)
+	: issuer(issuer), validSeconds((long)validDays * 24 * 60 * 60), keyIdentifier(!compact)
+{
+	if (issuer.key == NULL)
+		throw std::runtime_error("Issuer has no key to sign with");
+	// [0] v3
+	this->version = OpenSSLHelper::EncodeDER(0xA0, OpenSSLHelper::EncodeDER(V_ASN1_INTEGER, std::string(1, '\x02')));
+	this->issuerName = nameDER(X509_get_subject_name(issuer.cert));
+
+	X509_NAME* before = X509_NAME_new();
+	X509_NAME* after = X509_NAME_new();
+	try {
+		addSubjectFields(before, subject, 0, CommonNameField);
+		addSubjectFields(after, subject, CommonNameField + 1, SubjectFields);
+		this->subjectBefore = contentsDER(nameDER(before));
+		this->subjectAfter = contentsDER(nameDER(after));
+	}
+	catch (...) {
+		X509_NAME_free(before);
+		X509_NAME_free(after);
+		throw;
+	}
+	X509_NAME_free(before);
+	X509_NAME_free(after);
+
+	// The extensions are made by the same code as CreateCertKeyBundle's, on a prototype signed
+	// once to find out the signature algorithm
+	X509* prototype = X509_new();
+	if (prototype == NULL)
+		throw std::runtime_error("Failed to allocate certificate");
+	try {
+		X509_set_version(prototype, 2);
+		X509_gmtime_adj(X509_getm_notBefore(prototype), 0);
+		X509_gmtime_adj(X509_getm_notAfter(prototype), this->validSeconds);
+		X509_set_issuer_name(prototype, X509_get_subject_name(issuer.cert));
+		X509_set_pubkey(prototype, issuer.key);
+		OpenSSLHelper::addEndEntityExtensions(prototype, issuer.cert, server, compact);
+		if (!X509_sign(prototype, issuer.key, OpenSSLHelper::SigningDigest(issuer.key)))
+			throw std::runtime_error("Failed to sign certificate template. " + OpenSSLHelper::LastError());
+		for (int i = 0; i < X509_get_ext_count(prototype); i++) {
+			unsigned char* der = NULL;
+			int length = i2d_X509_EXTENSION(X509_get_ext(prototype, i), &der);
+			if (length <= 0)
+				throw std::runtime_error("Failed to encode extension. " + OpenSSLHelper::LastError());
+			this->extensions.append((const char*)der, length);
+			OPENSSL_free(der);
+		}
+		const X509_ALGOR* algorithm = NULL;
+		X509_get0_signature(NULL, &algorithm, prototype);
+		unsigned char* der = NULL;
+		int length = i2d_X509_ALGOR(algorithm, &der);
+		if (length <= 0)
+			throw std::runtime_error("Failed to encode signature algorithm. " + OpenSSLHelper::LastError());
+		this->signatureAlgorithm.assign((const char*)der, length);
+		OPENSSL_free(der);
+	}
+	catch (...) {
+		X509_free(prototype);
+		throw;
+	}
+	X509_free(prototype);
+}
+
+std::string CertTemplate::publicKeyInfo(EVP_PKEY* key, std::string& bits) const
+{
+	unsigned char point[256];
+	size_t pointLength = 0;
+	bool encodedPoint = false;
+	std::tuple<int, int, size_t> type(EVP_PKEY_base_id(key), NID_undef, 0);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	// EC and EdDSA keys hand out their encoded point cheaply, and the rest of their
+	// SubjectPublicKeyInfo is the same for every key of the type. RSA keys have no encoded point
+	// and take the encoder, but generating them costs far more anyway. 1.1.1 has no encoders in
+	// the way, so it always encodes the whole key.
+	if (std::get<0>(type) == EVP_PKEY_EC) {
+		char curve[64] = { 0 };
+		size_t curveLength = 0;
+		if (EVP_PKEY_get_group_name(key, curve, sizeof(curve), &curveLength) == 1)
+			std::get<1>(type) = OBJ_sn2nid(curve);
+		encodedPoint = std::get<1>(type) != NID_undef
+			&& EVP_PKEY_get_octet_string_param(key, OSSL_PKEY_PARAM_ENCODED_PUBLIC_KEY, point, sizeof(point), &pointLength) == 1;
+	}
+	else if (std::get<0>(type) == EVP_PKEY_ED25519 || std::get<0>(type) == EVP_PKEY_ED448) {
+		pointLength = sizeof(point);
+		encodedPoint = EVP_PKEY_get_raw_public_key(key, point, &pointLength) == 1;
+	}
+	std::get<2>(type) = pointLength;
+	if (encodedPoint) {
+		std::lock_guard<std::mutex> l(this->publicKeyLock);
+		auto prefix = this->publicKeyPrefixes.find(type);
+		if (prefix != this->publicKeyPrefixes.end()) {
+			bits.assign((const char*)point, pointLength);
+			return prefix->second + bits;
+		}
+	}
+#endif
+
+	X509_PUBKEY* pubkey = NULL;
+	unsigned char* der = NULL;
+	int length = X509_PUBKEY_set(&pubkey, key) == 1 ? i2d_X509_PUBKEY(pubkey, &der) : 0;
+	if (length <= 0) {
+		X509_PUBKEY_free(pubkey);
+		throw std::runtime_error("Failed to encode public key. " + OpenSSLHelper::LastError());
+	}
+	std::string info((const char*)der, length);
+	OPENSSL_free(der);
+	const unsigned char* keyBits = NULL;
+	int keyBitsLength = 0;
+	X509_PUBKEY_get0_param(NULL, &keyBits, &keyBitsLength, NULL, pubkey);
+	bits.assign((const char*)keyBits, keyBitsLength);
+	X509_PUBKEY_free(pubkey);
+
+	if (encodedPoint && bits == std::string((const char*)point, pointLength) && info.size() > pointLength
+		&& info.compare(info.size() - pointLength, pointLength, bits) == 0) {
+		std::lock_guard<std::mutex> l(this->publicKeyLock);
+		this->publicKeyPrefixes[type] = info.substr(0, info.size() - pointLength);
+	}
+	return info;
+}
+
+std::string CertTemplate::Issue(const std::string& commonName, EVP_PKEY* key, int serial) const
+{
+	// Serials are positive, a leading zero keeps the top bit from reading as a sign
+	std::string serialBytes;
+	unsigned long value = (unsigned long)serial;
+	do {
+		serialBytes.insert(serialBytes.begin(), (char)(value & 0xFF));
+		value >>= 8;
+	} while (value > 0);
+	if ((unsigned char)serialBytes[0] & 0x80)
+		serialBytes.insert(serialBytes.begin(), '\0');
+
+	// The Common Name goes through X509_NAME so it is checked and typed the way createCert's is
+	std::string commonNameRDN;
+	if (!commonName.empty()) {
+		X509_NAME* name = X509_NAME_new();
+		try {
+			addSubjectFields(name, CertificateSubject(commonName), CommonNameField, CommonNameField + 1);
+			commonNameRDN = contentsDER(nameDER(name));
+		}
+		catch (...) {
+			X509_NAME_free(name);
+			throw;
+		}
+		X509_NAME_free(name);
+	}
+
+	std::string bits;
+	std::string publicKey = this->publicKeyInfo(key, bits);
+	std::string extensionList = this->extensions;
+	if (this->keyIdentifier) {
+		// The SHA-1 of the subjectPublicKey bits, what the "hash" subject key identifier is
+		unsigned char digest[SHA_DIGEST_LENGTH];
+		SHA1((const unsigned char*)bits.data(), bits.size(), digest);
+		std::string keyId = OpenSSLHelper::EncodeDER(V_ASN1_OCTET_STRING, std::string((const char*)digest, sizeof(digest)));
+		extensionList += OpenSSLHelper::EncodeDER(0x30, std::string("\x06\x03\x55\x1d\x0e", 5) + OpenSSLHelper::EncodeDER(V_ASN1_OCTET_STRING, keyId));
+	}
+
+	std::string tbs;
+	tbs.reserve(this->issuerName.size() + this->extensions.size() + publicKey.size() + 256);
+	tbs += this->version;
+	tbs += OpenSSLHelper::EncodeDER(V_ASN1_INTEGER, serialBytes);
+	tbs += this->signatureAlgorithm;
+	tbs += this->issuerName;
+	tbs += OpenSSLHelper::EncodeDER(0x30, timeDER(0) + timeDER(this->validSeconds));
+	tbs += OpenSSLHelper::EncodeDER(0x30, this->subjectBefore + commonNameRDN + this->subjectAfter);
+	tbs += publicKey;
+	if (!extensionList.empty())
+		tbs += OpenSSLHelper::EncodeDER(0xA3, OpenSSLHelper::EncodeDER(0x30, extensionList));
+
+	return OpenSSLHelper::SignDER(OpenSSLHelper::EncodeDER(0x30, tbs), this->signatureAlgorithm, this->issuer.key);
+}
+
+std::unique_ptr<Identity> OpenSSLHelper::LoadIdentity(const std::string& certData, const std::string& keyData)
+{
+	BIO* bio = BIO_new_mem_buf(certData.data(), (int)certData.size());
+	X509* cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (cert == NULL)
+		throw std::runtime_error("Failed to parse certificate. " + LastError());
+	bio = BIO_new_mem_buf(keyData.data(), (int)keyData.size());
+	EVP_PKEY* key = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (key == NULL) {
+		X509_free(cert);
+		throw std::runtime_error("Failed to parse key. " + LastError());
+	}
+	return std::unique_ptr<Identity>(new Identity(cert, key));
+}
+
+static int dhProgress(EVP_PKEY_CTX* ctx)
+{
+	static const char progress[] = ".+*\n";
+	int p = EVP_PKEY_CTX_get_keygen_info(ctx, 0);
+	if (p >= 0 && p <= 3) {
+		fputc(progress[p], stdout);
+		fflush(stdout);
+	}
+	return 1;
+}
+
+std::string OpenSSLHelper::CreateDH(int keySize)
+{
+	EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_DH, NULL);
+	EVP_PKEY* params = NULL;
+	bool ok = ctx != NULL
+		&& EVP_PKEY_paramgen_init(ctx) > 0
+		&& EVP_PKEY_CTX_set_dh_paramgen_prime_len(ctx, keySize) > 0
+		&& EVP_PKEY_CTX_set_dh_paramgen_generator(ctx, 2) > 0;
+	if (ok) {
+		EVP_PKEY_CTX_set_cb(ctx, dhProgress);
+		ok = EVP_PKEY_paramgen(ctx, &params) > 0;
+	}
+	EVP_PKEY_CTX_free(ctx);
+	if (!ok)
+		throw std::runtime_error("Failed to generate DH parameters. " + LastError());
+
+	BIO* bio = BIO_new(BIO_s_mem());
+	PEM_write_bio_Parameters(bio, params);
+	EVP_PKEY_free(params);
+	char* data;
+	long len = BIO_get_mem_data(bio, &data);
+	std::string pem(data, len);
+	BIO_free(bio);
+	return pem;
+}
+
+std::string OpenSSLHelper::CreateCRL(const Identity& issuer, const std::string* crlData, const std::string& certData, int validDays)
+{
+	BIO* bio = BIO_new_mem_buf(certData.data(), (int)certData.size());
+	X509* cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (cert == NULL)
+		throw std::runtime_error("Failed to parse certificate. " + LastError());
+
+	X509_CRL* crl = NULL;
+	if (crlData != nullptr) {
+		bio = BIO_new_mem_buf(crlData->data(), (int)crlData->size());
+		crl = PEM_read_bio_X509_CRL(bio, NULL, NULL, NULL);
+		BIO_free(bio);
+		if (crl == NULL) {
+			X509_free(cert);
+			throw std::runtime_error("Failed to parse existing CRL. " + LastError());
+		}
+	}
+	else {
+		crl = X509_CRL_new();
+		X509_CRL_set_version(crl, 1);
+		X509_CRL_set_issuer_name(crl, X509_get_subject_name(issuer.cert));
+	}
+
+	X509_REVOKED* revoked = X509_REVOKED_new();
+	ASN1_TIME* now = X509_gmtime_adj(NULL, 0);
+	X509_REVOKED_set_serialNumber(revoked, X509_get_serialNumber(cert));
+	X509_REVOKED_set_revocationDate(revoked, now);
+	X509_CRL_add0_revoked(crl, revoked);
+	X509_free(cert);
+
+	ASN1_TIME* next = X509_gmtime_adj(NULL, (long)validDays * 24 * 60 * 60);
+	X509_CRL_set1_lastUpdate(crl, now);
+	X509_CRL_set1_nextUpdate(crl, next);
+	ASN1_TIME_free(now);
+	ASN1_TIME_free(next);
+	X509_CRL_sort(crl);
+	if (!X509_CRL_sign(crl, issuer.key, SigningDigest(issuer.key))) {
+		X509_CRL_free(crl);
+		throw std::runtime_error("Failed to sign CRL. " + LastError());
+	}
+
+	bio = BIO_new(BIO_s_mem());
+	PEM_write_bio_X509_CRL(bio, crl);
+	X509_CRL_free(crl);
+	char* data;
+	long len = BIO_get_mem_data(bio, &data);
+	std::string pem(data, len);
+	BIO_free(bio);
+	return pem;
+}
+
+std::string OpenSSLHelper::CertAsPEM(X509* cert)
+{
+	BIO* bio = BIO_new(BIO_s_mem());
+	if (!PEM_write_bio_X509(bio, cert)) {
+		BIO_free(bio);
+		return std::string();
+	}
+	char* data;
+	long len = BIO_get_mem_data(bio, &data);
+	std::string pem(data, len);
+	BIO_free(bio);
+	return pem;
+}
+
+std::string OpenSSLHelper::CertAsPEM(const std::string& certDER)
+{
+	BIO* bio = BIO_new(BIO_s_mem());
+	if (!PEM_write_bio(bio, PEM_STRING_X509, "", (const unsigned char*)certDER.data(), (long)certDER.size())) {
+		BIO_free(bio);
+		return std::string();
+	}
+	char* data;
+	long len = BIO_get_mem_data(bio, &data);
+	std::string pem(data, len);
+	BIO_free(bio);
+	return pem;
+}
+
+std::string OpenSSLHelper::EncodeDER(unsigned char tag, const std::string& content)
+{
+	std::string out(1, (char)tag);
+	size_t length = content.size();
+	if (length < 0x80) {
+		out += (char)length;
+	}
+	else {
+		std::string bytes;
+		for (; length > 0; length >>= 8)
+			bytes.insert(bytes.begin(), (char)(length & 0xFF));
+		out += (char)(0x80 | bytes.size());
+		out += bytes;
+	}
+	return out + content;
+}
+
+std::string OpenSSLHelper::SignDER(const std::string& tbs, const std::string& signatureAlgorithm, EVP_PKEY* key)
+{
+	EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+	size_t signatureLength = 0;
+	std::vector<unsigned char> signature;
+	bool ok = ctx != NULL
+		&& EVP_DigestSignInit(ctx, NULL, SigningDigest(key), NULL, key) == 1
+		&& EVP_DigestSign(ctx, NULL, &signatureLength, (const unsigned char*)tbs.data(), tbs.size()) == 1;
+	if (ok) {
+		signature.resize(signatureLength);
+		ok = EVP_DigestSign(ctx, signature.data(), &signatureLength, (const unsigned char*)tbs.data(), tbs.size()) == 1;
+	}
+	EVP_MD_CTX_free(ctx);
+	if (!ok)
+		throw std::runtime_error("Failed to sign. " + LastError());
+
+	std::string bits(1, '\0');
+	bits.append((const char*)signature.data(), signatureLength);
+	return EncodeDER(0x30, tbs + signatureAlgorithm + EncodeDER(V_ASN1_BIT_STRING, bits));
+}
+
+size_t OpenSSLHelper::CertDERSize(X509* cert)
+{
+	int length = i2d_X509(cert, NULL);
+	return length > 0 ? (size_t)length : 0;
+}
+
+std::string OpenSSLHelper::KeyAsPEM(EVP_PKEY* key)
+{
+	BIO* bio = BIO_new(BIO_s_secmem());
+	if (!PEM_write_bio_PrivateKey(bio, key, NULL, NULL, 0, NULL, NULL)) {
+		BIO_free(bio);
+		return std::string();
+	}
+	char* data;
+	long len = BIO_get_mem_data(bio, &data);
+	std::string pem(data, len);
+	BIO_free(bio);
+	return pem;
+}
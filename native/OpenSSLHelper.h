@@ -0,0 +1,140 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include "Json.h"
+
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+class CertificateSubject
+{
+public:
+	explicit CertificateSubject(const std::string& commonName);
+
+	std::string CommonName;
+	std::string Country;
+	std::string State;
+	std::string Location;
+	std::string Organisation;
+	std::string OrganisationUnit;
+	std::string Email;
+
+	Json toDict() const;
+	static std::unique_ptr<CertificateSubject> fromDict(const Json& dict);
+};
+
+// Owns a certificate and its private key
+class Identity
+{
+public:
+	Identity(X509* cert, EVP_PKEY* key);
+	// Issued from a template, the certificate is only kept encoded. Parsing it back into an X509
+	// decodes the public key again, which costs as much as signing it did.
+	Identity(const std::string& certDER, EVP_PKEY* key);
+	~Identity();
+	Identity(const Identity&) = delete;
+	Identity& operator=(const Identity&) = delete;
+
+	// NULL when the certificate is in certDER
+	X509* cert;
+	EVP_PKEY* key;
+	std::string certDER;
+};
+
+// What every end entity certificate from one issuer has in common, encoded once. Issuing only
+// encodes the Common Name, serial, validity and key and splices them in, producing the same
+// certificate CreateCertKeyBundle would without building and encoding a whole X509 each time.
+class CertTemplate
+{
+public:
+	// issuer has to outlive the template. Throws on failure.
+	CertTemplate(const CertificateSubject& subject, const Identity& issuer, int validDays, bool server, bool compact);
+
+	// Signs a certificate for key and returns it DER encoded. Safe to call from several threads.
+	// Throws on failure.
+	std::string Issue(const std::string& commonName, EVP_PKEY* key, int serial) const;
+
+private:
+	const Identity& issuer;
+	long validSeconds;
+	bool keyIdentifier;
+	// DER, in the order they appear in a TBSCertificate
+	std::string version;
+	std::string signatureAlgorithm;
+	std::string issuerName;
+	// The RDNs either side of the Common Name, without their SEQUENCE
+	std::string subjectBefore;
+	std::string subjectAfter;
+	// Every extension but the subject key identifier, which follows them
+	std::string extensions;
+	// SubjectPublicKeyInfo up to the encoded point, by key type, curve and point length. On
+	// OpenSSL 3 encoding a whole key goes through the encoders and costs more than signing.
+	mutable std::mutex publicKeyLock;
+	mutable std::map<std::tuple<int, int, size_t>, std::string> publicKeyPrefixes;
+
+	// The key's SubjectPublicKeyInfo and the subjectPublicKey bits in it
+	std::string publicKeyInfo(EVP_PKEY* key, std::string& bits) const;
+};
+
+class OpenSSLHelper
+{
+public:
+	enum class Algorithm {
+		RSA, ECDSA, EdDSA
+	};
+
+	static void OpenSSL_INIT();
+	static std::string OpenSSLVersion();
+	static std::vector<std::string> GetECCurves();
+	static std::vector<std::string> GetEdCurves();
+
+	static std::unique_ptr<Identity> CreateCAAndKey(const CertificateSubject& subject, Algorithm algorithm, int keySize, const std::string& curve, int validDays, int serial);
+	// A CA signed by issuer that can only issue end entity certificates
+	static std::unique_ptr<Identity> CreateIntermediateCA(const CertificateSubject& subject, const Identity& issuer, Algorithm algorithm, int keySize, const std::string& curve, int validDays, int serial, bool compact = false);
+	// An RSA key with more than 2 primes has the same modulus size but faster private key operations.
+	// Compact certificates only carry the extensions OpenVPN checks, they are sent on every handshake.
+	static std::unique_ptr<Identity> CreateCertKeyBundle(const CertificateSubject& subject, const Identity& issuer, Algorithm algorithm, int keySize, const std::string& curve, int validDays, int serial, bool server, int rsaPrimes = 2, bool compact = false);
+	// The same from a template, for issuing many certificates from one issuer. The identity's
+	// certificate is in certDER.
+	static std::unique_ptr<Identity> CreateCertKeyBundle(const CertTemplate& tmpl, const std::string& commonName, Algorithm algorithm, int keySize, const std::string& curve, int serial);
+	static std::unique_ptr<Identity> LoadIdentity(const std::string& certData, const std::string& keyData);
+	static std::string CreateDH(int keySize);
+	static std::string CreateCRL(const Identity& issuer, const std::string* crlData, const std::string& certData, int validDays);
+
+	static std::string CertAsPEM(X509* cert);
+	static std::string CertAsPEM(const std::string& certDER);
+	// Bytes the certificate takes in a handshake
+	static size_t CertDERSize(X509* cert);
+	static std::string KeyAsPEM(EVP_PKEY* key);
+
+	// A DER element with tag around content
+	static std::string EncodeDER(unsigned char tag, const std::string& content);
+	// Signs an encoded TBSCertificate or TBSCertList and wraps it the way X509_sign and
+	// X509_CRL_sign do. signatureAlgorithm is the DER AlgorithmIdentifier in tbs. Throws.
+	static std::string SignDER(const std::string& tbs, const std::string& signatureAlgorithm, EVP_PKEY* key);
+
+	// Digest to sign with, EdDSA signs the message directly
+	static const EVP_MD* SigningDigest(EVP_PKEY* key);
+	// Most primes OpenSSL will generate an RSA key of keySize bits with
+	static int MaxRSAPrimes(int keySize);
+	// Primes in an RSA private key, 0 for other keys
+	static int RSAPrimes(EVP_PKEY* key);
+	static std::string LastError();
+
+private:
+	static EVP_PKEY* createKey(Algorithm algorithm, int keySize, const std::string& curve, int rsaPrimes = 2);
+	static X509* createCert(const CertificateSubject& subject, EVP_PKEY* key, int validDays, int serial);
+	static void addExtension(X509* cert, X509* issuer, int nid, const char* value);
+	// Everything but the subject key identifier, which depends on the certificate's key
+	static void addEndEntityExtensions(X509* cert, X509* issuer, bool server, bool compact);
+
+	friend class CertTemplate;
+};
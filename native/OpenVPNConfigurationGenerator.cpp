@@ -0,0 +1,564 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "Auditor.h"
+#include "CLI.h"
+#include "HandshakeBench.h"
+#include "Interactive.h"
+#include "OCSPResponder.h"
+#include "RouteAggregator.h"
+#include "StressHarness.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+static bool tryParse(const std::string& value, int& result)
+{
+	char* end = nullptr;
+	long parsed = strtol(value.c_str(), &end, 10);
+	if (value.empty() || end == nullptr || *end != '\0')
+		return false;
+	result = (int)parsed;
+	return true;
+}
+
+static std::string toLower(std::string value)
+{
+	std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+	return value;
+}
+
+static bool openOutput(Interactive& interactive, std::map<CLI::OptionType, std::string>& options)
+{
+	if (!options.count(CLI::OptionType::Output))
+		return true;
+	try {
+		interactive.Output = OutputSink::Create(options[CLI::OptionType::Output]);
+	}
+	catch (const std::exception& e) {
+		printf("%s\n", e.what());
+		return false;
+	}
+	return true;
+}
+
+static bool closeOutput(Interactive& interactive)
+{
+	if (interactive.Output == nullptr)
+		return true;
+	try {
+		interactive.Output->Close();
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to finish output. %s\n", e.what());
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	CLI cli(argv[0]);
+
+	//Enough args?
+	if (argc < 2) {
+		cli.printUsage();
+		exit(1);
+	}
+	//Get Mode
+	CLI::Mode mode = cli.getMode(argv[1]);
+
+	if (mode == CLI::Mode::Help) {
+		cli.printUsage();
+		exit(0);
+	}
+	if (mode == CLI::Mode::About) {
+		cli.printAbout();
+		exit(0);
+	}
+
+	//Parse Options
+	std::map<CLI::OptionType, std::string> options;
+
+	for (int i = 2; i < argc; i++) {
+		CLI::OptionType op = cli.getOption(argv[i]);
+		if (op == CLI::OptionType::DCO || op == CLI::OptionType::CompactCerts || op == CLI::OptionType::Force) {
+			// A switch, no argument follows
+			options[op] = "";
+			continue;
+		}
+		i++;
+		if (op == CLI::OptionType::Unknown) {
+			printf("Unknown Option. Exiting\n");
+			cli.printUsage();
+			exit(1);
+		}
+		if (i < argc) {
+			options[op] = argv[i];
+		}
+		else {
+			printf("Option missing argument. Exiting\n");
+			cli.printUsage();
+			exit(1);
+		}
+	}
+
+	if (mode == CLI::Mode::Unknown) {
+		printf("Unknown Mode\n");
+		cli.printUsage();
+		exit(1);
+	}
+
+	//Determine the path
+	std::string path;
+	if (options.count(CLI::OptionType::Path)) {
+		path = options[CLI::OptionType::Path];
+	}
+	else {
+		// Get working dir
+		path = fs::current_path().string();
+	}
+
+	//Determine path exists
+	if (!fs::is_directory(path)) {
+		printf("Path %s not found.\n", path.c_str());
+		exit(1);
+	}
+
+	std::string metricsPath;
+	if (options.count(CLI::OptionType::Metrics))
+		metricsPath = options[CLI::OptionType::Metrics];
+	int metricsDays = 30;
+	if (options.count(CLI::OptionType::MetricsDays)) {
+		if (!tryParse(options[CLI::OptionType::MetricsDays], metricsDays) || metricsDays < 0) {
+			printf("Metrics days is not valid\n");
+			exit(1);
+		}
+	}
+
+	//Init SSL
+	OpenSSLHelper::OpenSSL_INIT();
+
+	if (mode == CLI::Mode::InitSetup) {
+		int keySize = 2048;
+		int validDays = 3650;
+		if (options.count(CLI::OptionType::KeySize)) {
+			if (!tryParse(options[CLI::OptionType::KeySize], keySize)) {
+				printf("Key Size is not valid\n");
+				exit(1);
+			}
+		}
+		if (options.count(CLI::OptionType::ValidDays)) {
+			if (!tryParse(options[CLI::OptionType::ValidDays], validDays)) {
+				printf("Valid Days is not valid\n");
+				exit(1);
+			}
+		}
+		// Compact certificates want the shortest keys and signatures, Ed25519 unless asked otherwise
+		bool compact = options.count(CLI::OptionType::CompactCerts) > 0;
+		OpenSSLHelper::Algorithm algorithm = compact ? OpenSSLHelper::Algorithm::EdDSA : OpenSSLHelper::Algorithm::RSA;
+		if (options.count(CLI::OptionType::Algorithm)) {
+			try {
+				algorithm = cli.getAlgorithm(toLower(options[CLI::OptionType::Algorithm]));
+			}
+			catch (const std::exception& e) {
+				printf("%s\n", e.what());
+				exit(1);
+			}
+			if (compact && algorithm == OpenSSLHelper::Algorithm::RSA)
+				printf("WARNING: RSA keys and signatures are several times the size of ECDSA or EdDSA ones, --compact-certs can only trim the rest of the certificate.\n");
+		}
+		std::string ecCurve;
+		if (options.count(CLI::OptionType::Curve)) {
+			ecCurve = options[CLI::OptionType::Curve];
+		}
+		else if (algorithm == OpenSSLHelper::Algorithm::EdDSA) {
+			ecCurve = "ED25519";
+		}
+		else {
+			ecCurve = "secp384r1";
+		}
+		std::string suffix;
+		if (options.count(CLI::OptionType::Suffix))
+			suffix = options[CLI::OptionType::Suffix];
+		bool crlDir = false;
+		if (options.count(CLI::OptionType::CRLMode)) {
+			std::string crlMode = toLower(options[CLI::OptionType::CRLMode]);
+			if (crlMode == "dir") {
+				crlDir = true;
+			}
+			else if (crlMode != "file") {
+				printf("Unknown CRL Mode: %s\n", crlMode.c_str());
+				exit(1);
+			}
+		}
+
+		TLSCrypt::Mode tlsCrypt = TLSCrypt::Mode::V1;
+		if (options.count(CLI::OptionType::TLSCrypt)) {
+			try {
+				tlsCrypt = cli.getTLSCryptMode(toLower(options[CLI::OptionType::TLSCrypt]));
+			}
+			catch (const std::exception& e) {
+				printf("%s\n", e.what());
+				exit(1);
+			}
+		}
+
+		Tuning::Profile profile = Tuning::Profile::None;
+		if (options.count(CLI::OptionType::Profile)) {
+			try {
+				profile = cli.getTuningProfile(toLower(options[CLI::OptionType::Profile]));
+			}
+			catch (const std::exception& e) {
+				printf("%s\n", e.what());
+				exit(1);
+			}
+		}
+
+		std::string subnet;
+		if (options.count(CLI::OptionType::Subnet)) {
+			subnet = options[CLI::OptionType::Subnet];
+			uint32_t network;
+			int prefixLength;
+			if (!AddressPool::TryParseSubnet(subnet, network, prefixLength)) {
+				printf("Subnet is not valid, expected a network between /8 and /29 such as 10.8.0.0/24\n");
+				exit(1);
+			}
+		}
+		if (options.count(CLI::OptionType::Clients)) {
+			int clients;
+			if (!tryParse(options[CLI::OptionType::Clients], clients) || clients <= 0) {
+				printf("Clients is not valid\n");
+				exit(1);
+			}
+			int prefixLength = AddressPool::PrefixForClients(clients);
+			if ((1LL << (32 - prefixLength)) - 3 < clients) {
+				printf("Clients is not valid, a single server can address at most %lld clients\n", (1LL << 24) - 3);
+				exit(1);
+			}
+			if (subnet.empty()) {
+				// Start from the default network, masked down to the wider prefix
+				uint32_t network;
+				AddressPool::TryParse("10.8.0.0", network);
+				network &= 0xFFFFFFFFu << (32 - prefixLength);
+				subnet = AddressPool::ToString(network) + "/" + std::to_string(prefixLength);
+			}
+			else if (atoi(subnet.substr(subnet.find('/') + 1).c_str()) > prefixLength) {
+				printf("Subnet %s is too small for %d clients\n", subnet.c_str(), clients);
+				exit(1);
+			}
+		}
+
+		int workers = 1;
+		if (options.count(CLI::OptionType::Workers)) {
+			if (!tryParse(options[CLI::OptionType::Workers], workers) || workers < 1 || workers > 64) {
+				printf("Workers is not valid, expected 1 to 64\n");
+				exit(1);
+			}
+			// Worker subnets follow on from the first, they all have to fit in the address space
+			uint32_t network;
+			int prefixLength;
+			AddressPool::TryParseSubnet(subnet.empty() ? "10.8.0.0/24" : subnet, network, prefixLength);
+			if ((uint64_t)network + ((uint64_t)workers << (32 - prefixLength)) > 0x100000000ULL) {
+				printf("Subnet is too large for %d workers\n", workers);
+				exit(1);
+			}
+		}
+
+		bool dco = options.count(CLI::OptionType::DCO) > 0;
+		if (dco) {
+			// None of these turn offload off, but they don't do what they would without it
+			if (profile != Tuning::Profile::None)
+				printf("WARNING: Offloaded traffic bypasses the socket buffer and queue settings of --profile, only its ciphers and MTU apply.\n");
+			if (workers > 1)
+				printf("WARNING: The kernel already spreads offloaded traffic across cores, --workers is unlikely to help with --dco.\n");
+		}
+
+		int serverPrimes = 2;
+		if (options.count(CLI::OptionType::ServerRSAPrimes)) {
+			if (!tryParse(options[CLI::OptionType::ServerRSAPrimes], serverPrimes) || serverPrimes < 2 || serverPrimes > 4) {
+				printf("Server RSA primes is not valid, expected 2 to 4\n");
+				exit(1);
+			}
+			if (algorithm != OpenSSLHelper::Algorithm::RSA) {
+				printf("Server RSA primes only applies to --algorithm rsa\n");
+				exit(1);
+			}
+			if (serverPrimes > OpenSSLHelper::MaxRSAPrimes(keySize)) {
+				printf("Key Size %d is too small for %d primes\n", keySize, serverPrimes);
+				exit(1);
+			}
+		}
+
+		std::vector<std::string> routes;
+		if (options.count(CLI::OptionType::Routes)) {
+			std::string routesFile = options[CLI::OptionType::Routes];
+			int count = 0;
+			try {
+				routes = RouteAggregator::Load(routesFile, count);
+			}
+			catch (const std::exception& e) {
+				printf("ERROR: Failed to load routes from %s. %s\n", routesFile.c_str(), e.what());
+				exit(1);
+			}
+			printf("Aggregated %d routes into %zu.\n", count, routes.size());
+		}
+
+		Interactive interactive(path, algorithm, keySize, ecCurve, validDays, suffix);
+		// Before the questions, a tar stream moves everything else printed to stderr
+		if (!openOutput(interactive, options))
+			exit(1);
+		interactive.UseCRLDir = crlDir;
+		interactive.TLSCryptMode = tlsCrypt;
+		interactive.Routes = routes;
+		if (!subnet.empty())
+			interactive.Subnet = subnet;
+		interactive.Workers = workers;
+		interactive.TuningProfile = profile;
+		interactive.DCO = dco;
+		interactive.ServerRSAPrimes = serverPrimes;
+		interactive.CompactCerts = compact;
+		interactive.MetricsPath = metricsPath;
+		interactive.MetricsExpiryDays = metricsDays;
+		if (!interactive.GenerateNewConfig())
+			exit(1);
+		printf("\n");
+		printf("Generating new server configuration...\n");
+		if (!interactive.CreateNewIssuer())
+			exit(1);
+		if (algorithm == OpenSSLHelper::Algorithm::RSA) {
+			// ECDSA uses an ECDH-Curve, and EdDSA has a predefined set of DH paramaters
+			// Thus, DH params are only required for RSA
+			if (!interactive.CreateDH())
+				exit(1);
+		}
+		if (!interactive.CreateTLSCryptKey())
+			exit(1);
+		if (!interactive.CreateServerConfig() || !closeOutput(interactive))
+			exit(1);
+		if (!interactive.SaveConfig())
+			exit(1);
+		interactive.WriteMetrics();
+
+		printf("Successfully initialised config.\n");
+		exit(0);
+	}
+	else if (mode == CLI::Mode::CreateClient) {
+		Interactive interactive(path, OpenSSLHelper::Algorithm::RSA, 2048, "", 3650, "");
+		if (!interactive.LoadConfig())
+			exit(1);
+		interactive.MetricsPath = metricsPath;
+		interactive.MetricsExpiryDays = metricsDays;
+		if (options.count(CLI::OptionType::Issuer))
+			interactive.IssuerName = options[CLI::OptionType::Issuer];
+		if (!openOutput(interactive, options))
+			exit(1);
+
+		if (options.count(CLI::OptionType::Batch)) {
+			// Names are streamed from the file rather than read in up front
+			std::string batch = options[CLI::OptionType::Batch];
+			std::ifstream names(batch);
+			if (!names) {
+				printf("ERROR: Failed to read %s.\n", batch.c_str());
+				exit(1);
+			}
+			bool created = interactive.CreateNewClientConfigs(names);
+			// A read error ends the names early, the clients before it are still saved below
+			if (names.bad()) {
+				printf("ERROR: Failed to read %s.\n", batch.c_str());
+				created = false;
+			}
+			// Closed either way so the stream ends cleanly with whatever was sent
+			created = closeOutput(interactive) && created;
+			// Whatever was issued before a failure still counts
+			interactive.WriteMetrics();
+			// Save the serial even on partial failure so issued serials are never reused
+			if (!interactive.SaveConfig() || !created)
+				exit(1);
+		}
+		else {
+			std::string name;
+			if (options.count(CLI::OptionType::CommonName))
+				name = options[CLI::OptionType::CommonName];
+
+			bool created = interactive.CreateNewClientConfig(name);
+			created = closeOutput(interactive) && created;
+			interactive.WriteMetrics();
+			if (!created || !interactive.SaveConfig())
+				exit(1);
+		}
+
+		printf("Successfully created new client.\n");
+		exit(0);
+	}
+	else if (mode == CLI::Mode::CreateIssuer) {
+		Interactive interactive(path, OpenSSLHelper::Algorithm::RSA, 2048, "", 3650, "");
+		if (!interactive.LoadConfig())
+			exit(1);
+		std::string name;
+		if (options.count(CLI::OptionType::CommonName))
+			name = options[CLI::OptionType::CommonName];
+		if (!interactive.CreateIssuingCA(name) || !interactive.SaveConfig())
+			exit(1);
+		exit(0);
+	}
+	else if (mode == CLI::Mode::Revoke) {
+		Interactive interactive(path, OpenSSLHelper::Algorithm::RSA, 2048, "", 3650, "");
+		if (!interactive.LoadConfig())
+			exit(1);
+		std::string name;
+		if (options.count(CLI::OptionType::CommonName))
+			name = options[CLI::OptionType::CommonName];
+		interactive.MetricsPath = metricsPath;
+		interactive.MetricsExpiryDays = metricsDays;
+		bool revoked = interactive.RevokeCert(name);
+		interactive.WriteMetrics();
+		if (!revoked)
+			exit(1);
+
+		exit(0);
+	}
+	else if (mode == CLI::Mode::Reconcile) {
+		if (!options.count(CLI::OptionType::Roster)) {
+			printf("Roster is required\n");
+			exit(1);
+		}
+		std::string rosterPath = options[CLI::OptionType::Roster];
+		std::ifstream roster(rosterPath);
+		if (!roster) {
+			printf("ERROR: Failed to read %s.\n", rosterPath.c_str());
+			exit(1);
+		}
+		Interactive interactive(path, OpenSSLHelper::Algorithm::RSA, 2048, "", 3650, "");
+		if (!interactive.LoadConfig())
+			exit(1);
+		interactive.MetricsPath = metricsPath;
+		interactive.MetricsExpiryDays = metricsDays;
+		if (options.count(CLI::OptionType::Issuer))
+			interactive.IssuerName = options[CLI::OptionType::Issuer];
+		interactive.ForceRevoke = options.count(CLI::OptionType::Force) > 0;
+		if (!openOutput(interactive, options))
+			exit(1);
+		bool reconciled = interactive.Reconcile(roster);
+		reconciled = closeOutput(interactive) && reconciled;
+		interactive.WriteMetrics();
+		// Saved even on partial failure so issued serials are never reused
+		if (!interactive.SaveConfig() || !reconciled)
+			exit(1);
+		exit(0);
+	}
+	else if (mode == CLI::Mode::OCSPServe) {
+		Interactive interactive(path, OpenSSLHelper::Algorithm::RSA, 2048, "", 3650, "");
+		if (!interactive.LoadConfig())
+			exit(1);
+
+		int port = 8888;
+		if (options.count(CLI::OptionType::Port)) {
+			if (!tryParse(options[CLI::OptionType::Port], port) || port <= 0 || port >= 65535) {
+				printf("Port is not valid\n");
+				exit(1);
+			}
+		}
+		std::string bind = "127.0.0.1";
+		if (options.count(CLI::OptionType::Bind))
+			bind = options[CLI::OptionType::Bind];
+
+		// Responses are valid for a day and re-signed in the background well before then
+		OCSPResponder responder((fs::path(path) / "pki").string(), 24);
+		responder.MetricsPath = metricsPath;
+		if (!responder.Load())
+			exit(1);
+		if (!responder.Serve(bind, port))
+			exit(1);
+		exit(0);
+	}
+	else if (mode == CLI::Mode::Regenerate) {
+		Interactive interactive(path, OpenSSLHelper::Algorithm::RSA, 2048, "", 3650, "");
+		if (!interactive.LoadConfig())
+			exit(1);
+		interactive.MetricsPath = metricsPath;
+		interactive.MetricsExpiryDays = metricsDays;
+		if (!openOutput(interactive, options))
+			exit(1);
+		bool regenerated = interactive.Regenerate();
+		regenerated = closeOutput(interactive) && regenerated;
+		interactive.WriteMetrics();
+		if (!interactive.SaveConfig() || !regenerated)
+			exit(1);
+		exit(0);
+	}
+	else if (mode == CLI::Mode::Verify) {
+		Auditor auditor(path);
+		if (options.count(CLI::OptionType::Output) && options[CLI::OptionType::Output] != "dir")
+			auditor.RequireBundles = false;
+		if (!auditor.Load())
+			exit(1);
+		// The report is all that goes to stdout, so it can be piped straight into other tools
+		if (!auditor.Run(std::cout, std::thread::hardware_concurrency()))
+			exit(1);
+		exit(0);
+	}
+	else if (mode == CLI::Mode::Stress) {
+		int jobs = 8;
+		int operations = 64;
+		if (options.count(CLI::OptionType::Jobs)) {
+			if (!tryParse(options[CLI::OptionType::Jobs], jobs) || jobs < 1) {
+				printf("Jobs is not valid\n");
+				exit(1);
+			}
+		}
+		if (options.count(CLI::OptionType::Operations)) {
+			if (!tryParse(options[CLI::OptionType::Operations], operations) || operations < 1) {
+				printf("Operations is not valid\n");
+				exit(1);
+			}
+		}
+		StressHarness harness(argv[0], path);
+		if (!harness.Run(jobs, operations))
+			exit(1);
+		exit(0);
+	}
+	else if (mode == CLI::Mode::BenchHandshake) {
+		int seconds = 3;
+		if (options.count(CLI::OptionType::Seconds)) {
+			if (!tryParse(options[CLI::OptionType::Seconds], seconds) || seconds < 1) {
+				printf("Seconds is not valid\n");
+				exit(1);
+			}
+		}
+		std::string name;
+		if (options.count(CLI::OptionType::CommonName))
+			name = options[CLI::OptionType::CommonName];
+		HandshakeBench bench(path);
+		if (options.count(CLI::OptionType::ServerRSAPrimes)) {
+			if (!tryParse(options[CLI::OptionType::ServerRSAPrimes], bench.ComparePrimes) || bench.ComparePrimes < 2 || bench.ComparePrimes > 4) {
+				printf("Server RSA primes is not valid, expected 2 to 4\n");
+				exit(1);
+			}
+		}
+		if (!bench.Load(name))
+			exit(1);
+		// One thread per core, each playing both ends of its handshakes
+		if (!bench.Run(std::thread::hardware_concurrency(), seconds))
+			exit(1);
+		exit(0);
+	}
+	else if (mode == CLI::Mode::ShowCurves) {
+		cli.showCurves();
+		exit(0);
+	}
+	else {
+		//In theory, this should never be hit...
+		printf("Unknown Mode\n");
+		cli.printUsage();
+		exit(1);
+	}
+}
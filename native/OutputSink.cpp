@@ -0,0 +1,155 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "OutputSink.h"
+#include "Archive.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+extern char** environ;
+
+// Tar archive on stdout. Everything else printed goes to stderr instead, so the stream can be
+// piped straight into tar or an uploader.
+class TarOutputSink : public OutputSink
+{
+public:
+	TarOutputSink()
+	{
+		fflush(stdout);
+		this->fd = dup(STDOUT_FILENO);
+		if (this->fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+			throw std::runtime_error(std::string("Failed to redirect stdout. ") + strerror(errno));
+		fcntl(this->fd, F_SETFD, FD_CLOEXEC);
+		this->tar.reset(new TarStreamWriter(this->fd));
+	}
+
+	~TarOutputSink()
+	{
+		if (this->fd >= 0)
+			close(this->fd);
+	}
+
+	void Write(const std::string& name, const std::string& data, unsigned int mode) override
+	{
+		std::lock_guard<std::mutex> l(this->lock);
+		this->tar->AddFile(name, data, mode);
+	}
+
+	void Close() override
+	{
+		std::lock_guard<std::mutex> l(this->lock);
+		this->tar->Close();
+		close(this->fd);
+		this->fd = -1;
+	}
+
+	std::string Describe() const override
+	{
+		return "stdout";
+	}
+
+private:
+	int fd = -1;
+	std::mutex lock;
+	std::unique_ptr<TarStreamWriter> tar;
+};
+
+// Runs a command per artifact with the contents on stdin and the artifact's name and mode in
+// OPENVPN_GENERATE_ARTIFACT and OPENVPN_GENERATE_MODE
+class ExecOutputSink : public OutputSink
+{
+public:
+	explicit ExecOutputSink(const std::string& command)
+	{
+		this->command = command;
+		// A command that exits without reading its input must fail the artifact, not the process
+		signal(SIGPIPE, SIG_IGN);
+	}
+
+	void Write(const std::string& name, const std::string& data, unsigned int mode) override
+	{
+		// Close on exec, so a command started by another writer meanwhile doesn't inherit this
+		// pipe and hold it open past the end of the data
+		int pipes[2];
+		if (pipe2(pipes, O_CLOEXEC) != 0)
+			throw std::runtime_error(std::string("Failed to run output command. ") + strerror(errno));
+
+		char modeText[8];
+		snprintf(modeText, sizeof(modeText), "%04o", mode);
+		std::vector<std::string> variables = {
+			"OPENVPN_GENERATE_ARTIFACT=" + name,
+			std::string("OPENVPN_GENERATE_MODE=") + modeText,
+		};
+		std::vector<char*> env;
+		for (std::string& variable : variables)
+			env.push_back(&variable[0]);
+		for (char** e = environ; *e != NULL; e++) {
+			if (strncmp(*e, "OPENVPN_GENERATE_ARTIFACT=", 26) != 0 && strncmp(*e, "OPENVPN_GENERATE_MODE=", 22) != 0)
+				env.push_back(*e);
+		}
+		env.push_back(NULL);
+
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		posix_spawn_file_actions_adddup2(&actions, pipes[0], STDIN_FILENO);
+		const char* argv[] = { "sh", "-c", this->command.c_str(), NULL };
+		pid_t pid;
+		int result = posix_spawn(&pid, "/bin/sh", &actions, NULL, (char* const*)argv, env.data());
+		posix_spawn_file_actions_destroy(&actions);
+		close(pipes[0]);
+		if (result != 0) {
+			close(pipes[1]);
+			throw std::runtime_error(std::string("Failed to run output command. ") + strerror(result));
+		}
+
+		size_t written = 0;
+		bool complete = true;
+		while (written < data.size()) {
+			ssize_t n = write(pipes[1], data.data() + written, data.size() - written);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				complete = false;
+				break;
+			}
+			written += (size_t)n;
+		}
+		close(pipes[1]);
+
+		int status = -1;
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			throw std::runtime_error("Output command failed for " + name);
+		if (!complete)
+			throw std::runtime_error("Output command didn't read all of " + name);
+	}
+
+	std::string Describe() const override
+	{
+		return "\"" + this->command + "\"";
+	}
+
+private:
+	std::string command;
+};
+
+std::unique_ptr<OutputSink> OutputSink::Create(const std::string& spec)
+{
+	if (spec == "dir")
+		return nullptr;
+	if (spec == "tar")
+		return std::unique_ptr<OutputSink>(new TarOutputSink());
+	if (spec.compare(0, 5, "exec:") == 0 && spec.size() > 5)
+		return std::unique_ptr<OutputSink>(new ExecOutputSink(spec.substr(5)));
+	throw std::runtime_error("Output must be dir, tar or exec:COMMAND");
+}
@@ -0,0 +1,27 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include <memory>
+#include <string>
+
+// Where generated server files and client bundles go when they shouldn't be left in the config
+// directory. Artifacts are named relative to it, like server/server.conf or clients/name.visz.
+// pki stays on disk either way, it's the CA's state.
+class OutputSink
+{
+public:
+	virtual ~OutputSink() = default;
+
+	// tar streams a tar archive to stdout, exec:COMMAND runs COMMAND through the shell once per
+	// artifact with its contents on stdin. dir, the config directory, is returned as nullptr.
+	// Throws on anything else.
+	static std::unique_ptr<OutputSink> Create(const std::string& spec);
+
+	// Hands one artifact on. Safe to call from several writers. Throws.
+	virtual void Write(const std::string& name, const std::string& data, unsigned int mode) = 0;
+	// Finishes the output once everything has been written
+	virtual void Close() {}
+	// Where the artifacts went, for messages
+	virtual std::string Describe() const = 0;
+};
@@ -0,0 +1,135 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "RegenerationCache.h"
+#include "DirectoryLock.h"
+#include "Json.h"
+
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+RegenerationCache::RegenerationCache(const std::string& root, const std::string& path)
+{
+	this->root = root;
+	this->path = path;
+}
+
+void RegenerationCache::read(std::unordered_map<std::string, std::string>& entries)
+{
+	entries.clear();
+	if (!fs::exists(this->path))
+		return;
+	try {
+		std::ifstream in(this->path, std::ios::binary);
+		std::ostringstream ss;
+		ss << in.rdbuf();
+		Json json = Json::parse(ss.str());
+		for (const auto& item : json.items())
+			entries[item.first] = item.second.asString();
+	}
+	catch (const std::exception& e) {
+		// Losing the cache only costs a full rebuild
+		printf("WARNING: Ignoring unreadable regeneration cache. %s\n", e.what());
+		entries.clear();
+	}
+}
+
+bool RegenerationCache::Load()
+{
+	std::lock_guard<std::mutex> l(this->lock);
+	read(this->entries);
+	this->changes.clear();
+	return true;
+}
+
+bool RegenerationCache::Save()
+{
+	std::lock_guard<std::mutex> l(this->lock);
+	read(this->entries);
+	for (const auto& change : this->changes) {
+		if (change.second.empty())
+			this->entries.erase(change.first);
+		else
+			this->entries[change.first] = change.second;
+	}
+	// Sorted so the file diffs cleanly between runs
+	std::vector<std::pair<std::string, std::string>> sorted(this->entries.begin(), this->entries.end());
+	std::sort(sorted.begin(), sorted.end());
+	Json json = Json::object();
+	for (const auto& entry : sorted)
+		json[entry.first] = entry.second;
+
+	std::error_code ec;
+	fs::create_directories(fs::path(this->path).parent_path(), ec);
+	try {
+		DirectoryLock::WriteFile(this->path, json.dump());
+	}
+	catch (const std::exception& e) {
+		printf("ERROR: Failed to write regeneration cache. %s\n", e.what());
+		return false;
+	}
+	this->changes.clear();
+	return true;
+}
+
+bool RegenerationCache::Fresh(const std::string& artifact, const std::string& key)
+{
+	{
+		std::lock_guard<std::mutex> l(this->lock);
+		auto it = this->entries.find(artifact);
+		if (it == this->entries.end() || it->second != key)
+			return false;
+	}
+	// Deleted by hand or by a revoke since, it has to be written again
+	return fs::exists(fs::path(this->root) / artifact);
+}
+
+void RegenerationCache::Record(const std::string& artifact, const std::string& key)
+{
+	std::lock_guard<std::mutex> l(this->lock);
+	this->entries[artifact] = key;
+	this->changes[artifact] = key;
+}
+
+void RegenerationCache::Forget(const std::string& artifact)
+{
+	std::lock_guard<std::mutex> l(this->lock);
+	this->entries.erase(artifact);
+	this->changes[artifact] = std::string();
+}
+
+std::string RegenerationCache::Key(const std::vector<std::string>& inputs)
+{
+	EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+	if (ctx == NULL || !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
+		EVP_MD_CTX_free(ctx);
+		throw std::runtime_error("Failed to initialise SHA-256");
+	}
+	for (const std::string& input : inputs) {
+		unsigned char length[8];
+		uint64_t size = input.size();
+		for (int i = 0; i < 8; i++)
+			length[i] = (unsigned char)(size >> (i * 8));
+		EVP_DigestUpdate(ctx, length, sizeof(length));
+		EVP_DigestUpdate(ctx, input.data(), input.size());
+	}
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digestLength = 0;
+	EVP_DigestFinal_ex(ctx, digest, &digestLength);
+	EVP_MD_CTX_free(ctx);
+
+	static const char hex[] = "0123456789abcdef";
+	std::string key;
+	for (unsigned int i = 0; i < digestLength; i++) {
+		key += hex[digest[i] >> 4];
+		key += hex[digest[i] & 0xF];
+	}
+	return key;
+}
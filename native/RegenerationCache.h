@@ -0,0 +1,40 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Remembers the hash of the inputs each generated file was last written from, so regenerating
+// only rewrites the files whose inputs changed. Artifacts are paths relative to the config
+// directory.
+class RegenerationCache
+{
+public:
+	RegenerationCache(const std::string& root, const std::string& path);
+
+	bool Load();
+	// Applies the entries recorded or forgotten since Load on top of what's on disk now, so
+	// processes sharing the directory don't drop each other's entries. Call with the directory
+	// lock held.
+	bool Save();
+	// True when the artifact is still on disk and was last written from inputs with this key
+	bool Fresh(const std::string& artifact, const std::string& key);
+	void Record(const std::string& artifact, const std::string& key);
+	void Forget(const std::string& artifact);
+
+	// SHA-256 over the inputs, each length prefixed so moving bytes between inputs changes the key
+	static std::string Key(const std::vector<std::string>& inputs);
+
+private:
+	std::string root;
+	std::string path;
+	std::unordered_map<std::string, std::string> entries;
+	// Changed since Load, an empty key marks a forgotten artifact
+	std::unordered_map<std::string, std::string> changes;
+	std::mutex lock;
+
+	void read(std::unordered_map<std::string, std::string>& entries);
+};
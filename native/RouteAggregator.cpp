@@ -0,0 +1,184 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "RouteAggregator.h"
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+// Inclusive [first, last] address ranges, 64 bit so last + 1 never wraps
+typedef std::vector<std::pair<uint64_t, uint64_t>> RangeList;
+
+// Merges overlapping and adjacent ranges, then splits each into the fewest aligned blocks.
+// Output is (network, prefix length) pairs in address order.
+static std::vector<std::pair<uint64_t, int>> collapse(RangeList& ranges)
+{
+	std::vector<std::pair<uint64_t, int>> blocks;
+	if (ranges.empty())
+		return blocks;
+
+	std::sort(ranges.begin(), ranges.end());
+	RangeList merged;
+	merged.push_back(ranges[0]);
+	for (size_t i = 1; i < ranges.size(); i++) {
+		if (ranges[i].first <= merged.back().second + 1)
+			merged.back().second = std::max(merged.back().second, ranges[i].second);
+		else
+			merged.push_back(ranges[i]);
+	}
+
+	for (const auto& range : merged) {
+		uint64_t first = range.first;
+		while (first <= range.second) {
+			// Grow the block while it stays aligned and inside the range
+			int length = 32;
+			while (length > 0) {
+				uint64_t size = 1ULL << (33 - length);
+				if ((first & (size - 1)) != 0 || first + size - 1 > range.second)
+					break;
+				length--;
+			}
+			blocks.push_back(std::make_pair(first, length));
+			first += 1ULL << (32 - length);
+		}
+	}
+	return blocks;
+}
+
+std::vector<std::string> RouteAggregator::Load(const std::string& path, int& count)
+{
+	std::ifstream in(path);
+	if (!in)
+		throw std::runtime_error(path + ": " + strerror(errno));
+
+	std::vector<std::string> prefixes;
+	int lineNumber = 0;
+	std::string line;
+	while (std::getline(in, line)) {
+		lineNumber++;
+		size_t comment = line.find('#');
+		if (comment != std::string::npos)
+			line.erase(comment);
+		size_t start = line.find_first_not_of(" \t\r\n");
+		if (start == std::string::npos)
+			continue;
+		line = line.substr(start, line.find_last_not_of(" \t\r\n") - start + 1);
+
+		uint32_t network;
+		int length;
+		bool ipv6;
+		if (!parse(line, network, length, ipv6)) {
+			if (ipv6) {
+				// The server only has an IPv4 tunnel network to route over
+				printf("WARNING: Skipping IPv6 route on line %d: %s\n", lineNumber, line.c_str());
+				continue;
+			}
+			throw std::runtime_error("Invalid route on line " + std::to_string(lineNumber) + ": " + line);
+		}
+		prefixes.push_back(line);
+	}
+	count = (int)prefixes.size();
+	return Aggregate(prefixes);
+}
+
+std::vector<std::string> RouteAggregator::Aggregate(const std::vector<std::string>& prefixes)
+{
+	RangeList ranges;
+	ranges.reserve(prefixes.size());
+	for (const std::string& prefix : prefixes) {
+		uint32_t network;
+		int length;
+		bool ipv6;
+		if (!parse(prefix, network, length, ipv6))
+			throw std::runtime_error("Invalid route: " + prefix);
+		uint64_t first = network & toMask(length);
+		ranges.push_back(std::make_pair(first, first + (1ULL << (32 - length)) - 1));
+	}
+
+	std::vector<std::string> result;
+	for (const auto& block : collapse(ranges)) {
+		result.push_back(toString((uint32_t)block.first) + "/" + std::to_string(block.second));
+	}
+	return result;
+}
+
+std::string RouteAggregator::PushLine(const std::string& cidr)
+{
+	uint32_t network;
+	int length;
+	bool ipv6;
+	if (!parse(cidr, network, length, ipv6))
+		throw std::runtime_error("Invalid route: " + cidr);
+	return "push \"route " + toString(network) + " " + toString(toMask(length)) + "\"";
+}
+
+bool RouteAggregator::parse(const std::string& prefix, uint32_t& network, int& length, bool& ipv6)
+{
+	ipv6 = false;
+	std::vector<std::string> parts;
+	std::string part;
+	std::istringstream ss(prefix);
+	while (std::getline(ss, part, '/')) {
+		std::istringstream words(part);
+		std::string word;
+		while (words >> word)
+			parts.push_back(word);
+	}
+	if (parts.size() < 1 || parts.size() > 2)
+		return false;
+
+	in_addr address;
+	if (inet_pton(AF_INET, parts[0].c_str(), &address) != 1) {
+		in6_addr address6;
+		ipv6 = inet_pton(AF_INET6, parts[0].c_str(), &address6) == 1;
+		return false;
+	}
+	network = ntohl(address.s_addr);
+
+	if (parts.size() == 1) {
+		length = 32;
+		return true;
+	}
+	// Either a prefix length or a dotted netmask
+	if (parts[1].find('.') != std::string::npos) {
+		in_addr mask;
+		if (inet_pton(AF_INET, parts[1].c_str(), &mask) != 1)
+			return false;
+		uint32_t inverted = ~ntohl(mask.s_addr);
+		if ((inverted & (inverted + 1)) != 0)
+			return false; // Not contiguous
+		length = 32;
+		while (inverted != 0) {
+			inverted >>= 1;
+			length--;
+		}
+		return true;
+	}
+	char* end = nullptr;
+	long parsed = strtol(parts[1].c_str(), &end, 10);
+	if (parts[1].empty() || *end != '\0' || parsed < 0 || parsed > 32)
+		return false;
+	length = (int)parsed;
+	return true;
+}
+
+std::string RouteAggregator::toString(uint32_t address)
+{
+	char buf[INET_ADDRSTRLEN];
+	in_addr addr;
+	addr.s_addr = htonl(address);
+	inet_ntop(AF_INET, &addr, buf, sizeof(buf));
+	return buf;
+}
+
+uint32_t RouteAggregator::toMask(int length)
+{
+	return length == 0 ? 0 : 0xFFFFFFFFu << (32 - length);
+}
@@ -0,0 +1,23 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Reduces a list of IPv4 prefixes to the smallest set of CIDR blocks covering exactly the
+// same addresses, so the server pushes (and clients install) as few routes as possible.
+class RouteAggregator
+{
+public:
+	// One prefix per line as a.b.c.d/nn, a.b.c.d m.m.m.m or a bare host. '#' starts a comment.
+	static std::vector<std::string> Load(const std::string& path, int& count);
+	static std::vector<std::string> Aggregate(const std::vector<std::string>& prefixes);
+	static std::string PushLine(const std::string& cidr);
+
+private:
+	static bool parse(const std::string& prefix, uint32_t& network, int& length, bool& ipv6);
+	static std::string toString(uint32_t address);
+	static uint32_t toMask(int length);
+};
@@ -0,0 +1,441 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "StressHarness.h"
+#include "Json.h"
+
+#include <openssl/bn.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <sstream>
+
+namespace fs = std::filesystem;
+
+StressHarness::StressHarness(const std::string& exePath, const std::string& path)
+{
+	// Children run this same binary
+	std::error_code ec;
+	fs::path self = fs::read_symlink("/proc/self/exe", ec);
+	this->exePath = ec ? fs::absolute(exePath).string() : self.string();
+	this->path = fs::absolute(path).string();
+	this->pkiPath = (fs::path(this->path) / "pki").string();
+}
+
+bool StressHarness::Run(int jobs, int count)
+{
+	if (!fs::exists(fs::path(this->path) / "config.conf")) {
+		printf("ERROR: No configuration in %s, run init first.\n", this->path.c_str());
+		return false;
+	}
+	char work[] = "/tmp/openvpn-generate-stress.XXXXXX";
+	if (mkdtemp(work) == NULL) {
+		printf("ERROR: Failed to create a work directory. %s\n", strerror(errno));
+		return false;
+	}
+	this->workPath = work;
+
+	printf("Running %d operations, %d at a time, against %s.\n", count, jobs, this->path.c_str());
+	fflush(stdout);
+
+	// Clients are named after this run so it can be repeated against the same directory
+	std::string prefix = "stress-" + std::to_string(getpid()) + "-";
+	std::vector<std::string> created;
+	std::map<pid_t, size_t> running;
+	auto start = std::chrono::steady_clock::now();
+	auto now = [&start]() { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); };
+	int next = 0;
+	this->operations.reserve(count);
+	while (next < count || !running.empty()) {
+		while ((int)running.size() < jobs && next < count) {
+			// Five clients, two revokes and a regenerate in every eight, revoking only clients
+			// that finished issuing
+			Operation op;
+			int slot = next % 8;
+			if (slot == 7) {
+				op.kind = Kind::Regenerate;
+			}
+			else if ((slot == 5 || slot == 6) && !created.empty()) {
+				op.kind = Kind::Revoke;
+				op.name = created.front();
+				created.erase(created.begin());
+			}
+			else {
+				op.kind = Kind::Client;
+				op.name = prefix + std::to_string(next);
+			}
+			op.log = (fs::path(this->workPath) / ("op-" + std::to_string(next) + ".log")).string();
+			op.metrics = (fs::path(this->workPath) / ("op-" + std::to_string(next) + ".prom")).string();
+			op.started = now();
+			this->operations.push_back(op);
+			pid_t pid = launch(op);
+			if (pid < 0)
+				problem(std::string("Failed to start ") + kindName(op.kind) + ". " + strerror(errno));
+			else
+				running[pid] = this->operations.size() - 1;
+			next++;
+		}
+
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		auto it = running.find(pid);
+		if (it == running.end())
+			continue;
+		Operation& op = this->operations[it->second];
+		op.seconds = now() - op.started;
+		op.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+		if (op.kind == Kind::Client && op.status == 0)
+			created.push_back(op.name);
+		running.erase(it);
+	}
+	double elapsed = now();
+
+	checkCertificates();
+	checkRevocations();
+	checkClients();
+	checkFiles();
+	report(elapsed);
+
+	std::error_code ec;
+	fs::remove_all(this->workPath, ec);
+	bool failed = std::any_of(this->operations.begin(), this->operations.end(), [](const Operation& op) { return op.status != 0; });
+	return !failed && this->problems.empty();
+}
+
+int StressHarness::launch(const Operation& operation) const
+{
+	std::vector<std::string> args = { this->exePath, kindName(operation.kind), "--path", this->path };
+	if (!operation.name.empty()) {
+		args.push_back("--name");
+		args.push_back(operation.name);
+	}
+	args.push_back("--metrics");
+	args.push_back(operation.metrics);
+
+	pid_t pid = fork();
+	if (pid != 0)
+		return pid;
+
+	// Nothing to answer prompts with, so revoke takes the default and regenerates the server
+	int in = open("/dev/null", O_RDONLY);
+	int out = open(operation.log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (in < 0 || out < 0)
+		_exit(127);
+	dup2(in, 0);
+	dup2(out, 1);
+	dup2(out, 2);
+	std::vector<char*> argv;
+	for (std::string& arg : args)
+		argv.push_back(&arg[0]);
+	argv.push_back(NULL);
+	execv(argv[0], argv.data());
+	_exit(127);
+}
+
+void StressHarness::checkCertificates()
+{
+	// Every certificate issued is in the index, even once revoked and removed from pki
+	std::ifstream index(fs::path(this->pkiPath) / "index.txt");
+	std::string line;
+	while (std::getline(index, line)) {
+		std::vector<std::string> fields;
+		std::stringstream ss(line);
+		std::string field;
+		while (std::getline(ss, field, '\t'))
+			fields.push_back(field);
+		if (fields.size() < 6 || fields[0].size() != 1) {
+			problem("Malformed index line: " + line);
+			continue;
+		}
+		if (this->indexed.count(fields[3]))
+			problem("Serial " + fields[3] + " issued to both " + this->indexed[fields[3]].second + " and " + fields[5]);
+		this->indexed[fields[3]] = { fields[0][0], fields[5] };
+	}
+
+	std::map<std::string, std::string> serials;
+	for (const auto& entry : fs::directory_iterator(this->pkiPath)) {
+		std::string stem = entry.path().stem().string();
+		if (entry.path().extension() != ".crt" || stem == "ca" || stem == "crl")
+			continue;
+		this->certificates++;
+		std::string data = readFile(entry.path().string());
+		BIO* bio = BIO_new_mem_buf(data.data(), (int)data.size());
+		X509* cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+		BIO_free(bio);
+		if (cert == NULL) {
+			problem("Torn or unreadable certificate " + entry.path().filename().string());
+			continue;
+		}
+		BIGNUM* bn = ASN1_INTEGER_to_BN(X509_get0_serialNumber(cert), NULL);
+		char* hex = BN_bn2hex(bn);
+		std::string serial(hex);
+		OPENSSL_free(hex);
+		BN_free(bn);
+		X509_free(cert);
+		if (serials.count(serial))
+			problem("Serial " + serial + " on both " + serials[serial] + " and " + stem);
+		serials[serial] = stem;
+		if (!this->indexed.count(serial))
+			problem("Certificate " + stem + " (serial " + serial + ") missing from the index");
+
+		std::string keyPath = (fs::path(this->pkiPath) / (stem + ".key")).string();
+		std::string key = fs::exists(keyPath) ? readFile(keyPath) : std::string();
+		bio = BIO_new_mem_buf(key.data(), (int)key.size());
+		EVP_PKEY* pkey = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+		BIO_free(bio);
+		if (pkey == NULL)
+			problem("Torn, unreadable or missing key for " + stem);
+		EVP_PKEY_free(pkey);
+	}
+}
+
+void StressHarness::checkRevocations()
+{
+	// Revoked serials the CRL or crl/ directory actually holds
+	std::set<std::string> listed;
+	std::string crlPath = (fs::path(this->pkiPath) / "crl.crt").string();
+	if (fs::exists(crlPath)) {
+		std::string data = readFile(crlPath);
+		BIO* bio = BIO_new_mem_buf(data.data(), (int)data.size());
+		X509_CRL* crl = PEM_read_bio_X509_CRL(bio, NULL, NULL, NULL);
+		BIO_free(bio);
+		if (crl == NULL) {
+			problem("Torn or unreadable CRL");
+		}
+		else {
+			STACK_OF(X509_REVOKED)* revoked = X509_CRL_get_REVOKED(crl);
+			for (int i = 0; i < sk_X509_REVOKED_num(revoked); i++) {
+				BIGNUM* bn = ASN1_INTEGER_to_BN(X509_REVOKED_get0_serialNumber(sk_X509_REVOKED_value(revoked, i)), NULL);
+				char* hex = BN_bn2hex(bn);
+				listed.insert(hex);
+				OPENSSL_free(hex);
+				BN_free(bn);
+			}
+			X509_CRL_free(crl);
+		}
+	}
+	fs::path crlDir = fs::path(this->pkiPath) / "crl";
+	if (fs::exists(crlDir)) {
+		for (const auto& entry : fs::directory_iterator(crlDir)) {
+			BIGNUM* bn = NULL;
+			if (BN_dec2bn(&bn, entry.path().filename().string().c_str()) > 0) {
+				char* hex = BN_bn2hex(bn);
+				listed.insert(hex);
+				OPENSSL_free(hex);
+			}
+			BN_free(bn);
+		}
+	}
+
+	for (const auto& entry : this->indexed) {
+		if (entry.second.first != 'R')
+			continue;
+		this->revocations++;
+		if (!listed.count(entry.first))
+			problem("Lost CRL entry for " + entry.second.second + " (serial " + entry.first + ")");
+	}
+
+	for (const Operation& op : this->operations) {
+		if (op.kind != Kind::Revoke || op.status != 0)
+			continue;
+		bool found = false;
+		for (const auto& entry : this->indexed) {
+			const std::string& subject = entry.second.second;
+			std::string cn = "/CN=" + op.name;
+			if (entry.second.first == 'R' && subject.size() >= cn.size() && subject.compare(subject.size() - cn.size(), cn.size(), cn) == 0)
+				found = true;
+		}
+		if (!found)
+			problem("Revocation of " + op.name + " missing from the index");
+		if (fs::exists(fs::path(this->pkiPath) / (op.name + ".crt")))
+			problem("Revoked client " + op.name + " still has a certificate");
+		if (fs::exists(fs::path(this->path) / "clients" / (op.name + ".visz")))
+			problem("Revoked client " + op.name + " still has a bundle");
+	}
+}
+
+void StressHarness::checkClients()
+{
+	std::set<std::string> revoked;
+	for (const Operation& op : this->operations) {
+		if (op.kind == Kind::Revoke && op.status == 0)
+			revoked.insert(op.name);
+	}
+	for (const Operation& op : this->operations) {
+		if (op.kind != Kind::Client || op.status != 0 || revoked.count(op.name))
+			continue;
+		if (!fs::exists(fs::path(this->pkiPath) / (op.name + ".crt")))
+			problem("Client " + op.name + " lost its certificate");
+		if (!fs::exists(fs::path(this->path) / "ccd" / op.name))
+			problem("Client " + op.name + " lost its address");
+
+		// The whole archive has to inflate, a torn one ends early or fails its checksum
+		std::string visz = (fs::path(this->path) / "clients" / (op.name + ".visz")).string();
+		gzFile file = gzopen(visz.c_str(), "rb");
+		if (file == NULL) {
+			problem("Client " + op.name + " has no bundle");
+			continue;
+		}
+		char buf[16384];
+		int n;
+		size_t total = 0;
+		while ((n = gzread(file, buf, sizeof(buf))) > 0)
+			total += (size_t)n;
+		if (gzclose(file) != Z_OK || n < 0 || total == 0)
+			problem("Torn bundle for " + op.name);
+		this->bundles++;
+	}
+
+	std::map<std::string, std::string> addresses;
+	fs::path ccd = fs::path(this->path) / "ccd";
+	if (!fs::exists(ccd))
+		return;
+	for (const auto& entry : fs::directory_iterator(ccd)) {
+		std::istringstream ss(readFile(entry.path().string()));
+		std::string directive, address;
+		ss >> directive >> address;
+		std::string name = entry.path().filename().string();
+		if (directive != "ifconfig-push") {
+			problem("Torn client config dir entry " + name);
+			continue;
+		}
+		if (addresses.count(address))
+			problem("Address " + address + " given to both " + addresses[address] + " and " + name);
+		addresses[address] = name;
+	}
+}
+
+void StressHarness::checkFiles()
+{
+	try {
+		Json config = Json::parse(readFile((fs::path(this->path) / "config.conf").string()));
+		const Json* serial = config.find("serial");
+		if (serial == nullptr) {
+			problem("config.conf has no serial");
+		}
+		else {
+			// The next serial handed out must be past everything already issued
+			for (const auto& entry : this->indexed) {
+				if (strtoll(entry.first.c_str(), NULL, 16) > serial->asInt())
+					problem("config.conf serial " + std::to_string(serial->asInt()) + " is behind issued serial " + entry.first);
+			}
+		}
+	}
+	catch (const std::exception& e) {
+		problem(std::string("Torn or unreadable config.conf. ") + e.what());
+	}
+	std::string cache = (fs::path(this->pkiPath) / "cache.json").string();
+	if (fs::exists(cache)) {
+		try {
+			Json::parse(readFile(cache));
+		}
+		catch (const std::exception& e) {
+			problem(std::string("Torn or unreadable cache.json. ") + e.what());
+		}
+	}
+	for (const auto& entry : fs::recursive_directory_iterator(this->path)) {
+		if (entry.path().extension() == ".tmp")
+			problem("Temporary file left behind: " + fs::relative(entry.path(), this->path).string());
+	}
+}
+
+void StressHarness::report(double elapsed) const
+{
+	printf("\n");
+	printf("Ran %zu operations in %.1fs, %.1f operations/s.\n", this->operations.size(), elapsed, elapsed > 0 ? this->operations.size() / elapsed : 0);
+	for (Kind kind : { Kind::Client, Kind::Revoke, Kind::Regenerate }) {
+		int ok = 0, failed = 0;
+		double seconds = 0;
+		for (const Operation& op : this->operations) {
+			if (op.kind != kind)
+				continue;
+			(op.status == 0 ? ok : failed)++;
+			seconds += op.seconds;
+		}
+		if (ok + failed > 0)
+			printf("  %-10s %4d ok, %d failed, %.2fs mean\n", kindName(kind), ok, failed, seconds / (ok + failed));
+	}
+
+	// Each child wrote its own lock wait histogram
+	double waited = 0;
+	long long waits = 0;
+	for (const Operation& op : this->operations) {
+		std::istringstream ss(readFile(op.metrics));
+		std::string line;
+		while (std::getline(ss, line)) {
+			size_t space = line.rfind(' ');
+			if (space == std::string::npos)
+				continue;
+			std::string name = line.substr(0, space);
+			if (name == "openvpn_generate_lock_wait_seconds_sum")
+				waited += strtod(line.c_str() + space + 1, NULL);
+			else if (name == "openvpn_generate_lock_wait_seconds_count")
+				waits += strtoll(line.c_str() + space + 1, NULL, 10);
+		}
+	}
+	printf("Lock waits: %lld, %.2fs in total, %.1fms mean.\n", waits, waited, waits > 0 ? waited * 1000 / waits : 0);
+	printf("Checked %d certificates, %d revocations and %d bundles.\n", this->certificates, this->revocations, this->bundles);
+
+	for (const Operation& op : this->operations) {
+		if (op.status != 0)
+			printf("FAILED: %s %s exited %d. %s\n", kindName(op.kind), op.name.c_str(), op.status, lastLine(op.log).c_str());
+	}
+	for (const std::string& problem : this->problems)
+		printf("PROBLEM: %s\n", problem.c_str());
+	if (this->problems.empty())
+		printf("No problems found.\n");
+}
+
+void StressHarness::problem(const std::string& message)
+{
+	this->problems.push_back(message);
+}
+
+const char* StressHarness::kindName(Kind kind)
+{
+	switch (kind) {
+	case Kind::Client:
+		return "client";
+	case Kind::Revoke:
+		return "revoke";
+	default:
+		return "regenerate";
+	}
+}
+
+std::string StressHarness::readFile(const std::string& path)
+{
+	std::ifstream in(path, std::ios::binary);
+	std::ostringstream ss;
+	ss << in.rdbuf();
+	return ss.str();
+}
+
+std::string StressHarness::lastLine(const std::string& path)
+{
+	std::istringstream ss(readFile(path));
+	std::string line, last;
+	while (std::getline(ss, line)) {
+		if (!line.empty())
+			last = line;
+	}
+	return last;
+}
@@ -0,0 +1,57 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Runs client, revoke and regenerate as concurrent processes against one config directory, the
+// way several provisioning hosts sharing it would, then checks what they left behind: no serial
+// issued twice, every revocation in the CRL, every address unique and every file whole.
+class StressHarness
+{
+public:
+	StressHarness(const std::string& exePath, const std::string& path);
+
+	// False if any operation failed or a check found a problem
+	bool Run(int jobs, int operations);
+
+private:
+	enum class Kind { Client, Revoke, Regenerate };
+
+	struct Operation
+	{
+		Kind kind;
+		std::string name;
+		std::string log;
+		std::string metrics;
+		double started = 0;
+		double seconds = 0;
+		int status = -1;
+	};
+
+	std::string exePath;
+	std::string path;
+	std::string pkiPath;
+	std::string workPath;
+	std::vector<Operation> operations;
+	// index.txt by serial, status and subject
+	std::map<std::string, std::pair<char, std::string>> indexed;
+	std::vector<std::string> problems;
+	int certificates = 0;
+	int revocations = 0;
+	int bundles = 0;
+
+	int launch(const Operation& operation) const;
+	void checkCertificates();
+	void checkRevocations();
+	void checkClients();
+	void checkFiles();
+	void report(double elapsed) const;
+	void problem(const std::string& message);
+
+	static const char* kindName(Kind kind);
+	static std::string readFile(const std::string& path);
+	static std::string lastLine(const std::string& path);
+};
@@ -0,0 +1,156 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "TLSCrypt.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <stdexcept>
+
+// Sizes as defined by OpenVPN's struct key2 and the tls-crypt-v2 wrapping
+static const size_t StaticKeyLength = 256;
+static const size_t ServerKeyLength = 128;
+static const size_t TagLength = 32;
+
+std::string TLSCrypt::CreateStaticKey()
+{
+	std::vector<unsigned char> key = randomBytes(StaticKeyLength);
+	std::string pem = "#\n# 2048 bit OpenVPN static key\n#\n";
+	pem += "-----BEGIN OpenVPN Static key V1-----\n";
+	char hex[3];
+	for (size_t i = 0; i < key.size(); i++) {
+		snprintf(hex, sizeof(hex), "%02x", key[i]);
+		pem += hex;
+		if (i % 16 == 15)
+			pem += "\n";
+	}
+	pem += "-----END OpenVPN Static key V1-----\n";
+	OPENSSL_cleanse(key.data(), key.size());
+	return pem;
+}
+
+std::string TLSCrypt::CreateV2ServerKey()
+{
+	std::vector<unsigned char> key = randomBytes(ServerKeyLength);
+	std::string pem = ToPEM("OpenVPN tls-crypt-v2 server key", key);
+	OPENSSL_cleanse(key.data(), key.size());
+	return pem;
+}
+
+std::string TLSCrypt::CreateV2ClientKey(const std::string& serverKey)
+{
+	std::vector<unsigned char> server = FromPEM("OpenVPN tls-crypt-v2 server key", serverKey);
+	if (server.size() != ServerKeyLength)
+		throw std::runtime_error("Invalid tls-crypt-v2 server key");
+
+	// Metadata is a timestamp, matching openvpn --genkey tls-crypt-v2-client
+	unsigned char metadata[9];
+	unsigned long long now = (unsigned long long)time(NULL);
+	metadata[0] = 0x01;
+	for (int i = 0; i < 8; i++) {
+		metadata[1 + i] = (unsigned char)(now >> (56 - 8 * i));
+	}
+
+	// Kc || WKc, where WKc = T || AES-256-CTR(Ke, T[0..16], Kc || metadata) || len
+	size_t wrappedLength = TagLength + StaticKeyLength + sizeof(metadata) + 2;
+	std::vector<unsigned char> client(StaticKeyLength + wrappedLength);
+	std::vector<unsigned char> kc = randomBytes(StaticKeyLength);
+	unsigned char* tag = client.data() + StaticKeyLength;
+	unsigned char* plain = tag + TagLength;
+	unsigned char* len = client.data() + client.size() - 2;
+	size_t plainLength = StaticKeyLength + sizeof(metadata);
+	std::copy(kc.begin(), kc.end(), client.begin());
+	std::copy(kc.begin(), kc.end(), plain);
+	std::copy(metadata, metadata + sizeof(metadata), plain + StaticKeyLength);
+	len[0] = (unsigned char)(wrappedLength >> 8);
+	len[1] = (unsigned char)(wrappedLength & 0xff);
+	OPENSSL_cleanse(kc.data(), kc.size());
+
+	// Ke and Ka are the cipher and HMAC halves of the server key
+	const unsigned char* ke = server.data();
+	const unsigned char* ka = ke + 64;
+
+	// T = HMAC-SHA256(Ka, len || Kc || metadata)
+	std::vector<unsigned char> authenticated(2 + plainLength);
+	std::copy(len, len + 2, authenticated.begin());
+	std::copy(plain, plain + plainLength, authenticated.begin() + 2);
+	unsigned int tagLength = 0;
+	bool ok = HMAC(EVP_sha256(), ka, 32, authenticated.data(), authenticated.size(), tag, &tagLength) != NULL;
+	OPENSSL_cleanse(authenticated.data(), authenticated.size());
+
+	// Encrypt Kc || metadata in place, using the tag as a synthetic IV
+	if (ok) {
+		EVP_CIPHER_CTX* cipher = EVP_CIPHER_CTX_new();
+		int outLength = 0, finalLength = 0;
+		ok = cipher != NULL
+			&& EVP_EncryptInit_ex(cipher, EVP_aes_256_ctr(), NULL, ke, tag)
+			&& EVP_EncryptUpdate(cipher, plain, &outLength, plain, (int)plainLength)
+			&& EVP_EncryptFinal_ex(cipher, plain + outLength, &finalLength);
+		EVP_CIPHER_CTX_free(cipher);
+	}
+	OPENSSL_cleanse(server.data(), server.size());
+	if (!ok)
+		throw std::runtime_error("Failed to wrap tls-crypt-v2 client key");
+
+	std::string pem = ToPEM("OpenVPN tls-crypt-v2 client key", client);
+	OPENSSL_cleanse(client.data(), client.size());
+	return pem;
+}
+
+std::vector<unsigned char> TLSCrypt::randomBytes(size_t length)
+{
+	std::vector<unsigned char> data(length);
+	if (RAND_bytes(data.data(), (int)length) != 1)
+		throw std::runtime_error("Failed to generate random key material");
+	return data;
+}
+
+std::string TLSCrypt::ToPEM(const std::string& name, const std::vector<unsigned char>& data)
+{
+	std::string encoded(4 * ((data.size() + 2) / 3) + 1, '\0');
+	int n = EVP_EncodeBlock((unsigned char*)&encoded[0], data.data(), (int)data.size());
+	encoded.resize(n);
+
+	std::string pem = "-----BEGIN " + name + "-----\n";
+	for (size_t i = 0; i < encoded.size(); i += 64) {
+		pem += encoded.substr(i, 64);
+		pem += "\n";
+	}
+	pem += "-----END " + name + "-----\n";
+	return pem;
+}
+
+std::vector<unsigned char> TLSCrypt::FromPEM(const std::string& name, const std::string& pem)
+{
+	std::string begin = "-----BEGIN " + name + "-----";
+	std::string end = "-----END " + name + "-----";
+	size_t start = pem.find(begin);
+	size_t stop = pem.find(end);
+	if (start == std::string::npos || stop == std::string::npos || stop < start)
+		return std::vector<unsigned char>();
+	std::string encoded;
+	for (size_t i = start + begin.size(); i < stop; i++) {
+		if (pem[i] != '\n' && pem[i] != '\r')
+			encoded += pem[i];
+	}
+	if (encoded.size() % 4 != 0)
+		return std::vector<unsigned char>();
+
+	std::vector<unsigned char> data(encoded.size() / 4 * 3);
+	int n = EVP_DecodeBlock(data.data(), (const unsigned char*)encoded.data(), (int)encoded.size());
+	if (n < 0)
+		return std::vector<unsigned char>();
+	// EVP_DecodeBlock doesn't account for padding
+	size_t padding = 0;
+	if (!encoded.empty() && encoded[encoded.size() - 1] == '=')
+		padding++;
+	if (encoded.size() > 1 && encoded[encoded.size() - 2] == '=')
+		padding++;
+	data.resize(n - padding);
+	return data;
+}
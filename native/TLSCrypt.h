@@ -0,0 +1,26 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Control channel keys for tls-crypt / tls-crypt-v2. With these in place the server drops
+// unauthenticated packets before they ever reach the TLS stack.
+class TLSCrypt
+{
+public:
+	enum class Mode {
+		None, V1, V2
+	};
+
+	static std::string CreateStaticKey();
+	static std::string CreateV2ServerKey();
+	static std::string CreateV2ClientKey(const std::string& serverKey);
+
+	static std::string ToPEM(const std::string& name, const std::vector<unsigned char>& data);
+	static std::vector<unsigned char> FromPEM(const std::string& name, const std::string& pem);
+
+private:
+	static std::vector<unsigned char> randomBytes(size_t length);
+};
@@ -0,0 +1,97 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#include "Tuning.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+bool Tuning::HasAESNI()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+	return (ecx & bit_AES) != 0;
+#elif defined(__aarch64__) && defined(__linux__)
+	return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#elif defined(__aarch64__) && defined(__APPLE__)
+	// Every Apple ARM core has the crypto extensions
+	return true;
+#else
+	return false;
+#endif
+}
+
+Tuning::Settings Tuning::settings(Profile profile)
+{
+	switch (profile) {
+	case Profile::Throughput:
+		// Deep buffers so bulk transfers aren't held back by the socket, full size packets
+		return { 1048576, 1000, 1500, 1450 };
+	case Profile::Latency:
+		// Short queues so interactive traffic doesn't wait behind bulk transfers
+		return { 262144, 100, 1500, 1450 };
+	case Profile::Mobile:
+		// Cellular links often carry less than 1500 bytes, smaller packets avoid fragmenting
+		return { 393216, 500, 1400, 1360 };
+	default:
+		return { 0, 0, 0, 0 };
+	}
+}
+
+std::string Tuning::dataCiphers(bool aesni)
+{
+	// The server picks the first cipher in its own list that the client also supports
+	if (aesni)
+		return "AES-256-GCM:AES-128-GCM:CHACHA20-POLY1305";
+	return "CHACHA20-POLY1305:AES-256-GCM:AES-128-GCM";
+}
+
+std::string Tuning::ServerDirectives(Profile profile, bool aesni, bool dco, const std::string& proto)
+{
+	std::string file;
+	if (dco) {
+		// A pushed or requested compression setting would move the peer back to userspace
+		file += "allow-compression no\n";
+	}
+	if (profile == Profile::None && !dco)
+		return file;
+	file += "data-ciphers " + dataCiphers(aesni) + "\n";
+	if (profile == Profile::None)
+		return file;
+	Settings s = settings(profile);
+	file += "sndbuf " + std::to_string(s.buffer) + "\nrcvbuf " + std::to_string(s.buffer) + "\n";
+	file += "push \"sndbuf " + std::to_string(s.buffer) + "\"\npush \"rcvbuf " + std::to_string(s.buffer) + "\"\n";
+	file += "txqueuelen " + std::to_string(s.txqueuelen) + "\n";
+	file += "tun-mtu " + std::to_string(s.tunMTU) + "\nmssfix " + std::to_string(s.mssfix) + "\n";
+	if (proto == "udp") {
+		// Non-blocking writes to the UDP socket, skipping a poll per packet. Offloaded packets
+		// never pass through the process so there's nothing to gain with dco.
+		if (!dco)
+			file += "fast-io\n";
+	}
+	else if (profile == Profile::Latency) {
+		file += "tcp-nodelay\n";
+	}
+	return file;
+}
+
+std::string Tuning::ClientDirectives(Profile profile, bool aesni, bool dco)
+{
+	std::string file;
+	if (dco)
+		file += "allow-compression no\n";
+	if (profile == Profile::None && !dco)
+		return file;
+	file += "data-ciphers " + dataCiphers(aesni) + "\n";
+	if (profile == Profile::None)
+		return file;
+	Settings s = settings(profile);
+	// tun-mtu has to match the server's, buffers are pushed
+	file += "tun-mtu " + std::to_string(s.tunMTU) + "\nmssfix " + std::to_string(s.mssfix) + "\n";
+	return file;
+}
@@ -0,0 +1,35 @@
+// Copyright SparkLabs Pty Ltd 2018
+
+#pragma once
+
+#include <string>
+
+// Data channel tuning. A profile picks the cipher order and the socket buffer, queue and MTU
+// settings written into the server and client configs.
+class Tuning
+{
+public:
+	enum class Profile {
+		None, Throughput, Latency, Mobile
+	};
+
+	// Whether this CPU has AES instructions. AES-GCM is only faster than ChaCha20-Poly1305 with them.
+	static bool HasAESNI();
+
+	// With dco the data channel is offloaded to the kernel (OpenVPN 2.6+), which only handles AEAD
+	// ciphers and no compression
+	static std::string ServerDirectives(Profile profile, bool aesni, bool dco, const std::string& proto);
+	static std::string ClientDirectives(Profile profile, bool aesni, bool dco);
+
+private:
+	struct Settings
+	{
+		int buffer;
+		int txqueuelen;
+		int tunMTU;
+		int mssfix;
+	};
+
+	static Settings settings(Profile profile);
+	static std::string dataCiphers(bool aesni);
+};